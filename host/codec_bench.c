@@ -0,0 +1,332 @@
+// Host build check for Tools/Hamming74.c and Tools/FEC.c
+// 1. Exhaustively compares the table driven codec against the original bit-loop implementation (kept below as ref_*)
+// 2. Checks every FEC code corrects every single bit error (and interleaving every garbled byte, SECDED detects doubles)
+// 3. Reports ns and cycles per data byte for both Hamming(7,4) implementations and each FEC code
+// Exits non-zero if any output differs.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+#include "Tools/Hamming74.h"
+#include "Tools/FEC.h"
+
+// -------------------------------- REFERENCE (original bit-loop codec) --------------------------------
+
+static int ref_parity_check(uint8_t encoded, uint8_t p)
+{
+    uint8_t pos_mask = (1 << p);
+    uint8_t sum = 0;
+    for (uint8_t i = 1; i < 8; i++) {
+        if ((i & pos_mask) != 0) {
+            sum ^= (encoded >> (i-1)) & 1;
+        }
+    }
+    return sum;
+}
+
+static uint8_t ref_calculate_syndrome(uint8_t encoded)
+{
+    uint8_t syndrome = 0;
+    for (uint8_t p = 0; p < 3; p++) {
+        syndrome ^= ref_parity_check(encoded, p) << p;
+    }
+    return syndrome;
+}
+
+static uint8_t ref_encode_nibble(const uint8_t nibble)
+{
+    uint8_t encoded_nibble = 0;
+    uint8_t j = 0;
+    for (uint8_t i = 0; i < 7; i++) {
+        if ((i & (i + 1)) == 0) {
+            continue;
+        }
+        encoded_nibble |= (((nibble >> j) & 1) << i);
+        j++;
+    }
+    for (uint8_t p = 0; p < 3; p++) {
+        uint8_t parity_pos = (1 << p) - 1;
+        encoded_nibble |= ref_parity_check(encoded_nibble, p) << parity_pos;
+    }
+    return encoded_nibble;
+}
+
+static uint8_t ref_decode_nibble(uint8_t encoded)
+{
+    uint8_t syndrome = ref_calculate_syndrome(encoded);
+    if (syndrome != 0) {
+        uint8_t error_pos = syndrome - 1;
+        if (error_pos < 7) {
+            encoded ^= 1 << error_pos;
+        }
+    }
+    uint8_t decoded = 0;
+    decoded |= (encoded >> 2) & 0x01;
+    decoded |= (encoded >> 3) & 0x02;
+    decoded |= (encoded >> 3) & 0x04;
+    decoded |= (encoded >> 3) & 0x08;
+    return decoded;
+}
+
+static void ref_encode_bytes(const uint8_t *data, uint8_t encoded_length, uint8_t *encoded_bytes)
+{
+    for (uint8_t i = 0; i < encoded_length; i++) {
+        uint8_t nibble = (i % 2 == 0) ? (data[i / 2] >> 4) : (data[i / 2] & 0x0F);
+        encoded_bytes[i] = ref_encode_nibble(nibble);
+    }
+}
+
+static void ref_decode_bytes(const uint8_t *encoded_bytes, uint8_t encoded_length, uint8_t *decoded_bytes)
+{
+    for (uint8_t i = 0; i < encoded_length; i++) {
+        uint8_t nibble = ref_decode_nibble(encoded_bytes[i]);
+        if (i % 2 == 0) {
+            decoded_bytes[i / 2] = nibble << 4;
+        } else {
+            decoded_bytes[i / 2] |= nibble;
+        }
+    }
+}
+
+// -------------------------------- EQUIVALENCE --------------------------------
+
+static unsigned failures = 0;
+
+static void expect_same(const char *what, const uint8_t *a, const uint8_t *b, size_t n, unsigned detail)
+{
+    if (memcmp(a, b, n) != 0) {
+        if (failures < 10) {
+            fprintf(stderr, "MISMATCH %s (case %u)\n", what, detail);
+        }
+        failures++;
+    }
+}
+
+static void check_equivalence(void)
+{
+    uint8_t data[128], enc_new[256], enc_ref[256], dec_new[130], dec_ref[130];
+
+    for (unsigned pair = 0; pair < 65536; pair++) {             // Every 2 byte input through the 32-bit bulk encoder
+        data[0] = pair >> 8;
+        data[1] = pair & 0xFF;
+        encode_bytes(data, 4, enc_new);
+        ref_encode_bytes(data, 4, enc_ref);
+        expect_same("encode pair", enc_new, enc_ref, 4, pair);
+        for (uint8_t len = 1; len < 4; len++) {                 // and through every tail length
+            encode_bytes(data, len, enc_new);
+            ref_encode_bytes(data, len, enc_ref);
+            expect_same("encode tail", enc_new, enc_ref, len, pair);
+        }
+    }
+
+    for (unsigned lane = 0; lane < 8; lane++) {                 // Every received byte (all 256 values, corrupted or not) in every word lane and tail position
+        for (unsigned value = 0; value < 256; value++) {
+            uint8_t rx[8] = {0x00, 0x07, 0x19, 0x1E, 0x2A, 0x2D, 0x33, 0x34};
+            rx[lane] = value;
+            for (uint8_t len = lane + 1; len <= 8; len++) {
+                memset(dec_new, 0xA5, sizeof(dec_new));
+                memset(dec_ref, 0xA5, sizeof(dec_ref));
+                decode_bytes(rx, len, dec_new);
+                ref_decode_bytes(rx, len, dec_ref);
+                expect_same("decode lane", dec_new, dec_ref, (len + 1) / 2, lane * 256 + value);
+            }
+        }
+    }
+
+    srand(5550);
+    for (unsigned trial = 0; trial < 200000; trial++) {         // Random lengths, random data, random bit errors, unaligned buffers
+        uint8_t len = rand() % 256;
+        uint8_t offset = rand() % 4;
+        for (unsigned i = 0; i < sizeof(data); i++) data[i] = rand();
+        encode_bytes(data, len, enc_new);
+        ref_encode_bytes(data, len, enc_ref);
+        expect_same("encode random", enc_new, enc_ref, len, trial);
+        for (unsigned i = 0; i < len; i++) {
+            if (rand() % 8 == 0) enc_ref[i] ^= 1 << (rand() % 8);
+        }
+        uint8_t rx[260];
+        memcpy(&rx[offset], enc_ref, len);
+        decode_bytes(&rx[offset], len, dec_new + (offset & 1));
+        ref_decode_bytes(enc_ref, len, dec_ref);
+        expect_same("decode random", dec_new + (offset & 1), dec_ref, (len + 1) / 2, trial);
+    }
+}
+
+// -------------------------------- FEC CODES --------------------------------
+
+static const char *code_names[FEC_CODES] = {"hamming74", "interleaved", "secded"};
+
+static void expect_decoded(const char *what, uint8_t code, const uint8_t *coded, const uint8_t *data, uint8_t length, unsigned detail, int expected_corrected)
+{
+    uint8_t decoded[128];
+    int corrected = fec_decode(code, coded, length, decoded);
+    if (corrected == FEC_UNCORRECTABLE) {
+        memset(decoded, ~data[0], length);                      // Force a mismatch
+    } else if (expected_corrected >= 0 && corrected != expected_corrected) {    // -1: any count, a garbled byte may hit several codewords
+        if (failures < 10) {
+            fprintf(stderr, "MISMATCH %s %s corrected %d, expected %d (detail %u)\n", what, code_names[code], corrected, expected_corrected, detail);
+        }
+        failures++;
+    }
+    expect_same(what, decoded, data, length, code * 100000 + detail);
+}
+
+static void check_fec(void)
+{
+    uint8_t data[128], coded[256], damaged[256];
+    srand(5551);
+    for (uint8_t code = 0; code < FEC_CODES; code++) {
+        for (uint8_t length = 1; length <= 82; length++) {      // Every message + CRC length a frame body can have
+            for (uint8_t i = 0; i < length; i++) data[i] = rand();
+            uint8_t coded_length = fec_encode(code, data, length, coded);
+            if (coded_length != fec_coded_length(code, length)) {
+                fprintf(stderr, "MISMATCH %s coded length %u\n", code_names[code], length);
+                failures++;
+            }
+            expect_decoded("fec clean", code, coded, data, length, length, 0);
+            for (unsigned bit = 0; bit < 8u * coded_length; bit++) {    // Every single bit error
+                if (code == FEC_HAMMING74 && bit % 8 == 7) {
+                    continue;                                   // Unused bit
+                }
+                memcpy(damaged, coded, coded_length);
+                damaged[bit / 8] ^= 1 << (bit % 8);
+                expect_decoded("fec single bit", code, damaged, data, length, length * 1000 + bit, 1);
+            }
+            if (code == FEC_INTERLEAVED) {
+                for (uint8_t byte = 0; byte < coded_length; byte++) {   // Every UART byte garbled
+                    memcpy(damaged, coded, coded_length);
+                    damaged[byte] ^= 1 + rand() % 255;
+                    expect_decoded("fec garbled byte", code, damaged, data, length, length * 1000 + byte, -1);
+                }
+            }
+            if (code == FEC_SECDED) {
+                for (uint8_t block = 0; block * 9 < coded_length; block++) {   // Every double bit error inside a block is detected
+                    unsigned bits = 8 * (coded_length - block * 9 < 9 ? coded_length - block * 9 : 9);
+                    for (unsigned a = 0; a < bits; a++) {
+                        for (unsigned b = a + 1; b < bits; b++) {
+                            memcpy(damaged, coded, coded_length);
+                            damaged[block * 9 + a / 8] ^= 1 << (a % 8);
+                            damaged[block * 9 + b / 8] ^= 1 << (b % 8);
+                            uint8_t decoded[128];
+                            if (fec_decode(code, damaged, length, decoded) != FEC_UNCORRECTABLE) {
+                                if (failures < 10) {
+                                    fprintf(stderr, "MISMATCH secded double error not detected (length %u bits %u %u)\n", length, a, b);
+                                }
+                                failures++;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// -------------------------------- BENCHMARK --------------------------------
+
+typedef void (*codec_fn)(const uint8_t *, uint8_t, uint8_t *);
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static volatile uint8_t sink;
+
+static void bench(const char *name, codec_fn fn, const uint8_t *in, uint8_t encoded_length, unsigned iterations)
+{
+    uint8_t out[256];
+    uint64_t t0 = now_ns();
+#ifdef HAVE_RDTSC
+    uint64_t c0 = __rdtsc();
+#endif
+    for (unsigned i = 0; i < iterations; i++) {
+        fn(in, encoded_length, out);
+        sink ^= out[i % encoded_length];
+    }
+#ifdef HAVE_RDTSC
+    uint64_t cycles = __rdtsc() - c0;
+#endif
+    uint64_t ns = now_ns() - t0;
+    double bytes = (double)iterations * (encoded_length / 2);
+#ifdef HAVE_RDTSC
+    printf("%-22s %8.2f ns/byte %8.2f cycles/byte\n", name, ns / bytes, cycles / bytes);
+#else
+    printf("%-22s %8.2f ns/byte\n", name, ns / bytes);
+#endif
+}
+
+static void bench_fec(uint8_t code, const uint8_t *data, uint8_t length, unsigned iterations)
+{
+    uint8_t coded[256], out[128];
+    uint8_t coded_length = fec_encode(code, data, length, coded);
+    for (int decode = 0; decode < 2; decode++) {
+        uint64_t t0 = now_ns();
+#ifdef HAVE_RDTSC
+        uint64_t c0 = __rdtsc();
+#endif
+        for (unsigned i = 0; i < iterations; i++) {
+            if (decode) {
+                sink ^= fec_decode(code, coded, length, out);
+            } else {
+                sink ^= fec_encode(code, data, length, out);
+            }
+        }
+#ifdef HAVE_RDTSC
+        uint64_t cycles = __rdtsc() - c0;
+#endif
+        uint64_t ns = now_ns() - t0;
+        double bytes = (double)iterations * length;
+        char name[32];
+        snprintf(name, sizeof(name), "%s %s", code_names[code], decode ? "decode" : "encode");
+#ifdef HAVE_RDTSC
+        printf("%-22s %8.2f ns/byte %8.2f cycles/byte   rate %.2f\n", name, ns / bytes, cycles / bytes, (double)length / coded_length);
+#else
+        printf("%-22s %8.2f ns/byte   rate %.2f\n", name, ns / bytes, (double)length / coded_length);
+#endif
+    }
+}
+
+int main(void)
+{
+    check_equivalence();
+    if (failures) {
+        fprintf(stderr, "FAIL: %u mismatches against the reference codec\n", failures);
+        return 1;
+    }
+    printf("PASS: table codec is bit-for-bit identical to the reference codec\n");
+    fec_init();
+    check_fec();
+    if (failures) {
+        fprintf(stderr, "FAIL: %u FEC code errors\n", failures);
+        return 1;
+    }
+    printf("PASS: every FEC code corrects every single bit error\n");
+
+    uint8_t data[64], encoded[128];
+    for (unsigned i = 0; i < sizeof(data); i++) data[i] = rand();
+    encode_bytes(data, sizeof(encoded), encoded);
+
+    const unsigned iterations = 200000;
+    const uint8_t sizes[] = {10, 18, 128};                      // Mouse report, keyboard report, 64 byte block (encoded lengths)
+    for (unsigned s = 0; s < sizeof(sizes); s++) {
+        printf("-- %u data bytes --\n", sizes[s] / 2);
+        bench("reference encode", ref_encode_bytes, data,    sizes[s], iterations);
+        bench("table encode",     encode_bytes,     data,    sizes[s], iterations);
+        bench("reference decode", ref_decode_bytes, encoded, sizes[s], iterations);
+        bench("table decode",     decode_bytes,     encoded, sizes[s], iterations);
+        for (uint8_t code = 0; code < FEC_CODES; code++) {
+            bench_fec(code, data, sizes[s] / 2, iterations);
+        }
+    }
+    return 0;
+}
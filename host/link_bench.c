@@ -0,0 +1,432 @@
+// Host benchmark of the link hot paths, built from the unmodified firmware sources
+// 1. Codec: data bytes per second through Hamming(7,4) and every FEC code
+// 2. Framing: send_frame and read_frame over a loopback transport in each FEC code, ns per frame and bytes per second
+// 3. Report routing: ns per mouse and keyboard report from the HID callback hand-off to the message delivered on the far side
+//    (report pool or coalescer, compact encoding, ARQ, framing and parsing, everything the two COM tasks do except waiting
+//    for the UART), and the coded bytes each report put on the wire
+// 4. Bit errors: share of frames delivered, bits corrected and frames rejected at several bit error rates in each code
+// Output is key=value lines. Keys ending in _MBps and _pct are better higher, keys ending in _ns better lower.
+// With --baseline FILE (the output of an earlier run) each of them is compared with the same key in FILE and the exit
+// status is non-zero if any regressed by more than --tolerance percent. A frame delivered with the wrong contents always fails.
+
+#define _GNU_SOURCE
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "Tools/UARTTools.c"                                    // Compiled in to set the transmit code and forget sent frames (statics)
+#include "Tools/Transport.h"
+#include "Tools/Hamming74.h"
+#include "Tools/FEC.h"
+#include "Tools/ReportPool.h"
+#include "Tools/MouseCoalescer.h"
+#include "Tools/LinkARQ.h"
+#include "Tools/LinkScheduler.h"
+#include "Tools/LatencyTools.h"
+#include "Tools/ReportCodec.h"
+#include "state_machines.h"
+#include "sim_port.h"
+
+#define WIRE_SIZE       (1 << 20)                               // Loopback transport buffer
+#define REPEATS         7                                       // Each measurement is the best of this many runs
+#define FRAMES          2000                                    // Frames per framing and bit error run
+#define REPORTS         20000                                   // Reports per routing run
+#define CODEC_BYTES     (1 << 24)                               // Data bytes per codec run
+#define MOUSE_LENGTH    (6 + LATENCY_TRAILER_LEN)               // Same as message_length in state_machine_com.c
+#define KEYBOARD_LENGTH (10 + LATENCY_TRAILER_LEN)
+#define MAX_METRICS     128
+#define READ_WAIT_MS    10                                      // Frames are already on the wire, only a descheduled bench waits
+#define SEQ_MASK        0x7F                                    // Sequence numbers as in state_machine_com.c
+
+static const char *code_names[FEC_CODES] = {"hamming74", "interleaved", "secded"};
+static const double error_rates[] = {1e-4, 1e-3, 1e-2};
+
+typedef struct {
+    char key[64];
+    double value;
+} metric_t;
+
+static metric_t metrics[MAX_METRICS];
+static unsigned metric_count = 0;
+static unsigned failures = 0;
+static volatile uint32_t sink;
+
+// -------------------------------- LOOPBACK TRANSPORT --------------------------------
+
+static uint8_t wire[WIRE_SIZE];
+static size_t wire_written = 0;
+static size_t wire_read = 0;
+static double wire_ber = 0;                                     // Bit error probability applied as bytes are written
+static uint64_t rng = 0x5550;
+
+static uint64_t next_random(void) {                             // xorshift64, the same errors on every run
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static void wire_reset(double ber) {
+    wire_written = 0;
+    wire_read = 0;
+    wire_ber = ber;
+}
+
+void transport_init(int baud_rate) {
+    (void)baud_rate;
+}
+
+void transport_set_baud(int baud_rate) {
+    (void)baud_rate;
+}
+
+void transport_write(const uint8_t *data, size_t length) {
+    if (wire_written + length > WIRE_SIZE) {
+        wire_written = wire_read = 0;                           // Only reached by a run that never reads
+    }
+    memcpy(&wire[wire_written], data, length);
+    if (wire_ber > 0) {
+        uint64_t threshold = (uint64_t)(wire_ber * (double)UINT64_MAX);
+        for (size_t i = 0; i < 8 * length; i++) {
+            if (next_random() < threshold) {
+                wire[wire_written + i / 8] ^= 1 << (i % 8);
+            }
+        }
+    }
+    wire_written += length;
+}
+
+int transport_receive(uint8_t *data, size_t length, int ms_to_wait) {
+    (void)ms_to_wait;                                           // Never waits, everything is already written
+    size_t available = wire_written - wire_read;
+    length = length < available ? length : available;
+    memcpy(data, &wire[wire_read], length);
+    wire_read += length;
+    return length;
+}
+
+void transport_wait_tx_done(int ms_to_wait) {
+    (void)ms_to_wait;
+}
+
+static void forget_sent(void) {                                 // The frames just sent were the far side's, not reflections of ours
+    memset(echoes, 0, sizeof(echoes));
+}
+
+static void parser_reset(void) {
+    rx_count = 0;
+    forget_sent();
+}
+
+// -------------------------------- HELPERS --------------------------------
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void emit(const char *key, double value) {
+    if (metric_count < MAX_METRICS) {
+        snprintf(metrics[metric_count].key, sizeof(metrics[metric_count].key), "%s", key);
+        metrics[metric_count++].value = value;
+    }
+    printf("%s=%.3f\n", key, value);
+}
+
+static void emitf(double value, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static void emitf(double value, const char *format, ...) {
+    char key[64];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(key, sizeof(key), format, args);
+    va_end(args);
+    emit(key, value);
+}
+
+static void fill_random(uint8_t *data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        data[i] = next_random();
+    }
+}
+
+// -------------------------------- CODEC --------------------------------
+
+static void bench_codec(void) {
+    static uint8_t data[64], coded[256], decoded[64];
+    fill_random(data, sizeof(data));
+    const unsigned blocks = CODEC_BYTES / sizeof(data);
+    for (uint8_t code = 0; code < FEC_CODES; code++) {
+        uint8_t coded_length = fec_encode(code, data, sizeof(data), coded);
+        uint64_t best_encode = UINT64_MAX, best_decode = UINT64_MAX;
+        for (int repeat = 0; repeat < REPEATS; repeat++) {
+            uint64_t t0 = now_ns();
+            for (unsigned i = 0; i < blocks; i++) {
+                data[i % sizeof(data)] ^= i;                    // Keep the compiler from hoisting the call
+                sink += fec_encode(code, data, sizeof(data), coded);
+            }
+            uint64_t t1 = now_ns();
+            for (unsigned i = 0; i < blocks; i++) {
+                sink += fec_decode(code, coded, sizeof(data), decoded) + decoded[i % sizeof(decoded)];
+            }
+            uint64_t t2 = now_ns();
+            best_encode = t1 - t0 < best_encode ? t1 - t0 : best_encode;
+            best_decode = t2 - t1 < best_decode ? t2 - t1 : best_decode;
+        }
+        emitf(1e3 * CODEC_BYTES / best_encode, "codec.%s.encode_MBps", code_names[code]);
+        emitf(1e3 * CODEC_BYTES / best_decode, "codec.%s.decode_MBps", code_names[code]);
+        emitf((double)sizeof(data) / coded_length, "codec.%s.rate", code_names[code]);
+    }
+}
+
+// -------------------------------- FRAMING --------------------------------
+
+static void bench_framing(void) {
+    uint8_t message[MAX_FRAME_PAYLOAD], received[MAX_FRAME_PAYLOAD], seq;
+    const uint8_t lengths[] = {MOUSE_LENGTH + 2, KEYBOARD_LENGTH + 3, MAX_FRAME_PAYLOAD};   // With their ARQ trailers
+    const char *names[] = {"mouse", "keyboard", "max"};
+    fill_random(message, sizeof(message));
+    for (uint8_t code = 0; code < FEC_CODES; code++) {
+        tx_code = code;
+        for (unsigned l = 0; l < sizeof(lengths); l++) {
+            uint64_t best_send = UINT64_MAX, best_read = UINT64_MAX;
+            for (int repeat = 0; repeat < REPEATS; repeat++) {
+                wire_reset(0);
+                parser_reset();
+                uint64_t t0 = now_ns();
+                for (unsigned i = 0; i < FRAMES; i++) {
+                    send_frame(message, i & SEQ_MASK, lengths[l]);
+                }
+                uint64_t t1 = now_ns();
+                forget_sent();
+                uint64_t t2 = now_ns();
+                for (unsigned i = 0; i < FRAMES; i++) {
+                    if (read_frame(received, &seq, READ_WAIT_MS) != lengths[l] || memcmp(received, message, lengths[l]) != 0) {
+                        fprintf(stderr, "FAIL: %s %s frame %u did not come back intact\n", code_names[code], names[l], i);
+                        failures++;
+                        break;
+                    }
+                }
+                uint64_t t3 = now_ns();
+                best_send = t1 - t0 < best_send ? t1 - t0 : best_send;
+                best_read = t3 - t2 < best_read ? t3 - t2 : best_read;
+            }
+            emitf((double)best_send / FRAMES, "frame.%s.%s.send_ns", code_names[code], names[l]);
+            emitf((double)best_read / FRAMES, "frame.%s.%s.parse_ns", code_names[code], names[l]);
+            emitf(1e3 * FRAMES * lengths[l] / best_read, "frame.%s.%s.parse_MBps", code_names[code], names[l]);
+        }
+    }
+    tx_code = FEC_HAMMING74;
+}
+
+// -------------------------------- REPORT ROUTING --------------------------------
+
+static uint64_t wire_bytes = 0;                                 // Coded bytes of the reports routed
+
+static bool route_mouse(uint8_t channel, uint8_t *message) {   // mouse_callback to the far side's deliver_message
+    usb_mouse_report_t report = {.x_displacement = 1};
+    coalesce_mouse_report(channel, &report, esp_timer_get_time());
+    scheduler_ready(CLASS_MOUSE, coalesce_pending());
+    if (scheduler_pick() != CLASS_MOUSE || !coalesce_take(message)) {
+        return false;
+    }
+    scheduler_served(CLASS_MOUSE);
+    report_compact(message);
+    uint8_t compact = report_compact_length(message) + LATENCY_TRAILER_LEN;
+    uint8_t length = arq_fill_trailer(message, compact);
+    send_frame(message, 0, length);
+    wire_bytes += frame_coded_length(length);
+    forget_sent();
+    uint8_t seq;
+    if (read_frame(message, &seq, READ_WAIT_MS) != length || !arq_receive(message, compact)) {
+        return false;
+    }
+    report_expand(message);
+    return message[0] == REPORT_MOUSE && message[1] == channel && message[3] == 1;
+}
+
+static bool route_keyboard(uint8_t channel, bool press, uint8_t *message) { // keyboard_callback to the far side's deliver_held
+    uint8_t *slot = report_pool_claim();
+    if (slot == NULL) {
+        return false;
+    }
+    memset(slot, 0, KEYBOARD_LENGTH);
+    slot[0] = REPORT_KEYBOARD;
+    slot[1] = channel;
+    slot[4] = 0x16;                                             // Held throughout, 0x04 is pressed and released next to it
+    slot[5] = press ? 0x04 : 0;
+    report_pool_publish(slot, false);
+    scheduler_ready(CLASS_KEYBOARD, report_pool_pending(false));
+    if (scheduler_pick() != CLASS_KEYBOARD) {
+        return false;
+    }
+    slot = report_pool_take(false);
+    scheduler_served(CLASS_KEYBOARD);
+    report_compact(slot);
+    uint8_t compact = report_compact_length(slot) + LATENCY_TRAILER_LEN;
+    arq_track(slot, compact);
+    uint8_t length = arq_fill_trailer(slot, compact);
+    send_frame(slot, 0, length);
+    wire_bytes += frame_coded_length(length);
+    report_pool_release(slot);
+    forget_sent();
+    uint8_t seq;
+    if (read_frame(message, &seq, READ_WAIT_MS) != length || arq_receive(message, compact) || !arq_deliver(message)) {
+        return false;
+    }
+    report_expand(message);
+    return message[0] == REPORT_KEYBOARD && message[1] == channel && message[4] == 0x16 && message[5] == (press ? 0x04 : 0);
+}
+
+static void bench_routing(void) {
+    uint8_t message[MAX_FRAME_PAYLOAD];
+    report_pool_init(xTaskGetCurrentTaskHandle());
+    coalesce_init(NULL);
+    for (int keyboard = 0; keyboard < 2; keyboard++) {
+        uint64_t best = UINT64_MAX;
+        wire_bytes = 0;
+        for (int repeat = 0; repeat < REPEATS; repeat++) {
+            wire_reset(0);
+            parser_reset();
+            uint64_t t0 = now_ns();
+            for (unsigned i = 0; i < REPORTS; i++) {
+                bool press = (i / HID_CHANNELS) & 1;
+                bool delivered = keyboard ? route_keyboard(i % HID_CHANNELS, press, message) : route_mouse(i % HID_CHANNELS, message);
+                if (!delivered) {
+                    fprintf(stderr, "FAIL: %s report %u was not delivered\n", keyboard ? "keyboard" : "mouse", i);
+                    failures++;
+                    break;
+                }
+                wire_reset(0);
+            }
+            uint64_t elapsed = now_ns() - t0;
+            best = elapsed < best ? elapsed : best;
+        }
+        emitf((double)best / REPORTS, "route.%s.report_ns", keyboard ? "keyboard" : "mouse");
+        emitf((double)wire_bytes / REPORTS / REPEATS, "route.%s.wire_bytes", keyboard ? "keyboard" : "mouse");
+    }
+}
+
+// -------------------------------- BIT ERRORS --------------------------------
+
+static void bench_errors(void) {
+    uint8_t message[KEYBOARD_LENGTH + 3], received[MAX_FRAME_PAYLOAD], seq;
+    for (uint8_t code = 0; code < FEC_CODES; code++) {
+        for (unsigned r = 0; r < sizeof(error_rates) / sizeof(error_rates[0]); r++) {
+            tx_code = code;
+            rng = 0x5550 + code * 16 + r;                       // Every run and every build sees the same errors
+            wire_reset(error_rates[r]);
+            parser_reset();
+            for (unsigned i = 0; i < FRAMES; i++) {
+                fill_random(message, sizeof(message));
+                message[0] = REPORT_KEYBOARD;
+                send_frame(message, i & SEQ_MASK, sizeof(message));
+            }
+            forget_sent();
+            wire_ber = 0;
+            uint32_t corrected_before = corrected, rejected_before = rejected;
+            unsigned delivered = 0;
+            int length;
+            while (wire_read < wire_written || rx_count > 0) {
+                length = read_frame(received, &seq, READ_WAIT_MS);
+                if (length == sizeof(message)) {
+                    delivered++;
+                } else if (length > 0) {
+                    fprintf(stderr, "FAIL: %s frame of %d bytes passed the CRC at BER %g\n", code_names[code], length, error_rates[r]);
+                    failures++;
+                } else if (length == 0) {
+                    break;
+                }
+            }
+            char rate[16];
+            snprintf(rate, sizeof(rate), "%.0e", error_rates[r]);
+            emitf(100.0 * delivered / FRAMES, "errors.%s.ber_%s.delivered_pct", code_names[code], rate);
+            emitf((double)(corrected - corrected_before) / FRAMES, "errors.%s.ber_%s.corrected_per_frame", code_names[code], rate);
+            emitf(rejected - rejected_before, "errors.%s.ber_%s.rejected", code_names[code], rate);
+        }
+    }
+    tx_code = FEC_HAMMING74;
+}
+
+// -------------------------------- BASELINE --------------------------------
+
+static int compare(const char *path, double tolerance) {        // Number of metrics that regressed against an earlier run's output
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    int regressions = 0;
+    char line[160];
+    while (fgets(line, sizeof(line), file)) {
+        char *equals = strchr(line, '=');
+        if (equals == NULL) {
+            continue;
+        }
+        *equals = '\0';
+        double baseline = atof(equals + 1);
+        bool higher_better = strstr(line, "_MBps") != NULL || strstr(line, "_pct") != NULL;
+        bool lower_better = strstr(line, "_ns") != NULL;
+        for (unsigned i = 0; i < metric_count && (higher_better || lower_better) && baseline > 0; i++) {
+            if (strcmp(metrics[i].key, line) != 0) {
+                continue;
+            }
+            double change = 100.0 * (metrics[i].value - baseline) / baseline;   // Positive is faster or more delivered
+            if (lower_better) {
+                change = -change;
+            }
+            if (change < -tolerance) {
+                printf("regression.%s=%.1f\n", line, change);
+                regressions++;
+            }
+        }
+    }
+    fclose(file);
+    return regressions;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  --baseline FILE      compare with an earlier run's output, fail on a regression\n"
+        "  --tolerance PCT      regression allowed before failing (15)\n",
+        argv0);
+}
+
+int main(int argc, char **argv) {
+    static const struct option long_options[] = {
+        {"baseline", required_argument, NULL, 'b'}, {"tolerance", required_argument, NULL, 't'},
+        {"help", no_argument, NULL, 'h'}, {NULL, 0, NULL, 0},
+    };
+    const char *baseline = NULL;
+    double tolerance = 15;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'b': baseline = optarg; break;
+            case 't': tolerance = atof(optarg); break;
+            default: usage(argv[0]); return 2;
+        }
+    }
+
+    sim_log_level = 0;
+    fec_init();
+    negotiate_fec(FEC_SUPPORTED);
+    bench_codec();
+    bench_framing();
+    bench_routing();
+    bench_errors();
+    printf("bench.failures=%u\n", failures);
+    if (baseline != NULL) {
+        int regressions = compare(baseline, tolerance);
+        printf("bench.regressions=%d\n", regressions);
+        if (regressions != 0) {
+            return 1;
+        }
+    }
+    return failures ? 1 : 0;
+}
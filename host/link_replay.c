@@ -0,0 +1,397 @@
+// Offline replay of a link trace (Tools/LinkTrace.h) through the unmodified firmware parser
+// 1. Decode: every recorded chunk of UART bytes goes through read_frame (framing, FEC and Hamming(7,4) decode_bytes) from a
+//    replay transport, with esp_timer_get_time held at the chunk's timestamp and the reflection filter primed from the
+//    recorded transmissions, so the result depends on nothing but the trace. Each frame and rejection is compared with the
+//    one the board recorded, from the first frame both agree on (the ring may have dropped the start of the one in progress).
+// 2. Reports: the keyboard and mouse reports decoded are put back in ARQ order, expanded from their compact wire form
+//    (Tools/ReportCodec.h) and applied the way the computer would see them, to find keys left held or held for a long
+//    time, the largest single mouse step and the longest gap between reports.
+// 3. Timeline (--timeline): COM and USB state transitions, frames and rejections in order, with their times.
+// The COM and USB tasks themselves do not run, their transitions are taken from the trace.
+// Output is key=value lines, the exit status is non-zero if the replay decoded anything other than what the board did.
+// Input is a binary trace (link_sim --trace, trace_copy) or with --hex a console log holding the output of 'trace'.
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "Tools/UARTTools.c"                                    // Compiled in to reset the parser between repeats (statics)
+#include "Tools/Transport.h"
+#include "Tools/LinkTrace.h"
+#include "Tools/LinkARQ.h"
+#include "Tools/ReportCodec.h"
+#include "Tools/USBDeviceTools.h"
+#include "state_machines.h"
+#include "sim_port.h"
+
+#define MAX_TRACE       (1 << 20)                               // Largest trace file read, 64 times the board's ring
+#define SYNC_WINDOW     64                                      // Recorded frames searched for the first one the replay agrees on
+#define MAX_RECORDS     (MAX_TRACE / TRACE_HEADER)
+
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+    int64_t time_us;                                            // Unwrapped from the 32 bit timestamps
+    const uint8_t *payload;
+} record_t;
+
+typedef struct {                                                // A frame or rejection, recorded or replayed
+    int length;                                                 // FRAME_CORRUPT for a rejection
+    uint8_t data[MAX_FRAME_PAYLOAD + 1];                        // Message, then the sequence byte
+} result_t;
+
+static const char *com_names[] = {"BACKOFF", "READ", "WRITE", "DUPLEX", "RECONNECT", "PROBE"};   // enum COM_STATE in state_machine_com.c
+static const char *usb_names[] = {"UNKNOWN", "DEVICE_UNKNOWN", "DEVICE_DATASTICK", "DEVICE_HID", "HOST_UNKNOWN", "HOST_DATASTICK", "HOST_HID"};
+static const char *header_names[] = {"NO_HEADER", "ERROR", "HELLO", "HEARD", "ACK", "STATE", "UPDATE", "REPORT_MOUSE",
+                                     "REPORT_KEYBOARD", "MSC_REQUEST", "MSC_DATA", "MSC_STATUS", "RESUME", "RATE", "TRAIN",
+                                     "REPORT_KEYS", "REPORT_MOTION", "OUTPUT_REPORT", "REPORT_RAW", "DESCRIPTOR",
+                                     "REPORT_RAW_MOUSE"};
+
+static uint8_t trace[MAX_TRACE];
+static size_t trace_length = 0;
+static record_t *records;
+static size_t record_count = 0;
+static result_t *expected;                                      // Frames and rejections the board recorded, in order
+static size_t expected_count = 0;
+
+static struct {
+    size_t matched, mismatched, skipped, unsynced, frames, rejects;
+} decode;
+
+static struct {
+    unsigned keyboard_reports, mouse_reports, keys_held_at_end;
+    int64_t held_since_us[HID_CHANNELS];                        // 0 while nothing is held on the channel
+    int64_t longest_hold_us, last_report_us, max_gap_us;
+    int max_mouse_step;
+} reports;
+
+static struct {                                                 // Reliable messages put back in order, as arq_deliver does on the board
+    bool synced;                                                // next is known, from a handshake or the first reliable message
+    uint8_t next;                                               // rseq of the next message to apply
+    uint8_t present;                                            // One bit per held entry
+    uint8_t held[ARQ_WINDOW][MAX_FRAME_PAYLOAD];
+} ordering;
+
+// -------------------------------- REPLAY TRANSPORT --------------------------------
+
+static const uint8_t *pending = NULL;                           // Rest of the chunk being replayed
+static size_t pending_length = 0;
+
+void transport_init(int baud_rate) {
+    (void)baud_rate;
+}
+
+void transport_set_baud(int baud_rate) {
+    (void)baud_rate;
+}
+
+void transport_write(const uint8_t *data, size_t length) {
+    (void)data;
+    (void)length;
+}
+
+int transport_receive(uint8_t *data, size_t length, int ms_to_wait) {
+    (void)ms_to_wait;                                           // Never waits, read_frame gets the next chunk when the replay hands it over
+    length = length < pending_length ? length : pending_length;
+    memcpy(data, pending, length);
+    pending += length;
+    pending_length -= length;
+    return length;
+}
+
+void transport_cancel_receive(void) {
+}
+
+void transport_wait_tx_done(int ms_to_wait) {
+    (void)ms_to_wait;
+}
+
+// -------------------------------- INPUT --------------------------------
+
+static bool read_trace(const char *path, bool hex) {
+    FILE *file = fopen(path, hex ? "r" : "rb");
+    if (file == NULL) {
+        return false;
+    }
+    if (!hex) {
+        trace_length = fread(trace, 1, sizeof(trace), file);
+    } else {
+        char line[1024];
+        while (fgets(line, sizeof(line), file) != NULL) {       // Only lines of nothing but hex pairs, the prompt and the byte count are skipped
+            size_t n = strcspn(line, "\r\n");
+            bool bytes = n > 0 && n % 2 == 0;
+            for (size_t i = 0; i < n && bytes; i++) {
+                bytes = isxdigit((unsigned char)line[i]);
+            }
+            for (size_t i = 0; bytes && i < n && trace_length < sizeof(trace); i += 2) {
+                char pair[3] = {line[i], line[i + 1], 0};
+                trace[trace_length++] = strtoul(pair, NULL, 16);
+            }
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+static bool parse_records(void) {                               // False if the trace ends inside a record
+    records = malloc(MAX_RECORDS * sizeof(record_t));
+    expected = malloc(MAX_RECORDS * sizeof(result_t));
+    uint32_t last = 0;
+    int64_t time_us = 0;
+    for (size_t offset = 0; offset < trace_length; ) {
+        if (offset + TRACE_HEADER > trace_length || offset + TRACE_HEADER + trace[offset + 1] > trace_length) {
+            return false;
+        }
+        record_t *record = &records[record_count];
+        uint32_t stamp = trace[offset + 2] | trace[offset + 3] << 8 | trace[offset + 4] << 16 | (uint32_t)trace[offset + 5] << 24;
+        time_us = record_count == 0 ? stamp : time_us + (uint32_t)(stamp - last);
+        last = stamp;
+        *record = (record_t){.type = trace[offset], .length = trace[offset + 1], .time_us = time_us,
+                             .payload = &trace[offset + TRACE_HEADER]};
+        if (record->type == TRACE_FRAME || record->type == TRACE_REJECT) {
+            result_t *result = &expected[expected_count++];
+            result->length = record->type == TRACE_REJECT ? FRAME_CORRUPT : record->length - 1;
+            memcpy(result->data, record->payload, record->length);
+        }
+        record_count++;
+        offset += TRACE_HEADER + record->length;
+    }
+    return true;
+}
+
+// -------------------------------- DECODE --------------------------------
+
+static bool same(const result_t *a, const result_t *b) {
+    return a->length == b->length && (a->length <= 0 || memcmp(a->data, b->data, a->length + 1) == 0);
+}
+
+static void compare(const result_t *result, size_t *next) {    // Against the recorded results from next on
+    if (decode.matched + decode.mismatched == 0) {              // Not in step yet
+        for (size_t i = *next; i < expected_count && i < *next + SYNC_WINDOW; i++) {
+            if (same(result, &expected[i])) {
+                decode.skipped += i - *next;
+                decode.matched++;
+                *next = i + 1;
+                return;
+            }
+        }
+        decode.unsynced++;
+        return;
+    }
+    if (*next < expected_count && same(result, &expected[*next])) {
+        decode.matched++;
+    } else {
+        decode.mismatched++;
+    }
+    (*next)++;
+}
+
+static void apply_report(const uint8_t *message, int64_t time_us) {
+    if (reports.last_report_us != 0 && time_us - reports.last_report_us > reports.max_gap_us) {
+        reports.max_gap_us = time_us - reports.last_report_us;
+    }
+    reports.last_report_us = time_us;
+    uint8_t channel = message[1] % HID_CHANNELS;
+    if (message[0] == REPORT_MOUSE) {
+        const usb_mouse_report_t *report = (const usb_mouse_report_t *)&message[2];
+        int step = abs(report->x_displacement) + abs(report->y_displacement);
+        reports.max_mouse_step = step > reports.max_mouse_step ? step : reports.max_mouse_step;
+        reports.mouse_reports++;
+        return;
+    }
+    const usb_keyboard_report_t *report = (const usb_keyboard_report_t *)&message[2];
+    bool held = report->modifier != 0;
+    for (uint8_t i = 0; i < 6; i++) {
+        held |= report->keycodes[i] != 0;
+    }
+    if (held && reports.held_since_us[channel] == 0) {
+        reports.held_since_us[channel] = time_us;
+    } else if (!held && reports.held_since_us[channel] != 0) {
+        int64_t hold = time_us - reports.held_since_us[channel];
+        reports.longest_hold_us = hold > reports.longest_hold_us ? hold : reports.longest_hold_us;
+        reports.held_since_us[channel] = 0;
+    }
+    reports.keyboard_reports++;
+}
+
+static void deliver(const uint8_t *frame, int length, int64_t time_us) {   // A decoded frame as the board's deliver_message sees it
+    uint8_t message[MAX_FRAME_PAYLOAD];
+    memcpy(message, frame, length);
+    if (message[0] == HELLO || message[0] == HEARD) {           // A handshake, both sides number reliable messages from 0 again
+        memset(&ordering, 0, sizeof(ordering));
+        ordering.synced = true;
+        return;
+    }
+    if (message[0] == REPORT_MOTION) {
+        report_expand(message);
+        apply_report(message, time_us);
+        return;
+    }
+    if (!arq_reliable(message[0])) {
+        return;
+    }
+    uint8_t rseq = message[length - arq_trailer_length(message[0])];
+    if (!ordering.synced) {                                     // The ring dropped the start of the session
+        ordering.synced = true;
+        ordering.next = rseq;
+    }
+    if ((uint8_t)(rseq - ordering.next) >= ARQ_WINDOW) {        // A retransmission of one already applied
+        return;
+    }
+    memcpy(ordering.held[rseq % ARQ_WINDOW], message, length);
+    ordering.present |= 1 << (rseq % ARQ_WINDOW);
+    while (ordering.present & (1 << (ordering.next % ARQ_WINDOW))) {
+        uint8_t *next = ordering.held[ordering.next % ARQ_WINDOW];
+        ordering.present &= ~(1 << (ordering.next % ARQ_WINDOW));
+        ordering.next++;
+        if (next[0] == REPORT_KEYS) {                           // Deltas against the keys the channel held, only valid in order
+            report_expand(next);
+            apply_report(next, time_us);
+        }
+    }
+}
+
+static void print_event(int64_t time_us, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static void print_event(int64_t time_us, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    printf("timeline %10.3f ", time_us / 1000.0);
+    vprintf(format, args);
+    printf("\n");
+    va_end(args);
+}
+
+static const char *name(const char **names, size_t count, uint8_t value) {
+    return value < count ? names[value] : "?";
+}
+
+static void replay(bool timeline) {                             // One pass over the records, everything decoded is compared and applied
+    rx_count = 0;
+    memset(echoes, 0, sizeof(echoes));
+    size_t next = 0;
+    for (size_t i = 0; i < record_count; i++) {
+        const record_t *record = &records[i];
+        sim_virtual_clock_us = record->time_us;
+        if (record->type == TRACE_TX && record->length == PREFIX_LENGTH - 1) {
+            expect_reflection(record->payload);
+        } else if (record->type == TRACE_COM_STATE && record->length == 2 && timeline) {
+            print_event(record->time_us, "com %s -> %s", name(com_names, 6, record->payload[0]), name(com_names, 6, record->payload[1]));
+        } else if (record->type == TRACE_USB_STATE && record->length == 2 && timeline) {
+            print_event(record->time_us, "usb %s -> %s", name(usb_names, 7, record->payload[0]), name(usb_names, 7, record->payload[1]));
+        } else if (record->type == TRACE_RX) {
+            pending = record->payload;
+            pending_length = record->length;
+            result_t result;
+            uint8_t seq;
+            while ((result.length = read_frame(result.data, &seq, 1)) != 0) {   // Every frame the chunk completes, then it is used up
+                if (result.length > 0) {
+                    result.data[result.length] = seq;
+                    decode.frames++;
+                    deliver(result.data, result.length, record->time_us);
+                    if (timeline) {
+                        print_event(record->time_us, "frame %s length %d seq 0x%02x", name(header_names, 21, result.data[0]), result.length, seq);
+                    }
+                } else {
+                    decode.rejects++;
+                    if (timeline) {
+                        print_event(record->time_us, "rejected");
+                    }
+                }
+                compare(&result, &next);
+            }
+        }
+    }
+}
+
+// -------------------------------- MAIN --------------------------------
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+        "usage: %s [options] TRACE\n"
+        "  --hex           TRACE is a console log with the output of 'trace', not a binary trace\n"
+        "  --timeline      print the state transitions, frames and rejections in order\n"
+        "  --repeat N      decode the trace N times and report the fastest pass (1)\n",
+        argv0);
+}
+
+int main(int argc, char **argv) {
+    static const struct option long_options[] = {
+        {"hex", no_argument, NULL, 'x'}, {"timeline", no_argument, NULL, 't'}, {"repeat", required_argument, NULL, 'r'},
+        {"help", no_argument, NULL, 'h'}, {NULL, 0, NULL, 0},
+    };
+    bool hex = false;
+    bool timeline = false;
+    int repeat = 1;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "h", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'x': hex = true; break;
+            case 't': timeline = true; break;
+            case 'r': repeat = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+            default: usage(argv[0]); return 2;
+        }
+    }
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (!read_trace(argv[optind], hex)) {
+        fprintf(stderr, "could not read %s\n", argv[optind]);
+        return 2;
+    }
+    sim_log_level = 0;
+    trace_enable(false);                                        // The replay's own read_frame calls are not recorded again
+    fec_init();
+    bool complete = parse_records();
+
+    size_t rx_bytes = 0;
+    for (size_t i = 0; i < record_count; i++) {
+        rx_bytes += records[i].type == TRACE_RX ? records[i].length : 0;
+    }
+    double best_s = 0;
+    for (int pass = 0; pass < repeat; pass++) {
+        memset(&decode, 0, sizeof(decode));
+        memset(&reports, 0, sizeof(reports));
+        memset(&ordering, 0, sizeof(ordering));
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        replay(timeline && pass == 0);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        best_s = pass == 0 || seconds < best_s ? seconds : best_s;
+    }
+    int64_t end_us = record_count ? records[record_count - 1].time_us : 0;
+    for (uint8_t channel = 0; channel < HID_CHANNELS; channel++) {
+        if (reports.held_since_us[channel] != 0) {
+            reports.keys_held_at_end++;
+            int64_t hold = end_us - reports.held_since_us[channel];
+            reports.longest_hold_us = hold > reports.longest_hold_us ? hold : reports.longest_hold_us;
+        }
+    }
+
+    printf("replay.trace_bytes=%zu\n", trace_length);
+    printf("replay.complete=%d\n", complete);
+    printf("replay.records=%zu\n", record_count);
+    printf("replay.duration_ms=%.3f\n", record_count ? (end_us - records[0].time_us) / 1000.0 : 0);
+    printf("replay.rx_bytes=%zu\n", rx_bytes);
+    printf("replay.recorded_results=%zu\n", expected_count);
+    printf("replay.frames=%zu\n", decode.frames);
+    printf("replay.rejects=%zu\n", decode.rejects);
+    printf("replay.matched=%zu\n", decode.matched);
+    printf("replay.mismatched=%zu\n", decode.mismatched);
+    printf("replay.skipped=%zu\n", decode.skipped);
+    printf("replay.unsynced=%zu\n", decode.unsynced);
+    printf("replay.keyboard_reports=%u\n", reports.keyboard_reports);
+    printf("replay.keys_held_at_end=%u\n", reports.keys_held_at_end);
+    printf("replay.longest_key_hold_ms=%.3f\n", reports.longest_hold_us / 1000.0);
+    printf("replay.mouse_reports=%u\n", reports.mouse_reports);
+    printf("replay.max_mouse_step=%d\n", reports.max_mouse_step);
+    printf("replay.max_report_gap_ms=%.3f\n", reports.max_gap_us / 1000.0);
+    printf("replay.decode_MBps=%.3f\n", best_s > 0 ? rx_bytes / best_s / 1e6 : 0);
+    return decode.mismatched || decode.matched + decode.mismatched < expected_count - decode.skipped ? 1 : 0;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+// ESP logging on the host: messages go to stderr prefixed with the board name, filtered by SIM_LOG_LEVEL (0 none .. 4 debug)
+
+#include <stdlib.h>
+
+#include "esp_err.h"
+
+void sim_log(int level, const char *tag, const char *format, ...) __attribute__((format(printf, 3, 4)));
+
+#define ESP_LOGE(tag, format, ...) sim_log(1, tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) sim_log(2, tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) sim_log(3, tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) sim_log(4, tag, format, ##__VA_ARGS__)
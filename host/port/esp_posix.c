@@ -0,0 +1,67 @@
+// esp_timer, esp_random, esp_system heap sizes and ESP logging on the host
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "esp_log.h"
+#include "esp_random.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "sim_port.h"
+
+const char *sim_board_name = "-";       // Prefix for log lines, set by the simulator for each board
+int64_t sim_clock_offset_us = 0;        // Added to esp_timer_get_time so the boards do not share a clock
+int sim_log_level = 1;                  // Messages above this level are dropped
+int64_t sim_virtual_clock_us = -1;
+
+static int64_t boot_us = 0;
+
+static int64_t monotonic_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void sim_port_boot(void) {
+    boot_us = monotonic_us();
+}
+
+int64_t sim_uptime_us(void) {
+    return monotonic_us() - boot_us;
+}
+
+int64_t esp_timer_get_time(void) {
+    if (sim_virtual_clock_us >= 0) {
+        return sim_virtual_clock_us;
+    }
+    return sim_uptime_us() + sim_clock_offset_us;
+}
+
+uint32_t esp_random(void) {
+    return ((uint32_t)random() << 16) ^ (uint32_t)random();
+}
+
+uint32_t esp_get_free_heap_size(void) {
+    return 0;
+}
+
+uint32_t esp_get_minimum_free_heap_size(void) {
+    return 0;
+}
+
+void sim_log(int level, const char *tag, const char *format, ...) {
+    static const char letters[] = "-EWID";
+    if (level > sim_log_level) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    flockfile(stderr);
+    fprintf(stderr, "[%s] %c (%lld) %s: ", sim_board_name, letters[level], (long long)(sim_uptime_us() / 1000), tag);
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    funlockfile(stderr);
+    va_end(args);
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stdint.h>
+
+uint32_t esp_get_free_heap_size(void);          // 0, the host heap is not measured
+
+uint32_t esp_get_minimum_free_heap_size(void);
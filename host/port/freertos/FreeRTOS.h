@@ -0,0 +1,88 @@
+#pragma once
+
+// Minimal FreeRTOS API on POSIX threads, enough to run the firmware state machines on Linux.
+// Only the calls the firmware uses are provided. Ticks follow CONFIG_FREERTOS_HZ=100 from sdkconfig.
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define configTICK_RATE_HZ  100
+
+typedef int32_t  BaseType_t;
+typedef uint32_t UBaseType_t;
+typedef uint32_t TickType_t;
+
+typedef struct sim_queue *QueueHandle_t;
+typedef struct sim_queue *QueueSetHandle_t;         // A set is a queue of member handles, as in FreeRTOS
+typedef struct sim_queue *QueueSetMemberHandle_t;
+typedef struct sim_task  *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+typedef uint8_t  StackType_t;                       // Stack depths are in bytes, as on ESP-IDF
+typedef struct { uint8_t unused; } StaticTask_t;    // Static task buffers are accepted and ignored, each thread has its own stack
+typedef struct { uint8_t unused; } StaticQueue_t;
+
+#define pdFALSE          0
+#define pdTRUE           1
+#define pdFAIL           0
+#define pdPASS           1
+#define portMAX_DELAY    ((TickType_t)0xFFFFFFFF)
+#define pdMS_TO_TICKS(ms)     ((TickType_t)(((uint64_t)(ms) * configTICK_RATE_HZ) / 1000))
+#define pdTICKS_TO_MS(ticks)  ((uint32_t)(((uint64_t)(ticks) * 1000) / configTICK_RATE_HZ))
+#define configASSERT(x)       assert(x)
+#define queueQUEUE_TYPE_BASE  0               // xQueueGenericCreateStatic types
+#define queueQUEUE_TYPE_SET   0
+
+// -------------------------------- CRITICAL SECTIONS --------------------------------
+
+typedef pthread_mutex_t portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED  PTHREAD_MUTEX_INITIALIZER
+#define portENTER_CRITICAL(mux)       pthread_mutex_lock(mux)
+#define portEXIT_CRITICAL(mux)        pthread_mutex_unlock(mux)
+
+// -------------------------------- TASKS --------------------------------
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *name, uint32_t stack_depth,
+                                   void *parameters, UBaseType_t priority, TaskHandle_t *created_task, BaseType_t core_id);
+
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t function, const char *name, uint32_t stack_depth, void *parameters,
+                                           UBaseType_t priority, StackType_t *stack, StaticTask_t *control, BaseType_t core_id);
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task);     // Always 0, the threads' stacks are not measured
+
+void vTaskDelay(TickType_t ticks);
+
+TickType_t xTaskGetTickCount(void);
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks_to_wait);
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+
+// -------------------------------- QUEUES --------------------------------
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size);
+
+QueueHandle_t xQueueCreateStatic(UBaseType_t length, UBaseType_t item_size, uint8_t *storage, StaticQueue_t *control);
+
+QueueHandle_t xQueueGenericCreateStatic(UBaseType_t length, UBaseType_t item_size, uint8_t *storage, StaticQueue_t *control, uint8_t type);
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait);
+
+BaseType_t xQueueSendToFront(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait);
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *buffer, TickType_t ticks_to_wait);
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue);
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue);
+
+QueueSetHandle_t xQueueCreateSet(UBaseType_t event_queue_length);
+
+BaseType_t xQueueAddToSet(QueueSetMemberHandle_t queue, QueueSetHandle_t set);
+
+QueueSetMemberHandle_t xQueueSelectFromSet(QueueSetHandle_t set, TickType_t ticks_to_wait);
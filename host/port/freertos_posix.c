@@ -0,0 +1,263 @@
+// FreeRTOS tasks, notifications and queues on POSIX threads (see freertos/FreeRTOS.h)
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "freertos/FreeRTOS.h"
+
+struct sim_task {
+    TaskFunction_t function;
+    void *parameters;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t notified;
+    uint32_t notifications;
+};
+
+struct sim_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    UBaseType_t length;
+    UBaseType_t item_size;
+    UBaseType_t head;                   // Index of the oldest item
+    UBaseType_t count;
+    uint8_t *items;
+    struct sim_queue *set;              // Queue set this queue belongs to, NULL if none
+};
+
+static __thread struct sim_task *current_task = NULL;
+static struct timespec boot_time;
+static pthread_once_t boot_once = PTHREAD_ONCE_INIT;
+
+static void record_boot_time(void) {
+    clock_gettime(CLOCK_MONOTONIC, &boot_time);
+}
+
+static struct timespec deadline_after(TickType_t ticks) {  // Absolute CLOCK_MONOTONIC time ticks from now
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    uint64_t ns = (uint64_t)ticks * (1000000000u / configTICK_RATE_HZ);
+    deadline.tv_sec += ns / 1000000000u;
+    deadline.tv_nsec += ns % 1000000000u;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    return deadline;
+}
+
+static bool wait_on(pthread_cond_t *cond, pthread_mutex_t *lock, TickType_t ticks, const struct timespec *deadline) {
+    if (ticks == portMAX_DELAY) {
+        pthread_cond_wait(cond, lock);
+        return true;
+    }
+    return pthread_cond_timedwait(cond, lock, deadline) != ETIMEDOUT;
+}
+
+static void init_cond(pthread_cond_t *cond) {          // Condition variables time out against CLOCK_MONOTONIC
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+// -------------------------------- TASKS --------------------------------
+
+static void *task_entry(void *arg) {
+    current_task = arg;
+    current_task->function(current_task->parameters);
+    return NULL;
+}
+
+static struct sim_task *task_new(void) {
+    struct sim_task *task = calloc(1, sizeof(*task));
+    pthread_mutex_init(&task->lock, NULL);
+    init_cond(&task->notified);
+    return task;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *name, uint32_t stack_depth,
+                                   void *parameters, UBaseType_t priority, TaskHandle_t *created_task, BaseType_t core_id) {
+    (void)name; (void)stack_depth; (void)priority; (void)core_id;
+    pthread_once(&boot_once, record_boot_time);
+    struct sim_task *task = task_new();
+    task->function = function;
+    task->parameters = parameters;
+    if (created_task != NULL) {
+        *created_task = task;
+    }
+    if (pthread_create(&task->thread, NULL, task_entry, task) != 0) {
+        return pdFAIL;
+    }
+    pthread_detach(task->thread);
+    return pdPASS;
+}
+
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t function, const char *name, uint32_t stack_depth, void *parameters,
+                                           UBaseType_t priority, StackType_t *stack, StaticTask_t *control, BaseType_t core_id) {
+    (void)stack; (void)control;
+    TaskHandle_t task = NULL;
+    return xTaskCreatePinnedToCore(function, name, stack_depth, parameters, priority, &task, core_id) == pdPASS ? task : NULL;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) {
+    (void)task;
+    return 0;
+}
+
+void vTaskDelay(TickType_t ticks) {
+    struct timespec deadline = deadline_after(ticks);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR) {
+    }
+}
+
+TickType_t xTaskGetTickCount(void) {
+    pthread_once(&boot_once, record_boot_time);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t ms = (now.tv_sec - boot_time.tv_sec) * 1000 + (now.tv_nsec - boot_time.tv_nsec) / 1000000;
+    return pdMS_TO_TICKS(ms);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void) {
+    if (current_task == NULL) {                         // The thread running main() becomes a task on first use
+        current_task = task_new();
+        current_task->thread = pthread_self();
+    }
+    return current_task;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks_to_wait) {
+    struct sim_task *task = xTaskGetCurrentTaskHandle();
+    struct timespec deadline = deadline_after(ticks_to_wait == portMAX_DELAY ? 0 : ticks_to_wait);
+    pthread_mutex_lock(&task->lock);
+    while (task->notifications == 0 && ticks_to_wait != 0) {
+        if (!wait_on(&task->notified, &task->lock, ticks_to_wait, &deadline)) {
+            break;
+        }
+    }
+    uint32_t value = task->notifications;
+    if (value != 0) {
+        task->notifications = clear_on_exit ? 0 : value - 1;
+    }
+    pthread_mutex_unlock(&task->lock);
+    return value;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+    pthread_mutex_lock(&task->lock);
+    task->notifications++;
+    pthread_cond_signal(&task->notified);
+    pthread_mutex_unlock(&task->lock);
+    return pdPASS;
+}
+
+// -------------------------------- QUEUES --------------------------------
+
+static struct sim_queue *queue_new(UBaseType_t length, UBaseType_t item_size, uint8_t *items) {
+    struct sim_queue *queue = calloc(1, sizeof(*queue));
+    pthread_mutex_init(&queue->lock, NULL);
+    init_cond(&queue->not_empty);
+    init_cond(&queue->not_full);
+    queue->length = length;
+    queue->item_size = item_size;
+    queue->items = items;
+    return queue;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t item_size) {
+    return queue_new(length, item_size, calloc(length, item_size));
+}
+
+QueueHandle_t xQueueCreateStatic(UBaseType_t length, UBaseType_t item_size, uint8_t *storage, StaticQueue_t *control) {
+    (void)control;
+    return queue_new(length, item_size, storage);           // The items live in the caller's storage, as on the target
+}
+
+QueueHandle_t xQueueGenericCreateStatic(UBaseType_t length, UBaseType_t item_size, uint8_t *storage, StaticQueue_t *control, uint8_t type) {
+    (void)type;                                             // A set is a queue of member handles here too
+    return xQueueCreateStatic(length, item_size, storage, control);
+}
+
+static BaseType_t queue_put(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait, bool to_front) {
+    struct timespec deadline = deadline_after(ticks_to_wait == portMAX_DELAY ? 0 : ticks_to_wait);
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == queue->length) {
+        if (ticks_to_wait == 0 || !wait_on(&queue->not_full, &queue->lock, ticks_to_wait, &deadline)) {
+            pthread_mutex_unlock(&queue->lock);
+            return pdFAIL;
+        }
+    }
+    UBaseType_t slot;
+    if (to_front) {
+        queue->head = (queue->head + queue->length - 1) % queue->length;
+        slot = queue->head;
+    } else {
+        slot = (queue->head + queue->count) % queue->length;
+    }
+    memcpy(&queue->items[slot * queue->item_size], item, queue->item_size);
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+    if (queue->set != NULL) {           // The set is as long as its members together, never full
+        queue_put(queue->set, &queue, portMAX_DELAY, false);
+    }
+    return pdPASS;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait) {
+    return queue_put(queue, item, ticks_to_wait, false);
+}
+
+BaseType_t xQueueSendToFront(QueueHandle_t queue, const void *item, TickType_t ticks_to_wait) {
+    return queue_put(queue, item, ticks_to_wait, true);
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *buffer, TickType_t ticks_to_wait) {
+    struct timespec deadline = deadline_after(ticks_to_wait == portMAX_DELAY ? 0 : ticks_to_wait);
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0) {
+        if (ticks_to_wait == 0 || !wait_on(&queue->not_empty, &queue->lock, ticks_to_wait, &deadline)) {
+            pthread_mutex_unlock(&queue->lock);
+            return pdFAIL;
+        }
+    }
+    memcpy(buffer, &queue->items[queue->head * queue->item_size], queue->item_size);
+    queue->head = (queue->head + 1) % queue->length;
+    queue->count--;
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+    return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+    pthread_mutex_lock(&queue->lock);
+    UBaseType_t count = queue->count;
+    pthread_mutex_unlock(&queue->lock);
+    return count;
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t queue) {
+    return queue->length - uxQueueMessagesWaiting(queue);
+}
+
+// -------------------------------- QUEUE SETS --------------------------------
+
+QueueSetHandle_t xQueueCreateSet(UBaseType_t event_queue_length) {
+    return xQueueCreate(event_queue_length, sizeof(QueueSetMemberHandle_t));
+}
+
+BaseType_t xQueueAddToSet(QueueSetMemberHandle_t queue, QueueSetHandle_t set) {
+    queue->set = set;
+    return pdPASS;
+}
+
+QueueSetMemberHandle_t xQueueSelectFromSet(QueueSetHandle_t set, TickType_t ticks_to_wait) {
+    QueueSetMemberHandle_t member = NULL;
+    return xQueueReceive(set, &member, ticks_to_wait) == pdPASS ? member : NULL;
+}
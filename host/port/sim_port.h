@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdint.h>
+
+// Knobs of the host port that the simulator sets per board before starting the firmware tasks
+
+extern const char *sim_board_name;
+extern int64_t sim_clock_offset_us;
+extern int sim_log_level;
+extern int64_t sim_virtual_clock_us;    // When not negative esp_timer_get_time returns it instead (host/link_replay.c sets the time of each record)
+
+void sim_port_boot(void);               // Restart esp_timer_get_time from zero (call when a simulated board powers up)
+
+int64_t sim_uptime_us(void);            // Time since sim_port_boot without the clock offset
@@ -0,0 +1,119 @@
+// Transport HAL backend for the host simulator: the "UART" is one end of a socket to the simulated optical channel
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "Tools/Transport.h"
+#include "Tools/PowerTools.h"
+#include "sim.h"
+
+int sim_link_fd = -1;                   // Set by the simulator before the COM task starts
+volatile int *sim_link_baud = NULL;     // Set by the simulator, the firmware writes the rate it asks for
+uint32_t sim_link_wakes = 0;
+
+#define TX_FIFO_SIZE 128                // Bytes the ESP32-S3 UART FIFO holds before uart_write_bytes blocks
+#define SLEEP_AFTER_US 30000            // A board that may sleep is taken to be in light sleep once its link has been quiet this long (3 idle ticks)
+
+static int64_t tx_idle_us = 0;          // When the simulated UART would finish shifting out everything written so far
+static int cancel_pipe[2] = {-1, -1};   // transport_cancel_receive writes a byte, a waiting transport_receive returns on it
+static int64_t last_activity_us = 0;    // Last byte written or received
+
+static int64_t now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int64_t now_ms(void) {
+    return now_us() / 1000;
+}
+
+void transport_init(int baud_rate) {
+    *sim_link_baud = baud_rate;
+    pipe(cancel_pipe);
+}
+
+static void sleep_us(int64_t us) {
+    if (us > 0) {
+        struct timespec pause = {.tv_sec = us / 1000000, .tv_nsec = (us % 1000000) * 1000};
+        nanosleep(&pause, NULL);
+    }
+}
+
+void transport_write(const uint8_t *data, size_t length) {     // Like uart_write_bytes without a TX ring: returns once the rest fits in the FIFO
+    int64_t now = now_us();
+    int64_t byte_ns = 10 * 1000000000LL / *sim_link_baud;        // Start + 8 data + stop bits
+    tx_idle_us = (tx_idle_us > now ? tx_idle_us : now) + (int64_t)length * byte_ns / 1000;
+    last_activity_us = now;
+    int64_t fits_us = tx_idle_us - TX_FIFO_SIZE * byte_ns / 1000; // When everything but a FIFO's worth has been shifted out
+    while (length > 0) {
+        ssize_t written = send(sim_link_fd, data, length, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;                         // Channel gone, the simulation is ending
+        }
+        data += written;
+        length -= written;
+    }
+    sleep_us(fits_us - now_us());
+}
+
+int transport_receive(uint8_t *data, size_t length, int ms_to_wait) {  // Like the UART data events: returns whatever arrived as soon as anything has
+    struct pollfd pfd[2] = {{.fd = sim_link_fd, .events = POLLIN}, {.fd = cancel_pipe[0], .events = POLLIN}};
+    int64_t deadline = now_ms() + ms_to_wait;
+    while (1) {
+        uint8_t cancel;
+        if (poll(&pfd[1], 1, 0) > 0 && read(cancel_pipe[0], &cancel, 1) == 1) {
+            return 0;
+        }
+        ssize_t n = recv(sim_link_fd, data, length, MSG_DONTWAIT);
+        if (n > 0) {
+            int64_t now = now_us();
+            bool asleep = power_sleeps() && now - last_activity_us >= SLEEP_AFTER_US;
+            last_activity_us = now;
+            if (asleep) {                   // The bytes that woke the UART are lost, like on the boards
+                sim_link_wakes++;
+                continue;
+            }
+            return (int)n;
+        }
+        int64_t remaining = deadline - now_ms();
+        if (n == 0 || remaining <= 0) {
+            return 0;                       // Timeout or channel closed
+        }
+        poll(pfd, 2, (int)remaining);
+    }
+}
+
+void transport_cancel_receive(void) {
+    uint8_t cancel = 0;
+    write(cancel_pipe[1], &cancel, 1);
+}
+
+void transport_set_baud(int baud_rate) {            // The UART switches once its FIFO has drained, bytes it had received are flushed
+    sleep_us(tx_idle_us - now_us());
+    *sim_link_baud = baud_rate;
+    uint8_t discard[256];
+    while (recv(sim_link_fd, discard, sizeof(discard), MSG_DONTWAIT) > 0) {
+    }
+}
+
+void transport_wait_tx_done(int ms_to_wait) {      // The channel paces the bytes, this only models how long the UART would stay busy
+    int64_t wait_us = tx_idle_us - now_us();
+    if (wait_us > (int64_t)ms_to_wait * 1000) {
+        wait_us = (int64_t)ms_to_wait * 1000;
+    }
+    sleep_us(wait_us);
+}
+
+void transport_wake_peer(int ms_to_wake) {
+    static const uint8_t burst[2] = {0x55, 0x55};
+    transport_write(burst, sizeof(burst));
+    transport_wait_tx_done(ms_to_wake);
+    sleep_us((int64_t)ms_to_wake * 1000);
+}
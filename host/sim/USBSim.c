@@ -0,0 +1,467 @@
+// USB HAL backend for the host simulator: stands in for Tools/USBDeviceTools.c (tinyusb) and Tools/USBHostTools.c (hid_host)
+// The device side records what would reach the computer, the host side generates reports like a plugged in mouse, keyboard
+// or a hub with both.
+// With a datastick the host side is a RAM disk and the device side plays a computer copying files to and from it.
+// With a keyboard the computer toggles Caps Lock every LEDS_PERIOD_MS and the host side records the LED state it is sent.
+// With passthrough the mouse (16 bit motion, report ID 1) and keyboard (14 keys) have report descriptors of their own and
+// send raw reports, the device side checks it presents the same descriptors and decodes the reports by them.
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "state_machines.h"
+#include "esp_log.h"
+#include "Tools/USBDeviceTools.h"
+#include "Tools/USBHostTools.h"
+#include "Tools/LatencyTools.h"
+#include "Tools/ReportPool.h"
+#include "Tools/MouseCoalescer.h"
+#include "Tools/MSCBridge.h"
+#include "Tools/OutputReports.h"
+#include "Tools/HIDPassthrough.h"
+#include "sim.h"
+#include "sim_port.h"
+
+static const char *TAG = "USB SIM";
+
+#define STICK_BLOCKS    8192                // 4 MB simulated datastick
+#define STICK_BLOCK_US  100                 // Time the stick takes per block
+#define PASS_BLOCKS     128                 // Blocks the simulated computer reads, then writes, in each pass
+#define WRITE_PATTERN   0xA5                // Written blocks are the read pattern with this mask
+#define LEDS_PERIOD_MS  500                 // The computer toggles Caps Lock this often
+#define REPORT_OUTPUT   2                   // hid_report_type_t of an LED report
+#define LED_CAPS_LOCK   0x02
+
+sim_usb_config_t sim_usb_config = {.report_hz = 125, .plug_delay_ms = 100};
+sim_usb_stats_t sim_usb_stats = {.device_ready_ms = -1, .first_report_ms = -1};
+
+static volatile bool installed = false;             // Device side: composite device enumerated to the computer
+static volatile uint8_t active_layout = 0;          // Device side: channels with an active HID interface
+static volatile bool datastick_active = false;      // Device side: mass storage medium present
+static volatile bool host_installed = false;        // Host side: host drivers are installed
+static volatile uint8_t hosted_layout = 0;          // Host side: HID channels opened by the (simulated) HID driver
+static volatile bool stick_attached = false;        // Host side: datastick opened by the (simulated) MSC driver
+static int64_t host_installed_ms = 0;
+static portMUX_TYPE plug_lock = portMUX_INITIALIZER_UNLOCKED;     // Between the generator plugging the peripheral and the USB task uninstalling
+static int64_t last_report_ms = -1;
+static int64_t last_leds_ms = 0;                    // Device side: when the computer last set the keyboard LEDs
+static uint8_t stick[STICK_BLOCKS][MSC_BLOCK_SIZE];
+static const char *device_names[] = {"none", "mouse", "keyboard", "datastick", "hub"};
+
+#define SIM_MOUSE_REPORT_ID    1
+#define SIM_MOUSE_REPORT_LEN   8            // ID, buttons, x and y (16 bit), wheel, horizontal scroll
+#define SIM_KEYBOARD_REPORT_LEN 16          // Modifiers, reserved, 14 keycodes
+
+static const uint8_t sim_mouse_descriptor[] = {     // Longer than one DESCRIPTOR chunk
+    0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x85, SIM_MOUSE_REPORT_ID, 0x09, 0x01, 0xA1, 0x00,
+    0x05, 0x09, 0x19, 0x01, 0x29, 0x05, 0x15, 0x00, 0x25, 0x01, 0x95, 0x05, 0x75, 0x01, 0x81, 0x02,
+    0x95, 0x01, 0x75, 0x03, 0x81, 0x01,
+    0x05, 0x01, 0x09, 0x30, 0x09, 0x31, 0x16, 0x01, 0x80, 0x26, 0xFF, 0x7F, 0x75, 0x10, 0x95, 0x02, 0x81, 0x06,
+    0x09, 0x38, 0x15, 0x81, 0x25, 0x7F, 0x75, 0x08, 0x95, 0x01, 0x81, 0x06,
+    0x05, 0x0C, 0x0A, 0x38, 0x02, 0x95, 0x01, 0x81, 0x06,
+    0xC0, 0xC0
+};
+
+static const uint8_t sim_keyboard_descriptor[] = {
+    0x05, 0x01, 0x09, 0x06, 0xA1, 0x01,
+    0x05, 0x07, 0x19, 0xE0, 0x29, 0xE7, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x08, 0x81, 0x02,
+    0x95, 0x01, 0x75, 0x08, 0x81, 0x01,
+    0x95, 0x05, 0x75, 0x01, 0x05, 0x08, 0x19, 0x01, 0x29, 0x05, 0x91, 0x02,
+    0x95, 0x01, 0x75, 0x03, 0x91, 0x01,
+    0x95, 0x0E, 0x75, 0x08, 0x15, 0x00, 0x26, 0xFF, 0x00, 0x05, 0x07, 0x19, 0x00, 0x2A, 0xFF, 0x00, 0x81, 0x00,
+    0xC0
+};
+
+static const uint8_t *sim_descriptor(uint8_t type, uint16_t *length) {
+    *length = type == MOUSE ? sizeof(sim_mouse_descriptor) : sizeof(sim_keyboard_descriptor);
+    return type == MOUSE ? sim_mouse_descriptor : sim_keyboard_descriptor;
+}
+
+static int64_t board_ms(void) {
+    return sim_uptime_us() / 1000;
+}
+
+static uint8_t peripheral_layout(uint8_t peripheral) {             // HID channels a peripheral brings up, see CHANNEL_TYPE
+    switch (peripheral) {
+        case MOUSE:
+        case KEYBOARD:  return peripheral;
+        case SIM_HUB:   return KEYBOARD | MOUSE << 2;
+        default:        return 0;
+    }
+}
+
+static uint8_t stick_pattern(uint32_t lba, uint32_t i) {           // Initial contents of the simulated stick
+    return (uint8_t)(lba * 131 + i * 7 + (lba >> 8));
+}
+
+// -------------------------------- DEVICE SIDE --------------------------------
+
+static void check_ready(void) {                                       // Record when the computer first sees the far side's peripheral
+    bool bridging = usb_state == DEVICE_HID || usb_state == DEVICE_DATASTICK;
+    bool expected = sim_usb_config.bridged == DATASTICK ? datastick_active
+                  : active_layout != 0 && active_layout == peripheral_layout(sim_usb_config.bridged);
+    if (bridging && expected && sim_usb_stats.device_ready_ms < 0) {
+        sim_usb_stats.device_ready_ms = board_ms();
+    }
+}
+
+void device_install(void) {
+    installed = true;
+    usb_event(USB_EVENT_COMPUTER);                                  // The computer mounts it at once, like tud_mount_cb
+}
+
+void activate_hid(uint8_t layout) {                                 // Every channel type fits, the composite device has two of each
+    active_layout = layout;
+    uint8_t cloned = 0;
+    for (uint8_t channel = 0; channel < HID_CHANNELS; channel++) {   // Like present_descriptors, without enumerating again
+        uint8_t type = CHANNEL_TYPE(layout, channel);
+        uint16_t length, expected_length;
+        const uint8_t *descriptor = passthrough_descriptor(channel, &length);
+        if ((type == MOUSE || type == KEYBOARD) && descriptor != NULL) {
+            const uint8_t *expected = sim_descriptor(type, &expected_length);
+            cloned += length == expected_length && memcmp(descriptor, expected, length) == 0;
+        }
+    }
+    sim_usb_stats.descriptors_cloned = cloned;
+    check_ready();
+}
+
+void activate_datastick(bool active) {
+    datastick_active = active;
+    check_ready();
+}
+
+static bool has_interface(uint8_t channel, uint8_t type) {
+    return installed && channel < HID_CHANNELS && CHANNEL_TYPE(active_layout, channel) == type;
+}
+
+static void report_delivered(void) {
+    int64_t now = board_ms();
+    if (sim_usb_stats.first_report_ms < 0) {
+        sim_usb_stats.first_report_ms = now;
+    } else if (now - last_report_ms > sim_usb_stats.max_gap_ms) {
+        sim_usb_stats.max_gap_ms = now - last_report_ms;
+    }
+    last_report_ms = now;
+    sim_usb_stats.reports_delivered++;
+}
+
+void send_mouse_report_to_computer(uint8_t channel, usb_mouse_report_t *report) {
+    if (!has_interface(channel, MOUSE)) {
+        return;
+    }
+    sim_usb_stats.motion_delivered += report->x_displacement;
+    report_delivered();
+}
+
+static void key_delivered(bool down) {
+    if (down && !sim_usb_stats.key_down_at_end) {
+        sim_usb_stats.key_presses_delivered++;
+    } else if (!down && sim_usb_stats.key_down_at_end) {
+        sim_usb_stats.key_releases_delivered++;
+    }
+    sim_usb_stats.key_down_at_end = down;
+    report_delivered();
+}
+
+void send_keyboard_report_to_computer(uint8_t channel, usb_keyboard_report_t *report) {
+    if (!has_interface(channel, KEYBOARD)) {
+        return;
+    }
+    key_delivered(report->keycodes[0] != 0);
+}
+
+void send_raw_report_to_computer(uint8_t channel, const uint8_t *report, uint8_t length) {
+    uint16_t descriptor_length;
+    if (passthrough_descriptor(channel, &descriptor_length) == NULL) {
+        return;                                                     // The interface still presents the canned descriptor
+    }
+    if (has_interface(channel, MOUSE) && length == SIM_MOUSE_REPORT_LEN && report[0] == SIM_MOUSE_REPORT_ID) {
+        sim_usb_stats.raw_reports_delivered++;
+        sim_usb_stats.motion_delivered += (int16_t)(report[2] | report[3] << 8);
+        report_delivered();
+    } else if (has_interface(channel, KEYBOARD) && length == SIM_KEYBOARD_REPORT_LEN) {
+        sim_usb_stats.raw_reports_delivered++;
+        key_delivered(report[2] != 0);
+    }
+}
+
+static void computer_leds(void) {                                   // Generator thread: SET_REPORT to the first bridged keyboard, like tud_hid_set_report_cb
+    if (usb_state != DEVICE_HID || board_ms() - last_leds_ms < LEDS_PERIOD_MS) {
+        return;
+    }
+    for (uint8_t channel = 0; channel < HID_CHANNELS; channel++) {
+        if (has_interface(channel, KEYBOARD)) {
+            sim_usb_stats.leds_sent ^= LED_CAPS_LOCK;
+            sim_usb_stats.output_reports_sent++;
+            output_queue(channel, REPORT_OUTPUT, 0, &sim_usb_stats.leds_sent, 1);
+            last_leds_ms = board_ms();
+            return;
+        }
+    }
+}
+
+static bool computer_read(uint32_t lba) {                           // Read one block like tinyusb with a one block endpoint buffer
+    uint8_t block[MSC_BLOCK_SIZE];
+    int32_t result;
+    while ((result = msc_bridge_read(lba, 0, block, MSC_BLOCK_SIZE)) == 0) {
+        if (!datastick_active) {
+            return false;
+        }
+    }
+    if (result < 0) {
+        sim_usb_stats.msc_errors++;
+        return false;
+    }
+    for (uint32_t i = 0; i < MSC_BLOCK_SIZE; i++) {
+        uint8_t expected = stick_pattern(lba, i) ^ (lba >= PASS_BLOCKS ? WRITE_PATTERN : 0);
+        if (block[i] != expected) {
+            sim_usb_stats.msc_read_mismatches++;
+            break;
+        }
+    }
+    return true;
+}
+
+static bool computer_write(uint32_t lba) {
+    uint8_t block[MSC_BLOCK_SIZE];
+    for (uint32_t i = 0; i < MSC_BLOCK_SIZE; i++) {
+        block[i] = stick_pattern(lba, i) ^ WRITE_PATTERN;
+    }
+    int32_t result;
+    while ((result = msc_bridge_write(lba, 0, block, MSC_BLOCK_SIZE)) == 0) {
+        if (!datastick_active) {
+            return false;
+        }
+    }
+    if (result < 0) {
+        sim_usb_stats.msc_errors++;
+        return false;
+    }
+    return true;
+}
+
+static void computer_task(void *arg) {                              // Copies files to and from the bridged datastick while its medium is present
+    uint32_t pass = 0;
+    while (1) {
+        uint32_t block_count;
+        if (!datastick_active || !msc_bridge_capacity(&block_count)) {
+            vTaskDelay(pdMS_TO_TICKS(10));
+            continue;
+        }
+        uint32_t base = (pass % 2) * PASS_BLOCKS;                   // Blocks below PASS_BLOCKS keep their original contents
+        int64_t start = sim_uptime_us();
+        int64_t spent = sim_usb_stats.msc_read_us;
+        for (uint32_t done = 0; done < PASS_BLOCKS && computer_read(base + done); done++) {
+            sim_usb_stats.msc_read_bytes += MSC_BLOCK_SIZE;         // Counted per block so a pass cut short by the end of the run still counts
+            sim_usb_stats.msc_read_us = spent + sim_uptime_us() - start;
+            if (sim_usb_stats.first_report_ms < 0) {
+                sim_usb_stats.first_report_ms = board_ms();
+            }
+        }
+        start = sim_uptime_us();
+        spent = sim_usb_stats.msc_write_us;
+        for (uint32_t done = 0; done < PASS_BLOCKS && computer_write(PASS_BLOCKS + done); done++) {
+            sim_usb_stats.msc_write_bytes += MSC_BLOCK_SIZE;
+            sim_usb_stats.msc_write_us = spent + sim_uptime_us() - start;
+        }
+        computer_read(2 * PASS_BLOCKS - 1);                         // Verify the last block written, its write is most likely still in flight
+        if (!msc_bridge_flush(5000)) {
+            sim_usb_stats.msc_errors++;
+        }
+        sim_usb_stats.msc_write_us = spent + sim_uptime_us() - start;
+        pass++;
+    }
+}
+
+void disconnect_device(void) {
+    installed = false;
+    usb_event(USB_EVENT_COMPUTER);
+}
+
+bool detect_host(void) {
+    return sim_usb_config.pc_connected && installed;
+}
+
+// -------------------------------- HOST SIDE --------------------------------
+
+void host_install(void) {
+    host_installed_ms = board_ms();
+    host_installed = true;
+}
+
+void host_uninstall(void) {
+    portENTER_CRITICAL(&plug_lock);
+    host_installed = false;
+    hosted_layout = 0;
+    stick_attached = false;
+    portEXIT_CRITICAL(&plug_lock);
+    for (uint8_t channel = 0; channel < HID_CHANNELS; channel++) {
+        passthrough_set(channel, NULL, 0);                          // Like close_channel
+    }
+}
+
+uint8_t detect_device(void) {
+    return stick_attached ? DATASTICK : NONE;
+}
+
+uint8_t hid_layout(void) {
+    return hosted_layout;
+}
+
+void handle_hosting(void) {                                         // The generator plugs the peripheral in, there is no driver to open it
+}
+
+bool send_output_report_to_device(uint8_t channel, uint8_t type, uint8_t id, const uint8_t *data, uint8_t length) {
+    if (channel >= HID_CHANNELS || CHANNEL_TYPE(hosted_layout, channel) == NONE) {
+        return false;
+    }
+    if (CHANNEL_TYPE(hosted_layout, channel) == KEYBOARD && type == REPORT_OUTPUT && length == 1) {
+        sim_usb_stats.leds_delivered = data[0];
+    }
+    sim_usb_stats.output_reports_delivered++;
+    return true;
+}
+
+static void plug_peripheral(void) {                                 // Generator thread: the simulated driver reports the peripheral plug_delay_ms after host_install
+    bool plugged = false;
+    portENTER_CRITICAL(&plug_lock);
+    if (host_installed && hosted_layout == 0 && !stick_attached && sim_usb_config.peripheral != NONE
+        && board_ms() - host_installed_ms >= sim_usb_config.plug_delay_ms) {
+        stick_attached = sim_usb_config.peripheral == DATASTICK;
+        uint8_t layout = peripheral_layout(sim_usb_config.peripheral);
+        for (uint8_t channel = 0; channel < HID_CHANNELS; channel++) {     // Like hid_host_device_event, before the layout lists the channel
+            uint16_t length = 0;
+            uint8_t type = CHANNEL_TYPE(layout, channel);
+            const uint8_t *descriptor = NULL;
+            if (sim_usb_config.passthrough && (type == MOUSE || type == KEYBOARD)) {
+                descriptor = sim_descriptor(type, &length);
+            }
+            passthrough_set(channel, descriptor, length);
+        }
+        hosted_layout = layout;
+        plugged = true;
+    }
+    portEXIT_CRITICAL(&plug_lock);
+    if (plugged) {
+        ESP_LOGI(TAG, "Simulated %s connected.", device_names[sim_usb_config.peripheral]);
+        usb_event(USB_EVENT_PERIPHERAL);
+    }
+}
+
+bool datastick_info(uint32_t *block_count, uint32_t *block_size) {
+    *block_count = STICK_BLOCKS;
+    *block_size = MSC_BLOCK_SIZE;
+    return stick_attached;
+}
+
+bool datastick_read(uint32_t lba, uint8_t blocks, uint8_t *data) {
+    if (!stick_attached || lba + blocks > STICK_BLOCKS) {
+        return false;
+    }
+    usleep(blocks * STICK_BLOCK_US);
+    memcpy(data, stick[lba], blocks * MSC_BLOCK_SIZE);
+    return true;
+}
+
+bool datastick_write(uint32_t lba, uint8_t blocks, const uint8_t *data) {
+    if (!stick_attached || lba + blocks > STICK_BLOCKS) {
+        return false;
+    }
+    usleep(blocks * STICK_BLOCK_US);
+    for (uint8_t b = 0; b < blocks; b++) {                          // The computer side writes the read pattern with WRITE_PATTERN
+        for (uint32_t i = 0; i < MSC_BLOCK_SIZE; i++) {
+            if (data[b * MSC_BLOCK_SIZE + i] != (stick_pattern(lba + b, i) ^ WRITE_PATTERN)) {
+                sim_usb_stats.msc_write_mismatches++;
+                break;
+            }
+        }
+    }
+    memcpy(stick[lba], data, blocks * MSC_BLOCK_SIZE);
+    return true;
+}
+
+static void queue_report(const uint8_t *data, bool mouse) {         // Same hand-off as keyboard_callback
+    int64_t capture_time = esp_timer_get_time();
+    sim_usb_stats.reports_generated++;
+    uint8_t *slot = report_pool_claim();
+    if (slot == NULL) {
+        sim_usb_stats.reports_dropped++;
+        return;
+    }
+    memcpy(slot, data, REPORT_SLOT_SIZE);
+    latency_report_captured(capture_time, mouse);
+    report_pool_publish(slot, mouse);
+}
+
+static void *generator(void *arg) {                                 // One report per HID channel every period
+    (void)arg;
+    bool key_down = false;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (1) {
+        long period_ns = 1000000000L / sim_usb_config.report_hz;
+        next.tv_nsec += period_ns;
+        while (next.tv_nsec >= 1000000000L) {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        plug_peripheral();
+        computer_leds();
+        int every = sim_usb_config.pause_every_ms;
+        if (every > 0 && board_ms() % every >= every - sim_usb_config.pause_ms) {
+            continue;                                               // Nobody touching the mouse or keyboard
+        }
+        uint8_t layout = hosted_layout;
+        for (uint8_t channel = 0; channel < HID_CHANNELS; channel++) {
+            uint8_t data[REPORT_SLOT_SIZE] = {0};
+            if (CHANNEL_TYPE(layout, channel) == MOUSE && passthrough_raw(channel)) {
+                int16_t x = 1;
+                data[0] = REPORT_RAW_MOUSE;
+                data[1] = channel;
+                data[2] = SIM_MOUSE_REPORT_LEN;
+                data[3] = SIM_MOUSE_REPORT_ID;
+                data[5] = x & 0xFF;
+                data[6] = x >> 8;
+                sim_usb_stats.motion_generated += x;
+                queue_report(data, true);                           // Not coalesced, like publish_raw_report
+            } else if (CHANNEL_TYPE(layout, channel) == KEYBOARD && passthrough_raw(channel)) {
+                key_down = !key_down;
+                data[0] = REPORT_RAW;
+                data[1] = channel;
+                data[2] = SIM_KEYBOARD_REPORT_LEN;
+                data[5] = key_down ? 0x04 : 0x00;
+                sim_usb_stats.key_down_generated = key_down;
+                queue_report(data, false);
+            } else if (CHANNEL_TYPE(layout, channel) == MOUSE) {
+                usb_mouse_report_t report = {.x_displacement = 1};  // Summed on the far side to detect lost motion
+                sim_usb_stats.reports_generated++;
+                sim_usb_stats.motion_generated += report.x_displacement;
+                coalesce_mouse_report(channel, &report, esp_timer_get_time());
+            } else if (CHANNEL_TYPE(layout, channel) == KEYBOARD) {
+                key_down = !key_down;
+                data[0] = REPORT_KEYBOARD;
+                data[1] = channel;
+                data[4] = key_down ? 0x04 : 0x00;                   // First keycode: 'a' pressed / released
+                sim_usb_stats.key_down_generated = key_down;
+                queue_report(data, false);
+            }
+        }
+    }
+    return NULL;
+}
+
+void sim_usb_start(void) {
+    for (uint32_t lba = 0; lba < STICK_BLOCKS; lba++) {
+        for (uint32_t i = 0; i < MSC_BLOCK_SIZE; i++) {
+            stick[lba][i] = stick_pattern(lba, i);
+        }
+    }
+    xTaskCreatePinnedToCore(computer_task, "Computer", 4096, NULL, 5, NULL, 0);
+    pthread_t thread;
+    pthread_create(&thread, NULL, generator, NULL);
+    pthread_detach(thread);
+}
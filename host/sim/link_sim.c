@@ -0,0 +1,504 @@
+// Runs two copies of the unmodified firmware state machines against a simulated optical channel.
+//
+// Board A is plugged into a computer, board B hosts a mouse, keyboard, hub with both or datastick (--unplugged: neither has anything).
+// With a keyboard the computer also toggles Caps Lock, the LED reports cross the link the other way.
+// With --passthrough the keyboard and mouse run the report protocol, their descriptors and raw reports cross the link.
+// Each board runs in its own process (the firmware keeps its state in globals) and talks to the channel, which runs in this
+// process, through a socket.
+// The channel paces bytes at the rate the sending board set (garbling them for a receiver set to another) and can add latency,
+// bit errors, reflections, dropouts and a rate above which the optical path gets noisy.
+//
+// Output is key=value lines (A.*, B.*, channel.*, summary.*) followed by each board's latency table.
+// Exit status is non-zero if no report (or datastick block) reached the computer, or a datastick block was corrupted.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "state_machines.h"
+#include "Tools/LatencyTools.h"
+#include "Tools/UARTTools.h"
+#include "Tools/LinkARQ.h"
+#include "Tools/FEC.h"
+#include "Tools/Telemetry.h"
+#include "Tools/StaticMemory.h"
+#include "Tools/LinkScheduler.h"
+#include "Tools/LinkTrace.h"
+#include "Tools/PowerTools.h"
+#include "Tools/OutputReports.h"
+#include "Tools/MouseCoalescer.h"
+#include "sim.h"
+#include "sim_port.h"
+
+QueueHandle_t usb_to_com_queue;         // Defined in main.c on the boards
+QueueHandle_t com_to_usb_queue;
+QueueHandle_t com_to_usb_mouse_queue;
+QueueHandle_t usb_event_queue;
+QueueSetHandle_t usb_event_set;
+
+typedef struct {
+    double duration_s;
+    double ber;                         // Probability of each bit being flipped
+    int64_t latency_us;                 // Propagation delay added to every byte
+    double echo;                        // Probability of each byte being reflected back to its sender
+    int64_t dropout_start_ms;           // First beam interruption, relative to power up
+    int64_t dropout_every_ms;           // Interval between beam interruptions (0 = none)
+    int64_t dropout_ms;                 // Length of each interruption
+    int max_baud;                       // Fastest rate the optical path carries cleanly (0 = no limit)
+    uint8_t peripheral;
+    bool unplugged;                     // Nothing on either board, both may light sleep
+    int report_hz;
+    int pause_every_ms;                 // The peripheral goes quiet for the last pause_ms of every period this long (0 = never)
+    int pause_ms;
+    int64_t clock_skew_us;              // Board B's clock runs this far ahead of board A's
+    bool passthrough;                   // Board B's keyboard and mouse run the report protocol (Tools/HIDPassthrough.h)
+    int log_level;
+    const char *trace;                  // Each board writes its link trace to this path with .A or .B appended (NULL = none)
+} sim_options_t;
+
+static sim_options_t options = {
+    .duration_s = 10, .peripheral = MOUSE, .report_hz = 125,
+    .dropout_start_ms = 3000, .dropout_ms = 50, .clock_skew_us = 1234567, .log_level = 1, .pause_ms = 6000,
+};
+
+static volatile int *bauds;             // Rate each board's UART is set to, in memory shared with the board processes
+
+static int64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// -------------------------------- BOARDS --------------------------------
+
+static void write_trace(const char *name) {    // The ring as trace_copy returns it, what host/link_replay.c reads
+    static uint8_t trace[TRACE_BYTES];
+    char path[256];
+    snprintf(path, sizeof(path), "%s.%s", options.trace, name);
+    size_t length = trace_copy(trace, sizeof(trace));
+    FILE *file = fopen(path, "wb");
+    if (file == NULL || fwrite(trace, 1, length, file) != length) {
+        fprintf(stderr, "could not write %s\n", path);
+    }
+    if (file != NULL) {
+        fclose(file);
+    }
+    printf("%s.trace_bytes=%zu\n", name, length);
+}
+
+static void run_board(const char *name, int link_fd, volatile int *baud, bool pc_connected, uint8_t peripheral, uint8_t bridged, int64_t clock_offset_us) {
+    sim_port_boot();
+    sim_board_name = name;
+    sim_clock_offset_us = clock_offset_us;
+    sim_log_level = options.log_level;
+    sim_link_fd = link_fd;
+    sim_link_baud = baud;
+    sim_usb_config.pc_connected = pc_connected;
+    sim_usb_config.peripheral = peripheral;
+    sim_usb_config.bridged = bridged;
+    sim_usb_config.report_hz = options.report_hz;
+    sim_usb_config.pause_every_ms = options.pause_every_ms;
+    sim_usb_config.pause_ms = options.pause_ms;
+    sim_usb_config.passthrough = options.passthrough;
+    srandom(getpid());
+
+    power_init();                                                          // Same as app_main
+    MEMORY_QUEUE(usb_to_com_memory, "usb to com", 10, USB_MESSAGE_SIZE);
+    MEMORY_QUEUE(com_to_usb_memory, "com to usb", 10, USB_MESSAGE_SIZE);
+    MEMORY_QUEUE(com_to_usb_mouse_memory, "com to usb mouse", 10, USB_MESSAGE_SIZE);
+    MEMORY_QUEUE(usb_event_memory, "usb events", 8, sizeof(uint8_t));
+    MEMORY_QUEUE(usb_event_set_memory, "usb event set", 28, sizeof(QueueSetMemberHandle_t));
+    MEMORY_TASK(usb_task_memory, "USB SM", STACK_USB_SM);
+    MEMORY_TASK(com_task_memory, "COM SM", STACK_COM_SM);
+    usb_to_com_queue = memory_queue_create(&usb_to_com_memory);
+    com_to_usb_queue = memory_queue_create(&com_to_usb_memory);
+    com_to_usb_mouse_queue = memory_queue_create(&com_to_usb_mouse_memory);
+    usb_event_queue = memory_queue_create(&usb_event_memory);
+    usb_event_set = memory_queue_set_create(&usb_event_set_memory);
+    xQueueAddToSet(com_to_usb_queue, usb_event_set);
+    xQueueAddToSet(com_to_usb_mouse_queue, usb_event_set);
+    xQueueAddToSet(usb_event_queue, usb_event_set);
+    sim_usb_start();
+    memory_task_start(&usb_task_memory, usb_state_machine, NULL, 2, 0);
+    memory_task_start(&com_task_memory, com_state_machine, NULL, 2, 1);
+
+    struct timespec run = {.tv_sec = (time_t)options.duration_s,
+                           .tv_nsec = (long)((options.duration_s - (time_t)options.duration_s) * 1e9)};
+    nanosleep(&run, NULL);
+
+    const sim_usb_stats_t *s = &sim_usb_stats;
+    printf("%s.device_ready_ms=%lld\n", name, (long long)s->device_ready_ms);
+    printf("%s.first_report_ms=%lld\n", name, (long long)s->first_report_ms);
+    printf("%s.max_report_gap_ms=%lld\n", name, (long long)s->max_gap_ms);
+    printf("%s.reports_delivered=%u\n", name, s->reports_delivered);
+    printf("%s.motion_delivered=%lld\n", name, (long long)s->motion_delivered);
+    printf("%s.key_presses_delivered=%u\n", name, s->key_presses_delivered);
+    printf("%s.key_releases_delivered=%u\n", name, s->key_releases_delivered);
+    printf("%s.key_down_at_end=%d\n", name, s->key_down_at_end);
+    printf("%s.reports_generated=%u\n", name, s->reports_generated);
+    printf("%s.reports_dropped=%u\n", name, s->reports_dropped);
+    printf("%s.mouse_reports_dropped=%u\n", name, coalesce_dropped());
+    printf("%s.motion_generated=%lld\n", name, (long long)s->motion_generated);
+    printf("%s.key_down_generated=%d\n", name, s->key_down_generated);
+    if (options.peripheral == DATASTICK) {
+        printf("%s.msc_read_bytes=%llu\n", name, (unsigned long long)s->msc_read_bytes);
+        printf("%s.msc_read_us=%lld\n", name, (long long)s->msc_read_us);
+        printf("%s.msc_write_bytes=%llu\n", name, (unsigned long long)s->msc_write_bytes);
+        printf("%s.msc_write_us=%lld\n", name, (long long)s->msc_write_us);
+        printf("%s.msc_read_mismatches=%u\n", name, s->msc_read_mismatches);
+        printf("%s.msc_write_mismatches=%u\n", name, s->msc_write_mismatches);
+        printf("%s.msc_errors=%u\n", name, s->msc_errors);
+    }
+    if (options.peripheral == KEYBOARD || options.peripheral == SIM_HUB) {
+        printf("%s.output_reports_sent=%u\n", name, s->output_reports_sent);
+        printf("%s.output_reports_delivered=%u\n", name, s->output_reports_delivered);
+        printf("%s.output_reports_dropped=%u\n", name, output_dropped());
+        printf("%s.leds_sent=%u\n", name, s->leds_sent);
+        printf("%s.leds_delivered=%u\n", name, s->leds_delivered);
+    }
+    if (options.passthrough) {
+        printf("%s.raw_reports_delivered=%u\n", name, s->raw_reports_delivered);
+        printf("%s.descriptors_cloned=%u\n", name, s->descriptors_cloned);
+    }
+    printf("%s.frames_rejected=%u\n", name, frames_rejected());
+    printf("%s.echoes_filtered=%u\n", name, echoes_filtered());
+    printf("%s.retransmissions=%u\n", name, arq_retransmissions());
+    printf("%s.bits_corrected=%u\n", name, bits_corrected());
+    printf("%s.code_switches=%u\n", name, code_switches());
+    printf("%s.transmit_code=%u\n", name, transmit_code());
+    printf("%s.uncorrectable=%u\n", name, telemetry_total(TELEMETRY_UNCORRECTABLE));
+    printf("%s.link_timeouts=%u\n", name, telemetry_total(TELEMETRY_LINK_TIMEOUTS));
+    printf("%s.backoff_entries=%u\n", name, telemetry_total(TELEMETRY_BACKOFF_ENTRIES));
+    printf("%s.report_pool_peak=%u\n", name, telemetry_peak(TELEMETRY_REPORT_POOL));
+    printf("%s.com_to_usb_peak=%u\n", name, telemetry_peak(TELEMETRY_COM_TO_USB));
+    printf("%s.arq_window_peak=%u\n", name, telemetry_peak(TELEMETRY_ARQ_WINDOW));
+    printf("%s.rate_changes=%u\n", name, telemetry_total(TELEMETRY_RATE_CHANGES));
+    printf("%s.baud=%d\n", name, *baud);
+    printf("%s.bytes_sent=%u\n", name, telemetry_total(TELEMETRY_BYTES_SENT));
+    printf("%s.idle_ms=%u\n", name, power_idle_ms());
+    printf("%s.wake_bursts=%u\n", name, power_wake_bursts());
+    printf("%s.sleep_wakes=%u\n", name, sim_link_wakes);
+    const char *class_names[LINK_CLASSES] = {"control", "keyboard", "mouse", "output", "bulk"};
+    for (uint8_t class = 0; class < LINK_CLASSES; class++) {
+        printf("%s.%s_wait_max_us=%u\n", name, class_names[class], scheduler_worst_wait_us(class));
+        printf("%s.%s_overdue=%u\n", name, class_names[class], scheduler_overdue(class));
+    }
+    printf("%s.usb_state=%u\n", name, usb_state);
+    if (options.trace != NULL) {
+        write_trace(name);
+    }
+    latency_dump();
+    fflush(stdout);
+    _exit(0);
+}
+
+static pid_t spawn_board(const char *name, int link_fd, volatile int *baud, int close_fd, int out_fd, bool pc, uint8_t peripheral, uint8_t bridged, int64_t skew) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(close_fd);
+        dup2(out_fd, STDOUT_FILENO);
+        run_board(name, link_fd, baud, pc, peripheral, bridged, skew);
+    }
+    return pid;
+}
+
+// -------------------------------- CHANNEL --------------------------------
+
+#define PENDING_SIZE 65536
+#define RX_CHUNK_NS  250000                // Bytes due within this window are delivered together
+#define FAST_BER     1e-2                  // Bit error probability of bytes sent faster than --max-baud
+
+typedef struct {
+    int64_t due_ns;
+    int fd;
+    int baud;                           // Rate it was sent at, a receiver set to another rate gets garbage
+    uint8_t byte;
+} pending_byte_t;
+
+typedef struct {
+    const char *name;
+    int src;                            // Parent end of the transmitting board's socket
+    int dst;                            // Parent end of the receiving board's socket
+    volatile int *src_baud;
+    volatile int *dst_baud;
+    pending_byte_t pending[PENDING_SIZE];
+    unsigned head, tail;
+    int64_t last_due_ns;
+    unsigned short rng[3];
+    uint64_t bytes, bits_flipped, bytes_dropped, bytes_echoed, bytes_overrun, bytes_garbled;
+} direction_t;
+
+static int64_t start_ns;
+
+static bool in_dropout(int64_t t_ns) {
+    if (options.dropout_every_ms <= 0) {
+        return false;
+    }
+    int64_t t_ms = (t_ns - start_ns) / 1000000 - options.dropout_start_ms;
+    return t_ms >= 0 && t_ms % options.dropout_every_ms < options.dropout_ms;
+}
+
+static void push(direction_t *d, int64_t due_ns, int fd, int baud, uint8_t byte) {
+    if (d->tail - d->head < PENDING_SIZE) {
+        d->pending[d->tail++ % PENDING_SIZE] = (pending_byte_t){due_ns, fd, baud, byte};
+    }
+}
+
+static void *channel(void *arg) {
+    direction_t *d = arg;
+    while (1) {
+        int64_t now = now_ns();
+        while (d->head != d->tail && d->pending[d->head % PENDING_SIZE].due_ns <= now) {   // Deliver everything that is due
+            uint8_t burst[256];                                     // One send per run of bytes to the same board, single byte sends
+            size_t length = 0;                                      // exhaust the socket buffer long before its byte count does
+            int fd = d->pending[d->head % PENDING_SIZE].fd;
+            while (d->head != d->tail && length < sizeof(burst)) {
+                pending_byte_t *p = &d->pending[d->head % PENDING_SIZE];
+                if (p->due_ns > now || p->fd != fd) {
+                    break;
+                }
+                volatile int *receiver_baud = fd == d->dst ? d->dst_baud : d->src_baud;
+                if (p->baud != *receiver_baud) {                    // The receiving UART samples at the wrong rate
+                    p->byte = nrand48(d->rng);
+                    d->bytes_garbled++;
+                }
+                burst[length++] = p->byte;
+                d->head++;
+            }
+            ssize_t sent = send(fd, burst, length, MSG_NOSIGNAL | MSG_DONTWAIT);   // A board that stops reading overruns its RX buffer,
+            if (sent < 0 && errno == EPIPE) {                                      // it never stalls the channel
+                return NULL;
+            }
+            d->bytes_overrun += sent < 0 ? length : length - sent;
+        }
+        int64_t wait_ns = d->head != d->tail ? d->pending[d->head % PENDING_SIZE].due_ns - now : 50000000;
+        if (wait_ns < RX_CHUNK_NS) {                                // Hand bytes over in chunks like the UART RX FIFO does
+            wait_ns = RX_CHUNK_NS;
+        }
+        struct timespec timeout = {.tv_sec = wait_ns / 1000000000, .tv_nsec = wait_ns % 1000000000};
+        struct pollfd pfd = {.fd = d->src, .events = POLLIN};
+        if (ppoll(&pfd, 1, &timeout, NULL) <= 0) {
+            continue;
+        }
+        uint8_t buffer[512];
+        ssize_t n = recv(d->src, buffer, sizeof(buffer), 0);
+        if (n <= 0) {
+            return NULL;                                            // Board exited
+        }
+        now = now_ns();
+        const int baud = *d->src_baud;
+        const int64_t byte_ns = 10 * 1000000000LL / baud;           // Start + 8 data + stop bits
+        const double ber = options.max_baud > 0 && baud > options.max_baud ? options.ber + FAST_BER : options.ber;
+        for (ssize_t i = 0; i < n; i++) {
+            int64_t due = now + options.latency_us * 1000;          // Serialise at the baud rate behind earlier bytes
+            if (due < d->last_due_ns + byte_ns) {
+                due = d->last_due_ns + byte_ns;
+            }
+            d->last_due_ns = due;
+            d->bytes++;
+            if (in_dropout(due)) {
+                d->bytes_dropped++;
+                continue;
+            }
+            uint8_t byte = buffer[i];
+            for (uint8_t bit = 0; bit < 8 && ber > 0; bit++) {
+                if (erand48(d->rng) < ber) {
+                    byte ^= 1 << bit;
+                    d->bits_flipped++;
+                }
+            }
+            if (options.echo > 0 && erand48(d->rng) < options.echo) {
+                d->bytes_echoed++;
+                push(d, due, d->src, baud, byte);                          // Reflection arrives back at the transmitter, handed over first (shorter path)
+            }                                                        // so a reply to this byte can never overtake it
+            push(d, due, d->dst, baud, byte);
+        }
+    }
+}
+
+// -------------------------------- MAIN --------------------------------
+
+static int64_t find_value(const char *output, const char *key) {
+    const char *at = strstr(output, key);
+    return at ? strtoll(at + strlen(key), NULL, 10) : -1;
+}
+
+static double raw_rate(int64_t baud, int64_t code) {     // Payload bytes per second code carries at baud, 10 line bits per UART byte
+    const uint8_t sample = 120;                             // Whole blocks in every code, and its longest coding still fits a uint8_t
+    return baud / 10.0 * sample / fec_coded_length((uint8_t)code, sample);
+}
+
+static void read_all(int fd, char *buffer, size_t size) {
+    size_t used = 0;
+    ssize_t n;
+    while (used + 1 < size && (n = read(fd, buffer + used, size - used - 1)) > 0) {
+        used += n;
+    }
+    buffer[used] = '\0';
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  --duration S         simulated run time in seconds (%.0f)\n"
+        "  --ber P              bit error probability (0)\n"
+        "  --latency-us US      propagation delay (0)\n"
+        "  --echo P             probability of each byte reflecting back to its sender (0)\n"
+        "  --dropout-every MS   beam interruption period, 0 for none (0)\n"
+        "  --dropout-ms MS      beam interruption length (%lld)\n"
+        "  --dropout-start MS   first beam interruption (%lld)\n"
+        "  --max-baud N         fastest rate the optical path carries cleanly, faster bits flip with probability %g (0 = no limit)\n"
+        "  --keyboard           board B hosts a keyboard instead of a mouse\n"
+        "  --hub                board B hosts a hub with a keyboard and a mouse\n"
+        "  --datastick          board B hosts a datastick, the computer on board A reads and writes it\n"
+        "  --passthrough        board B's keyboard and mouse run the report protocol, board A clones their descriptors\n"
+        "  --unplugged          nothing on either board, both may light sleep (exit status: the link never timed out)\n"
+        "  --rate HZ            peripheral report rate (%d)\n"
+        "  --pause-every MS     the peripheral goes quiet at the end of every period this long, 0 for never (0)\n"
+        "  --pause-ms MS        how long it stays quiet (%d)\n"
+        "  --skew-us US         board B clock offset (%lld)\n"
+        "  --trace PREFIX       write each board's link trace to PREFIX.A and PREFIX.B for link_replay\n"
+        "  -v                   more firmware logging (repeat for more)\n",
+        argv0, options.duration_s, (long long)options.dropout_ms, (long long)options.dropout_start_ms,
+        FAST_BER, options.report_hz, options.pause_ms, (long long)options.clock_skew_us);
+}
+
+int main(int argc, char **argv) {
+    static const struct option long_options[] = {
+        {"duration", required_argument, NULL, 'd'}, {"ber", required_argument, NULL, 'b'},
+        {"latency-us", required_argument, NULL, 'l'}, {"echo", required_argument, NULL, 'e'},
+        {"dropout-every", required_argument, NULL, 'p'}, {"dropout-ms", required_argument, NULL, 'm'},
+        {"dropout-start", required_argument, NULL, 's'}, {"max-baud", required_argument, NULL, 'B'},
+        {"keyboard", no_argument, NULL, 'k'}, {"datastick", no_argument, NULL, 'D'}, {"rate", required_argument, NULL, 'r'},
+        {"hub", no_argument, NULL, 'H'}, {"unplugged", no_argument, NULL, 'U'}, {"passthrough", no_argument, NULL, 'R'},
+        {"pause-every", required_argument, NULL, 'P'}, {"pause-ms", required_argument, NULL, 'M'},
+        {"skew-us", required_argument, NULL, 'S'}, {"trace", required_argument, NULL, 'T'}, {"help", no_argument, NULL, 'h'}, {NULL, 0, NULL, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "vh", long_options, NULL)) != -1) {
+        switch (opt) {
+            case 'd': options.duration_s = atof(optarg); break;
+            case 'b': options.ber = atof(optarg); break;
+            case 'l': options.latency_us = atoll(optarg); break;
+            case 'e': options.echo = atof(optarg); break;
+            case 'p': options.dropout_every_ms = atoll(optarg); break;
+            case 'm': options.dropout_ms = atoll(optarg); break;
+            case 's': options.dropout_start_ms = atoll(optarg); break;
+            case 'B': options.max_baud = atoi(optarg); break;
+            case 'k': options.peripheral = KEYBOARD; break;
+            case 'D': options.peripheral = DATASTICK; break;
+            case 'H': options.peripheral = SIM_HUB; break;
+            case 'U': options.unplugged = true; options.peripheral = NONE; break;
+            case 'R': options.passthrough = true; break;
+            case 'r': options.report_hz = atoi(optarg); break;
+            case 'P': options.pause_every_ms = atoi(optarg); break;
+            case 'M': options.pause_ms = atoi(optarg); break;
+            case 'S': options.clock_skew_us = atoll(optarg); break;
+            case 'T': options.trace = optarg; break;
+            case 'v': options.log_level++; break;
+            default: usage(argv[0]); return 2;
+        }
+    }
+
+    int link_a[2], link_b[2], out_a[2], out_b[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, link_a) || socketpair(AF_UNIX, SOCK_STREAM, 0, link_b) || pipe(out_a) || pipe(out_b)) {
+        perror("socketpair/pipe");
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    bauds = mmap(NULL, 2 * sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    bauds[0] = bauds[1] = 115200;                                   // Until the firmware configures its UART
+    start_ns = now_ns();
+    pid_t pid_a = spawn_board("A", link_a[1], &bauds[0], link_a[0], out_a[1], !options.unplugged, NONE, options.peripheral, 0);
+    pid_t pid_b = spawn_board("B", link_b[1], &bauds[1], link_b[0], out_b[1], false, options.peripheral, NONE, options.clock_skew_us);
+    close(link_a[1]); close(link_b[1]); close(out_a[1]); close(out_b[1]);
+
+    static direction_t a_to_b = {.name = "a_to_b", .rng = {1, 2, 3}};
+    static direction_t b_to_a = {.name = "b_to_a", .rng = {4, 5, 6}};
+    a_to_b.src = link_a[0]; a_to_b.dst = link_b[0]; a_to_b.src_baud = &bauds[0]; a_to_b.dst_baud = &bauds[1];
+    b_to_a.src = link_b[0]; b_to_a.dst = link_a[0]; b_to_a.src_baud = &bauds[1]; b_to_a.dst_baud = &bauds[0];
+    pthread_t threads[2];
+    pthread_create(&threads[0], NULL, channel, &a_to_b);
+    pthread_create(&threads[1], NULL, channel, &b_to_a);
+
+    static char output_a[65536], output_b[65536];
+    read_all(out_a[0], output_a, sizeof(output_a));
+    read_all(out_b[0], output_b, sizeof(output_b));
+    waitpid(pid_a, NULL, 0);
+    waitpid(pid_b, NULL, 0);
+    shutdown(link_a[0], SHUT_RDWR);
+    shutdown(link_b[0], SHUT_RDWR);
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+
+    fputs(output_a, stdout);
+    fputs(output_b, stdout);
+    const direction_t *dirs[2] = {&a_to_b, &b_to_a};
+    for (int i = 0; i < 2; i++) {
+        printf("channel.%s.bytes=%llu\n", dirs[i]->name, (unsigned long long)dirs[i]->bytes);
+        printf("channel.%s.bits_flipped=%llu\n", dirs[i]->name, (unsigned long long)dirs[i]->bits_flipped);
+        printf("channel.%s.bytes_dropped=%llu\n", dirs[i]->name, (unsigned long long)dirs[i]->bytes_dropped);
+        printf("channel.%s.bytes_echoed=%llu\n", dirs[i]->name, (unsigned long long)dirs[i]->bytes_echoed);
+        printf("channel.%s.bytes_overrun=%llu\n", dirs[i]->name, (unsigned long long)dirs[i]->bytes_overrun);
+        printf("channel.%s.bytes_garbled=%llu\n", dirs[i]->name, (unsigned long long)dirs[i]->bytes_garbled);
+    }
+
+    int64_t first_report = find_value(output_a, "A.first_report_ms=");
+    int64_t delivered = find_value(output_a, "A.reports_delivered=");
+    int64_t motion_delivered = find_value(output_a, "A.motion_delivered=");
+    int64_t motion_generated = find_value(output_b, "B.motion_generated=");
+    printf("summary.handshake_ms=%lld\n", (long long)find_value(output_a, "A.device_ready_ms="));
+    printf("summary.baud=%lld\n", (long long)find_value(output_a, "A.baud="));
+    if (first_report >= 0) {
+        double window_s = options.duration_s - first_report / 1000.0;
+        printf("summary.reports_per_s=%.1f\n", window_s > 0 ? delivered / window_s : 0.0);
+    }
+    if ((options.peripheral == MOUSE || options.peripheral == SIM_HUB) && motion_generated > 0) {
+        printf("summary.motion_delivered_pct=%.2f\n", 100.0 * motion_delivered / motion_generated);
+    }
+    printf("summary.max_report_gap_ms=%lld\n", (long long)find_value(output_a, "A.max_report_gap_ms="));
+    if (options.peripheral == KEYBOARD || options.peripheral == SIM_HUB) {       // A toggle still crossing the link at the end leaves them different
+        printf("summary.output_reports_delivered=%lld/%lld\n", (long long)find_value(output_b, "B.output_reports_delivered="),
+               (long long)find_value(output_a, "A.output_reports_sent="));
+        printf("summary.leds_match=%d\n", find_value(output_a, "A.leds_sent=") == find_value(output_b, "B.leds_delivered="));
+    }
+    if (options.passthrough) {
+        printf("summary.descriptors_cloned=%lld/%d\n", (long long)find_value(output_a, "A.descriptors_cloned="),
+               options.peripheral == SIM_HUB ? 2 : options.peripheral == MOUSE || options.peripheral == KEYBOARD);
+    }
+    if (options.peripheral == DATASTICK) {
+        int64_t baud = find_value(output_a, "A.baud=");                 // The rate the link ended on
+        double read_raw = raw_rate(baud, find_value(output_b, "B.transmit_code="));     // Blocks read travel B to A
+        double write_raw = raw_rate(baud, find_value(output_a, "A.transmit_code="));
+        int64_t read_us = find_value(output_a, "A.msc_read_us=");
+        int64_t write_us = find_value(output_a, "A.msc_write_us=");
+        double read_rate = read_us > 0 ? find_value(output_a, "A.msc_read_bytes=") * 1e6 / read_us : 0;
+        double write_rate = write_us > 0 ? find_value(output_a, "A.msc_write_bytes=") * 1e6 / write_us : 0;
+        printf("summary.msc_read_kBps=%.1f\n", read_rate / 1000);
+        printf("summary.msc_write_kBps=%.1f\n", write_rate / 1000);
+        printf("summary.msc_read_pct_of_raw=%.1f\n", 100 * read_rate / read_raw);
+        printf("summary.msc_write_pct_of_raw=%.1f\n", 100 * write_rate / write_raw);
+        int64_t corrupted = find_value(output_a, "A.msc_read_mismatches=") + find_value(output_b, "B.msc_write_mismatches=");
+        printf("summary.msc_corrupted_blocks=%lld\n", (long long)corrupted);
+        if (corrupted != 0) {
+            return 1;
+        }
+    }
+    if (options.unplugged) {
+        int64_t timeouts = find_value(output_a, "A.link_timeouts=") + find_value(output_b, "B.link_timeouts=");
+        printf("summary.link_timeouts=%lld\n", (long long)timeouts);
+        return timeouts == 0 ? 0 : 1;
+    }
+    return first_report >= 0 ? 0 : 1;
+}
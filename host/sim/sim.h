@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Shared state between the simulator main (link_sim.c) and the host backends of the firmware HAL
+
+// -------------------------------- TRANSPORT (TransportSim.c) --------------------------------
+
+extern int sim_link_fd;                 // Board end of the socket to the simulated channel
+extern volatile int *sim_link_baud;     // Baud rate the firmware last configured, shared with the channel (it paces and garbles by it)
+extern uint32_t sim_link_wakes;         // Times received bytes were lost waking the board from light sleep (Tools/PowerTools.h)
+
+// -------------------------------- USB (USBSim.c) --------------------------------
+
+#define SIM_HUB 4                       // Peripheral value after enum device: a hub with a keyboard on channel 0 and a mouse on channel 1
+
+typedef struct {
+    bool pc_connected;                  // This board's device port is plugged into a computer
+    uint8_t peripheral;                 // enum device plugged into this board's host port (NONE, MOUSE, KEYBOARD, DATASTICK) or SIM_HUB
+    uint8_t bridged;                    // enum device the far board hosts (or SIM_HUB), i.e. what this board should bridge to the computer
+    int report_hz;                      // Input report rate of the simulated peripheral
+    int plug_delay_ms;                  // Delay between host drivers installing and the peripheral enumerating
+    int pause_every_ms;                 // The peripheral goes quiet for the last pause_ms of every period this long (0 = never)
+    int pause_ms;
+    bool passthrough;                   // The peripheral's HID devices run the report protocol with descriptors of their own (Tools/HIDPassthrough.h)
+} sim_usb_config_t;
+
+typedef struct {                        // Times are ms since the board started, -1 if it never happened
+    int64_t device_ready_ms;            // Interfaces for the bridged peripheral active on the computer
+    int64_t first_report_ms;            // First report handed to the computer
+    int64_t max_gap_ms;                 // Longest gap between reports handed to the computer
+    uint32_t reports_delivered;
+    int64_t motion_delivered;           // Sum of mouse x displacement handed to the computer
+    uint32_t key_presses_delivered;
+    uint32_t key_releases_delivered;
+    bool key_down_at_end;               // A key was still held on the computer when the simulation stopped
+    uint32_t reports_generated;
+    uint32_t reports_dropped;           // Generated but rejected by usb_to_com_queue
+    int64_t motion_generated;
+    bool key_down_generated;            // Last generated keyboard report held a key
+    uint64_t msc_read_bytes;            // Device side: bytes the computer read from the bridged datastick
+    int64_t msc_read_us;                // Time spent reading them
+    uint64_t msc_write_bytes;           // Device side: bytes the computer wrote
+    int64_t msc_write_us;               // Time spent writing them, including the flush at the end of each pass
+    uint32_t msc_read_mismatches;       // Device side: blocks read back with the wrong contents
+    uint32_t msc_write_mismatches;      // Host side: blocks written to the stick with the wrong contents
+    uint32_t msc_errors;                // Device side: reads, writes or flushes that failed
+    uint32_t output_reports_sent;       // Device side: LED reports the computer sent to the bridged keyboard
+    uint8_t leds_sent;                  // Device side: LED state of the last one
+    uint32_t output_reports_delivered;  // Host side: output reports handed to the keyboard
+    uint8_t leds_delivered;             // Host side: LED state of the last one
+    uint32_t raw_reports_delivered;     // Device side: REPORT_RAW reports handed to an interface presenting the device's descriptor
+    uint8_t descriptors_cloned;         // Device side: channels whose interface presents exactly the far side's descriptor
+} sim_usb_stats_t;
+
+extern sim_usb_config_t sim_usb_config;
+extern sim_usb_stats_t sim_usb_stats;
+
+void sim_usb_start(void);               // Start the peripheral report generator thread
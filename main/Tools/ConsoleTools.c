@@ -0,0 +1,110 @@
+#include <string.h>
+
+#include "esp_console.h"
+#include "esp_log.h"
+
+#include "Tools/ConsoleTools.h"
+#include "Tools/LatencyTools.h"
+#include "Tools/Telemetry.h"
+#include "Tools/LinkScheduler.h"
+#include "Tools/LinkTrace.h"
+#include "Tools/StaticMemory.h"
+#include "Tools/PowerTools.h"
+
+static const char *TAG = "CONSOLE";
+
+static int latency_command(int argc, char **argv) {    // latency [reset]
+    if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+        latency_reset();
+        printf("latency histograms cleared\n");
+    } else {
+        latency_dump();
+    }
+    return 0;
+}
+
+static int link_command(int argc, char **argv) {       // link [history]
+    if (argc > 1 && strcmp(argv[1], "history") == 0) {
+        telemetry_dump_history();
+    } else {
+        telemetry_dump();
+        scheduler_dump();
+    }
+    return 0;
+}
+
+static int trace_command(int argc, char **argv) {      // trace [on|off|clear]
+    if (argc > 1 && strcmp(argv[1], "on") == 0) {
+        trace_enable(true);
+    } else if (argc > 1 && strcmp(argv[1], "off") == 0) {
+        trace_enable(false);
+    } else if (argc > 1 && strcmp(argv[1], "clear") == 0) {
+        trace_clear();
+    } else {
+        trace_dump();
+        return 0;
+    }
+    printf("trace %s\n", trace_enabled() ? "on" : "off");
+    return 0;
+}
+
+static int memory_command(int argc, char **argv) {     // memory
+    memory_report();
+    return 0;
+}
+
+static int power_command(int argc, char **argv) {      // power
+    power_dump();
+    return 0;
+}
+
+void console_start(void) {
+    esp_console_repl_t *repl = NULL;
+    esp_console_repl_config_t repl_config = ESP_CONSOLE_REPL_CONFIG_DEFAULT();
+    repl_config.prompt = "fso>";
+    esp_console_dev_uart_config_t uart_config = ESP_CONSOLE_DEV_UART_CONFIG_DEFAULT();
+    ESP_ERROR_CHECK(esp_console_new_repl_uart(&uart_config, &repl_config, &repl));
+
+    const esp_console_cmd_t latency_cmd = {
+        .command = "latency",
+        .help = "Print per stage report latency (p50/p99/max). 'latency reset' clears the histograms.",
+        .hint = "[reset]",
+        .func = &latency_command,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&latency_cmd));
+
+    const esp_console_cmd_t link_cmd = {
+        .command = "link",
+        .help = "Print link health counters, rates, queue high-water marks and the worst wait per traffic class. 'link history' prints one line per second.",
+        .hint = "[history]",
+        .func = &link_command,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&link_cmd));
+
+    const esp_console_cmd_t trace_cmd = {
+        .command = "trace",
+        .help = "Dump the link trace as hex for host/link_replay --hex. 'trace off' freezes it, 'trace on' resumes, 'trace clear' empties it.",
+        .hint = "[on|off|clear]",
+        .func = &trace_command,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&trace_cmd));
+
+    const esp_console_cmd_t memory_cmd = {
+        .command = "memory",
+        .help = "Print RAM per task, queue and buffer, the lowest free stack of each task and the heap.",
+        .hint = NULL,
+        .func = &memory_command,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&memory_cmd));
+
+    const esp_console_cmd_t power_cmd = {
+        .command = "power",
+        .help = "Print whether light sleep is allowed, whether the link is idle, the time spent idle and the wake bursts sent. 'latency' shows the wake stage.",
+        .hint = NULL,
+        .func = &power_command,
+    };
+    ESP_ERROR_CHECK(esp_console_cmd_register(&power_cmd));
+
+    ESP_ERROR_CHECK(esp_console_start_repl(repl));
+    ESP_LOGI(TAG, "Console started.");
+}
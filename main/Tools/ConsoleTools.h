@@ -0,0 +1,3 @@
+#pragma once
+
+void console_start(void);       // Start the REPL on the ESP console UART and register the diagnostic commands
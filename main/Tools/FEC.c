@@ -0,0 +1,151 @@
+#include <string.h>
+
+#include "Tools/FEC.h"
+#include "Tools/Hamming74.h"
+
+#define INTERLEAVE_DATA  4                                  // Data bytes per interleaved block: 8 codewords, bit i of each in UART byte i
+#define INTERLEAVE_CODED 7
+#define SECDED_BLOCK     8                                  // Data bytes per SECDED check byte
+#define NO_BIT           0xFF
+
+static uint8_t secded_syndrome[SECDED_BLOCK][256];          // Check bits each value of each data byte in a block contributes
+static uint8_t secded_bit[256];                             // Data bit (8 * byte + bit) a single error with this syndrome flipped, NO_BIT if none
+
+// -------------------------------- HELPERS --------------------------------
+
+static uint64_t transpose(uint64_t x) {                     // 8x8 bit matrix transpose, bit j of byte i <-> bit i of byte j (its own inverse)
+    uint64_t t;
+    t = (x ^ (x >> 7))  & 0x00AA00AA00AA00AAULL;  x ^= t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;  x ^= t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;  x ^= t ^ (t << 28);
+    return x;
+}
+
+// -------------------------------- HAMMING(7,4) INTERLEAVED --------------------------------
+
+static uint8_t encode_interleaved(const uint8_t *data, uint8_t length, uint8_t *coded) {
+    uint8_t out = 0;
+    for (uint8_t i = 0; i < length; i += INTERLEAVE_DATA) {
+        uint8_t block[INTERLEAVE_DATA] = {0};                   // The last block is padded with zeros
+        memcpy(block, &data[i], length - i < INTERLEAVE_DATA ? length - i : INTERLEAVE_DATA);
+        uint8_t codewords[8];
+        encode_bytes(block, 8, codewords);
+        uint64_t word;
+        memcpy(&word, codewords, sizeof(word));                 // Little endian on both the ESP32-S3 and the host, like Hamming74.c
+        word = transpose(word);
+        memcpy(&coded[out], &word, INTERLEAVE_CODED);           // Byte 7 would only hold the unused bit 7 of each codeword
+        out += INTERLEAVE_CODED;
+    }
+    return out;
+}
+
+static int decode_interleaved(const uint8_t *coded, uint8_t length, uint8_t *data) {
+    int corrected = 0;
+    for (uint8_t i = 0, in = 0; i < length; i += INTERLEAVE_DATA, in += INTERLEAVE_CODED) {
+        uint64_t word = 0;
+        memcpy(&word, &coded[in], INTERLEAVE_CODED);
+        word = transpose(word);
+        uint8_t codewords[8], block[INTERLEAVE_DATA];
+        memcpy(codewords, &word, sizeof(codewords));
+        corrected += decode_bytes_counted(codewords, 8, block);
+        memcpy(&data[i], block, length - i < INTERLEAVE_DATA ? length - i : INTERLEAVE_DATA);
+    }
+    return corrected;
+}
+
+// -------------------------------- SECDED --------------------------------
+
+static uint8_t encode_secded(const uint8_t *data, uint8_t length, uint8_t *coded) {
+    uint8_t out = 0;
+    for (uint8_t i = 0; i < length; i += SECDED_BLOCK) {
+        uint8_t n = length - i < SECDED_BLOCK ? length - i : SECDED_BLOCK;  // A short last block is coded as if padded with zeros
+        uint8_t check = 0;
+        for (uint8_t j = 0; j < n; j++) {
+            check ^= secded_syndrome[j][data[i + j]];
+            coded[out++] = data[i + j];
+        }
+        coded[out++] = check;
+    }
+    return out;
+}
+
+static int decode_secded(const uint8_t *coded, uint8_t length, uint8_t *data) {
+    int corrected = 0;
+    for (uint8_t i = 0, in = 0; i < length; i += SECDED_BLOCK, in += SECDED_BLOCK + 1) {
+        uint8_t n = length - i < SECDED_BLOCK ? length - i : SECDED_BLOCK;
+        uint8_t syndrome = coded[in + n];
+        for (uint8_t j = 0; j < n; j++) {
+            data[i + j] = coded[in + j];
+            syndrome ^= secded_syndrome[j][data[i + j]];
+        }
+        if (syndrome == 0) {
+            continue;
+        }
+        corrected++;
+        if ((syndrome & (syndrome - 1)) == 0) {                 // One bit: the check byte itself was hit
+            continue;
+        }
+        uint8_t bit = secded_bit[syndrome];
+        if (bit >= 8*n) {                                       // Even weight (two errors), or a bit of the padding
+            return FEC_UNCORRECTABLE;
+        }
+        data[i + bit / 8] ^= 1 << (bit % 8);
+    }
+    return corrected;
+}
+
+// -------------------------------- CODES --------------------------------
+
+void fec_init(void) {
+    uint8_t column[8*SECDED_BLOCK];                             // Hsiao code: each data bit's check column has odd weight of 3 or more, so a single
+    uint8_t count = 0;                                          // error leaves an odd syndrome and a double error an even, non-zero one
+    for (uint8_t weight = 3; weight <= 5; weight += 2) {        // All 56 columns of weight 3, then the first 8 of weight 5
+        for (uint16_t value = 0; value < 256 && count < sizeof(column); value++) {
+            if (__builtin_popcount(value) == weight) {
+                column[count++] = value;
+            }
+        }
+    }
+    memset(secded_bit, NO_BIT, sizeof(secded_bit));
+    for (uint8_t bit = 0; bit < sizeof(column); bit++) {
+        secded_bit[column[bit]] = bit;
+    }
+    for (uint8_t byte = 0; byte < SECDED_BLOCK; byte++) {
+        for (uint16_t value = 0; value < 256; value++) {
+            uint8_t syndrome = 0;
+            for (uint8_t bit = 0; bit < 8; bit++) {
+                if (value & (1 << bit)) {
+                    syndrome ^= column[8*byte + bit];
+                }
+            }
+            secded_syndrome[byte][value] = syndrome;
+        }
+    }
+}
+
+uint8_t fec_coded_length(uint8_t code, uint8_t length) {
+    switch (code) {
+        case FEC_INTERLEAVED: return (length + INTERLEAVE_DATA - 1) / INTERLEAVE_DATA * INTERLEAVE_CODED;
+        case FEC_SECDED:      return length + (length + SECDED_BLOCK - 1) / SECDED_BLOCK;
+        default:              return 2*length;
+    }
+}
+
+uint8_t fec_encode(uint8_t code, const uint8_t *data, uint8_t length, uint8_t *coded) {
+    switch (code) {
+        case FEC_INTERLEAVED: return encode_interleaved(data, length, coded);
+        case FEC_SECDED:      return encode_secded(data, length, coded);
+        default:
+            encode_bytes(data, 2*length, coded);
+            return 2*length;
+    }
+}
+
+int fec_decode(uint8_t code, const uint8_t *coded, uint8_t length, uint8_t *data) {
+    switch (code) {
+        case FEC_INTERLEAVED: return decode_interleaved(coded, length, data);
+        case FEC_SECDED:      return decode_secded(coded, length, data);
+        default:
+            return decode_bytes_counted(coded, 2*length, data);
+    }
+}
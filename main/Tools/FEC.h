@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+
+#define FEC_UNCORRECTABLE -1                                // fec_decode result when a block had more errors than its code corrects
+
+// Forward error correction codes a frame body can be sent with. Every frame says which one it uses (Tools/UARTTools.h),
+// so each side can change the code it sends with at any frame.
+
+enum fec_codes {
+    FEC_HAMMING74,          // Hamming(7,4), each nibble in its own UART byte: rate 1/2, one bit per nibble. Handshake code, always supported
+    FEC_INTERLEAVED,        // Hamming(7,4), 8 codewords bit-interleaved over 7 UART bytes: rate 4/7, also survives one garbled UART byte in every 7
+    FEC_SECDED,             // Hsiao (72,64) SECDED, one check byte after every 8 data bytes: rate 8/9, corrects one bit and detects two per block
+    FEC_CODES
+};
+
+void fec_init(void);                                                                // Build the SECDED tables, call once before coding
+
+uint8_t fec_coded_length(uint8_t code, uint8_t length);                             // UART bytes length data bytes take in code
+
+uint8_t fec_encode(uint8_t code, const uint8_t *data, uint8_t length, uint8_t *coded);  // Returns the coded length
+
+int fec_decode(uint8_t code, const uint8_t *coded, uint8_t length, uint8_t *data);  // Decode length data bytes, returns the bits corrected or FEC_UNCORRECTABLE
@@ -0,0 +1,116 @@
+#include <string.h>
+
+#include "Tools/HIDPassthrough.h"
+#include "Tools/StaticMemory.h"
+#include "state_machines.h"
+
+typedef struct {                            // Report descriptor of the device on one channel
+    uint16_t length;                            // 0 while the device uses the boot protocol, or while its descriptor is being received
+    bool sending;                               // Hosting side: announced, chunks from next_chunk on still to go out
+    uint8_t next_chunk;
+    uint8_t data[DESCRIPTOR_MAX];
+} clone_t;
+
+static clone_t clones[HID_CHANNELS];
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t consumer_task = NULL;
+
+// -------------------------------- SETUP --------------------------------
+
+void passthrough_init(TaskHandle_t consumer) {
+    consumer_task = consumer;
+    memory_account("hid descriptors", sizeof(clones));
+}
+
+// -------------------------------- HOSTING SIDE --------------------------------
+
+void passthrough_set(uint8_t channel, const uint8_t *descriptor, uint16_t length) {
+    clone_t *clone = &clones[channel];
+    portENTER_CRITICAL(&lock);
+    clone->length = descriptor != NULL && length <= DESCRIPTOR_MAX ? length : 0;
+    if (clone->length > 0) {
+        memcpy(clone->data, descriptor, clone->length);
+    }
+    clone->sending = false;                     // Sent with the next HID_CONNECTED
+    portEXIT_CRITICAL(&lock);
+}
+
+bool passthrough_raw(uint8_t channel) {
+    return clones[channel].length > 0;
+}
+
+void passthrough_announce(void) {
+    portENTER_CRITICAL(&lock);
+    for (uint8_t channel = 0; channel < HID_CHANNELS; channel++) {  // Free channels too, the far side may still hold a clone for them
+        clones[channel].sending = true;
+        clones[channel].next_chunk = 0;
+    }
+    portEXIT_CRITICAL(&lock);
+    if (consumer_task != NULL) {
+        xTaskNotifyGive(consumer_task);
+    }
+}
+
+// -------------------------------- LINK --------------------------------
+
+bool passthrough_pending(void) {
+    for (uint8_t channel = 0; channel < HID_CHANNELS; channel++) {
+        if (clones[channel].sending) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool passthrough_next(uint8_t *message) {
+    bool filled = false;
+    portENTER_CRITICAL(&lock);
+    for (uint8_t channel = 0; channel < HID_CHANNELS && !filled; channel++) {
+        clone_t *clone = &clones[channel];
+        if (!clone->sending) {
+            continue;
+        }
+        uint8_t chunks = (clone->length + DESCRIPTOR_CHUNK - 1) / DESCRIPTOR_CHUNK;
+        uint16_t offset = clone->next_chunk * DESCRIPTOR_CHUNK;
+        uint8_t length = clone->length - offset < DESCRIPTOR_CHUNK ? clone->length - offset : DESCRIPTOR_CHUNK;
+        message[0] = DESCRIPTOR;
+        message[1] = channel;
+        message[2] = clone->next_chunk;
+        message[3] = chunks;
+        message[4] = length;
+        memcpy(&message[5], &clone->data[offset], length);
+        clone->next_chunk++;
+        clone->sending = clone->next_chunk < chunks;    // A boot protocol device's empty chunk is the only one
+        filled = true;
+    }
+    portEXIT_CRITICAL(&lock);
+    return filled;
+}
+
+void passthrough_receive(const uint8_t *message) {
+    uint8_t channel = message[1], chunk = message[2], chunks = message[3], length = message[4];
+    uint16_t offset = chunk * DESCRIPTOR_CHUNK;
+    if (channel >= HID_CHANNELS || length > DESCRIPTOR_CHUNK || offset + length > DESCRIPTOR_MAX || (chunks > 0 && chunk >= chunks)) {
+        return;
+    }
+    clone_t *clone = &clones[channel];
+    portENTER_CRITICAL(&lock);
+    if (chunk == 0) {
+        clone->length = 0;                      // The boot protocol until the last chunk is in
+    }
+    memcpy(&clone->data[offset], &message[5], length);
+    if (chunks > 0 && chunk == chunks - 1) {
+        clone->length = offset + length;
+    }
+    portEXIT_CRITICAL(&lock);
+}
+
+// -------------------------------- COMPUTER SIDE --------------------------------
+
+const uint8_t *passthrough_descriptor(uint8_t channel, uint16_t *length) {
+    if (channel >= HID_CHANNELS || clones[channel].length == 0) {
+        return NULL;
+    }
+    *length = clones[channel].length;
+    return clones[channel].data;
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "freertos/FreeRTOS.h"
+
+#define HID_PASSTHROUGH  1                                  // Set to 0 to host every keyboard and mouse in the boot protocol behind the canned descriptors
+#define DESCRIPTOR_MAX   512                                // Longest report descriptor cloned, a device with a longer one is hosted in the boot protocol
+#define DESCRIPTOR_CHUNK 64                                 // Descriptor bytes carried by one DESCRIPTOR message
+#define RAW_REPORT_MAX   64                                 // Longest input report forwarded, what hid_host_device_get_raw_input_report_data may return
+
+#define DESCRIPTOR_LENGTH(chunk_length) (5 + (chunk_length))    // [DESCRIPTOR][channel][chunk][chunks][length][data], chunks 0: boot protocol
+#define REPORT_RAW_LENGTH(report_length) (3 + (report_length))  // [REPORT_RAW or REPORT_RAW_MOUSE][channel][length][report], then the latency trailer
+
+// Report protocol passthrough. With HID_PASSTHROUGH the hosting board keeps each keyboard and mouse in the report
+// protocol, copies its report descriptor here when it opens it and forwards its input reports as they are (REPORT_RAW,
+// report ID included), so 16 bit motion, extra buttons, horizontal scroll and NKRO survive. A mouse's reports are not
+// retransmitted and overtake keystrokes, as boot protocol motion does (REPORT_RAW_MOUSE). Before every HID_CONNECTED
+// the descriptors go to the far side as reliable DESCRIPTOR chunks, ahead of the update in the same traffic class,
+// and the board plugged into the computer presents each one on the interface its channel is mapped to. A changed
+// descriptor length changes the configuration descriptor, so that board re-enumerates (Tools/USBDeviceTools.h).
+// Devices without a descriptor or with one over DESCRIPTOR_MAX fall back to the boot protocol and the canned
+// descriptors, and announce that with an empty DESCRIPTOR so the far side drops the last clone of the channel.
+// A board either hosts or bridges to a computer, never both, so one descriptor per channel serves either role.
+
+void passthrough_init(TaskHandle_t consumer);               // Consumer (COM task) is notified whenever descriptors are announced
+
+// -------------------------------- HOSTING SIDE (USB TASK) --------------------------------
+
+void passthrough_set(uint8_t channel, const uint8_t *descriptor, uint16_t length);  // Device opened (NULL: boot protocol) or closed (NULL)
+
+bool passthrough_raw(uint8_t channel);                      // The channel's device is in the report protocol, its reports go out as REPORT_RAW(_MOUSE)
+
+void passthrough_announce(void);                            // Before HID_CONNECTED: send every channel's descriptor, or its absence, to the far side
+
+// -------------------------------- LINK (COM TASK) --------------------------------
+
+bool passthrough_pending(void);                             // True if passthrough_next has a chunk to send
+
+bool passthrough_next(uint8_t *message);                    // Fill the next DESCRIPTOR message, false if there is nothing to send
+
+void passthrough_receive(const uint8_t *message);           // Hand over a received DESCRIPTOR message, chunks arrive in order (reliable)
+
+// -------------------------------- COMPUTER SIDE (USB TASK, TINYUSB CALLBACKS) --------------------------------
+
+const uint8_t *passthrough_descriptor(uint8_t channel, uint16_t *length);   // The far side's descriptor for the channel, NULL while it uses the boot protocol
@@ -1,84 +1,117 @@
-#include "Tools/hamming74.h"
-#include <stdint.h>
-
-static int parity_check(uint8_t encoded, uint8_t p) // modify to calculate syndrome (at first 0 in position so just parity, second time through calculates syndrome)
-{
-    uint8_t pos_mask = (1 << p);                    // 1-based position of parity bit 1,2,4 (000x0xx)
-    uint8_t sum = 0;
-    for (uint8_t i = 1; i < 8; i++) {               // Iterate over all 1-based positions
-        if ((i & pos_mask) != 0) {                  // Check if the i-th position has the p-th position bit set
-            sum ^= (encoded >> (i-1)) & 1;
-        }
-    }
-    return sum;
-}
-
-static uint8_t calculate_syndrome(uint8_t encoded)
-{
-    uint8_t syndrome = 0;
-    for (uint8_t p = 0; p < 3; p++) {
-        syndrome ^= parity_check(encoded, p) << p;
-    }
-    return syndrome;
-}
-
-static uint8_t encode_nibble(const uint8_t nibble)
-{
-    uint8_t encoded_nibble = 0;
-    uint8_t j = 0;
-    for (uint8_t i = 0; i < 7; i++) {              // Place data bits in non-parity positions
-        if ((i & (i + 1)) == 0) {                  // Skip positions that are powers of 2: indices 0, 1, and 3 (i+1 == 1,2,4)
-            continue;
-        }
-        encoded_nibble |= (((nibble >> j) & 1) << i); // |= bitwise OR
-        j++;
-    }
-    for (uint8_t p = 0; p < 3; p++) {  // Calculate and set the parity bits
-        uint8_t parity_pos = (1 << p) - 1;  // 0-based index for parity bit
-        encoded_nibble |= parity_check(encoded_nibble, p) << parity_pos;
-    }
-    return encoded_nibble;
-}
-
-static uint8_t decode_nibble(uint8_t encoded)
-{
-    uint8_t syndrome = calculate_syndrome(encoded); // Calculate the syndrome to detect errors over 7 bits
-    if (syndrome != 0) {                         // Correct the error if syndrome is non-zero
-        uint8_t error_pos = syndrome - 1;  // Convert to 0-based index
-        if (error_pos < 7) {
-            encoded ^= 1 << error_pos;  // Flip the incorrect bit
-        }
-    }
-
-    uint8_t decoded = 0;
-    decoded |= (encoded >> 2) & 0x01;  // For Hamming(7,4), the data bits are at indices 2, 4, 5, and 6.
-    decoded |= (encoded >> 3) & 0x02;
-    decoded |= (encoded >> 3) & 0x04;
-    decoded |= (encoded >> 3) & 0x08;
-    return decoded;
-}
-
-void encode_bytes(const uint8_t *data, uint8_t encoded_length, uint8_t *encoded_bytes)
-{
-    for (uint8_t i = 0; i < encoded_length; i++) {
-        uint8_t nibble;
-        if (i % 2 == 0) {                               // if even, extract high nibble
-            nibble = data[i / 2] >> 4;   
-        } else {                                        // if odd, extract low nibble
-            nibble = data[i / 2] & 0x0F;
-        }
-        encoded_bytes[i] = encode_nibble(nibble);       // Place the encoded byte into the output array.
-    }
-}
-
-void decode_bytes(const uint8_t *encoded_bytes, uint8_t encoded_length, uint8_t *decoded_bytes) // length should be even
-{
-    for (uint8_t i = 0; i < encoded_length; i++) {
-        uint8_t nibble = decode_nibble(encoded_bytes[i]);
-        if (i % 2 == 0) {                           // if even, set high nibble
-            decoded_bytes[i / 2] = nibble << 4;     // Sets upper half to decoded bits and lower half to 0
-        } else {                            
-            decoded_bytes[i / 2] |= nibble;   
-        }
-    }
-}
\ No newline at end of file
+#include "Tools/Hamming74.h"
+#include <stdint.h>
+#include <string.h>
+
+// Codewords use 0-based bit layout p1 p2 d0 p3 d1 d2 d3 (bits 0..6), bit 7 is always 0 on transmit and ignored on receive.
+
+static const uint8_t encode_table[16] = {           // encode_table[nibble] = Hamming(7,4) codeword
+    0x00, 0x07, 0x19, 0x1E, 0x2A, 0x2D, 0x33, 0x34,
+    0x4B, 0x4C, 0x52, 0x55, 0x61, 0x66, 0x78, 0x7F
+};
+
+static const uint8_t decode_table[128] = {          // decode_table[codeword & 0x7F] = nibble after single bit correction
+    0x0, 0x0, 0x0, 0x1, 0x0, 0x1, 0x1, 0x1, 0x0, 0x2, 0x4, 0x8, 0x9, 0x5, 0x3, 0x1,
+    0x0, 0x2, 0xA, 0x6, 0x7, 0xB, 0x3, 0x1, 0x2, 0x2, 0x3, 0x2, 0x3, 0x2, 0x3, 0x3,
+    0x0, 0xC, 0x4, 0x6, 0x7, 0x5, 0xD, 0x1, 0x4, 0x5, 0x4, 0x4, 0x5, 0x5, 0x4, 0x5,
+    0x7, 0x6, 0x6, 0x6, 0x7, 0x7, 0x7, 0x6, 0xE, 0x2, 0x4, 0x6, 0x7, 0x5, 0x3, 0xF,
+    0x0, 0xC, 0xA, 0x8, 0x9, 0xB, 0xD, 0x1, 0x9, 0x8, 0x8, 0x8, 0x9, 0x9, 0x9, 0x8,
+    0xA, 0xB, 0xA, 0xA, 0xB, 0xB, 0xA, 0xB, 0xE, 0x2, 0xA, 0x8, 0x9, 0xB, 0x3, 0xF,
+    0xC, 0xC, 0xD, 0xC, 0xD, 0xC, 0xD, 0xD, 0xE, 0xC, 0x4, 0x8, 0x9, 0x5, 0xD, 0xF,
+    0xE, 0xC, 0xA, 0x6, 0x7, 0xB, 0xD, 0xF, 0xE, 0xE, 0xE, 0xF, 0xE, 0xF, 0xF, 0xF
+};
+
+static const uint8_t corrected_table[128] = {       // decode_table with bit 4 set if the codeword had a bit flipped
+    0x00, 0x10, 0x10, 0x11, 0x10, 0x11, 0x11, 0x01, 0x10, 0x12, 0x14, 0x18, 0x19, 0x15, 0x13, 0x11,
+    0x10, 0x12, 0x1A, 0x16, 0x17, 0x1B, 0x13, 0x11, 0x12, 0x02, 0x13, 0x12, 0x13, 0x12, 0x03, 0x13,
+    0x10, 0x1C, 0x14, 0x16, 0x17, 0x15, 0x1D, 0x11, 0x14, 0x15, 0x04, 0x14, 0x15, 0x05, 0x14, 0x15,
+    0x17, 0x16, 0x16, 0x06, 0x07, 0x17, 0x17, 0x16, 0x1E, 0x12, 0x14, 0x16, 0x17, 0x15, 0x13, 0x1F,
+    0x10, 0x1C, 0x1A, 0x18, 0x19, 0x1B, 0x1D, 0x11, 0x19, 0x18, 0x18, 0x08, 0x09, 0x19, 0x19, 0x18,
+    0x1A, 0x1B, 0x0A, 0x1A, 0x1B, 0x0B, 0x1A, 0x1B, 0x1E, 0x12, 0x1A, 0x18, 0x19, 0x1B, 0x13, 0x1F,
+    0x1C, 0x0C, 0x1D, 0x1C, 0x1D, 0x1C, 0x0D, 0x1D, 0x1E, 0x1C, 0x14, 0x18, 0x19, 0x15, 0x1D, 0x1F,
+    0x1E, 0x1C, 0x1A, 0x16, 0x17, 0x1B, 0x1D, 0x1F, 0x0E, 0x1E, 0x1E, 0x1F, 0x1E, 0x1F, 0x1F, 0x0F
+};
+
+static inline uint8_t encode_nibble(const uint8_t nibble)
+{
+    return encode_table[nibble & 0x0F];
+}
+
+static inline uint8_t decode_nibble(uint8_t encoded)
+{
+    return decode_table[encoded & 0x7F];
+}
+
+static inline uint32_t encode_pair(const uint8_t *data)   // Two data bytes -> one 32-bit word of four codewords in wire order
+{
+    return  (uint32_t)encode_table[data[0] >> 4]
+         | ((uint32_t)encode_table[data[0] & 0x0F] << 8)
+         | ((uint32_t)encode_table[data[1] >> 4]   << 16)
+         | ((uint32_t)encode_table[data[1] & 0x0F] << 24);
+}
+
+static inline void decode_pair(uint32_t word, uint8_t *decoded)  // One 32-bit word of four codewords -> two data bytes
+{
+    decoded[0] = (decode_table[ word        & 0x7F] << 4) | decode_table[(word >> 8)  & 0x7F];
+    decoded[1] = (decode_table[(word >> 16) & 0x7F] << 4) | decode_table[(word >> 24) & 0x7F];
+}
+
+void encode_bytes(const uint8_t *data, uint8_t encoded_length, uint8_t *encoded_bytes)
+{
+    uint8_t i = 0;
+    for (; i + 4 <= encoded_length; i += 4) {           // Bulk path: 2 data bytes -> 4 codewords per 32-bit store (words are little endian on both the ESP32-S3 and the host)
+        uint32_t word = encode_pair(&data[i / 2]);
+        memcpy(&encoded_bytes[i], &word, sizeof(word)); // memcpy keeps unaligned buffers legal, compiles to a single store
+    }
+    for (; i < encoded_length; i++) {                   // Tail: remaining 1-3 nibbles
+        uint8_t nibble;
+        if (i % 2 == 0) {                               // if even, extract high nibble
+            nibble = data[i / 2] >> 4;
+        } else {                                        // if odd, extract low nibble
+            nibble = data[i / 2] & 0x0F;
+        }
+        encoded_bytes[i] = encode_nibble(nibble);       // Place the encoded byte into the output array.
+    }
+}
+
+void decode_bytes(const uint8_t *encoded_bytes, uint8_t encoded_length, uint8_t *decoded_bytes) // length should be even
+{
+    uint8_t i = 0;
+    for (; i + 4 <= encoded_length; i += 4) {           // Bulk path: one 32-bit load -> 2 data bytes
+        uint32_t word;
+        memcpy(&word, &encoded_bytes[i], sizeof(word));
+        decode_pair(word, &decoded_bytes[i / 2]);
+    }
+    for (; i < encoded_length; i++) {                   // Tail: remaining 1-3 nibbles
+        uint8_t nibble = decode_nibble(encoded_bytes[i]);
+        if (i % 2 == 0) {                               // if even, set high nibble
+            decoded_bytes[i / 2] = nibble << 4;         // Sets upper half to decoded bits and lower half to 0
+        } else {
+            decoded_bytes[i / 2] |= nibble;
+        }
+    }
+}
+
+uint8_t decode_bytes_counted(const uint8_t *encoded_bytes, uint8_t encoded_length, uint8_t *decoded_bytes)  // decode_bytes, one lookup per codeword also counts the corrected ones
+{
+    uint8_t corrected = 0;
+    uint8_t i = 0;
+    for (; i + 4 <= encoded_length; i += 4) {
+        uint32_t word;
+        memcpy(&word, &encoded_bytes[i], sizeof(word));
+        uint8_t a = corrected_table[ word        & 0x7F], b = corrected_table[(word >> 8)  & 0x7F];
+        uint8_t c = corrected_table[(word >> 16) & 0x7F], d = corrected_table[(word >> 24) & 0x7F];
+        decoded_bytes[i / 2]     = (a << 4) | (b & 0x0F);
+        decoded_bytes[i / 2 + 1] = (c << 4) | (d & 0x0F);
+        corrected += (a >> 4) + (b >> 4) + (c >> 4) + (d >> 4);
+    }
+    for (; i < encoded_length; i++) {
+        uint8_t entry = corrected_table[encoded_bytes[i] & 0x7F];
+        if (i % 2 == 0) {
+            decoded_bytes[i / 2] = entry << 4;
+        } else {
+            decoded_bytes[i / 2] |= entry & 0x0F;
+        }
+        corrected += entry >> 4;
+    }
+    return corrected;
+}
@@ -1,5 +1,7 @@
-#include <stdint.h>
-
-void encode_bytes(const uint8_t *data, uint8_t encoded_length, uint8_t *encoded_bytes);
-
-void decode_bytes(const uint8_t *encoded_bytes, uint8_t encoded_length, uint8_t *decoded_bytes);
\ No newline at end of file
+#include <stdint.h>
+
+void encode_bytes(const uint8_t *data, uint8_t encoded_length, uint8_t *encoded_bytes);
+
+void decode_bytes(const uint8_t *encoded_bytes, uint8_t encoded_length, uint8_t *decoded_bytes);
+
+uint8_t decode_bytes_counted(const uint8_t *encoded_bytes, uint8_t encoded_length, uint8_t *decoded_bytes);   // Also returns the codewords corrected
\ No newline at end of file
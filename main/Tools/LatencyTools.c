@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdatomic.h>
+
+#include "esp_timer.h"
+
+#include "Tools/LatencyTools.h"
+
+#define RING_SIZE       16              // Stamps in flight per ring, must cover every report slot (REPORT_SLOTS) and the depth of each queue to the USB task (10)
+#define LINEAR_BUCKETS  16              // 0..15 us get one bucket each
+#define SUB_BUCKETS     4               // Every power of two above that is split into 4 buckets
+#define BUCKETS         (LINEAR_BUCKETS + 20 * SUB_BUCKETS) // Covers up to 2^24 us (~16 s)
+#define RTT_SLACK_US    200             // Offset samples with a round trip this close to the best seen are trusted
+#define NO_ECHO         0xFFFFFFFF      // Hold time sent before any peer heartbeat has been received
+
+typedef struct {                        // Timestamps that follow a report through a FreeRTOS queue
+    int64_t start;                          // Capture time in local clock (0 if unknown)
+    int64_t stamp;                          // Time the report entered the queue
+    bool wake;                              // First report after an idle link, also recorded as LATENCY_WAKE
+} stamp_t;
+
+typedef struct {                        // Single producer single consumer ring, shadows a FIFO queue of reports
+    stamp_t slot[RING_SIZE];
+    atomic_uint head;                       // Written by the producer only
+    atomic_uint tail;                       // Written by the consumer only
+} stamp_ring_t;
+
+typedef struct {                        // Log-linear histogram, written by one task and read by the console without locks
+    atomic_uint count[BUCKETS];
+    atomic_uint samples;
+    atomic_uint max_us;
+} histogram_t;
+
+static const char *stage_names[LATENCY_STAGES] = {
+    "queue", "transmit", "link", "deliver", "end-to-end", "wake"
+};
+
+static histogram_t histograms[LATENCY_STAGES];
+static stamp_ring_t tx_ring[2];         // HID host callback -> COM task  (hosting board, shadows the report pool's two ready rings)
+static stamp_ring_t rx_ring[2];         // COM task -> USB task           (device board, keyboard and mouse queues)
+static stamp_t tx_current;              // Report currently being transmitted by the COM task
+static stamp_t rx_current;              // Report currently being delivered by the USB task
+static bool tx_valid = false;
+static bool rx_valid = false;
+
+#if LATENCY_TRACE
+static uint32_t peer_time = 0;          // Last heartbeat time received from the peer (peer clock)
+static int64_t peer_time_rx = 0;        // Local time that heartbeat arrived (0 if none yet)
+#endif
+static int32_t clock_offset = 0;        // Peer clock minus local clock in us (low 32 bits)
+static uint32_t best_rtt = 0;           // Smallest recent heartbeat round trip in us
+static volatile bool clock_valid = false;
+
+// -------------------------------- HELPERS --------------------------------
+
+static bool ring_push(stamp_ring_t *ring, stamp_t stamp) {
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail >= RING_SIZE) {
+        return false;
+    }
+    ring->slot[head % RING_SIZE] = stamp;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return true;
+}
+
+static bool ring_pop(stamp_ring_t *ring, stamp_t *stamp) {
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail == atomic_load_explicit(&ring->head, memory_order_acquire)) {
+        return false;
+    }
+    *stamp = ring->slot[tail % RING_SIZE];
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+static uint8_t bucket_of(uint32_t us) {
+    if (us < LINEAR_BUCKETS) {
+        return us;
+    }
+    uint8_t exponent = 31 - __builtin_clz(us);                  // >= 4
+    uint8_t sub = (us >> (exponent - 2)) & (SUB_BUCKETS - 1);   // Next two bits below the leading one
+    uint16_t bucket = LINEAR_BUCKETS + (exponent - 4) * SUB_BUCKETS + sub;
+    return bucket < BUCKETS ? bucket : BUCKETS - 1;
+}
+
+static uint32_t bucket_upper(uint8_t bucket) {                  // Largest value that lands in a bucket
+    if (bucket < LINEAR_BUCKETS) {
+        return bucket;
+    }
+    uint8_t exponent = 4 + (bucket - LINEAR_BUCKETS) / SUB_BUCKETS;
+    uint8_t sub = (bucket - LINEAR_BUCKETS) % SUB_BUCKETS;
+    return (1u << exponent) + ((sub + 1u) << (exponent - 2)) - 1;
+}
+
+static void record(uint8_t stage, int64_t us) {
+    if (us < 0) {                                               // Clock offset estimate overshot, clamp rather than drop
+        us = 0;
+    }
+    uint32_t value = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+    histogram_t *h = &histograms[stage];
+    atomic_fetch_add_explicit(&h->count[bucket_of(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->samples, 1, memory_order_relaxed);
+    unsigned max = atomic_load_explicit(&h->max_us, memory_order_relaxed);
+    while (value > max && !atomic_compare_exchange_weak_explicit(&h->max_us, &max, value, memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+static uint32_t percentile(const histogram_t *h, unsigned samples, unsigned per_mille) {
+    unsigned target = (samples * per_mille + 999) / 1000;       // Rank of the requested sample (1-based)
+    unsigned seen = 0;
+    for (uint8_t b = 0; b < BUCKETS; b++) {
+        seen += atomic_load_explicit(&h->count[b], memory_order_relaxed);
+        if (seen >= target) {
+            uint32_t upper = bucket_upper(b);
+            uint32_t max = atomic_load_explicit(&h->max_us, memory_order_relaxed);
+            return upper < max ? upper : max;
+        }
+    }
+    return atomic_load_explicit(&h->max_us, memory_order_relaxed);
+}
+
+#if LATENCY_TRACE
+static void put_u32(uint8_t *bytes, uint32_t value) {
+    bytes[0] = value;
+    bytes[1] = value >> 8;
+    bytes[2] = value >> 16;
+    bytes[3] = value >> 24;
+}
+
+static uint32_t get_u32(const uint8_t *bytes) {
+    return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+#endif
+
+// -------------------------------- HOSTING BOARD --------------------------------
+
+void latency_report_captured(int64_t capture_time, bool mouse) {
+    stamp_t stamp = {.start = capture_time, .stamp = esp_timer_get_time()};
+    ring_push(&tx_ring[mouse], stamp);
+}
+
+void latency_report_dequeued(bool mouse) {
+    tx_valid = ring_pop(&tx_ring[mouse], &tx_current);
+    if (tx_valid) {
+        int64_t now = esp_timer_get_time();
+        record(LATENCY_QUEUE, now - tx_current.start);
+        tx_current.stamp = now;                                 // Reuse as the dequeue time for the transmit stage
+    }
+}
+
+void latency_report_coalesced(int64_t capture_time) {
+    int64_t now = esp_timer_get_time();
+    record(LATENCY_QUEUE, now - capture_time);
+    tx_current = (stamp_t){.start = capture_time, .stamp = now};
+    tx_valid = true;
+}
+
+void latency_report_transmit(uint8_t *trailer) {
+    int64_t now = esp_timer_get_time();
+    uint32_t age = 0;
+    if (tx_valid) {
+        record(LATENCY_TRANSMIT, now - tx_current.stamp);
+        age = (uint32_t)(now - tx_current.start);
+        tx_valid = false;
+    }
+#if LATENCY_TRACE
+    put_u32(&trailer[0], (uint32_t)now);
+    put_u32(&trailer[4], age);
+#else
+    (void)trailer;
+    (void)age;
+#endif
+}
+
+// -------------------------------- DEVICE BOARD --------------------------------
+
+void latency_report_decoded(const uint8_t *trailer, bool mouse, bool wake) {
+    stamp_t stamp = {.start = 0, .stamp = esp_timer_get_time(), .wake = wake};
+#if LATENCY_TRACE
+    if (clock_valid) {
+        uint32_t tx_local = get_u32(&trailer[0]) - (uint32_t)clock_offset;  // Peer transmit time moved onto the local clock
+        int32_t link = (int32_t)((uint32_t)stamp.stamp - tx_local);
+        record(LATENCY_LINK, link);
+        stamp.start = stamp.stamp - link - get_u32(&trailer[4]);            // Capture time on the local clock
+    }
+#else
+    (void)trailer;
+#endif
+    ring_push(&rx_ring[mouse], stamp);
+}
+
+void latency_report_received(bool mouse) {
+    rx_valid = ring_pop(&rx_ring[mouse], &rx_current);
+}
+
+void latency_report_delivered(void) {
+    if (!rx_valid) {
+        return;
+    }
+    int64_t now = esp_timer_get_time();
+    record(LATENCY_DELIVER, now - rx_current.stamp);
+    if (rx_current.start != 0) {
+        record(LATENCY_END_TO_END, now - rx_current.start);
+        if (rx_current.wake) {
+            record(LATENCY_WAKE, now - rx_current.start);
+        }
+    }
+    rx_valid = false;
+}
+
+// -------------------------------- CLOCK OFFSET --------------------------------
+
+void latency_fill_heartbeat(uint8_t *payload) {
+#if LATENCY_TRACE
+    int64_t now = esp_timer_get_time();
+    put_u32(&payload[0], (uint32_t)now);                                    // Own time
+    put_u32(&payload[4], peer_time);                                        // Echo of the last peer time
+    put_u32(&payload[8], peer_time_rx ? (uint32_t)(now - peer_time_rx) : NO_ECHO); // How long we held it
+#endif
+}
+
+void latency_read_heartbeat(const uint8_t *payload) {
+#if LATENCY_TRACE
+    int64_t now = esp_timer_get_time();
+    uint32_t sent = get_u32(&payload[0]);
+    uint32_t echo = get_u32(&payload[4]);
+    uint32_t hold = get_u32(&payload[8]);
+    peer_time = sent;
+    peer_time_rx = now;
+    if (hold == NO_ECHO) {
+        return;
+    }
+    uint32_t rtt = (uint32_t)now - echo - hold;                             // Round trip of our earlier heartbeat minus the peer's hold time
+    if (rtt > 1000000) {                                                    // Stale echo (e.g. across a reconnect), ignore
+        return;
+    }
+    if (!clock_valid || rtt <= best_rtt + RTT_SLACK_US) {                   // Only trust samples with a near-minimal round trip
+        clock_offset = (int32_t)(sent + rtt / 2 - (uint32_t)now);
+        best_rtt = (!clock_valid || rtt < best_rtt) ? rtt : best_rtt;
+        clock_valid = true;
+    } else {
+        best_rtt += (rtt - best_rtt) / 8;                                   // Let the best round trip drift up if the link got slower
+    }
+#endif
+}
+
+// -------------------------------- OUTPUT --------------------------------
+
+unsigned latency_samples(uint8_t stage) {
+    return atomic_load_explicit(&histograms[stage].samples, memory_order_relaxed);
+}
+
+uint32_t latency_percentile_us(uint8_t stage, unsigned per_mille) {
+    unsigned samples = latency_samples(stage);
+    return samples ? percentile(&histograms[stage], samples, per_mille) : 0;
+}
+
+void latency_dump(void) {
+    printf("clock offset: %ld us, best rtt %lu us%s\n", (long)clock_offset, (unsigned long)best_rtt, clock_valid ? "" : " (not synced)");
+    printf("%-12s %8s %8s %8s %8s\n", "stage", "samples", "p50 us", "p99 us", "max us");
+    for (uint8_t stage = 0; stage < LATENCY_STAGES; stage++) {
+        const histogram_t *h = &histograms[stage];
+        unsigned samples = atomic_load_explicit(&h->samples, memory_order_relaxed);
+        if (samples == 0) {
+            printf("%-12s %8u %8s %8s %8s\n", stage_names[stage], 0u, "-", "-", "-");
+            continue;
+        }
+        printf("%-12s %8u %8lu %8lu %8u\n", stage_names[stage], samples,
+               (unsigned long)percentile(h, samples, 500),
+               (unsigned long)percentile(h, samples, 990),
+               atomic_load_explicit(&h->max_us, memory_order_relaxed));
+    }
+}
+
+void latency_reset(void) {
+    for (uint8_t stage = 0; stage < LATENCY_STAGES; stage++) {
+        histogram_t *h = &histograms[stage];
+        for (uint8_t b = 0; b < BUCKETS; b++) {
+            atomic_store_explicit(&h->count[b], 0, memory_order_relaxed);
+        }
+        atomic_store_explicit(&h->samples, 0, memory_order_relaxed);
+        atomic_store_explicit(&h->max_us, 0, memory_order_relaxed);
+    }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef LATENCY_TRACE
+#define LATENCY_TRACE 0                                     // 1 puts timestamps on every report and ACK for the link and end to end stages (both boards must match)
+#endif
+
+#if LATENCY_TRACE
+#define LATENCY_TRAILER_LEN   8                             // Bytes appended to every report: transmit time (4) + capture age (4)
+#define LATENCY_HEARTBEAT_LEN 12                            // Bytes appended to every ACK: own time (4) + echoed peer time (4) + hold time (4)
+#else
+#define LATENCY_TRAILER_LEN   0
+#define LATENCY_HEARTBEAT_LEN 0
+#endif
+
+enum latency_stages {       // Stages of the report pipeline, each with its own histogram
+    LATENCY_QUEUE,              // HID host callback -> dequeued by the COM task              (hosting board)
+    LATENCY_TRANSMIT,           // dequeued by the COM task -> written to the UART            (hosting board)
+    LATENCY_LINK,               // written to the UART -> decoded on the far side             (device board, clock offset corrected)
+    LATENCY_DELIVER,            // decoded -> passed to tinyusb for the computer              (device board)
+    LATENCY_END_TO_END,         // HID host callback -> passed to tinyusb for the computer    (device board, clock offset corrected)
+    LATENCY_WAKE,               // End to end of the first report after an idle link         (device board, Tools/PowerTools.h)
+    LATENCY_STAGES
+};
+
+// -------------------------------- HOSTING BOARD --------------------------------
+
+void latency_report_captured(int64_t capture_time, bool mouse);    // HID host callback, before the report slot is published to the COM task (mouse: to its mouse ring)
+
+void latency_report_dequeued(bool mouse);                   // COM task, after taking a report slot from the report pool
+
+void latency_report_coalesced(int64_t capture_time);        // COM task, after taking a merged mouse report from the coalescer (oldest capture time)
+
+void latency_report_transmit(uint8_t *trailer);             // COM task, just before the UART write, fills LATENCY_TRAILER_LEN bytes
+
+// -------------------------------- DEVICE BOARD --------------------------------
+
+void latency_report_decoded(const uint8_t *trailer, bool mouse, bool wake);    // COM task, after a report is read, before it is queued for the USB task, wake if it ended an idle period
+
+void latency_report_received(bool mouse);                   // USB task, after taking a report off com_to_usb_queue (mouse: com_to_usb_mouse_queue)
+
+void latency_report_delivered(void);                        // USB task, after the report has been handed to tinyusb
+
+// -------------------------------- CLOCK OFFSET --------------------------------
+
+void latency_fill_heartbeat(uint8_t *payload);              // Fill LATENCY_HEARTBEAT_LEN bytes of an outgoing ACK
+
+void latency_read_heartbeat(const uint8_t *payload);        // Update the clock offset estimate from a received ACK
+
+// -------------------------------- OUTPUT --------------------------------
+
+unsigned latency_samples(uint8_t stage);
+
+uint32_t latency_percentile_us(uint8_t stage, unsigned per_mille);  // 0 until the stage has a sample
+
+void latency_dump(void);                                    // Print p50/p99/max per stage to the console
+
+void latency_reset(void);
@@ -0,0 +1,237 @@
+#include <string.h>
+
+#include "esp_timer.h"
+
+#include "Tools/LinkARQ.h"
+#include "Tools/Telemetry.h"
+#include "Tools/StaticMemory.h"
+#include "state_machines.h"
+
+#define ARQ_INITIAL_RTO_US  50000                   // Retransmit timeout before the first round trip has been measured
+#define ARQ_MIN_RTO_US      10000                   // One tick, the COM task looks for expired timers once per tick
+#define ARQ_MAX_RTO_US      200000                  // Timeouts double on every retransmission up to this
+#define SACK_BITS           (ARQ_WINDOW - 1)
+
+typedef struct {                                    // Sender: a reliable message waiting for its acknowledgement
+    bool used;
+    bool resent;                                        // Sent more than once, its acknowledgement gives no round trip sample
+    uint8_t rseq;
+    uint8_t length;                                     // Message bytes, the copy also holds the rseq byte after them
+    int64_t sent;                                       // Time of the last transmission
+    int64_t timeout;                                    // Sent again if unacknowledged this long after sent
+    uint8_t data[ARQ_MAX_MESSAGE + 1];
+} tx_slot_t;
+
+static tx_slot_t tx_slots[ARQ_WINDOW];
+static uint8_t tx_next = 0;                         // rseq of the next new reliable message
+static int64_t srtt = 0;                            // Smoothed round trip from transmission to acknowledgement in us
+static uint32_t retransmissions = 0;
+
+static uint8_t rx_slots[ARQ_WINDOW][ARQ_MAX_MESSAGE]; // Receiver: reliable messages held until everything before them is delivered, indexed by rseq
+static uint8_t rx_present = 0;                      // One bit per rx_slots entry
+static uint8_t rx_expected = 0;                     // rseq of the next message to deliver
+static volatile bool ack_due = false;
+
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t consumer_task = NULL;
+
+// -------------------------------- HELPERS --------------------------------
+
+static int64_t rto(void) {
+    int64_t timeout = srtt ? 2 * srtt : ARQ_INITIAL_RTO_US;
+    return timeout < ARQ_MIN_RTO_US ? ARQ_MIN_RTO_US : (timeout > ARQ_MAX_RTO_US ? ARQ_MAX_RTO_US : timeout);
+}
+
+static void acknowledge(uint8_t ack, uint8_t sack) {   // Free every slot the peer has received
+    int64_t now = esp_timer_get_time();
+    for (uint8_t i = 0; i < ARQ_WINDOW; i++) {
+        tx_slot_t *slot = &tx_slots[i];
+        if (!slot->used) {
+            continue;
+        }
+        uint8_t ahead = slot->rseq - ack;               // >= 128 if the slot is before ack (wraps)
+        if (ahead < 128 && (ahead == 0 || ahead > SACK_BITS || !(sack & (1 << (ahead - 1))))) {
+            continue;
+        }
+        if (!slot->resent) {
+            int64_t sample = now - slot->sent;
+            srtt = srtt ? srtt + (sample - srtt) / 8 : sample;
+        }
+        slot->used = false;
+    }
+}
+
+static uint8_t selective_acks(void) {               // Bit i set if rx_expected + 1 + i is held
+    uint8_t sack = 0;
+    for (uint8_t i = 0; i < SACK_BITS; i++) {
+        if (rx_present & (1 << ((rx_expected + 1 + i) % ARQ_WINDOW))) {
+            sack |= 1 << i;
+        }
+    }
+    return sack;
+}
+
+// -------------------------------- SETUP --------------------------------
+
+void arq_init(TaskHandle_t consumer) {
+    consumer_task = consumer;
+    memory_account("link ARQ", sizeof(tx_slots) + sizeof(rx_slots));
+}
+
+void arq_reset(void) {
+    portENTER_CRITICAL(&lock);
+    tx_slot_t kept[ARQ_WINDOW];
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < ARQ_WINDOW; i++) {          // Oldest first, each keeps its place in the order
+        tx_slot_t *oldest = NULL;
+        for (uint8_t j = 0; j < ARQ_WINDOW; j++) {
+            if (tx_slots[j].used && (oldest == NULL || (int8_t)(tx_slots[j].rseq - oldest->rseq) < 0)) {
+                oldest = &tx_slots[j];
+            }
+        }
+        if (oldest == NULL) {
+            break;
+        }
+        kept[count] = *oldest;
+        oldest->used = false;
+        count++;
+    }
+    for (uint8_t i = 0; i < ARQ_WINDOW; i++) {
+        tx_slots[i] = i < count ? kept[i] : (tx_slot_t){0};
+        if (i < count) {
+            tx_slots[i].rseq = i;                       // Renumbered for the peer's fresh receive window
+            tx_slots[i].data[tx_slots[i].length] = i;
+            tx_slots[i].resent = true;
+            tx_slots[i].timeout = 0;                    // Due at once
+        }
+    }
+    tx_next = count;
+    rx_present = 0;
+    rx_expected = 0;
+    ack_due = false;
+    portEXIT_CRITICAL(&lock);
+}
+
+bool arq_reliable(uint8_t header) {
+    return header == UPDATE || header == REPORT_KEYS || header == OUTPUT_REPORT || header == REPORT_RAW || header == DESCRIPTOR;
+}
+
+uint8_t arq_trailer_length(uint8_t header) {
+    return arq_reliable(header) ? 3 : 2;
+}
+
+// -------------------------------- SENDER --------------------------------
+
+bool arq_window_full(void) {                        // The receiver drops anything ARQ_WINDOW or more past its oldest gap
+    portENTER_CRITICAL(&lock);
+    bool full = false;
+    for (uint8_t i = 0; i < ARQ_WINDOW; i++) {
+        full |= tx_slots[i].used && (uint8_t)(tx_next - tx_slots[i].rseq) >= ARQ_WINDOW;
+    }
+    portEXIT_CRITICAL(&lock);
+    return full;
+}
+
+void arq_track(uint8_t *message, uint8_t length) {
+    if (!arq_reliable(message[0]) || length > ARQ_MAX_MESSAGE) {
+        return;
+    }
+    uint8_t in_flight = 0;
+    bool tracked = false;
+    portENTER_CRITICAL(&lock);
+    for (uint8_t i = 0; i < ARQ_WINDOW; i++) {
+        tx_slot_t *slot = &tx_slots[i];
+        if (!slot->used && !tracked) {              // First free slot, the rest are only counted
+            tracked = true;
+            message[length] = tx_next;
+            *slot = (tx_slot_t){.used = true, .rseq = tx_next++, .length = length, .sent = esp_timer_get_time(), .timeout = rto()};
+            memcpy(slot->data, message, length + 1);
+        }
+        in_flight += slot->used;
+    }
+    portEXIT_CRITICAL(&lock);
+    telemetry_high_water(TELEMETRY_ARQ_WINDOW, in_flight);
+}
+
+bool arq_retransmit(uint8_t *message) {
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&lock);
+    tx_slot_t *oldest = NULL;
+    for (uint8_t i = 0; i < ARQ_WINDOW; i++) {
+        tx_slot_t *slot = &tx_slots[i];
+        if (slot->used && now - slot->sent >= slot->timeout && (oldest == NULL || (int8_t)(slot->rseq - oldest->rseq) < 0)) {
+            oldest = slot;
+        }
+    }
+    if (oldest != NULL) {
+        memcpy(message, oldest->data, oldest->length + 1);
+        oldest->sent = now;
+        oldest->timeout = oldest->resent && oldest->timeout ? 2 * oldest->timeout : rto();
+        oldest->timeout = oldest->timeout > ARQ_MAX_RTO_US ? ARQ_MAX_RTO_US : oldest->timeout;
+        oldest->resent = true;
+        retransmissions++;
+    }
+    portEXIT_CRITICAL(&lock);
+    return oldest != NULL;
+}
+
+uint8_t arq_fill_trailer(uint8_t *message, uint8_t length) {
+    uint8_t at = arq_reliable(message[0]) ? length + 1 : length;    // After the rseq byte arq_track wrote
+    portENTER_CRITICAL(&lock);
+    message[at] = rx_expected;
+    message[at + 1] = selective_acks();
+    ack_due = false;
+    portEXIT_CRITICAL(&lock);
+    return at + 2;
+}
+
+bool arq_ack_due(void) {
+    return ack_due;
+}
+
+// -------------------------------- RECEIVER --------------------------------
+
+bool arq_receive(const uint8_t *message, uint8_t length) {
+    bool reliable = arq_reliable(message[0]);
+    uint8_t at = reliable ? length + 1 : length;
+    portENTER_CRITICAL(&lock);
+    acknowledge(message[at], message[at + 1]);
+    if (reliable) {
+        uint8_t ahead = message[length] - rx_expected;
+        if (ahead < ARQ_WINDOW && length <= ARQ_MAX_MESSAGE) {  // Duplicates of delivered messages are only acknowledged again
+            memcpy(rx_slots[message[length] % ARQ_WINDOW], message, length);
+            rx_present |= 1 << (message[length] % ARQ_WINDOW);
+        }
+        ack_due = true;
+    }
+    portEXIT_CRITICAL(&lock);
+    if (reliable && consumer_task != NULL) {
+        xTaskNotifyGive(consumer_task);
+    }
+    return !reliable;
+}
+
+bool arq_deliver(uint8_t *message) {
+    portENTER_CRITICAL(&lock);
+    uint8_t index = rx_expected % ARQ_WINDOW;
+    bool ready = rx_present & (1 << index);
+    if (ready) {
+        memcpy(message, rx_slots[index], ARQ_MAX_MESSAGE);
+        rx_present &= ~(1 << index);
+        rx_expected++;
+        ack_due = true;                                 // The cumulative ack moved
+    }
+    portEXIT_CRITICAL(&lock);
+    if (ready && consumer_task != NULL) {
+        xTaskNotifyGive(consumer_task);
+    }
+    return ready;
+}
+
+bool arq_holding(void) {
+    return rx_present & (1 << (rx_expected % ARQ_WINDOW));
+}
+
+uint32_t arq_retransmissions(void) {
+    return retransmissions;
+}
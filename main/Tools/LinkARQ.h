@@ -0,0 +1,47 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "freertos/FreeRTOS.h"
+
+#define ARQ_WINDOW      8                                   // Reliable messages in flight per direction (the selective ack bitmap has ARQ_WINDOW - 1 bits)
+#define ARQ_MAX_MESSAGE 75                                  // Longest reliable message (a 64 byte raw report with its latency trailer), fits MAX_FRAME_PAYLOAD with the trailer
+#define ARQ_TRAILER_MAX 3                                   // Longest trailer, room every message buffer needs past message_length
+
+// Selective repeat ARQ for the messages that must not be lost: updates, descriptors, keyboard, raw and output reports. Every message carries a
+// trailer after its data, [rseq][ack][sack] for reliable messages and [ack][sack] for the rest, so acknowledgements ride
+// on whatever the other side sends next. ack is the next reliable sequence number expected, bit i of sack marks
+// ack + 1 + i as received out of order. Unacknowledged messages are sent again once their timer (an adaptive multiple
+// of the measured round trip) expires, the receiver holds out of order ones back and delivers them in order.
+// Mouse reports, datastick messages and heartbeats bypass the window and are never held or sent again.
+
+void arq_init(TaskHandle_t consumer);                       // Consumer (COM task) is notified whenever an acknowledgement is due
+
+void arq_reset(void);                                       // New link session: numbering restarts, unacknowledged messages are kept and sent again first
+
+bool arq_reliable(uint8_t header);                          // True for the message types the window carries
+
+uint8_t arq_trailer_length(uint8_t header);                 // Trailer bytes a message of this type carries
+
+// -------------------------------- SENDER (COM TASK) --------------------------------
+
+bool arq_window_full(void);                                 // True while the oldest unacknowledged message is ARQ_WINDOW behind the next, take no new ones
+
+void arq_track(uint8_t *message, uint8_t length);           // Number a new reliable message and keep a copy until it is acknowledged (no-op for the rest)
+
+bool arq_retransmit(uint8_t *message);                      // Copy out the oldest message whose timer expired, false if none has
+
+uint8_t arq_fill_trailer(uint8_t *message, uint8_t length); // Write the trailer after length message bytes, returns the frame length
+
+bool arq_ack_due(void);                                     // A reliable message arrived and nothing has carried its acknowledgement yet
+
+// -------------------------------- RECEIVER --------------------------------
+
+bool arq_receive(const uint8_t *message, uint8_t length);   // Use the trailer's acks and hold a reliable message, true if an unreliable one should be delivered now
+
+bool arq_deliver(uint8_t *message);                         // Copy out the next reliable message in order, false if it has not arrived
+
+bool arq_holding(void);                                     // True while the next reliable message in order waits for arq_deliver
+
+uint32_t arq_retransmissions(void);                         // Messages sent again since power up
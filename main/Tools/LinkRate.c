@@ -0,0 +1,136 @@
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+
+#include "Tools/LinkRate.h"
+#include "Tools/Transport.h"
+#include "Tools/Telemetry.h"
+#include "state_machines.h"
+
+#define RATE_BUDGET_BITS    300                 // Error budget: at most one correction per this many received bits (the strong code copes with several times more)
+#define RATE_MAX_LOSS_PCT   10                  // A window losing more of its frames than this is bad
+#define RATE_WINDOW_US      1000000             // The rung is judged over windows at least this long
+#define RATE_WINDOW_FRAMES  20                  // and holding at least this many frames
+#define RATE_BAD_WINDOWS    2                   // Step down after this many bad windows in a row
+#define RATE_CLEAN_WINDOWS  30                  // Step up after this many windows without a correction or a lost frame
+#define RATE_MAX_CLEAN      960                 // Cap of the clean windows a step up waits for, doubled after each failed one
+#define PROBE_MIN_GOOD      (TRAIN_FRAMES - 1)  // Training frames that must arrive intact
+
+static const int ladder[RATE_RUNGS] = {115200, 230400, 460800, 1000000, 2000000, 5000000};   // 5 Mbaud is the ESP32-S3 UART's limit
+
+static uint8_t current = RATE_BASE;
+static uint32_t probe_corrected = 0;            // Totals when the probe started
+static uint32_t probe_bytes = 0;
+
+static int64_t window_start = 0;
+static uint32_t window_totals[4];               // Frames, rejected, corrected and bytes received when the window started
+static uint8_t bad_windows = 0;
+static uint16_t clean_windows = 0;
+static uint16_t clean_needed = RATE_CLEAN_WINDOWS;
+
+static const uint8_t window_counters[4] = {
+    TELEMETRY_FRAMES_RECEIVED, TELEMETRY_FRAMES_REJECTED, TELEMETRY_BITS_CORRECTED, TELEMETRY_BYTES_RECEIVED
+};
+
+// -------------------------------- HELPERS --------------------------------
+
+static uint8_t training_byte(uint8_t i) {       // Alternating bits and long runs, the patterns a slow optical receiver gets wrong first
+    static const uint8_t pattern[4] = {0x55, 0x00, 0xAA, 0xFF};
+    return pattern[i % 4] ^ (i / 4);
+}
+
+static bool over_budget(uint32_t corrected, uint32_t bytes) {
+    return (uint64_t)corrected * RATE_BUDGET_BITS > (uint64_t)bytes * 8;
+}
+
+static void start_window(void) {
+    window_start = esp_timer_get_time();
+    for (uint8_t i = 0; i < 4; i++) {
+        window_totals[i] = telemetry_total(window_counters[i]);
+    }
+}
+
+// -------------------------------- RUNGS --------------------------------
+
+int rate_baud(uint8_t rung) {
+    return ladder[rung < RATE_RUNGS ? rung : RATE_TOP];
+}
+
+uint8_t rate_current(void) {
+    return current;
+}
+
+void rate_set(uint8_t rung) {
+    if (rung == current || rung >= RATE_RUNGS) {
+        return;
+    }
+    transport_set_baud(ladder[rung]);
+    current = rung;
+    telemetry_count(TELEMETRY_RATE_CHANGES, 1);
+    bad_windows = 0;                            // The new rung is judged from scratch
+    clean_windows = 0;
+    start_window();
+}
+
+// -------------------------------- PROBE --------------------------------
+
+void rate_fill_training(uint8_t *message, uint8_t index, uint8_t verdict) {
+    message[0] = TRAIN;
+    message[1] = index;
+    message[2] = verdict;
+    for (uint8_t i = 3; i < TRAIN_LENGTH; i++) {
+        message[i] = training_byte(i);
+    }
+}
+
+bool rate_training_valid(const uint8_t *message) {
+    for (uint8_t i = 3; i < TRAIN_LENGTH; i++) {
+        if (message[i] != training_byte(i)) {
+            return false;
+        }
+    }
+    return message[1] < TRAIN_FRAMES;
+}
+
+void rate_probe_start(void) {
+    probe_corrected = telemetry_total(TELEMETRY_BITS_CORRECTED);
+    probe_bytes = telemetry_total(TELEMETRY_BYTES_RECEIVED);
+}
+
+bool rate_probe_passed(uint8_t good) {
+    uint32_t corrected = telemetry_total(TELEMETRY_BITS_CORRECTED) - probe_corrected;
+    uint32_t bytes = telemetry_total(TELEMETRY_BYTES_RECEIVED) - probe_bytes;
+    return good >= PROBE_MIN_GOOD && !over_budget(corrected, bytes);
+}
+
+void rate_step_up_failed(void) {
+    clean_needed = clean_needed * 2 > RATE_MAX_CLEAN ? RATE_MAX_CLEAN : clean_needed * 2;
+}
+
+// -------------------------------- SESSION --------------------------------
+
+uint8_t rate_advice(uint8_t ceiling) {
+    if (esp_timer_get_time() - window_start < RATE_WINDOW_US) {
+        return current;
+    }
+    uint32_t delta[4];
+    for (uint8_t i = 0; i < 4; i++) {
+        delta[i] = telemetry_total(window_counters[i]) - window_totals[i];
+    }
+    uint32_t frames = delta[0] + delta[1];
+    if (frames < RATE_WINDOW_FRAMES) {
+        return current;                         // A quiet link takes longer to fill a window
+    }
+    start_window();
+    bool bad = delta[1] * 100 > frames * RATE_MAX_LOSS_PCT || over_budget(delta[2], delta[3]);
+    bad_windows = bad ? bad_windows + 1 : 0;
+    clean_windows = delta[1] == 0 && delta[2] == 0 ? clean_windows + 1 : 0;
+    if (bad_windows >= RATE_BAD_WINDOWS && current > RATE_BASE) {
+        bad_windows = 0;                        // Asked once, the next request needs another run of bad windows
+        return current - 1;
+    }
+    if (clean_windows >= clean_needed && current < ceiling) {
+        clean_windows = 0;
+        return current + 1;
+    }
+    return current;
+}
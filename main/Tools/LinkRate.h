@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define RATE_RUNGS   6                                      // Baud rates on the ladder, slowest first
+#define RATE_BASE    0                                      // Rung of the handshake and of everything outside a session
+#define RATE_TOP     (RATE_RUNGS - 1)                       // Fastest rung this board offers in HELLO
+#define TRAIN_LENGTH 24                                     // Training message [TRAIN][index][verdict][pattern]
+#define TRAIN_FRAMES 8                                      // Training frames each side sends per round of a probe
+
+// Baud rate ladder of the optical link. Handshakes run at the base rate, then the initiator probes the fastest rung
+// both boards offer and each slower one in turn until one passes (the exchange is in state_machine_com.c): both sides
+// switch, each sends TRAIN_FRAMES training frames, and the rung is kept if nearly all of them arrived on both sides with
+// fewer corrections than the error budget. A failed probe returns both sides to the rung they were on.
+// During a session the counters in Tools/Telemetry.h judge the rung in windows like the FEC selection does: sustained
+// frame loss or corrections over the budget asks for a slower rung, a long run of clean windows for a faster one.
+
+int rate_baud(uint8_t rung);
+
+uint8_t rate_current(void);
+
+void rate_set(uint8_t rung);                                // Switch the UART once everything written has left, no-op if already there
+
+// -------------------------------- PROBE --------------------------------
+
+void rate_fill_training(uint8_t *message, uint8_t index, uint8_t verdict);
+
+bool rate_training_valid(const uint8_t *message);           // Pattern intact (the frame CRC passed, this catches a frame from another rung that happens to)
+
+void rate_probe_start(void);                                // Before reading the peer's training frames
+
+bool rate_probe_passed(uint8_t good);                       // Enough of the peer's training frames arrived, with corrections within the budget
+
+void rate_step_up_failed(void);                             // A faster rung failed its probe, wait twice as long before the next try
+
+// -------------------------------- SESSION --------------------------------
+
+uint8_t rate_advice(uint8_t ceiling);                       // COM task, once per loop: the rung to move to, rate_current() to stay
@@ -0,0 +1,83 @@
+#include <stdio.h>
+#include <stdatomic.h>
+
+#include "esp_timer.h"
+
+#include "Tools/LinkScheduler.h"
+
+static const char *class_names[LINK_CLASSES] = {
+    "control", "keyboard", "mouse", "output", "bulk"
+};
+
+static const uint32_t bound_us[LINK_CLASSES] = {   // Longest a ready class waits for the classes above it
+    20000,                              // Control: an update every few seconds at most, never delayed long by anything
+    10000,                              // Keyboard: a keystroke within a 100 Hz poll of the computer
+    20000,                              // Mouse: motion merges while it waits, nothing is lost
+    20000,                              // Output: an LED change, the board plugged into the computer sends little else
+    50000                               // Bulk: datastick transfers time out after seconds, only starvation matters
+};
+
+static int64_t ready_since[LINK_CLASSES];   // COM task only: when the class last became ready, 0 while it is not
+static uint8_t overdue_class = CLASS_NONE;  // Class scheduler_pick chose for passing its bound
+static atomic_uint worst_wait[LINK_CLASSES];
+static atomic_uint overdue[LINK_CLASSES];
+
+// -------------------------------- ARBITER --------------------------------
+
+void scheduler_ready(uint8_t class, bool ready) {
+    if (!ready) {
+        ready_since[class] = 0;
+    } else if (ready_since[class] == 0) {
+        ready_since[class] = esp_timer_get_time();
+    }
+}
+
+uint8_t scheduler_pick(void) {
+    int64_t now = esp_timer_get_time();
+    uint8_t first = CLASS_NONE;
+    overdue_class = CLASS_NONE;
+    for (uint8_t class = 0; class < LINK_CLASSES; class++) {
+        if (ready_since[class] == 0) {
+            continue;
+        }
+        if (first == CLASS_NONE) {
+            first = class;
+        } else if (now - ready_since[class] > bound_us[class]) {
+            overdue_class = class;              // Highest overdue class below the first ready one
+            return class;
+        }
+    }
+    return first;
+}
+
+void scheduler_served(uint8_t class) {
+    if (ready_since[class] != 0) {
+        uint32_t wait = esp_timer_get_time() - ready_since[class];
+        unsigned worst = atomic_load_explicit(&worst_wait[class], memory_order_relaxed);
+        if (wait > worst) {
+            atomic_store_explicit(&worst_wait[class], wait, memory_order_relaxed);  // Single writer, no compare and swap needed
+        }
+    }
+    if (class == overdue_class) {
+        atomic_fetch_add_explicit(&overdue[class], 1, memory_order_relaxed);
+    }
+    ready_since[class] = 0;                     // Restarts on the next pass if more is waiting
+}
+
+// -------------------------------- OUTPUT --------------------------------
+
+uint32_t scheduler_worst_wait_us(uint8_t class) {
+    return atomic_load_explicit(&worst_wait[class], memory_order_relaxed);
+}
+
+uint32_t scheduler_overdue(uint8_t class) {
+    return atomic_load_explicit(&overdue[class], memory_order_relaxed);
+}
+
+void scheduler_dump(void) {
+    printf("%-18s %10s %10s %10s\n", "class", "bound us", "worst us", "overdue");
+    for (uint8_t class = 0; class < LINK_CLASSES; class++) {
+        printf("%-18s %10lu %10lu %10lu\n", class_names[class], (unsigned long)bound_us[class],
+               (unsigned long)scheduler_worst_wait_us(class), (unsigned long)scheduler_overdue(class));
+    }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+enum link_classes {         // Traffic classes of the COM transmit path, highest priority first
+    CLASS_CONTROL,              // Updates from usb_to_com_queue, the far side has to enumerate before reports are any use
+    CLASS_KEYBOARD,             // Keyboard reports from the report pool
+    CLASS_MOUSE,                // Merged mouse motion from Tools/MouseCoalescer.h
+    CLASS_OUTPUT,               // Output and feature reports from the computer, Tools/OutputReports.h
+    CLASS_BULK,                 // Datastick messages from Tools/MSCBridge.h
+    LINK_CLASSES,
+    CLASS_NONE = LINK_CLASSES
+};
+
+// Arbiter between the per-class sources of next_outgoing in state_machine_com.c. Each class is served in strict priority
+// order, except that a class which has had a message ready for longer than its latency bound goes first, ahead of the
+// classes above it, for one message. A class that keeps the link busy can therefore delay the ones below it by no more
+// than their bound plus one frame, while a keystroke never waits behind mouse motion or datastick data that was not
+// itself overdue. The UART holds at most one frame behind the one being written (no TX ring buffer), so a frame
+// already handed to the driver delays the next class by one frame time at most.
+
+void scheduler_ready(uint8_t class, bool ready);            // COM task, every pass: whether the class has a message to send
+
+uint8_t scheduler_pick(void);                               // Class to serve next, CLASS_NONE if none is ready
+
+void scheduler_served(uint8_t class);                       // A message of the class was taken, its wait is recorded
+
+// -------------------------------- OUTPUT --------------------------------
+
+uint32_t scheduler_worst_wait_us(uint8_t class);            // Longest a message of the class has waited since power up
+
+uint32_t scheduler_overdue(uint8_t class);                  // Times the class went ahead of a higher one because it passed its bound
+
+void scheduler_dump(void);                                  // Print bound, worst wait and overdue count per class to the console
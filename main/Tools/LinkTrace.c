@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+
+#include "Tools/LinkTrace.h"
+
+#define DUMP_LINE 32                    // Ring bytes per hex line of trace_dump
+
+static uint8_t ring[TRACE_BYTES];
+static size_t tail = 0;                 // Offset of the oldest record
+static size_t used = 0;
+static bool enabled = true;
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;   // Between the tasks recording, and the console copying or dumping
+
+// -------------------------------- HELPERS --------------------------------
+
+static uint8_t peek(size_t offset) {    // Byte offset bytes after the oldest record's start
+    return ring[(tail + offset) % TRACE_BYTES];
+}
+
+static void put(const uint8_t *data, size_t length) {
+    size_t head = (tail + used) % TRACE_BYTES;
+    size_t first = length < TRACE_BYTES - head ? length : TRACE_BYTES - head;
+    memcpy(&ring[head], data, first);
+    memcpy(ring, &data[first], length - first);
+    used += length;
+}
+
+static void get(size_t offset, uint8_t *data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        data[i] = peek(offset + i);
+    }
+}
+
+// -------------------------------- RECORDING --------------------------------
+
+void trace_record(uint8_t type, const uint8_t *payload, uint8_t length) {
+    portENTER_CRITICAL(&lock);
+    if (enabled) {
+        uint32_t time = esp_timer_get_time();   // Taken under the lock so the records of every task are in time order
+        uint8_t header[TRACE_HEADER] = {type, length, time, time >> 8, time >> 16, time >> 24};
+        while (used + TRACE_HEADER + length > TRACE_BYTES) {
+            size_t oldest = TRACE_HEADER + peek(1);
+            tail = (tail + oldest) % TRACE_BYTES;
+            used -= oldest;
+        }
+        put(header, TRACE_HEADER);
+        if (length) {
+            put(payload, length);
+        }
+    }
+    portEXIT_CRITICAL(&lock);
+}
+
+void trace_enable(bool enable) {
+    portENTER_CRITICAL(&lock);
+    enabled = enable;
+    portEXIT_CRITICAL(&lock);
+}
+
+bool trace_enabled(void) {
+    return enabled;
+}
+
+void trace_clear(void) {
+    portENTER_CRITICAL(&lock);
+    tail = 0;
+    used = 0;
+    portEXIT_CRITICAL(&lock);
+}
+
+size_t trace_copy(uint8_t *buffer, size_t length) {
+    portENTER_CRITICAL(&lock);
+    size_t skip = 0;
+    while (used - skip > length) {      // Newest records that fit
+        skip += TRACE_HEADER + peek(skip + 1);
+    }
+    get(skip, buffer, used - skip);
+    size_t copied = used - skip;
+    portEXIT_CRITICAL(&lock);
+    return copied;
+}
+
+// -------------------------------- OUTPUT --------------------------------
+
+void trace_dump(void) {
+    portENTER_CRITICAL(&lock);
+    bool was_enabled = enabled;
+    enabled = false;                    // Nothing moves while the ring is printed, no copy of it needed
+    portEXIT_CRITICAL(&lock);
+    printf("trace %u bytes\n", (unsigned)used);
+    for (size_t line = 0; line < used; line += DUMP_LINE) {
+        for (size_t i = line; i < used && i < line + DUMP_LINE; i++) {
+            printf("%02x", peek(i));
+        }
+        printf("\n");
+    }
+    trace_enable(was_enabled);
+}
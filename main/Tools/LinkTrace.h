@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define TRACE_BYTES        32768                            // RAM ring the records are kept in, the oldest are dropped whole when it fills
+#define TRACE_HEADER       6                                // [type][payload length][time us (4), little endian] in front of every record
+
+// Binary trace of the link for reproducing a stuck key or a cursor jump offline. Every UART byte read is recorded
+// before it is decoded, with each frame it decoded into (or the rejection), the prefix of each frame sent (so the
+// replay drops reflections like the board did) and every COM and USB state transition, timestamped with
+// esp_timer_get_time. Recording is a copy into the ring under a spinlock, cheap enough to stay on. The console dumps
+// the ring as hex ('trace'), host/link_replay.c feeds the UART bytes back through read_frame on a virtual clock and
+// checks it decodes the same frames, then replays the HID reports to show which keys were left held.
+
+enum trace_records {        // Record types, the payload follows the header
+    TRACE_RX,                   // UART bytes as transport_receive returned them
+    TRACE_FRAME,                // Message read_frame decoded from them, then its sequence byte
+    TRACE_REJECT,               // read_frame dropped a frame, no payload
+    TRACE_TX,                   // Codes, length and sequence bytes of a frame sent
+    TRACE_COM_STATE,            // COM state left, then state entered
+    TRACE_USB_STATE             // USB state left, then state entered
+};
+
+void trace_record(uint8_t type, const uint8_t *payload, uint8_t length);   // Any task, payload may be NULL for length 0
+
+void trace_enable(bool enable);                             // On from power up, off keeps the ring as it is
+
+bool trace_enabled(void);
+
+void trace_clear(void);
+
+size_t trace_copy(uint8_t *buffer, size_t length);          // Records oldest first, whole records only, returns the bytes copied
+
+// -------------------------------- OUTPUT --------------------------------
+
+void trace_dump(void);                                      // Print the ring to the console as hex lines, host/link_replay.c --hex reads them back
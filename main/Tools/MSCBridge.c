@@ -0,0 +1,614 @@
+#include <string.h>
+
+#include "esp_log.h"
+
+#include "Tools/MSCBridge.h"
+#include "Tools/USBHostTools.h"
+#include "Tools/StaticMemory.h"
+#include "state_machines.h"
+
+#define MSC_TIMEOUT_MS  300                 // A transfer with no reply and no other MSC traffic for this long is requested again
+#define CHUNKS_PER_BLOCK (MSC_BLOCK_SIZE / MSC_CHUNK_SIZE)
+#define SLOT_MASK       0x07                // Low bits of a tag: slot index (MSC_SLOTS), high bits: generation
+
+static const char *TAG = "MSC BRIDGE";
+
+enum msc_ops {                              // Operation carried by an MSC_REQUEST
+    MSC_OP_INFO,                                // Stick size, answered by an MSC_STATUS carrying the block count
+    MSC_OP_READ,                                // Answered by the blocks as MSC_DATA, or MSC_STATUS on failure
+    MSC_OP_WRITE                                // Followed by the blocks as MSC_DATA, answered by MSC_STATUS
+};
+
+enum msc_statuses {
+    MSC_OK,
+    MSC_FAILED
+};
+
+enum slot_states {
+    SLOT_FREE,
+    SLOT_REQUESTED,                         // Computer side: waiting for the reply (read data or status)
+    SLOT_CACHED,                            // Computer side: read complete, serves the computer until evicted
+    SLOT_FAILED,                            // Computer side: read failed, reported on the next read of its blocks
+    SLOT_FILLING,                           // Computer side: write data being copied in, outside the critical section
+    SLOT_RECEIVING,                         // Stick side: write request received, data arriving
+    SLOT_QUEUED,                            // Stick side: waiting for the worker task
+    SLOT_WORKING,                           // Stick side: worker task is reading or writing the stick
+    SLOT_SENDING                            // Stick side: read data going out
+};
+
+typedef struct {
+    uint8_t state;
+    uint8_t op;
+    uint8_t tag;                            // Slot index | generation, replies with an older tag are ignored
+    uint32_t lba;
+    uint8_t blocks;
+    uint64_t chunks;                        // Chunks received, one bit each
+    uint8_t tx_chunk;                       // Next chunk to send
+    bool request_pending;                   // Computer side: MSC_REQUEST still to send
+    bool status_pending;                    // Stick side: MSC_STATUS still to send
+    uint8_t status;
+    uint32_t value;
+    uint32_t order;                         // Issue order, data for the oldest transfer goes out first
+    TickType_t sent;                        // Computer side: when the request (and write data) finished sending
+    TickType_t used;                        // Computer side: last time the computer read from this slot
+    uint8_t pins;                           // Computer side: reads copying out of this slot, it is not evicted meanwhile
+    uint8_t data[MSC_MAX_BLOCKS * MSC_BLOCK_SIZE];
+} msc_slot_t;
+
+static msc_slot_t slots[MSC_SLOTS];
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t consumer_task = NULL;   // COM task, sends the messages
+static TaskHandle_t worker_task = NULL;     // Stick side: reads and writes the stick
+MEMORY_TASK(worker_memory, "MSC", STACK_MSC);
+static TaskHandle_t reader_task = NULL;     // Computer side: task waiting in msc_bridge_read
+static bool active = false;
+static bool hosting = false;
+static uint8_t generation = 0;
+static uint32_t issued = 0;
+static TickType_t last_progress = 0;        // Last MSC message received, transfers queued behind others are not timed out
+static bool capacity_known = false;
+static uint32_t block_count = 0;
+#define NO_LBA UINT32_MAX
+static uint32_t failed_lba = NO_LBA;        // First block of a write the stick rejected, failed to the computer by the next write or flush
+static uint32_t next_lba = 0;               // Block after the last one the computer read, detects sequential reads
+
+// -------------------------------- HELPERS --------------------------------
+
+static uint8_t chunk_count(const msc_slot_t *slot) {
+    return slot->op == MSC_OP_INFO ? 0 : slot->blocks * CHUNKS_PER_BLOCK;
+}
+
+static uint64_t all_chunks(const msc_slot_t *slot) {
+    uint8_t count = chunk_count(slot);
+    return count == 64 ? UINT64_MAX : ((uint64_t)1 << count) - 1;
+}
+
+static bool covers(const msc_slot_t *slot, uint32_t lba) {
+    return slot->op == MSC_OP_READ && lba >= slot->lba && lba < slot->lba + slot->blocks;
+}
+
+static bool overlaps(const msc_slot_t *slot, uint32_t lba, uint32_t blocks) {
+    return slot->lba < lba + blocks && lba < slot->lba + slot->blocks;
+}
+
+static bool older(const msc_slot_t *slot, const msc_slot_t *than) {
+    return (int32_t)(slot->order - than->order) < 0;
+}
+
+static void put_u32(uint8_t *bytes, uint32_t value) {
+    for (uint8_t i = 0; i < 4; i++) {
+        bytes[i] = value >> (8 * i);
+    }
+}
+
+static uint32_t get_u32(const uint8_t *bytes) {
+    return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+}
+
+static void notify(TaskHandle_t task) {
+    if (task != NULL) {
+        xTaskNotifyGive(task);
+    }
+}
+
+// -------------------------------- COMPUTER SIDE --------------------------------
+
+static msc_slot_t *find_read(uint32_t lba) {                // Slot holding or fetching a block, NULL if there is none
+    for (uint8_t i = 0; i < MSC_SLOTS; i++) {
+        if ((slots[i].state == SLOT_REQUESTED || slots[i].state == SLOT_CACHED || slots[i].state == SLOT_FAILED) && covers(&slots[i], lba)) {
+            return &slots[i];
+        }
+    }
+    return NULL;
+}
+
+static msc_slot_t *allocate(void) {                         // Free slot, or the least recently used cached read, NULL if all are busy
+    msc_slot_t *oldest = NULL;
+    for (uint8_t i = 0; i < MSC_SLOTS; i++) {
+        if (slots[i].state == SLOT_FREE) {
+            return &slots[i];
+        }
+        if (slots[i].state == SLOT_CACHED && slots[i].pins == 0 && (oldest == NULL || (int32_t)(slots[i].used - oldest->used) < 0)) {
+            oldest = &slots[i];
+        }
+    }
+    return oldest;
+}
+
+static void issue(msc_slot_t *slot, uint8_t op, uint32_t lba, uint8_t blocks) {   // (Re)send a request from a slot under a new tag
+    generation++;
+    slot->tag = (slot - slots) | (generation << 3);
+    slot->state = SLOT_REQUESTED;
+    slot->op = op;
+    slot->lba = lba;
+    slot->blocks = blocks;
+    slot->chunks = 0;
+    slot->tx_chunk = 0;
+    slot->request_pending = true;
+    slot->order = issued++;
+    slot->used = xTaskGetTickCount();
+}
+
+static bool fetch(uint32_t lba) {                           // Make sure the transfer holding a block is cached or requested, false if no slot is free
+    if (lba >= block_count || find_read(lba) != NULL) {
+        return true;
+    }
+    msc_slot_t *slot = allocate();
+    if (slot == NULL) {
+        return false;
+    }
+    uint32_t start = lba - lba % MSC_MAX_BLOCKS;            // Transfers are aligned so every block has exactly one
+    uint32_t blocks = block_count - start < MSC_MAX_BLOCKS ? block_count - start : MSC_MAX_BLOCKS;
+    for (uint8_t i = 0; i < MSC_SLOTS; i++) {               // Asked again once the stick acknowledges a write of these blocks, so it never reads them first
+        if (slots[i].state == SLOT_REQUESTED && slots[i].op == MSC_OP_WRITE && overlaps(&slots[i], start, blocks)) {
+            return true;
+        }
+    }
+    issue(slot, MSC_OP_READ, start, blocks);
+    return true;
+}
+
+static uint8_t check_timeouts(void) {                       // Request again anything the stick side never answered, returns how many
+    TickType_t now = xTaskGetTickCount();
+    uint8_t timed_out = 0;
+    for (uint8_t i = 0; i < MSC_SLOTS; i++) {
+        msc_slot_t *slot = &slots[i];
+        bool sending = slot->request_pending || (slot->op == MSC_OP_WRITE && slot->tx_chunk < chunk_count(slot));
+        if (slot->state != SLOT_REQUESTED || sending) {
+            continue;
+        }
+        TickType_t quiet = now - slot->sent < now - last_progress ? now - slot->sent : now - last_progress;
+        if (quiet >= pdMS_TO_TICKS(MSC_TIMEOUT_MS)) {
+            issue(slot, slot->op, slot->lba, slot->blocks);
+            timed_out++;
+        }
+    }
+    return timed_out;
+}
+
+bool msc_bridge_capacity(uint32_t *count) {
+    *count = block_count;
+    return capacity_known;
+}
+
+int32_t msc_bridge_read(uint32_t lba, uint32_t offset, uint8_t *buffer, uint32_t size) {
+    int32_t result = size;
+    msc_slot_t *pinned[MSC_SLOTS];                          // Transfers the read spans, in block order (each cached, so at most one per slot)
+    uint8_t pinned_count = 0;
+    portENTER_CRITICAL(&lock);
+    uint32_t first = lba + offset / MSC_BLOCK_SIZE;
+    uint32_t last = lba + (offset + size - 1) / MSC_BLOCK_SIZE;
+    for (uint32_t block = first; block <= last && result > 0; block++) {
+        if (pinned_count > 0 && covers(pinned[pinned_count - 1], block)) {
+            continue;                                       // Same transfer as the block before
+        }
+        msc_slot_t *slot = find_read(block);
+        if (slot == NULL) {
+            fetch(block);
+            result = 0;
+        } else if (slot->state == SLOT_FAILED) {
+            slot->state = SLOT_FREE;                        // Report the failure once, the next read asks again
+            result = -1;
+        } else if (slot->state == SLOT_REQUESTED) {
+            result = 0;
+        } else {
+            pinned[pinned_count++] = slot;
+        }
+    }
+    for (uint8_t i = 0; i < pinned_count && result > 0; i++) {
+        pinned[i]->pins++;                                  // Copied from outside the critical section
+    }
+    if (result >= 0 && first == next_lba) {                 // Sequential reader, keep transfers in flight ahead of it
+        for (uint32_t ahead = 1; ahead <= MSC_READ_AHEAD; ahead++) {
+            if (!fetch(last - last % MSC_MAX_BLOCKS + ahead * MSC_MAX_BLOCKS)) {
+                break;
+            }
+        }
+    }
+    if (result > 0) {
+        next_lba = last + 1;
+    }
+    reader_task = xTaskGetCurrentTaskHandle();
+    portEXIT_CRITICAL(&lock);
+    notify(consumer_task);
+    if (result == 0) {
+        ulTaskNotifyTake(pdTRUE, 1);                        // Woken when data arrives, so the retry is not a busy loop
+    }
+    if (result <= 0) {
+        return result;
+    }
+    uint32_t done = 0;
+    for (uint8_t i = 0; i < pinned_count; i++) {            // Only the reader's own task evicts or rewrites a cached slot, the pin stops it
+        uint32_t position = lba * MSC_BLOCK_SIZE + offset + done;
+        uint32_t from = position - pinned[i]->lba * MSC_BLOCK_SIZE;
+        uint32_t length = pinned[i]->blocks * MSC_BLOCK_SIZE - from;
+        length = length < size - done ? length : size - done;
+        memcpy(&buffer[done], &pinned[i]->data[from], length);
+        done += length;
+    }
+    portENTER_CRITICAL(&lock);
+    for (uint8_t i = 0; i < pinned_count; i++) {
+        pinned[i]->pins--;
+        pinned[i]->used = xTaskGetTickCount();
+    }
+    portEXIT_CRITICAL(&lock);
+    return result;
+}
+
+int32_t msc_bridge_write(uint32_t lba, uint32_t offset, const uint8_t *buffer, uint32_t size) {
+    if (offset != 0 || size < MSC_BLOCK_SIZE) {             // tinyusb hands over whole blocks with an endpoint buffer of at least one block
+        return -1;
+    }
+    uint32_t blocks = size / MSC_BLOCK_SIZE < MSC_MAX_BLOCKS ? size / MSC_BLOCK_SIZE : MSC_MAX_BLOCKS;
+    portENTER_CRITICAL(&lock);
+    uint32_t failed = failed_lba;
+    failed_lba = NO_LBA;                                    // Reported once
+    if (failed != NO_LBA) {
+        portEXIT_CRITICAL(&lock);
+        ESP_LOGE(TAG, "Failing the write of block %lu, the write of block %lu before it failed.", (unsigned long)lba, (unsigned long)failed);
+        return -1;
+    }
+    for (uint8_t i = 0; i < MSC_SLOTS; i++) {               // Drop cached or in flight reads of the blocks being written
+        msc_slot_t *slot = &slots[i];
+        if ((slot->state == SLOT_REQUESTED || slot->state == SLOT_CACHED || slot->state == SLOT_FAILED) && slot->op == MSC_OP_READ
+            && overlaps(slot, lba, blocks)) {
+            slot->state = SLOT_FREE;
+        }
+    }
+    msc_slot_t *slot = allocate();
+    if (slot != NULL) {
+        slot->state = SLOT_FILLING;                         // Neither allocated nor sent while the data is copied in
+    }
+    reader_task = xTaskGetCurrentTaskHandle();
+    portEXIT_CRITICAL(&lock);
+    if (slot == NULL) {
+        ulTaskNotifyTake(pdTRUE, 1);                        // Woken when a write is acknowledged
+        return 0;
+    }
+    memcpy(slot->data, buffer, blocks * MSC_BLOCK_SIZE);
+    portENTER_CRITICAL(&lock);
+    bool kept = slot->state == SLOT_FILLING;                // Not cleared by msc_bridge_stop meanwhile
+    if (kept) {
+        issue(slot, MSC_OP_WRITE, lba, blocks);
+    }
+    portEXIT_CRITICAL(&lock);
+    if (!kept) {
+        return -1;
+    }
+    notify(consumer_task);
+    return blocks * MSC_BLOCK_SIZE;
+}
+
+bool msc_bridge_flush(int ms_to_wait) {
+    TickType_t start = xTaskGetTickCount();
+    while (1) {
+        bool writing = false;
+        portENTER_CRITICAL(&lock);
+        for (uint8_t i = 0; i < MSC_SLOTS; i++) {
+            writing |= slots[i].state == SLOT_REQUESTED && slots[i].op == MSC_OP_WRITE;
+        }
+        uint32_t failed = failed_lba;
+        if (!writing || !active) {
+            failed_lba = NO_LBA;                            // Reported once
+        }
+        portEXIT_CRITICAL(&lock);
+        if (!writing || !active) {
+            if (failed != NO_LBA) {
+                ESP_LOGE(TAG, "Flush failed, the write of block %lu failed.", (unsigned long)failed);
+            }
+            return failed == NO_LBA;
+        }
+        if (xTaskGetTickCount() - start >= pdMS_TO_TICKS(ms_to_wait)) {
+            return false;
+        }
+        vTaskDelay(1);
+    }
+}
+
+// -------------------------------- STICK SIDE --------------------------------
+
+static bool waits_for_write(const msc_slot_t *read) {       // An older write of the same blocks has not reached the stick yet
+    for (uint8_t i = 0; i < MSC_SLOTS; i++) {
+        const msc_slot_t *slot = &slots[i];
+        bool unwritten = slot->state == SLOT_RECEIVING || slot->state == SLOT_QUEUED || slot->state == SLOT_WORKING;
+        if (unwritten && slot->op == MSC_OP_WRITE && older(slot, read) && overlaps(slot, read->lba, read->blocks)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static msc_slot_t *next_work(void) {                        // Oldest queued transfer the worker can run, in the order the requests arrived
+    msc_slot_t *next = NULL;
+    for (uint8_t i = 0; i < MSC_SLOTS; i++) {
+        msc_slot_t *slot = &slots[i];
+        if (slot->state == SLOT_QUEUED && (next == NULL || older(slot, next)) && !(slot->op == MSC_OP_READ && waits_for_write(slot))) {
+            next = slot;
+        }
+    }
+    return next;
+}
+
+static void msc_worker(void *arg) {                         // Reads and writes the stick, the USB host calls block for the whole transfer
+    while (1) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while (1) {
+            portENTER_CRITICAL(&lock);
+            msc_slot_t *slot = next_work();
+            if (slot == NULL) {                             // Woken again when a write's last chunk arrives or a transfer finishes
+                portEXIT_CRITICAL(&lock);
+                break;
+            }
+            slot->state = SLOT_WORKING;
+            uint8_t tag = slot->tag;
+            uint8_t op = slot->op;
+            uint32_t lba = slot->lba;
+            uint8_t blocks = slot->blocks;
+            portEXIT_CRITICAL(&lock);
+
+            bool ok = true;
+            uint32_t value = 0;
+            uint32_t size = 0;
+            switch (op) {
+                case MSC_OP_INFO:
+                    ok = datastick_info(&value, &size) && size == MSC_BLOCK_SIZE;
+                    if (!ok) {
+                        ESP_LOGW(TAG, "Datastick has %lu byte blocks, only %d byte blocks can be bridged.", (unsigned long)size, MSC_BLOCK_SIZE);
+                    }
+                    break;
+                case MSC_OP_READ:
+                    ok = datastick_read(lba, blocks, slot->data);
+                    break;
+                case MSC_OP_WRITE:
+                    ok = datastick_write(lba, blocks, slot->data);
+                    break;
+            }
+
+            portENTER_CRITICAL(&lock);
+            if (slot->state == SLOT_WORKING && slot->tag == tag) {     // Not replaced by a newer request meanwhile
+                if (op == MSC_OP_READ && ok) {
+                    slot->state = SLOT_SENDING;
+                    slot->tx_chunk = 0;
+                } else {
+                    slot->state = SLOT_FREE;
+                    slot->status = ok ? MSC_OK : MSC_FAILED;
+                    slot->value = value;
+                    slot->status_pending = true;
+                }
+            }
+            portEXIT_CRITICAL(&lock);
+            notify(consumer_task);
+        }
+    }
+}
+
+static void queue_work(msc_slot_t *slot) {
+    slot->state = SLOT_QUEUED;
+}
+
+// -------------------------------- SETUP --------------------------------
+
+void msc_bridge_init(TaskHandle_t consumer) {
+    consumer_task = consumer;
+    worker_task = memory_task_start(&worker_memory, msc_worker, NULL, 2, 0);
+    memory_account("datastick bridge", sizeof(slots));
+}
+
+void msc_bridge_stop(void) {
+    portENTER_CRITICAL(&lock);
+    active = false;
+    for (uint8_t i = 0; i < MSC_SLOTS; i++) {
+        slots[i].state = SLOT_FREE;
+        slots[i].request_pending = false;
+        slots[i].status_pending = false;
+    }
+    capacity_known = false;
+    block_count = 0;
+    failed_lba = NO_LBA;
+    next_lba = 0;
+    portEXIT_CRITICAL(&lock);
+}
+
+void msc_bridge_start(bool stick_side) {
+    msc_bridge_stop();
+    portENTER_CRITICAL(&lock);
+    hosting = stick_side;
+    active = true;
+    last_progress = xTaskGetTickCount();
+    if (!hosting) {
+        issue(&slots[0], MSC_OP_INFO, 0, 0);                // Ask for the size before the computer does
+    }
+    portEXIT_CRITICAL(&lock);
+    notify(consumer_task);
+}
+
+// -------------------------------- LINK --------------------------------
+
+static bool next_message(uint8_t *message, uint8_t *timed_out) {
+    portENTER_CRITICAL(&lock);
+    if (!active) {
+        portEXIT_CRITICAL(&lock);
+        return false;
+    }
+    *timed_out = hosting ? 0 : check_timeouts();  // Logged by the caller, not inside the critical section
+    msc_slot_t *request = NULL;
+    msc_slot_t *data = NULL;
+    for (uint8_t i = 0; i < MSC_SLOTS; i++) {
+        msc_slot_t *slot = &slots[i];
+        if (slot->status_pending) {                         // Replies and requests first, they are short and unblock the far side
+            slot->status_pending = false;
+            message[0] = MSC_STATUS;
+            message[1] = slot->tag;
+            message[2] = slot->status;
+            put_u32(&message[3], slot->value);
+            portEXIT_CRITICAL(&lock);
+            return true;
+        }
+        if (slot->request_pending && (request == NULL || older(slot, request))) {
+            request = slot;                                 // In issue order, the stick side runs them in the order they arrive
+        }
+        bool sending = hosting ? slot->state == SLOT_SENDING : (slot->state == SLOT_REQUESTED && slot->op == MSC_OP_WRITE);
+        if (sending && slot->tx_chunk < chunk_count(slot) && (data == NULL || older(slot, data))) {
+            data = slot;
+        }
+    }
+    if (request != NULL) {                                  // Before any data, a write's chunks follow its request
+        request->request_pending = false;
+        request->sent = xTaskGetTickCount();
+        message[0] = MSC_REQUEST;
+        message[1] = request->op;
+        message[2] = request->tag;
+        put_u32(&message[3], request->lba);
+        message[7] = request->blocks;
+        portEXIT_CRITICAL(&lock);
+        return true;
+    }
+    if (data == NULL) {
+        portEXIT_CRITICAL(&lock);
+        return false;
+    }
+    message[0] = MSC_DATA;                                  // Next chunk of the oldest transfer
+    message[1] = data->tag;
+    message[2] = data->tx_chunk;
+    memcpy(&message[3], &data->data[data->tx_chunk * MSC_CHUNK_SIZE], MSC_CHUNK_SIZE);
+    if (++data->tx_chunk == chunk_count(data)) {
+        if (hosting) {
+            data->state = SLOT_FREE;                        // Read fully sent, the computer side asks again if any of it is lost
+        } else {
+            data->sent = xTaskGetTickCount();               // Write fully sent, the status timeout starts now
+        }
+    }
+    portEXIT_CRITICAL(&lock);
+    return true;
+}
+
+bool msc_bridge_pending(void) {
+    bool pending = false;
+    portENTER_CRITICAL(&lock);
+    for (uint8_t i = 0; active && i < MSC_SLOTS && !pending; i++) {
+        msc_slot_t *slot = &slots[i];
+        bool sending = hosting ? slot->state == SLOT_SENDING : (slot->state == SLOT_REQUESTED && slot->op == MSC_OP_WRITE);
+        pending = slot->status_pending || slot->request_pending || (sending && slot->tx_chunk < chunk_count(slot));
+    }
+    portEXIT_CRITICAL(&lock);
+    return pending;
+}
+
+bool msc_bridge_next(uint8_t *message) {
+    uint8_t timed_out = 0;
+    bool ready = next_message(message, &timed_out);
+    if (timed_out) {
+        ESP_LOGW(TAG, "%d transfer(s) timed out, requesting them again.", timed_out);
+    }
+    return ready;
+}
+
+void msc_bridge_receive(const uint8_t *message) {
+    portENTER_CRITICAL(&lock);
+    if (!active) {
+        portEXIT_CRITICAL(&lock);
+        return;
+    }
+    last_progress = xTaskGetTickCount();
+    bool woke_reader = false;
+    bool woke_worker = false;
+    bool sized = false;
+    uint32_t rejected = NO_LBA;
+    switch (message[0]) {
+        case MSC_REQUEST: {
+            msc_slot_t *slot = &slots[message[2] & SLOT_MASK];
+            if (!hosting || message[1] > MSC_OP_WRITE) {
+                break;
+            }
+            slot->op = message[1];
+            slot->tag = message[2];
+            slot->lba = get_u32(&message[3]);
+            slot->blocks = message[7] < MSC_MAX_BLOCKS ? message[7] : MSC_MAX_BLOCKS;
+            slot->chunks = 0;
+            slot->tx_chunk = 0;
+            slot->status_pending = false;
+            slot->order = issued++;
+            if (slot->op == MSC_OP_WRITE) {
+                slot->state = SLOT_RECEIVING;
+            } else {
+                queue_work(slot);
+                woke_worker = true;
+            }
+            break;
+        }
+        case MSC_DATA: {
+            msc_slot_t *slot = &slots[message[1] & SLOT_MASK];
+            bool expected = hosting ? slot->state == SLOT_RECEIVING : (slot->state == SLOT_REQUESTED && slot->op == MSC_OP_READ);
+            if (!expected || slot->tag != message[1] || message[2] >= chunk_count(slot)) {
+                break;                                      // Stale or corrupt, the timeout recovers whatever is missing
+            }
+            memcpy(&slot->data[message[2] * MSC_CHUNK_SIZE], &message[3], MSC_CHUNK_SIZE);
+            slot->chunks |= (uint64_t)1 << message[2];
+            if (slot->chunks == all_chunks(slot)) {
+                if (hosting) {
+                    queue_work(slot);
+                    woke_worker = true;
+                } else {
+                    slot->state = SLOT_CACHED;
+                    woke_reader = true;
+                }
+            }
+            break;
+        }
+        case MSC_STATUS: {
+            msc_slot_t *slot = &slots[message[1] & SLOT_MASK];
+            if (hosting || slot->state != SLOT_REQUESTED || slot->tag != message[1]) {
+                break;
+            }
+            bool ok = message[2] == MSC_OK;
+            if (slot->op == MSC_OP_INFO && ok) {
+                block_count = get_u32(&message[3]);
+                capacity_known = true;
+                sized = true;
+            } else if (slot->op == MSC_OP_WRITE && !ok) {
+                rejected = slot->lba;
+                failed_lba = failed_lba == NO_LBA ? rejected : failed_lba;  // The first failure is the one reported
+            }
+            if (slot->op == MSC_OP_INFO && !ok) {
+                slot->sent = last_progress;                 // Stick not ready or not bridgeable, ask again after the timeout
+            } else {
+                slot->state = slot->op == MSC_OP_READ && !ok ? SLOT_FAILED : SLOT_FREE;
+            }
+            woke_reader = true;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&lock);
+    if (sized) {
+        ESP_LOGI(TAG, "Datastick has %lu blocks.", (unsigned long)block_count);
+    }
+    if (rejected != NO_LBA) {
+        ESP_LOGW(TAG, "The stick rejected the write of block %lu.", (unsigned long)rejected);
+    }
+    if (woke_reader) {
+        notify(reader_task);
+    }
+    if (woke_worker) {
+        notify(worker_task);
+    }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "freertos/FreeRTOS.h"
+
+#define MSC_BLOCK_SIZE   512                                // Only sticks with 512 byte blocks are bridged
+#define MSC_MAX_BLOCKS   4                                  // Blocks per transfer
+#define MSC_SLOTS        8                                  // Transfers in flight or cached (the slot index is the low bits of the tag)
+#define MSC_READ_AHEAD   4                                  // Transfers requested ahead of a sequential reader
+#define MSC_CHUNK_SIZE   64                                 // Block bytes carried by one MSC_DATA message (fits MAX_FRAME_PAYLOAD)
+
+#define MSC_REQUEST_LENGTH 8                                // [MSC_REQUEST][op][tag][lba x4][blocks]
+#define MSC_DATA_LENGTH    (3 + MSC_CHUNK_SIZE)             // [MSC_DATA][tag][chunk][data]
+#define MSC_STATUS_LENGTH  7                                // [MSC_STATUS][tag][status][value x4]
+
+// Bridges a USB mass storage device across the link. The board hosting the stick serves block requests from it,
+// the board plugged into the computer enumerates as a mass storage device and turns SCSI reads and writes into requests.
+// Each transfer of up to MSC_MAX_BLOCKS blocks streams as MSC_DATA chunks, several transfers are in flight at once,
+// completed reads stay in their slot as a read-ahead cache and writes are acknowledged to the computer once queued.
+// That early acknowledgement is a write-behind cache: a write the stick rejects fails the computer's next write or
+// flush (SYNCHRONIZE CACHE, eject) instead, and its first block is logged.
+// A read of blocks with a write still in flight is requested once the write is acknowledged, and the stick side runs
+// transfers in the order their requests arrived, a read never before an older write of its blocks.
+// Transfers without a reply within MSC_TIMEOUT_MS are requested again, every request is idempotent.
+
+void msc_bridge_init(TaskHandle_t consumer);                // Consumer (COM task) is notified whenever a message is ready to send
+
+void msc_bridge_start(bool hosting);                        // Begin bridging as the stick side (hosting) or the computer side
+
+void msc_bridge_stop(void);                                 // Drop every transfer, received messages are ignored until the next start
+
+// -------------------------------- LINK (COM TASK) --------------------------------
+
+bool msc_bridge_pending(void);                              // True if msc_bridge_next has a message to fill (timed out transfers aside)
+
+bool msc_bridge_next(uint8_t *message);                     // Fill the next MSC message to send, false if there is nothing to send
+
+void msc_bridge_receive(const uint8_t *message);            // Hand over a received MSC_REQUEST, MSC_DATA or MSC_STATUS message
+
+// -------------------------------- COMPUTER SIDE (TINYUSB CALLBACKS) --------------------------------
+
+bool msc_bridge_capacity(uint32_t *block_count);            // False until the stick side has reported its size
+
+int32_t msc_bridge_read(uint32_t lba, uint32_t offset, uint8_t *buffer, uint32_t size);         // Bytes copied, 0 if not here yet (retry), -1 on error
+
+int32_t msc_bridge_write(uint32_t lba, uint32_t offset, const uint8_t *buffer, uint32_t size);  // Bytes queued, 0 if no slot is free (retry), -1 on error or an earlier write failing
+
+bool msc_bridge_flush(int ms_to_wait);                      // Wait for every queued write to be acknowledged, false on timeout or a write failing since the last report
@@ -0,0 +1,132 @@
+#include "esp_timer.h"
+
+#include "Tools/MouseCoalescer.h"
+#include "Tools/LatencyTools.h"
+#include "Tools/StaticMemory.h"
+#include "state_machines.h"
+
+#define IDLE_GAP_US 100000                  // Gaps between mouse reports longer than this are the mouse resting, not its polling interval
+
+typedef struct {                            // One run of reports from one mouse with the same buttons
+    uint8_t channel;
+    uint8_t buttons;
+    int32_t x;                                  // Summed displacement not sent yet
+    int32_t y;
+    int32_t wheel;
+    int64_t capture_time;                       // Capture time of the oldest report in the run, for the latency trace
+} mouse_event_t;
+
+static mouse_event_t events[COALESCE_EVENTS];
+static uint8_t first = 0;                   // Index of the oldest event
+static uint8_t count = 0;
+static uint32_t dropped = 0;                // Reports that found every event taken and no run of their own to join
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t consumer_task = NULL;
+
+static int64_t last_capture = 0;            // Producer: capture time of the previous report
+static int64_t input_us = 0;                // Producer: smoothed interval between mouse reports
+static int64_t link_us = 0;                 // Consumer: smoothed time to transmit one mouse report
+
+// -------------------------------- HELPERS --------------------------------
+
+static int8_t saturate(int32_t value) {
+    return value > INT8_MAX ? INT8_MAX : (value < INT8_MIN ? INT8_MIN : value);
+}
+
+static void smooth(int64_t *average, int64_t sample) {
+    *average = *average ? *average + (sample - *average) / 8 : sample;
+}
+
+// -------------------------------- SETUP --------------------------------
+
+void coalesce_init(TaskHandle_t consumer) {
+    consumer_task = consumer;
+    memory_account("mouse coalescer", sizeof(events));
+}
+
+// -------------------------------- PRODUCER --------------------------------
+
+void coalesce_mouse_report(uint8_t channel, const usb_mouse_report_t *report, int64_t capture_time) {
+    portENTER_CRITICAL(&lock);
+    if (last_capture != 0 && capture_time - last_capture < IDLE_GAP_US) {
+        smooth(&input_us, capture_time - last_capture);
+    }
+    last_capture = capture_time;
+    mouse_event_t *run = count ? &events[(first + count - 1) % COALESCE_EVENTS] : NULL;
+    if (count == COALESCE_EVENTS) {                         // Full: only the mouse's own latest run can take it, and only with the same buttons
+        run = NULL;
+        for (uint8_t i = count; i > 0 && run == NULL; i--) {
+            mouse_event_t *event = &events[(first + i - 1) % COALESCE_EVENTS];
+            if (event->channel == channel) {
+                run = event->buttons == report->buttons ? event : NULL;
+                break;
+            }
+        }
+        if (run == NULL) {                                  // Merging would add motion to another mouse or lose a press or release
+            dropped++;
+            portEXIT_CRITICAL(&lock);
+            return;
+        }
+    } else if (run == NULL || run->buttons != report->buttons || run->channel != channel) {
+        run = &events[(first + count) % COALESCE_EVENTS];   // Start a new event, the button change keeps its place in the order
+        *run = (mouse_event_t){.channel = channel, .buttons = report->buttons, .capture_time = capture_time};
+        count++;
+    }
+    run->x += report->x_displacement;
+    run->y += report->y_displacement;
+    run->wheel += report->wheel;
+    portEXIT_CRITICAL(&lock);
+    if (consumer_task != NULL) {
+        xTaskNotifyGive(consumer_task);
+    }
+}
+
+// -------------------------------- CONSUMER --------------------------------
+
+bool coalesce_pending(void) {
+    return count != 0;
+}
+
+bool coalesce_batching(void) {
+    portENTER_CRITICAL(&lock);
+    bool batching = link_us > input_us;
+    portEXIT_CRITICAL(&lock);
+    return batching;
+}
+
+bool coalesce_take(uint8_t *message) {
+    portENTER_CRITICAL(&lock);
+    if (count == 0) {
+        portEXIT_CRITICAL(&lock);
+        return false;
+    }
+    mouse_event_t *event = &events[first];
+    usb_mouse_report_t *report = (usb_mouse_report_t *)&message[2];
+    message[0] = REPORT_MOUSE;
+    message[1] = event->channel;
+    report->buttons = event->buttons;
+    report->x_displacement = saturate(event->x);
+    report->y_displacement = saturate(event->y);
+    report->wheel = saturate(event->wheel);
+    event->x -= report->x_displacement;                     // Carry whatever did not fit
+    event->y -= report->y_displacement;
+    event->wheel -= report->wheel;
+    int64_t capture_time = event->capture_time;
+    if (event->x == 0 && event->y == 0 && event->wheel == 0) {
+        first = (first + 1) % COALESCE_EVENTS;              // Fully sent, later reports start a new event
+        count--;
+    } else {
+        event->capture_time = esp_timer_get_time();         // The carry is traced from now on
+    }
+    portEXIT_CRITICAL(&lock);
+    latency_report_coalesced(capture_time);
+    return true;
+}
+
+void coalesce_link_time(int64_t us) {
+    smooth(&link_us, us);
+}
+
+uint32_t coalesce_dropped(void) {
+    return dropped;
+}
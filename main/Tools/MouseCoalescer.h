@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "Tools/USBDeviceTools.h"
+
+#define COALESCE_EVENTS 8                                   // Button transitions held while the link is behind (a ninth is dropped, see coalesce_dropped)
+
+// Coalescing stage between mouse_callback and the COM task. Motion is summed while the link is busy so none is lost,
+// each run of reports from the same mouse (channel) with the same buttons becomes one event, and the events go out in order. Sums that do not fit
+// an int8 report are sent saturated and the remainder carries into the next report.
+
+void coalesce_init(TaskHandle_t consumer);                 // Consumer is notified whenever a mouse report is added
+
+// -------------------------------- PRODUCER (HID HOST CALLBACK) --------------------------------
+
+void coalesce_mouse_report(uint8_t channel, const usb_mouse_report_t *report, int64_t capture_time);
+
+// -------------------------------- CONSUMER (COM TASK) --------------------------------
+
+bool coalesce_pending(void);                               // True if there is motion or a button change to send
+
+bool coalesce_batching(void);                              // True if the link is slower than the mouse, hold each report until the transmitter is idle
+
+bool coalesce_take(uint8_t *message);                      // Fill a REPORT_MOUSE message (channel and report) with the oldest event, false if nothing is pending
+
+void coalesce_link_time(int64_t us);                       // Time one mouse report took to transmit, drives coalesce_batching
+
+uint32_t coalesce_dropped(void);                           // Reports dropped with every event taken: another mouse's or a button change, never merged
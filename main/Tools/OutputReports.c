@@ -0,0 +1,145 @@
+#include <string.h>
+
+#include "esp_log.h"
+
+#include "Tools/OutputReports.h"
+#include "Tools/USBHostTools.h"
+#include "Tools/StaticMemory.h"
+#include "state_machines.h"
+
+static const char *TAG = "OUTPUT";
+
+typedef struct {                            // A report waiting to cross the link or to reach the device
+    uint8_t channel;
+    uint8_t type;
+    uint8_t id;
+    uint8_t length;
+    uint8_t data[OUTPUT_MAX_DATA];
+} output_report_t;
+
+typedef struct {                            // Reports in the order they arrived
+    output_report_t reports[OUTPUT_SLOTS];
+    uint8_t first;                              // Index of the oldest report
+    uint8_t count;
+} output_ring_t;
+
+static output_ring_t outgoing;              // Computer side: queued by tinyusb, taken by the COM task
+static output_ring_t incoming;              // Device side: received by the COM or RX task, delivered by the USB task
+static uint32_t dropped = 0;
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+static TaskHandle_t consumer_task = NULL;
+
+// -------------------------------- HELPERS --------------------------------
+
+static bool put(output_ring_t *ring, uint8_t channel, uint8_t type, uint8_t id, const uint8_t *data, uint8_t length) {   // Under the lock, false if every slot is waiting
+    output_report_t *report = NULL;
+    for (uint8_t i = 0; i < ring->count && report == NULL; i++) {  // Only the latest LED state or feature setting matters, it keeps the older one's place
+        output_report_t *waiting = &ring->reports[(ring->first + i) % OUTPUT_SLOTS];
+        if (waiting->channel == channel && waiting->type == type && waiting->id == id) {
+            report = waiting;
+        }
+    }
+    if (report == NULL && ring->count == OUTPUT_SLOTS) {
+        return false;
+    }
+    if (report == NULL) {
+        report = &ring->reports[(ring->first + ring->count++) % OUTPUT_SLOTS];
+    }
+    *report = (output_report_t){.channel = channel, .type = type, .id = id, .length = length};
+    memcpy(report->data, data, length);
+    return true;
+}
+
+static bool take(output_ring_t *ring, output_report_t *report) {
+    portENTER_CRITICAL(&lock);
+    bool taken = ring->count > 0;
+    if (taken) {
+        *report = ring->reports[ring->first];
+        ring->first = (ring->first + 1) % OUTPUT_SLOTS;
+        ring->count--;
+    }
+    portEXIT_CRITICAL(&lock);
+    return taken;
+}
+
+static void drop(const char *reason, uint8_t channel) {
+    portENTER_CRITICAL(&lock);
+    dropped++;
+    portEXIT_CRITICAL(&lock);
+    ESP_LOGW(TAG, "Dropped a report for channel %d: %s.", channel, reason);
+}
+
+// -------------------------------- SETUP --------------------------------
+
+void output_init(TaskHandle_t consumer) {
+    consumer_task = consumer;
+    memory_account("output reports", sizeof(outgoing) + sizeof(incoming));
+}
+
+// -------------------------------- COMPUTER SIDE --------------------------------
+
+void output_queue(uint8_t channel, uint8_t type, uint8_t id, const uint8_t *data, uint16_t length) {
+    if (length > OUTPUT_MAX_DATA) {
+        drop("too long for the link", channel);
+        return;
+    }
+    portENTER_CRITICAL(&lock);
+    bool queued = put(&outgoing, channel, type, id, data, length);
+    portEXIT_CRITICAL(&lock);
+    if (!queued) {
+        drop("every slot waiting", channel);
+        return;
+    }
+    if (consumer_task != NULL) {
+        xTaskNotifyGive(consumer_task);
+    }
+}
+
+// -------------------------------- LINK --------------------------------
+
+bool output_pending(void) {
+    return outgoing.count > 0;
+}
+
+bool output_next(uint8_t *message) {
+    output_report_t report;
+    if (!take(&outgoing, &report)) {
+        return false;
+    }
+    message[0] = OUTPUT_REPORT;
+    message[1] = report.channel;
+    message[2] = report.type;
+    message[3] = report.id;
+    message[4] = report.length;
+    memcpy(&message[5], report.data, report.length);
+    return true;
+}
+
+void output_receive(const uint8_t *message) {
+    if (message[1] >= HID_CHANNELS || message[4] > OUTPUT_MAX_DATA) {
+        return;
+    }
+    portENTER_CRITICAL(&lock);
+    bool queued = put(&incoming, message[1], message[2], message[3], &message[5], message[4]);
+    portEXIT_CRITICAL(&lock);
+    if (!queued) {
+        drop("every slot waiting for the device", message[1]);
+        return;
+    }
+    usb_event(USB_EVENT_OUTPUT);
+}
+
+// -------------------------------- DEVICE SIDE --------------------------------
+
+void output_deliver(void) {
+    output_report_t report;
+    while (take(&incoming, &report)) {
+        if (!send_output_report_to_device(report.channel, report.type, report.id, report.data, report.length)) {
+            drop("no device took it", report.channel);
+        }
+    }
+}
+
+uint32_t output_dropped(void) {
+    return dropped;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "freertos/FreeRTOS.h"
+
+#include "Tools/LinkARQ.h"
+
+#define OUTPUT_SLOTS     4                                  // Reports waiting on either side (a newer one for the same channel, type and ID replaces a waiting one)
+#define OUTPUT_MAX_DATA  (ARQ_MAX_MESSAGE - 5)              // Longest report carried, the ARQ window holds the whole message, longer ones are dropped
+#define OUTPUT_REPORT_LENGTH(data_length) (5 + (data_length))   // [OUTPUT_REPORT][channel][type][id][length][data]
+
+// Back-channel for the reports a computer sends to a HID device: keyboard LEDs (output reports) and feature reports.
+// tinyusb's SET_REPORT callback queues them for the channel behind the interface, the COM task sends them as reliable
+// OUTPUT_REPORT messages in a traffic class of their own, so they go out between the heartbeats of the board plugged into
+// the computer and never ahead of the far side's input reports. The hosting board's receiver copies them out and wakes
+// the USB task, which passes them on with a SET_REPORT control transfer: the RX task and the HID callbacks never wait
+// on one. GET_REPORT is answered at once by tinyusb and cannot wait for the link, only the telemetry feature report is.
+
+void output_init(TaskHandle_t consumer);                    // Consumer (COM task) is notified whenever a report is queued
+
+// -------------------------------- COMPUTER SIDE (TINYUSB CALLBACK) --------------------------------
+
+void output_queue(uint8_t channel, uint8_t type, uint8_t id, const uint8_t *data, uint16_t length);    // type is a hid_report_type_t
+
+// -------------------------------- LINK (COM TASK) --------------------------------
+
+bool output_pending(void);                                  // True if output_next has a report to send
+
+bool output_next(uint8_t *message);                         // Fill an OUTPUT_REPORT message with the oldest queued report, false if none is
+
+void output_receive(const uint8_t *message);                // Hand over a received OUTPUT_REPORT, the USB task is woken to deliver it
+
+// -------------------------------- DEVICE SIDE (USB TASK) --------------------------------
+
+void output_deliver(void);                                  // Pass every received report to the hosted device on its channel
+
+uint32_t output_dropped(void);                              // Reports dropped: too long, every slot waiting, or no device on the channel
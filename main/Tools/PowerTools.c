@@ -0,0 +1,148 @@
+#include <stdio.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#ifdef ESP_PLATFORM
+#include "esp_pm.h"
+#endif
+
+#include "Tools/PowerTools.h"
+#include "Tools/Transport.h"
+#include "Tools/LatencyTools.h"
+
+static const char *TAG = "POWER";
+
+static int64_t last_traffic = 0;                // When a message from or for the USB side last crossed the link
+static int64_t idle_since = 0;                  // When the current idle period started
+static bool idle = false;
+static bool capped = false;                     // Wakes broke WAKE_CAP_MS, power saving stays off until power up
+static uint32_t idle_total_ms = 0;              // Closed idle periods
+static volatile bool usb_active = false;
+static volatile bool peer_sleeps = true;        // Until the peer's first ACK says otherwise
+static int64_t last_sent = 0;                   // When the last frame was written
+static uint32_t bursts = 0;
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;   // Between the COM task and the RX task, both carry traffic
+
+#if defined(ESP_PLATFORM) && CONFIG_PM_ENABLE
+static esp_pm_lock_handle_t sleep_lock = NULL;  // ESP_PM_NO_LIGHT_SLEEP, held while anything is on a USB port or once capped
+#endif
+
+// -------------------------------- HELPERS --------------------------------
+
+static void hold_off_sleep(bool hold) {
+#if defined(ESP_PLATFORM) && CONFIG_PM_ENABLE
+    if (hold) {
+        esp_pm_lock_acquire(sleep_lock);
+    } else {
+        esp_pm_lock_release(sleep_lock);
+    }
+#endif
+}
+
+static bool wakes_too_slow(void) {              // Median of the measured wakes over the cap
+    return latency_samples(LATENCY_WAKE) >= WAKE_SAMPLES && latency_percentile_us(LATENCY_WAKE, 500) > WAKE_CAP_MS * 1000;
+}
+
+static bool update_idle(int64_t now) {          // Under the lock, returns whether the link is idle now
+    if (!POWER_SAVE || capped) {
+        return false;
+    }
+    bool was_idle = idle;
+    idle = now - last_traffic >= IDLE_AFTER_MS * 1000LL;
+    if (idle && !was_idle) {
+        idle_since = last_traffic + IDLE_AFTER_MS * 1000LL;
+    } else if (!idle && was_idle) {
+        idle_total_ms += (uint32_t)((now - idle_since) / 1000);
+    }
+    return idle;
+}
+
+// -------------------------------- STATE --------------------------------
+
+void power_init(void) {
+#if defined(ESP_PLATFORM) && CONFIG_PM_ENABLE
+    ESP_ERROR_CHECK(esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "power", &sleep_lock));
+    esp_pm_config_t config = {
+        .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+        .min_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,    // No frequency scaling, the link UART runs from the APB clock to reach 5 Mbaud
+        .light_sleep_enable = POWER_SAVE,
+    };
+    ESP_ERROR_CHECK(esp_pm_configure(&config));
+#endif
+    last_traffic = esp_timer_get_time();        // Power up counts as traffic, the first HELLOs go out at the active rate
+}
+
+void power_usb_active(bool active) {
+    if (active != usb_active && !capped) {      // Once capped the lock is held for good
+        hold_off_sleep(active);
+    }
+    usb_active = active;
+}
+
+bool power_traffic(void) {
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&lock);
+    bool woke = update_idle(now);
+    last_traffic = now;
+    update_idle(now);
+    portEXIT_CRITICAL(&lock);
+    return woke;
+}
+
+bool power_idle(void) {
+    if (POWER_SAVE && !capped && wakes_too_slow()) {
+        ESP_LOGW(TAG, "First reports after idle take over %d ms, power saving off.", WAKE_CAP_MS);
+        power_traffic();                        // Close the idle period, if any
+        capped = true;
+        if (!usb_active) {
+            hold_off_sleep(true);
+        }
+    }
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&lock);
+    bool result = update_idle(now);
+    portEXIT_CRITICAL(&lock);
+    return result;
+}
+
+bool power_sleeps(void) {
+    return POWER_SAVE && !capped && !usb_active;
+}
+
+// -------------------------------- PEER --------------------------------
+
+void power_peer_sleeps(bool sleeps) {
+    peer_sleeps = sleeps;
+}
+
+void power_before_transmit(void) {              // Also with POWER_SAVE off, the peer may have it on
+    int64_t now = esp_timer_get_time();
+    if (peer_sleeps && now - last_sent >= PEER_QUIET_MS * 1000LL) {
+        transport_wake_peer(PEER_WAKE_MS);
+        bursts++;
+        now = esp_timer_get_time();
+    }
+    last_sent = now;
+}
+
+// -------------------------------- OUTPUT --------------------------------
+
+uint32_t power_wake_bursts(void) {
+    return bursts;
+}
+
+uint32_t power_idle_ms(void) {
+    int64_t now = esp_timer_get_time();
+    portENTER_CRITICAL(&lock);
+    uint32_t total = idle_total_ms + (update_idle(now) ? (uint32_t)((now - idle_since) / 1000) : 0);
+    portEXIT_CRITICAL(&lock);
+    return total;
+}
+
+void power_dump(void) {
+    printf("power saving %s, light sleep %s\n", !POWER_SAVE ? "off" : (capped ? "off (wakes over the cap)" : "on"),
+           power_sleeps() ? "allowed" : "held off");
+    printf("link %s, idle %lu ms since power up\n", power_idle() ? "idle" : "active", (unsigned long)power_idle_ms());
+    printf("peer %s, %lu wake bursts sent\n", peer_sleeps ? "may sleep" : "awake", (unsigned long)bursts);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define POWER_SAVE       1                                  // Set to 0 to never light sleep and keep the heartbeat and BACKOFF at their active periods
+#define IDLE_AFTER_MS    5000                               // The link is idle once no message from or for the USB side has crossed it for this long
+#define PEER_QUIET_MS    20                                 // A peer that may sleep is woken before a frame if nothing was sent to it for this long (its idle task sleeps after 30 ms)
+#define PEER_WAKE_MS     2                                  // Time a peer's UART takes to come out of light sleep after the wake burst
+#define WAKE_CAP_MS      10                                 // Power saving turns itself off if the first reports after idle periods take longer than this end to end
+#define WAKE_SAMPLES     4                                  // Wakes measured before their median is held to WAKE_CAP_MS
+#define POWER_SLEEPS     0x80                               // Power byte of an ACK: the sender may light sleep between frames, the low bits hold its heartbeat period
+
+// Low-power idle. With POWER_SAVE the CPU enters automatic light sleep whenever every task is blocked, woken by its
+// timers or by edges on the link UART's RX pin. Light sleep stops the USB peripheral, so the USB task holds it off
+// whenever anything is on either port: only a board with nothing plugged in sleeps, and tinyusb only sees a computer
+// plugged into it once the board next wakes (within a BACKOFF listen or USB_POLL_MS). The bytes that wake a UART are
+// lost, so a frame to a peer that may be asleep is preceded by a wake burst and PEER_WAKE_MS of silence. Every ACK
+// tells the peer whether the sender may sleep and which heartbeat period it uses, that period and the BACKOFF listens
+// lengthen once the link is idle, and the peer waits twice the announced period before it declares the link lost.
+// The end to end time of the first report after an idle period is its own latency stage ('latency' wake), if their
+// median breaks WAKE_CAP_MS the board stops sleeping and going idle until it powers up again.
+
+void power_init(void);                                      // app_main, before the tasks start: automatic light sleep and the locks that hold it off
+
+void power_usb_active(bool active);                         // USB task on every state change, light sleep is held off while true
+
+bool power_traffic(void);                                   // COM task, a message from or for the USB side crossed the link, true if it ended an idle period
+
+bool power_idle(void);                                      // No traffic for IDLE_AFTER_MS, never with power saving off
+
+bool power_sleeps(void);                                    // This board may be in light sleep between frames, what its ACKs announce
+
+// -------------------------------- PEER --------------------------------
+
+void power_peer_sleeps(bool sleeps);                        // From the peer's ACK, true whenever a session starts or resumes (its state is unknown)
+
+void power_before_transmit(void);                           // Before every frame: a peer that may be asleep and heard nothing for PEER_QUIET_MS is woken first
+
+// -------------------------------- OUTPUT --------------------------------
+
+uint32_t power_wake_bursts(void);                           // Wake bursts sent since power up
+
+uint32_t power_idle_ms(void);                               // Time the link spent idle since power up
+
+void power_dump(void);                                      // Print the power state, the time idle and the wakes to the console
@@ -0,0 +1,177 @@
+#include <string.h>
+
+#include "esp_timer.h"
+
+#include "Tools/ReportCodec.h"
+#include "Tools/LatencyTools.h"
+#include "Tools/USBDeviceTools.h"
+#include "state_machines.h"
+
+#define KEYS_SNAPSHOT  7                    // ups count of a REPORT_KEYS message listing every key held
+#define META_CHANNEL   0x03
+#define MOTION_FIELDS  4                    // Presence bits from bit 2: buttons, x, y, wheel, the order of usb_mouse_report_t
+
+static usb_keyboard_report_t sent[HID_CHANNELS];        // Sender: the last report of each keyboard, what the far side holds once the ARQ delivers it
+static int64_t snapshot_at[HID_CHANNELS];               // Sender: when each keyboard's last whole report was sent, 0 for none this session
+static usb_keyboard_report_t received[HID_CHANNELS];    // Receiver: each keyboard's state as the deltas rebuild it
+
+// -------------------------------- HELPERS --------------------------------
+
+static uint8_t held_keys(const usb_keyboard_report_t *report, uint8_t *keys) {  // Nonzero keycodes in report order, returns how many
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < sizeof(report->keycodes); i++) {
+        if (report->keycodes[i]) {
+            keys[count++] = report->keycodes[i];
+        }
+    }
+    return count;
+}
+
+static bool contains(const uint8_t *keys, uint8_t count, uint8_t key) {
+    return memchr(keys, key, count) != NULL;
+}
+
+static uint8_t difference(const uint8_t *from, uint8_t from_count, const uint8_t *without, uint8_t without_count, uint8_t *keys) {
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < from_count; i++) {
+        if (!contains(without, without_count, from[i])) {
+            keys[count++] = from[i];
+        }
+    }
+    return count;
+}
+
+static bool repeats(const uint8_t *keys, uint8_t count) { // Phantom state, every slot ErrorRollOver, which a set of keys cannot express
+    for (uint8_t i = 1; i < count; i++) {
+        if (contains(keys, i, keys[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void place_trailer(uint8_t *message, uint8_t from, uint8_t to) {  // Move the latency trailer from offset from to offset to
+    uint8_t trailer[LATENCY_TRAILER_LEN + 1];       // + 1, the trailer may be compiled out
+    memcpy(trailer, &message[from], LATENCY_TRAILER_LEN);
+    memcpy(&message[to], trailer, LATENCY_TRAILER_LEN);
+}
+
+static void compact_keyboard(uint8_t *message) {
+    uint8_t channel = message[1] & META_CHANNEL;
+    usb_keyboard_report_t report;
+    memcpy(&report, &message[2], sizeof(report));
+    uint8_t now[6], before[6], downs[6], ups[6];
+    uint8_t now_count = held_keys(&report, now);
+    uint8_t before_count = held_keys(&sent[channel], before);
+    uint8_t down_count = difference(now, now_count, before, before_count, downs);
+    uint8_t up_count = difference(before, before_count, now, now_count, ups);
+    int64_t time = esp_timer_get_time();
+    bool snapshot = snapshot_at[channel] == 0 || time - snapshot_at[channel] >= REPORT_SNAPSHOT_MS * 1000LL
+                    || repeats(now, now_count) || down_count + up_count >= now_count;  // A whole report is no longer than that delta
+    if (snapshot) {
+        memcpy(downs, now, now_count);
+        down_count = now_count;
+        up_count = KEYS_SNAPSHOT;
+        snapshot_at[channel] = time;
+    }
+    sent[channel] = report;
+    message[0] = REPORT_KEYS;
+    message[1] = channel | down_count << 2 | up_count << 5;
+    message[2] = report.modifier;
+    memcpy(&message[3], downs, down_count);
+    if (!snapshot) {
+        memcpy(&message[3 + down_count], ups, up_count);
+    }
+}
+
+static void compact_mouse(uint8_t *message) {
+    uint8_t fields[MOTION_FIELDS];
+    memcpy(fields, &message[2], MOTION_FIELDS);
+    uint8_t meta = message[1] & META_CHANNEL;
+    uint8_t length = 2;
+    for (uint8_t i = 0; i < MOTION_FIELDS; i++) {
+        if (fields[i]) {
+            meta |= 1 << (2 + i);
+            message[length++] = fields[i];
+        }
+    }
+    message[0] = REPORT_MOTION;
+    message[1] = meta;
+}
+
+static void expand_keyboard(uint8_t *message) {
+    uint8_t channel = message[1] & META_CHANNEL;
+    uint8_t down_count = (message[1] >> 2) & 0x07;
+    uint8_t up_count = message[1] >> 5;
+    const uint8_t *downs = &message[3];
+    usb_keyboard_report_t *state = &received[channel];
+    uint8_t keys[6 + 7];                            // Held keys and up to 7 downs the meta byte can count
+    uint8_t count = 0;
+    if (up_count != KEYS_SNAPSHOT) {                // Keys still held keep their order, new ones go after them
+        uint8_t held[6];
+        uint8_t held_count = held_keys(state, held);
+        count = difference(held, held_count, &downs[down_count], up_count, keys);
+    }
+    for (uint8_t i = 0; i < down_count; i++) {
+        if (up_count == KEYS_SNAPSHOT || !contains(keys, count, downs[i])) {
+            keys[count++] = downs[i];
+        }
+    }
+    memset(state, 0, sizeof(*state));
+    state->modifier = message[2];
+    memcpy(state->keycodes, keys, count < sizeof(state->keycodes) ? count : sizeof(state->keycodes));
+    place_trailer(message, report_compact_length(message), 2 + sizeof(*state));
+    message[0] = REPORT_KEYBOARD;
+    message[1] = channel;
+    memcpy(&message[2], state, sizeof(*state));
+}
+
+static void expand_mouse(uint8_t *message) {
+    uint8_t meta = message[1];
+    uint8_t fields[MOTION_FIELDS] = {0};
+    uint8_t length = 2;
+    for (uint8_t i = 0; i < MOTION_FIELDS; i++) {
+        if (meta & (1 << (2 + i))) {
+            fields[i] = message[length++];
+        }
+    }
+    place_trailer(message, length, 2 + MOTION_FIELDS);
+    message[0] = REPORT_MOUSE;
+    message[1] = meta & META_CHANNEL;
+    memcpy(&message[2], fields, MOTION_FIELDS);
+}
+
+// -------------------------------- CODEC --------------------------------
+
+void report_codec_reset(void) {
+    memset(snapshot_at, 0, sizeof(snapshot_at));
+}
+
+uint8_t report_compact_length(const uint8_t *message) {
+    uint8_t meta = message[1];
+    if (message[0] == REPORT_KEYS) {
+        uint8_t ups = meta >> 5;
+        return 3 + ((meta >> 2) & 0x07) + (ups == KEYS_SNAPSHOT ? 0 : ups);
+    }
+    uint8_t length = 2;
+    for (uint8_t i = 0; i < MOTION_FIELDS; i++) {
+        length += (meta >> (2 + i)) & 1;
+    }
+    return length;
+}
+
+void report_compact(uint8_t *message) {
+    if (message[0] == REPORT_KEYBOARD) {
+        compact_keyboard(message);
+    } else if (message[0] == REPORT_MOUSE) {
+        compact_mouse(message);
+    }
+}
+
+void report_expand(uint8_t *message) {
+    if (message[0] == REPORT_KEYS) {
+        expand_keyboard(message);
+    } else if (message[0] == REPORT_MOTION) {
+        expand_mouse(message);
+    }
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+
+#define REPORT_SNAPSHOT_MS 1000                             // A keyboard's report is sent whole if its last whole one is older than this
+
+// Compact wire forms of the HID reports, made by the COM task just before a report enters the ARQ window and turned
+// back into the full report just before it is delivered. Both are [header][meta][fields][latency trailer]:
+//   REPORT_KEYS   meta = channel | downs << 2 | ups << 5, then the modifier, the keycodes pressed and the keycodes
+//                 released since the channel's previous report. ups == KEYS_SNAPSHOT instead lists every key held.
+//                 The ARQ delivers these in order, so the far side's state is always the last report sent. A whole
+//                 report goes first in every session and at least every REPORT_SNAPSHOT_MS, in case the far side restarted.
+//   REPORT_MOTION meta = channel | one presence bit per field (buttons, x, y, wheel), then the nonzero fields. No state.
+
+void report_codec_reset(void);                              // New session: the next report of every keyboard is sent whole
+
+uint8_t report_compact_length(const uint8_t *message);      // Header to last field of a REPORT_KEYS or REPORT_MOTION message, read from its meta byte
+
+void report_compact(uint8_t *message);                      // REPORT_KEYBOARD or REPORT_MOUSE to its compact form in place, before the trailer is stamped
+
+void report_expand(uint8_t *message);                       // A received compact report back to the full report, trailer included, others are left alone
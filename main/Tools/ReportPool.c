@@ -0,0 +1,96 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "Tools/ReportPool.h"
+#include "Tools/Telemetry.h"
+#include "Tools/StaticMemory.h"
+
+typedef struct {                        // Single producer single consumer ring of slot indices
+    uint8_t index[REPORT_SLOTS];
+    atomic_uint head;                       // Written by the producer only
+    atomic_uint tail;                       // Written by the consumer only
+} index_ring_t;
+
+static uint8_t slots[REPORT_SLOTS][REPORT_SLOT_SIZE];
+static index_ring_t free_ring;          // COM task -> HID host callback
+static index_ring_t ready_ring[2];      // HID host callback -> COM task (keyboard and other, mouse)
+static TaskHandle_t consumer_task = NULL;
+static atomic_uint dropped;
+
+// -------------------------------- HELPERS --------------------------------
+
+static void ring_push(index_ring_t *ring, uint8_t index) {     // Never full, a ring can hold every slot
+    unsigned head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    ring->index[head % REPORT_SLOTS] = index;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+static bool ring_pop(index_ring_t *ring, uint8_t *index) {
+    unsigned tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail == atomic_load_explicit(&ring->head, memory_order_acquire)) {
+        return false;
+    }
+    *index = ring->index[tail % REPORT_SLOTS];
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+static uint8_t index_of(const uint8_t *slot) {
+    return (slot - &slots[0][0]) / REPORT_SLOT_SIZE;
+}
+
+// -------------------------------- SETUP --------------------------------
+
+void report_pool_init(TaskHandle_t consumer) {
+    consumer_task = consumer;
+    memory_account("report pool", sizeof(slots) + sizeof(free_ring) + sizeof(ready_ring));
+    for (uint8_t i = 0; i < REPORT_SLOTS; i++) {
+        ring_push(&free_ring, i);
+    }
+}
+
+// -------------------------------- PRODUCER --------------------------------
+
+uint8_t *report_pool_claim(void) {
+    uint8_t index;
+    if (!ring_pop(&free_ring, &index)) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return NULL;
+    }
+    return slots[index];
+}
+
+void report_pool_unclaim(uint8_t *slot) {                       // Undo the pop, the free ring's producer never writes the entry behind its tail
+    unsigned tail = atomic_load_explicit(&free_ring.tail, memory_order_relaxed) - 1;
+    free_ring.index[tail % REPORT_SLOTS] = index_of(slot);
+    atomic_store_explicit(&free_ring.tail, tail, memory_order_release);
+}
+
+static unsigned ready_count(const index_ring_t *ring) {
+    return atomic_load_explicit(&ring->head, memory_order_relaxed) - atomic_load_explicit(&ring->tail, memory_order_relaxed);
+}
+
+void report_pool_publish(uint8_t *slot, bool mouse) {
+    ring_push(&ready_ring[mouse], index_of(slot));
+    telemetry_high_water(TELEMETRY_REPORT_POOL, ready_count(&ready_ring[0]) + ready_count(&ready_ring[1]));
+    xTaskNotifyGive(consumer_task);
+}
+
+// -------------------------------- CONSUMER --------------------------------
+
+bool report_pool_pending(bool mouse) {
+    return atomic_load_explicit(&ready_ring[mouse].tail, memory_order_relaxed) != atomic_load_explicit(&ready_ring[mouse].head, memory_order_acquire);
+}
+
+uint8_t *report_pool_take(bool mouse) {
+    uint8_t index;
+    return ring_pop(&ready_ring[mouse], &index) ? slots[index] : NULL;
+}
+
+void report_pool_release(uint8_t *slot) {
+    ring_push(&free_ring, index_of(slot));
+}
+
+uint32_t report_pool_dropped(void) {
+    return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
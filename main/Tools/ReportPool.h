@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "freertos/FreeRTOS.h"
+
+#define REPORT_SLOTS     16                                 // Reports in flight between the HID host callbacks and the COM task (power of two)
+#define REPORT_SLOT_SIZE 80                                 // A whole frame payload: header, channel, length, a 64 byte raw report and its trailers, encoded in place
+
+// Preallocated report slots passed by index through lock-free single producer single consumer rings:
+// the HID host callback (core 0) claims a free slot, reads the report straight into it and publishes it,
+// the COM task (core 1) takes it, stamps and encodes it in place and releases it back to the free ring.
+// Mouse reports are published to a ready ring of their own, so a keystroke waiting on the ARQ window never holds them up.
+
+void report_pool_init(TaskHandle_t consumer);               // Fill the free ring, consumer is notified whenever a report is published
+
+// -------------------------------- PRODUCER (HID HOST CALLBACK) --------------------------------
+
+uint8_t *report_pool_claim(void);                           // Free slot to fill, NULL if every slot is in flight (the report is dropped)
+
+void report_pool_publish(uint8_t *slot, bool mouse);        // Hand a filled slot to the consumer and wake it, mouse: for the mouse class
+
+void report_pool_unclaim(uint8_t *slot);                    // Give back the slot just claimed without publishing it (the report could not be read)
+
+// -------------------------------- CONSUMER (COM TASK) --------------------------------
+
+bool report_pool_pending(bool mouse);                       // True if a published slot is waiting for report_pool_take
+
+uint8_t *report_pool_take(bool mouse);                      // Oldest published slot, NULL if there is none
+
+void report_pool_release(uint8_t *slot);                    // Return a slot once it has been transmitted
+
+uint32_t report_pool_dropped(void);                         // Reports dropped because no slot was free
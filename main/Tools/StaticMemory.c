@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "esp_system.h"
+
+#include "Tools/StaticMemory.h"
+
+enum entry_kinds {
+    ENTRY_TASK,
+    ENTRY_QUEUE,
+    ENTRY_BUFFER
+};
+
+typedef struct {                            // One line of the report
+    uint8_t kind;
+    const char *name;
+    size_t bytes;
+    TaskHandle_t task;                          // ENTRY_TASK only, for its high-water mark
+} entry_t;
+
+static entry_t entries[MEMORY_ENTRIES];
+static uint8_t entry_count = 0;
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;
+
+#ifdef ESP_PLATFORM
+extern int _data_start, _data_end, _bss_start, _bss_end;    // Internal RAM sections, from the ESP-IDF linker script
+#endif
+
+// -------------------------------- HELPERS --------------------------------
+
+static void add_entry(uint8_t kind, const char *name, size_t bytes, TaskHandle_t task) {   // An entry of the same name is replaced
+    portENTER_CRITICAL(&lock);
+    uint8_t i = 0;
+    while (i < entry_count && strcmp(entries[i].name, name) != 0) {
+        i++;
+    }
+    if (i < MEMORY_ENTRIES) {
+        entries[i].kind = kind;
+        entries[i].name = name;
+        entries[i].bytes = bytes;
+        entries[i].task = task;
+        entry_count = i == entry_count ? entry_count + 1 : entry_count;
+    }
+    portEXIT_CRITICAL(&lock);
+}
+
+// -------------------------------- CREATION --------------------------------
+
+TaskHandle_t memory_task_start(memory_task_t *task, TaskFunction_t function, void *arg, UBaseType_t priority, BaseType_t core) {
+    if (task->handle != NULL) {
+        return task->handle;
+    }
+#if STATIC_MEMORY
+    task->handle = xTaskCreateStaticPinnedToCore(function, task->name, task->stack_bytes / sizeof(StackType_t), arg, priority,
+                                                 task->stack, task->control, core);
+    add_entry(ENTRY_TASK, task->name, task->stack_bytes + sizeof(StaticTask_t), task->handle);
+#else
+    xTaskCreatePinnedToCore(function, task->name, task->stack_bytes, arg, priority, &task->handle, core);
+    add_entry(ENTRY_TASK, task->name, task->stack_bytes, task->handle);
+#endif
+    configASSERT(task->handle != NULL);
+    return task->handle;
+}
+
+QueueHandle_t memory_queue_create(memory_queue_t *queue) {
+    if (queue->handle != NULL) {
+        return queue->handle;
+    }
+#if STATIC_MEMORY
+    queue->handle = xQueueCreateStatic(queue->length, queue->item_size, queue->storage, queue->control);
+    add_entry(ENTRY_QUEUE, queue->name, queue->length * queue->item_size + sizeof(StaticQueue_t), NULL);
+#else
+    queue->handle = xQueueCreate(queue->length, queue->item_size);
+    add_entry(ENTRY_QUEUE, queue->name, queue->length * queue->item_size, NULL);
+#endif
+    configASSERT(queue->handle != NULL);
+    return queue->handle;
+}
+
+QueueSetHandle_t memory_queue_set_create(memory_queue_t *set) {
+    if (set->handle != NULL) {
+        return set->handle;
+    }
+#if STATIC_MEMORY
+    set->handle = xQueueGenericCreateStatic(set->length, set->item_size, set->storage, set->control, queueQUEUE_TYPE_SET);  // What xQueueCreateSet does, on static storage
+    add_entry(ENTRY_QUEUE, set->name, set->length * set->item_size + sizeof(StaticQueue_t), NULL);
+#else
+    set->handle = xQueueCreateSet(set->length);
+    add_entry(ENTRY_QUEUE, set->name, set->length * set->item_size, NULL);
+#endif
+    configASSERT(set->handle != NULL);
+    return set->handle;
+}
+
+void memory_account(const char *subsystem, size_t bytes) {
+    add_entry(ENTRY_BUFFER, subsystem, bytes, NULL);
+}
+
+// -------------------------------- OUTPUT --------------------------------
+
+void memory_report(void) {
+    static const char *kind_names[] = {"task", "queue", "buffer"};
+    size_t totals[3] = {0};
+    printf("%-8s %-20s %8s %12s\n", "kind", "name", "bytes", "stack free");
+    for (uint8_t i = 0; i < entry_count; i++) {
+        entry_t *entry = &entries[i];
+        totals[entry->kind] += entry->bytes;
+        if (entry->kind == ENTRY_TASK) {
+            printf("%-8s %-20s %8u %12u\n", kind_names[entry->kind], entry->name, (unsigned)entry->bytes,
+                   (unsigned)uxTaskGetStackHighWaterMark(entry->task));     // Lowest free stack since the task started
+        } else {
+            printf("%-8s %-20s %8u\n", kind_names[entry->kind], entry->name, (unsigned)entry->bytes);
+        }
+    }
+    printf("tasks and queues %u bytes (%s), buffers %u bytes\n", (unsigned)(totals[ENTRY_TASK] + totals[ENTRY_QUEUE]),
+           STATIC_MEMORY ? "static" : "heap", (unsigned)totals[ENTRY_BUFFER]);
+#ifdef ESP_PLATFORM
+    size_t sections = ((char *)&_data_end - (char *)&_data_start) + ((char *)&_bss_end - (char *)&_bss_start);
+    printf("data + bss %u bytes\n", (unsigned)sections);      // Everything static, the firmware's and ESP-IDF's
+#endif
+    printf("heap free %u bytes, lowest %u\n", (unsigned)esp_get_free_heap_size(), (unsigned)esp_get_minimum_free_heap_size());
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+#define STATIC_MEMORY  1                                    // Set to 0 to take task stacks and queue storage from the heap instead
+#define MEMORY_ENTRIES 24                                   // Tasks, queues and buffers the RAM report can list
+
+#define STACK_USB_SM   4096                                 // Task stacks in bytes, trim them to the high-water marks 'memory' prints
+#define STACK_COM_SM   4096
+#define STACK_COM_RX   4096
+#define STACK_MSC      4096
+#define STACK_USB_LIB  4096
+
+// Fixed footprint. With STATIC_MEMORY the stack and control block of every task and the storage of every queue are
+// static arrays declared with MEMORY_TASK and MEMORY_QUEUE next to their user, so the footprint is known at link time
+// and thousands of plug cycles can neither fragment nor leak the heap. Either way each task and queue is created once
+// and kept. Module buffers (report slots, ARQ windows, the trace ring...) are static already, their init functions
+// account them with memory_account so 'memory' lists RAM per subsystem. The USB drivers' tasks, the UART driver's
+// rings and the console come from the heap inside ESP-IDF, the heap line of the report shows what they take.
+
+typedef struct {
+    const char *name;
+    uint32_t stack_bytes;
+    StackType_t *stack;                                         // NULL without STATIC_MEMORY
+    StaticTask_t *control;
+    TaskHandle_t handle;                                        // Set once created
+} memory_task_t;
+
+typedef struct {
+    const char *name;
+    UBaseType_t length;
+    UBaseType_t item_size;
+    uint8_t *storage;                                           // NULL without STATIC_MEMORY
+    StaticQueue_t *control;
+    QueueHandle_t handle;                                       // Set once created
+} memory_queue_t;
+
+#if STATIC_MEMORY
+#define MEMORY_TASK(var, name, bytes)                                               \
+    static StackType_t var##_stack[(bytes) / sizeof(StackType_t)];                  \
+    static StaticTask_t var##_control;                                              \
+    static memory_task_t var = {name, bytes, var##_stack, &var##_control, NULL}
+#define MEMORY_QUEUE(var, name, length, item_size)                                  \
+    static uint8_t var##_storage[(length) * (item_size)];                           \
+    static StaticQueue_t var##_control;                                             \
+    static memory_queue_t var = {name, length, item_size, var##_storage, &var##_control, NULL}
+#else
+#define MEMORY_TASK(var, name, bytes)               static memory_task_t var = {name, bytes, NULL, NULL, NULL}
+#define MEMORY_QUEUE(var, name, length, item_size)  static memory_queue_t var = {name, length, item_size, NULL, NULL, NULL}
+#endif
+
+TaskHandle_t memory_task_start(memory_task_t *task, TaskFunction_t function, void *arg, UBaseType_t priority, BaseType_t core);   // Later calls return the running task
+
+QueueHandle_t memory_queue_create(memory_queue_t *queue);   // Later calls return the same queue
+
+QueueSetHandle_t memory_queue_set_create(memory_queue_t *set);  // A queue set holding length events, item_size sizeof(QueueSetMemberHandle_t)
+
+void memory_account(const char *subsystem, size_t bytes);   // Static buffers of a subsystem, once from its init function
+
+// -------------------------------- OUTPUT --------------------------------
+
+void memory_report(void);                                   // Print RAM per task, queue and subsystem, stack high-water marks and the heap
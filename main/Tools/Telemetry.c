@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <stdatomic.h>
+
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+
+#include "Tools/Telemetry.h"
+#include "Tools/UARTTools.h"
+#include "Tools/LinkARQ.h"
+#include "Tools/ReportPool.h"
+
+#define REPORT_VERSION 2                // First byte of the feature report, bumped whenever its layout changes
+
+typedef struct {                        // One period of the history
+    uint32_t time_ms;                       // Time the period ended
+    uint32_t length_ms;
+    uint32_t count[TELEMETRY_COUNTERS];     // Gained during the period
+    uint8_t mark[TELEMETRY_MARKS];          // Highest level during the period
+} sample_t;
+
+static const char *counter_names[TELEMETRY_COUNTERS] = {
+    "frames_received", "bits_corrected", "frames_rejected", "uncorrectable", "link_timeouts", "backoff_entries", "rate_changes",
+    "retransmissions",
+    "bytes_sent", "bytes_received", "reports_sent", "reports_received", "reports_dropped"
+};
+
+static const char *mark_names[TELEMETRY_MARKS] = {
+    "report_pool", "usb_to_com", "com_to_usb", "arq_window"
+};
+
+static atomic_uint counters[TELEMETRY_COUNTERS];
+static atomic_uint period_marks[TELEMETRY_MARKS];  // Reset when a period closes
+static atomic_uint peak_marks[TELEMETRY_MARKS];    // Highest of the closed periods
+
+static sample_t history[TELEMETRY_SAMPLES];
+static uint8_t history_next = 0;
+static uint8_t history_count = 0;
+static uint32_t last_total[TELEMETRY_COUNTERS];    // COM task: totals when the current period started
+static int64_t period_start = 0;
+static portMUX_TYPE lock = portMUX_INITIALIZER_UNLOCKED;   // Between the COM task closing a period and the console reading the ring
+
+// -------------------------------- HELPERS --------------------------------
+
+static void raise(atomic_uint *mark, uint32_t level) {
+    unsigned high = atomic_load_explicit(mark, memory_order_relaxed);
+    while (level > high && !atomic_compare_exchange_weak_explicit(mark, &high, level, memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+static uint32_t rate(uint32_t count, uint32_t length_ms) {
+    return length_ms ? (uint64_t)count * 1000 / length_ms : 0;
+}
+
+static void put_u32(uint8_t *buffer, uint32_t value) {
+    for (uint8_t i = 0; i < 4; i++) {
+        buffer[i] = value >> (8*i);
+    }
+}
+
+// -------------------------------- COUNTERS --------------------------------
+
+void telemetry_count(uint8_t counter, uint32_t n) {
+    atomic_fetch_add_explicit(&counters[counter], n, memory_order_relaxed);
+}
+
+void telemetry_high_water(uint8_t mark, uint32_t level) {
+    raise(&period_marks[mark], level);
+}
+
+uint32_t telemetry_total(uint8_t counter) {
+    switch (counter) {                  // Counters their modules already keep are read from them, not counted twice
+        case TELEMETRY_BITS_CORRECTED:  return bits_corrected();
+        case TELEMETRY_FRAMES_REJECTED: return frames_rejected();
+        case TELEMETRY_RETRANSMISSIONS: return arq_retransmissions();
+        case TELEMETRY_REPORTS_DROPPED: return report_pool_dropped();
+        default:                        return atomic_load_explicit(&counters[counter], memory_order_relaxed);
+    }
+}
+
+uint32_t telemetry_peak(uint8_t mark) {
+    uint32_t period = atomic_load_explicit(&period_marks[mark], memory_order_relaxed);
+    uint32_t peak = atomic_load_explicit(&peak_marks[mark], memory_order_relaxed);
+    return period > peak ? period : peak;
+}
+
+void telemetry_sample(void) {
+    int64_t now = esp_timer_get_time();
+    if (now - period_start < (int64_t)TELEMETRY_PERIOD_MS * 1000) {
+        return;
+    }
+    sample_t sample = {.time_ms = now / 1000, .length_ms = (now - period_start) / 1000};
+    for (uint8_t counter = 0; counter < TELEMETRY_COUNTERS; counter++) {
+        uint32_t total = telemetry_total(counter);
+        sample.count[counter] = total - last_total[counter];
+        last_total[counter] = total;
+    }
+    for (uint8_t mark = 0; mark < TELEMETRY_MARKS; mark++) {
+        uint32_t high = atomic_exchange_explicit(&period_marks[mark], 0, memory_order_relaxed);
+        raise(&peak_marks[mark], high);
+        sample.mark[mark] = high > UINT8_MAX ? UINT8_MAX : high;
+    }
+    if (period_start == 0) {            // The first call only starts the first period
+        period_start = now;
+        return;
+    }
+    period_start = now;
+    portENTER_CRITICAL(&lock);
+    history[history_next] = sample;
+    history_next = (history_next + 1) % TELEMETRY_SAMPLES;
+    history_count += history_count < TELEMETRY_SAMPLES;
+    portEXIT_CRITICAL(&lock);
+}
+
+// -------------------------------- OUTPUT --------------------------------
+
+void telemetry_dump(void) {
+    sample_t last = {0};
+    portENTER_CRITICAL(&lock);
+    if (history_count) {
+        last = history[(history_next + TELEMETRY_SAMPLES - 1) % TELEMETRY_SAMPLES];
+    }
+    portEXIT_CRITICAL(&lock);
+    printf("%-18s %10s %10s\n", "counter", "total", "last /s");
+    for (uint8_t counter = 0; counter < TELEMETRY_COUNTERS; counter++) {
+        printf("%-18s %10lu %10lu\n", counter_names[counter], (unsigned long)telemetry_total(counter),
+               (unsigned long)rate(last.count[counter], last.length_ms));
+    }
+    printf("%-18s %10s %10s\n", "queue", "peak", "last");
+    for (uint8_t mark = 0; mark < TELEMETRY_MARKS; mark++) {
+        printf("%-18s %10lu %10u\n", mark_names[mark], (unsigned long)telemetry_peak(mark), last.mark[mark]);
+    }
+    uint32_t received = telemetry_total(TELEMETRY_BYTES_RECEIVED);
+    if (received) {                     // One correction per codeword or block, close to one bit each at a usable error rate
+        printf("estimated ber: %.2e\n", (double)telemetry_total(TELEMETRY_BITS_CORRECTED) / (8.0 * received));
+    }
+}
+
+void telemetry_dump_history(void) {
+    sample_t ring[TELEMETRY_SAMPLES];
+    portENTER_CRITICAL(&lock);
+    uint8_t count = history_count;
+    for (uint8_t i = 0; i < count; i++) {
+        ring[i] = history[(history_next + TELEMETRY_SAMPLES - count + i) % TELEMETRY_SAMPLES];
+    }
+    portEXIT_CRITICAL(&lock);
+    printf("%10s %8s %8s %6s %6s %6s %6s %6s %6s %6s %4s %4s %4s %4s\n", "time ms", "tx B/s", "rx B/s", "tx r/s", "rx r/s",
+           "corr", "rej", "uncor", "retx", "tmo", "pool", "u>c", "c>u", "arq");
+    for (uint8_t i = 0; i < count; i++) {
+        sample_t *s = &ring[i];
+        printf("%10lu %8lu %8lu %6lu %6lu %6lu %6lu %6lu %6lu %6lu %4u %4u %4u %4u\n", (unsigned long)s->time_ms,
+               (unsigned long)rate(s->count[TELEMETRY_BYTES_SENT], s->length_ms),
+               (unsigned long)rate(s->count[TELEMETRY_BYTES_RECEIVED], s->length_ms),
+               (unsigned long)rate(s->count[TELEMETRY_REPORTS_SENT], s->length_ms),
+               (unsigned long)rate(s->count[TELEMETRY_REPORTS_RECEIVED], s->length_ms),
+               (unsigned long)s->count[TELEMETRY_BITS_CORRECTED], (unsigned long)s->count[TELEMETRY_FRAMES_REJECTED],
+               (unsigned long)s->count[TELEMETRY_UNCORRECTABLE], (unsigned long)s->count[TELEMETRY_RETRANSMISSIONS],
+               (unsigned long)s->count[TELEMETRY_LINK_TIMEOUTS], s->mark[TELEMETRY_REPORT_POOL],
+               s->mark[TELEMETRY_USB_TO_COM], s->mark[TELEMETRY_COM_TO_USB], s->mark[TELEMETRY_ARQ_WINDOW]);
+    }
+}
+
+uint16_t telemetry_report(uint8_t *buffer, uint16_t length) {
+    if (length < TELEMETRY_REPORT_LENGTH) {
+        return 0;
+    }
+    buffer[0] = REPORT_VERSION;
+    put_u32(&buffer[1], esp_timer_get_time() / 1000);
+    for (uint8_t counter = 0; counter < TELEMETRY_COUNTERS; counter++) {
+        put_u32(&buffer[5 + 4*counter], telemetry_total(counter));
+    }
+    for (uint8_t mark = 0; mark < TELEMETRY_MARKS; mark++) {
+        uint32_t peak = telemetry_peak(mark);
+        buffer[5 + 4*TELEMETRY_COUNTERS + mark] = peak > UINT8_MAX ? UINT8_MAX : peak;
+    }
+    return TELEMETRY_REPORT_LENGTH;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+
+#define TELEMETRY_FEATURE_REPORT 0                          // Set to 1 to also serve the totals as a vendor feature report on the first keyboard interface
+#define TELEMETRY_REPORT_ID      2                          // Feature report ID on that interface (the keyboard report becomes ID 1)
+#define TELEMETRY_PERIOD_MS      1000                       // Counters are sampled into the history at least this far apart
+#define TELEMETRY_SAMPLES        32                         // Periods kept in the history ring
+
+// Link health counters cheap enough to stay on in production: every event is one relaxed atomic add or a compare and
+// swap for a high-water mark, nothing is logged. The COM task calls telemetry_sample once per loop, at most every
+// TELEMETRY_PERIOD_MS it moves what each counter gained and the highest mark reached into a ring of TELEMETRY_SAMPLES
+// periods, read by the console ('link') and, with TELEMETRY_FEATURE_REPORT, by a GET_REPORT from the computer.
+
+enum telemetry_counters {   // Events counted since power up
+    TELEMETRY_FRAMES_RECEIVED,  // Frames that passed the CRC, reflections included
+    TELEMETRY_BITS_CORRECTED,   // Errors the FEC corrected (kept by Tools/UARTTools.c)
+    TELEMETRY_FRAMES_REJECTED,  // Frames dropped by the CRC or length check (kept by Tools/UARTTools.c)
+    TELEMETRY_UNCORRECTABLE,    // Frame bodies with more errors than their code corrects
+    TELEMETRY_LINK_TIMEOUTS,    // Times the link stopped answering for two heartbeat periods
+    TELEMETRY_BACKOFF_ENTRIES,  // Times the COM state machine fell back to BACKOFF to handshake again
+    TELEMETRY_RATE_CHANGES,     // Times the UART baud rate was changed (Tools/LinkRate.h)
+    TELEMETRY_RETRANSMISSIONS,  // Reliable messages sent again (kept by Tools/LinkARQ.c)
+    TELEMETRY_BYTES_SENT,       // UART bytes written
+    TELEMETRY_BYTES_RECEIVED,   // UART bytes read, reflections and garbage included
+    TELEMETRY_REPORTS_SENT,     // New HID reports framed for the link
+    TELEMETRY_REPORTS_RECEIVED, // HID reports passed to the USB task
+    TELEMETRY_REPORTS_DROPPED,  // HID reports lost for want of a report slot (kept by Tools/ReportPool.c)
+    TELEMETRY_COUNTERS
+};
+
+enum telemetry_marks {      // Queue depths, the highest level seen is kept per period and since power up
+    TELEMETRY_REPORT_POOL,      // Report slots published but not yet taken by the COM task
+    TELEMETRY_USB_TO_COM,       // Messages waiting in usb_to_com_queue
+    TELEMETRY_COM_TO_USB,       // Messages waiting in com_to_usb_queue and com_to_usb_mouse_queue
+    TELEMETRY_ARQ_WINDOW,       // Reliable messages unacknowledged
+    TELEMETRY_MARKS
+};
+
+#define TELEMETRY_REPORT_LENGTH (5 + 4*TELEMETRY_COUNTERS + TELEMETRY_MARKS) // [version][uptime ms (4)][counters (4 each)][marks (1 each)], little endian
+
+void telemetry_count(uint8_t counter, uint32_t n);          // Any task or callback
+
+void telemetry_high_water(uint8_t mark, uint32_t level);    // Any task or callback, after the queue grew
+
+uint32_t telemetry_total(uint8_t counter);                  // Count since power up
+
+uint32_t telemetry_peak(uint8_t mark);                      // Highest level since power up, the current period included
+
+void telemetry_sample(void);                                // COM task, once per loop, closes the period once TELEMETRY_PERIOD_MS have passed
+
+// -------------------------------- OUTPUT --------------------------------
+
+void telemetry_dump(void);                                  // Print the totals, the last period's rates and the estimated bit error rate to the console
+
+void telemetry_dump_history(void);                          // Print one line per period in the ring, oldest first
+
+uint16_t telemetry_report(uint8_t *buffer, uint16_t length);    // Fill the feature report, returns the bytes written
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Hardware abstraction for the optical link transport.
+// On the boards this is the UART in Tools/TransportUART.c, on Linux it is the simulated channel in host/sim/TransportSim.c.
+// The USB side is abstracted the same way by Tools/USBDeviceTools.h and Tools/USBHostTools.h.
+
+void transport_init(int baud_rate);                                 // Bring up the link at the given baud rate
+
+void transport_set_baud(int baud_rate);                             // Change the rate once everything written has left, bytes still buffered are dropped
+
+void transport_write(const uint8_t *data, size_t length);           // Queue bytes for transmission, returns once they are accepted
+
+int transport_receive(uint8_t *data, size_t length, int ms_to_wait); // Wait for received bytes, returns up to length of them as soon as any are there, 0 on timeout
+
+void transport_cancel_receive(void);                                // Make the transport_receive waiting in another task (or the next one) return 0 at once
+
+void transport_wait_tx_done(int ms_to_wait);                        // Block until the transmitter is idle (or the timeout expires)
+
+void transport_wake_peer(int ms_to_wake);                           // Send a burst that wakes the peer from light sleep (and is lost), then stay silent while it wakes
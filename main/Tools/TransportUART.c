@@ -0,0 +1,88 @@
+#include "driver/uart.h"
+#include "freertos/queue.h"
+#include "esp_sleep.h"
+#include "esp_rom_sys.h"
+
+#include "Tools/Transport.h"
+
+#define UART_PORT UART_NUM_1
+#define TX_PIN    17
+#define RX_PIN    18
+#define RX_BUFFER_SIZE     1024
+#define EVENT_QUEUE_LENGTH 16
+#define RX_FULL_THRESHOLD  16       // FIFO bytes that raise a data event while bytes keep arriving (default 120 would hold back a streamed frame)
+#define RX_TIMEOUT_SYMBOLS 2        // Idle byte times after the last byte that raise a data event, frames have no end marker to detect
+#define TX_DRAIN_MS        100      // Longest a rate change waits for the transmitter, a full FIFO takes 12 ms at 115200 baud
+#define CANCEL_EVENT       UART_EVENT_MAX   // Posted to the event queue by transport_cancel_receive, never raised by the driver
+#define WAKE_THRESHOLD     3        // RX rising edges that wake the chip from light sleep, the fewest the UART counts
+#define WAKE_BYTE          0x55     // Five rising edges per byte, start and stop bits included
+#define WAKE_BURST         2        // Wake bytes sent, either one alone crosses the threshold
+
+static QueueHandle_t uart_events = NULL;
+
+void transport_init(int baud_rate) {
+    const uart_config_t uart_config = {
+        .baud_rate = baud_rate,
+        .data_bits = UART_DATA_8_BITS,
+        .parity    = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE
+    };
+    uart_driver_install(UART_PORT, RX_BUFFER_SIZE, 0, EVENT_QUEUE_LENGTH, &uart_events, 0);
+    uart_param_config(UART_PORT, &uart_config);
+    uart_set_pin(UART_PORT, TX_PIN, RX_PIN, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+    uart_set_rx_full_threshold(UART_PORT, RX_FULL_THRESHOLD);
+    uart_set_rx_timeout(UART_PORT, RX_TIMEOUT_SYMBOLS);
+    uart_set_wakeup_threshold(UART_PORT, WAKE_THRESHOLD);   // Only used once power management enables light sleep (Tools/PowerTools.h)
+    esp_sleep_enable_uart_wakeup(UART_PORT);
+}
+
+void transport_set_baud(int baud_rate) {
+    uart_wait_tx_done(UART_PORT, pdMS_TO_TICKS(TX_DRAIN_MS));
+    uart_set_baudrate(UART_PORT, baud_rate);
+    uart_flush_input(UART_PORT);            // Anything half received was at the old rate
+}
+
+void transport_write(const uint8_t *data, size_t length) {
+    uart_write_bytes(UART_PORT, (const char *)data, length);
+}
+
+int transport_receive(uint8_t *data, size_t length, int ms_to_wait) {
+    TickType_t ticks = (ms_to_wait + portTICK_PERIOD_MS - 1) / portTICK_PERIOD_MS;  // Rounded up, a wait under one tick must not turn into a busy loop
+    TickType_t start = xTaskGetTickCount();
+    while (1) {
+        size_t buffered = 0;
+        uart_get_buffered_data_len(UART_PORT, &buffered);
+        if (buffered > 0) {                 // Bytes from an earlier event (or this one), hand over everything there is
+            return uart_read_bytes(UART_PORT, data, buffered < length ? buffered : length, 0);
+        }
+        TickType_t waited = xTaskGetTickCount() - start;
+        uart_event_t event;
+        if (waited >= ticks || xQueueReceive(uart_events, &event, ticks - waited) != pdPASS) {
+            return 0;
+        }
+        if (event.type == CANCEL_EVENT) {
+            return 0;
+        }
+        if (event.type == UART_FIFO_OVF || event.type == UART_BUFFER_FULL) {
+            uart_flush_input(UART_PORT);    // Bytes were lost either way, the frame parser resynchronises on the next sync pattern
+            xQueueReset(uart_events);
+        }
+    }
+}
+
+void transport_cancel_receive(void) {
+    uart_event_t event = {.type = CANCEL_EVENT};
+    xQueueSend(uart_events, &event, 0);
+}
+
+void transport_wait_tx_done(int ms_to_wait) {
+    uart_wait_tx_done(UART_PORT, pdMS_TO_TICKS(ms_to_wait));
+}
+
+void transport_wake_peer(int ms_to_wake) {
+    static const uint8_t burst[WAKE_BURST] = {WAKE_BYTE, WAKE_BYTE};
+    uart_write_bytes(UART_PORT, (const char *)burst, sizeof(burst));
+    uart_wait_tx_done(UART_PORT, pdMS_TO_TICKS(TX_DRAIN_MS));
+    esp_rom_delay_us(ms_to_wake * 1000);    // Shorter than a tick, the frame follows at once
+}
@@ -1,65 +1,304 @@
-#include "Tools/UARTTools.h"
-
-#include "driver/uart.h"
-
-#include "Tools/Hamming74.h"
-#include "state_machines.h"
-
-#define UART_PORT UART_NUM_1
-#define TX_PIN    17
-#define RX_PIN    18
-
-void uart_init(int baud_rate) {
-    const uart_config_t uart_config = {
-        .baud_rate = baud_rate,
-        .data_bits = UART_DATA_8_BITS,
-        .parity    = UART_PARITY_DISABLE,
-        .stop_bits = UART_STOP_BITS_1,
-        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE
-    };
-    uart_driver_install(UART_PORT, 1024, 0, 0, NULL, 0);
-    uart_param_config(UART_PORT, &uart_config);
-    uart_set_pin(UART_PORT, TX_PIN, RX_PIN, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
-}
-
-
-
-void send_header(uint8_t header) {
-    uint8_t encoded_header[2];
-    encode_bytes(&header, 2, encoded_header);
-    uart_write_bytes(UART_PORT, (const char *)encoded_header, 2);
-    uart_flush(UART_PORT);
-}
-
-void send_data(const uint8_t *data, uint8_t length) {
-    uint8_t encoded_bytes[2*length];
-    encode_bytes(data, 2*length, encoded_bytes);
-    uart_write_bytes(UART_PORT, (const char *)encoded_bytes, 2*length);
-    uart_flush(UART_PORT);
-}
-
-
-uint8_t read_header(int ms_to_wait) {     // change to return success / fail instead of error header?
-    int len;
-    uint8_t encoded_header[2];
-    uint8_t header;
-    len = uart_read_bytes(UART_PORT, encoded_header, 2, pdMS_TO_TICKS(ms_to_wait));
-    if (len == 2) {
-        decode_bytes(encoded_header, 2, &header);
-    } else if (len == 1) {
-        header = ERROR;
-    } else {
-        header = NO_HEADER;
-    }
-    return header;
-}
-
-uint8_t read_data(uint8_t *data, uint8_t length, int ms_to_wait) {
-    uint8_t len;
-    uint8_t encoded_bytes[2*length];
-    len = uart_read_bytes(UART_PORT, encoded_bytes, 2*length, pdMS_TO_TICKS(ms_to_wait));
-    if (len == 2*length) {
-        decode_bytes(encoded_bytes, 2*length, data);
-    } 
-    return len;
-}
\ No newline at end of file
+#include <stdbool.h>
+#include <string.h>
+
+#include "Tools/UARTTools.h"
+
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+#include "Tools/Transport.h"
+#include "Tools/Hamming74.h"
+#include "Tools/FEC.h"
+#include "Tools/LinkRate.h"
+#include "Tools/Telemetry.h"
+#include "Tools/LinkTrace.h"
+#include "Tools/StaticMemory.h"
+
+#define SYNC_CODED      4                                       // UART bytes of the two sync bytes
+#define PREFIX_LENGTH   4                                       // Sync, codes, length and sequence bytes, always Hamming(7,4) coded
+#define PREFIX_CODED    8
+#define MAX_FRAME_CODED (2*(MAX_FRAME_PAYLOAD + FRAME_OVERHEAD)) // Hamming(7,4) is the longest code
+#define CODE_MASK       0x03                                    // One code in the low nibble of the second sync byte, bits 0-1 sent, bits 2-3 wanted
+#define FEC_WINDOW_US       500000                              // Corrections are judged over windows at least this long
+#define FEC_WINDOW_BYTES    1000                                // and holding at least this many UART bytes
+#define FEC_STEP_UP_RATE    1000                                // Leave the light code after a window with a correction per this many UART bytes, or a lost frame
+#define FEC_STEP_DOWN_RATE  10000                               // Take it again after FEC_CLEAN_WINDOWS windows in a row with less than one per this many
+#define FEC_CLEAN_WINDOWS   4
+#define ECHO_MEMORY     8                                       // Frames sent recently enough that their reflection may still arrive
+#define ECHO_FRAMES     2                                       // A reflection lands within the air time of the frame ahead of it in the FIFO and its own
+#define ECHO_MARGIN_US  10000                                   // plus the receiving task running a tick late: 40 ms at 115200 baud, 11 ms at 5 Mbaud
+
+static const uint16_t crc_table[16] = {                         // CRC-16/CCITT (poly 0x1021) one nibble at a time
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF
+};
+
+static uint8_t rx_buffer[MAX_FRAME_CODED];                      // UART bytes read but not parsed yet, a candidate frame starts at rx_buffer[0]
+static uint8_t rx_count = 0;
+static uint32_t rejected = 0;
+
+typedef struct {                                                // A frame this side sent, identified by its prefix after the first sync byte
+    uint8_t prefix[PREFIX_LENGTH - 1];
+    int64_t expires;
+} echo_t;
+
+static echo_t echoes[ECHO_MEMORY];
+static uint8_t echo_next = 0;
+static portMUX_TYPE echo_lock = portMUX_INITIALIZER_UNLOCKED;   // Written by the sending task, read by the receiving one
+static uint32_t echoes_dropped = 0;
+
+static uint8_t fec_agreed = 1 << FEC_HAMMING74;                 // Codes both sides support, only Hamming(7,4) outside a session
+static volatile uint8_t tx_code = FEC_HAMMING74;                // Code the peer asked for (set by the RX side, read by the TX side)
+static volatile uint8_t rx_code = FEC_HAMMING74;                // Code this side asks the peer for
+static uint8_t peer_request = FEC_HAMMING74;                    // Code the sender of the last frame read asked for
+static int64_t window_start = 0;
+static uint32_t window_bytes = 0;                               // UART bytes of the frames read in this window
+static uint32_t window_corrected = 0;
+static bool window_lost = false;                                // A frame was rejected in this window
+static uint8_t clean_windows = 0;
+static uint32_t corrected = 0;
+static uint32_t switches = 0;
+
+// -------------------------------- HELPERS --------------------------------
+
+static uint16_t crc16(const uint8_t *data, uint8_t length, uint16_t crc) {
+    for (uint8_t i = 0; i < length; i++) {
+        crc = (crc << 4) ^ crc_table[(crc >> 12) ^ (data[i] >> 4)];
+        crc = (crc << 4) ^ crc_table[(crc >> 12) ^ (data[i] & 0x0F)];
+    }
+    return crc;
+}
+
+static uint16_t frame_crc(const uint8_t *prefix, const uint8_t *message) {   // Covers the prefix after the first sync byte, then the message
+    return crc16(message, prefix[2], crc16(&prefix[1], PREFIX_LENGTH - 1, 0xFFFF));
+}
+
+static uint8_t encode_frame(const uint8_t *message, uint8_t seq, uint8_t length, uint8_t *encoded) {   // Encoded length
+    uint8_t code = tx_code;
+    uint8_t prefix[PREFIX_LENGTH] = {FRAME_SYNC_0, FRAME_SYNC_1 | (rx_code << 2) | code, length, seq};
+    expect_reflection(&prefix[1]);
+    uint8_t body[MAX_FRAME_PAYLOAD + 2];                        // Message and CRC share one code block sequence
+    uint16_t crc = frame_crc(prefix, message);
+    memcpy(body, message, length);
+    body[length] = crc >> 8;
+    body[length + 1] = crc & 0xFF;
+    encode_bytes(prefix, PREFIX_CODED, encoded);
+    return PREFIX_CODED + fec_encode(code, body, length + 2, &encoded[PREFIX_CODED]);
+}
+
+static bool is_sync(const uint8_t *encoded) {                  // Compared after decoding, a single bit error per codeword still matches
+    uint8_t sync[2];
+    decode_bytes(encoded, SYNC_CODED, sync);
+    return sync[0] == FRAME_SYNC_0 && (sync[1] & 0xF0) == FRAME_SYNC_1;
+}
+
+static bool is_echo(const uint8_t *prefix) {                   // The peer's frames differ in the sequence byte (role bit or count) from any we just sent
+    int64_t now = esp_timer_get_time();
+    bool echo = false;
+    portENTER_CRITICAL(&echo_lock);
+    for (uint8_t i = 0; i < ECHO_MEMORY && !echo; i++) {
+        echo = now < echoes[i].expires && memcmp(echoes[i].prefix, &prefix[1], sizeof(echoes[i].prefix)) == 0;
+    }
+    portEXIT_CRITICAL(&echo_lock);
+    return echo;
+}
+
+static void drop(uint8_t count) {
+    rx_count -= count;
+    memmove(rx_buffer, &rx_buffer[count], rx_count);
+}
+
+static void hunt(void) {                                        // Drop everything in front of the first sync pattern, keep a possible partial one
+    uint8_t i = 0;
+    for (; i + SYNC_CODED <= rx_count; i++) {
+        if (is_sync(&rx_buffer[i])) {
+            break;
+        }
+    }
+    drop(i);
+}
+
+static uint8_t strong_code(void) {                              // Interleaving also survives a garbled UART byte at a better rate than plain Hamming(7,4)
+    return fec_agreed & (1 << FEC_INTERLEAVED) ? FEC_INTERLEAVED : FEC_HAMMING74;
+}
+
+static uint8_t light_code(void) {
+    return fec_agreed & (1 << FEC_SECDED) ? FEC_SECDED : strong_code();
+}
+
+static void request_code(uint8_t code) {
+    if (code != rx_code) {
+        rx_code = code;
+        switches++;
+    }
+    clean_windows = 0;
+}
+
+static void observe(uint8_t coded_length, int frame_corrected) {   // Judge the code asked for on every frame read, frame_corrected < 0 for a rejected one
+    int64_t now = esp_timer_get_time();
+    if (frame_corrected < 0) {
+        window_lost = true;
+        if (rx_code != strong_code()) {                         // A frame lost in the light code, do not wait for the window
+            request_code(strong_code());
+        }
+    } else {
+        corrected += frame_corrected;
+        window_corrected += frame_corrected;
+        window_bytes += coded_length;
+    }
+    if (now - window_start < FEC_WINDOW_US || window_bytes < FEC_WINDOW_BYTES) {
+        return;                                                 // A quiet direction takes longer to fill a window
+    }
+    if (rx_code == light_code() && window_corrected * FEC_STEP_UP_RATE >= window_bytes) {
+        request_code(strong_code());
+    } else if (rx_code != light_code() && !window_lost && window_corrected * FEC_STEP_DOWN_RATE < window_bytes) {
+        if (++clean_windows >= FEC_CLEAN_WINDOWS) {
+            request_code(light_code());
+        }
+    } else {
+        clean_windows = 0;
+    }
+    window_start = now;
+    window_bytes = 0;
+    window_corrected = 0;
+    window_lost = false;
+}
+
+static int reject(void) {                                       // Skip one UART byte so the next hunt looks for a sync inside the rejected frame
+    rejected++;
+    trace_record(TRACE_REJECT, NULL, 0);
+    observe(0, -1);
+    drop(1);
+    return FRAME_CORRUPT;
+}
+
+// -------------------------------- LINK --------------------------------
+
+void uart_init(int baud_rate) {
+    fec_init();
+    memory_account("frame parser", sizeof(rx_buffer) + sizeof(echoes));
+    transport_init(baud_rate);
+}
+
+void send_frame(const uint8_t *message, uint8_t seq, uint8_t length) {
+    uint8_t encoded[MAX_FRAME_CODED];
+    uint8_t coded_length = encode_frame(message, seq, length, encoded);
+    transport_write(encoded, coded_length);
+    telemetry_count(TELEMETRY_BYTES_SENT, coded_length);
+}
+
+int read_frame(uint8_t *message, uint8_t *seq, int ms_to_wait) {
+    int64_t deadline = esp_timer_get_time() + (int64_t)ms_to_wait * 1000;
+    while (1) {
+        hunt();
+        uint8_t wanted = SYNC_CODED;                            // UART bytes needed before the frame can be parsed further
+        if (rx_count >= SYNC_CODED) {
+            wanted = PREFIX_CODED;
+        }
+        if (rx_count >= PREFIX_CODED) {
+            uint8_t prefix[PREFIX_LENGTH];                      // Sync, codes, length, sequence
+            int prefix_corrected = fec_decode(FEC_HAMMING74, rx_buffer, PREFIX_LENGTH, prefix);
+            uint8_t code = prefix[1] & CODE_MASK;
+            if (prefix[2] == 0 || prefix[2] > MAX_FRAME_PAYLOAD || code >= FEC_CODES) {
+                return reject();
+            }
+            wanted = PREFIX_CODED + fec_coded_length(code, prefix[2] + 2);
+            if (rx_count >= wanted && is_echo(prefix)) {        // Our own frame reflected back, dropped whole even if its body was hit
+                echoes_dropped++;
+                drop(wanted);
+                continue;
+            }
+            if (rx_count >= wanted) {
+                uint8_t body[MAX_FRAME_PAYLOAD + 2];
+                int body_corrected = fec_decode(code, &rx_buffer[PREFIX_CODED], prefix[2] + 2, body);
+                if (body_corrected == FEC_UNCORRECTABLE) {
+                    telemetry_count(TELEMETRY_UNCORRECTABLE, 1);
+                    return reject();
+                }
+                if (frame_crc(prefix, body) != ((body[prefix[2]] << 8) | body[prefix[2] + 1])) {
+                    return reject();
+                }
+                observe(wanted, prefix_corrected + body_corrected);
+                telemetry_count(TELEMETRY_FRAMES_RECEIVED, 1);
+                memcpy(message, body, prefix[2]);
+                peer_request = (prefix[1] >> 2) & CODE_MASK;
+                drop(wanted);
+                *seq = prefix[3];
+                body[prefix[2]] = prefix[3];                    // The CRC is checked, its place carries the sequence byte into the trace
+                trace_record(TRACE_FRAME, body, prefix[2] + 1);
+                return prefix[2];
+            }
+        }
+        int64_t remaining_ms = (deadline - esp_timer_get_time() + 999) / 1000;
+        if (remaining_ms <= 0) {
+            return 0;
+        }
+        int len = transport_receive(&rx_buffer[rx_count], sizeof(rx_buffer) - rx_count, remaining_ms);   // Bytes past this frame stay buffered for the next one
+        if (len == 0) {
+            return 0;                                           // Timed out, or the wait was cancelled
+        }
+        if (len > 0) {
+            trace_record(TRACE_RX, &rx_buffer[rx_count], len);
+            rx_count += len;
+            telemetry_count(TELEMETRY_BYTES_RECEIVED, len);
+        }
+    }
+}
+
+void expect_reflection(const uint8_t *prefix) {
+    trace_record(TRACE_TX, prefix, PREFIX_LENGTH - 1);          // First, a chunk the RX task records after it cannot hold the reflection yet
+    int64_t window = (int64_t)ECHO_FRAMES * MAX_FRAME_CODED * 10 * 1000000 / rate_baud(rate_current()) + ECHO_MARGIN_US;   // 10 line bits per UART byte
+    int64_t expires = esp_timer_get_time() + window;
+    portENTER_CRITICAL(&echo_lock);
+    echo_t *echo = &echoes[echo_next++ % ECHO_MEMORY];
+    memcpy(echo->prefix, prefix, sizeof(echo->prefix));
+    echo->expires = expires;
+    portEXIT_CRITICAL(&echo_lock);
+}
+
+uint32_t frames_rejected(void) {
+    return rejected;
+}
+
+uint32_t echoes_filtered(void) {
+    return echoes_dropped;
+}
+
+uint8_t frame_coded_length(uint8_t length) {
+    return PREFIX_CODED + fec_coded_length(tx_code, length + 2);
+}
+
+// -------------------------------- FEC SELECTION --------------------------------
+
+uint8_t negotiate_fec(uint8_t peer_codes) {
+    fec_agreed = (peer_codes & FEC_SUPPORTED) | (1 << FEC_HAMMING74);
+    tx_code = FEC_HAMMING74;                                    // Until the peer says what it wants
+    rx_code = strong_code();                                    // Start safe, step down once the link proves clean
+    clean_windows = 0;
+    window_start = esp_timer_get_time();
+    window_bytes = 0;
+    window_corrected = 0;
+    window_lost = false;
+    return fec_agreed;
+}
+
+void reset_fec(void) {
+    negotiate_fec(0);
+}
+
+void follow_fec_request(void) {
+    if (fec_agreed & (1 << peer_request)) {
+        tx_code = peer_request;
+    }
+}
+
+uint8_t transmit_code(void) {
+    return tx_code;
+}
+
+uint32_t bits_corrected(void) {
+    return corrected;
+}
+
+uint32_t code_switches(void) {
+    return switches;
+}
@@ -1,15 +1,51 @@
-#include "driver/uart.h"
-
-#include "Hamming74.h"
-
-extern const uint8_t error_header;
-
-void uart_init(int baud_rate);
-
-void send_header(uint8_t header);
-
-void send_data(const uint8_t *data, uint8_t length);
-
-uint8_t read_header(int ms_to_wait);
-
-uint8_t read_data(uint8_t *data, uint8_t length, int ms_to_wait);
\ No newline at end of file
+#include <stdint.h>
+
+#include "Tools/FEC.h"
+
+#define MAX_FRAME_PAYLOAD 80    // Longest message (header + data bytes) a frame carries: header + 64 byte HID report + latency trailer fits
+#define FRAME_SYNC_0      0xB5  // Two sync bytes start every frame, the parser hunts for them after a corrupt or partial frame
+#define FRAME_SYNC_1      0x30  // High nibble of the second sync byte, its low nibble holds the frame's FEC codes
+#define FRAME_OVERHEAD    6     // Sync (2) + length (1) + sequence (1) + CRC-16 (2) bytes around the message
+#define FRAME_CORRUPT     -1    // read_frame result when a frame failed its CRC or length check
+#define FEC_SUPPORTED     ((1 << FEC_HAMMING74) | (1 << FEC_INTERLEAVED) | (1 << FEC_SECDED)) // Codes this board offers in HELLO
+
+// Every message crosses the link as a frame [sync][sync | codes][length][seq][message (length bytes)][crc hi][crc lo].
+// The first four bytes are always Hamming(7,4) coded, the rest in the code named by bits 0-1 of codes (Tools/FEC.h),
+// bits 2-3 name the code the sender wants to receive. The CRC-16/CCITT covers codes, length, seq and message. Corrupt
+// frames are dropped and the parser resynchronises on the next sync pattern at any UART byte offset, so the link
+// survives a bad or missing byte. Frames come back as soon as their last byte is received, bytes after it stay buffered.
+// Reflections of our own frames are recognised by their prefix (codes, length and sequence byte) matching a frame sent
+// moments ago and dropped whole, so nothing received ever has to be flushed and the peer can answer straight away.
+// Outside a session only Hamming(7,4) is used. After the handshake each side asks for the strongest code both support,
+// steps down to the lightest once a few windows of traffic needed almost no corrections, and back up as soon as a
+// window needs many or a frame is lost, so a clean link is not paying 2x overhead.
+
+extern const uint8_t error_header;
+
+void uart_init(int baud_rate);
+
+void send_frame(const uint8_t *message, uint8_t seq, uint8_t length);   // Frame and transmit, remembering the frame to recognise its reflection
+
+int read_frame(uint8_t *message, uint8_t *seq, int ms_to_wait);         // Message length, 0 if no frame arrived in time (or the wait was cancelled), FRAME_CORRUPT if one was rejected
+
+void expect_reflection(const uint8_t *prefix);                          // Codes, length and sequence bytes of a frame written, send_frame calls it (host/link_replay.c for each one traced)
+
+uint8_t frame_coded_length(uint8_t length);                             // UART bytes a frame of length message bytes takes in the current transmit code
+
+uint32_t frames_rejected(void);                                         // Frames dropped by the CRC or length check since power up
+
+uint32_t echoes_filtered(void);                                         // Reflections of our own frames dropped since power up
+
+// -------------------------------- FEC SELECTION --------------------------------
+
+uint8_t negotiate_fec(uint8_t peer_codes);                              // New session with a peer offering these codes, returns the codes both support
+
+void reset_fec(void);                                                   // Back to Hamming(7,4) only, before starting a handshake
+
+void follow_fec_request(void);                                          // The last frame read came from the peer (not a reflection), send in the code it asked for
+
+uint8_t transmit_code(void);                                            // Code frames are sent in now
+
+uint32_t bits_corrected(void);                                          // Errors the FEC corrected since power up (one per Hamming codeword or SECDED block)
+
+uint32_t code_switches(void);                                           // Times this side asked the peer for a different code
@@ -1,153 +1,460 @@
-//#include <stdlib.h>
-//#include <stdio.h>
-//#include <stdbool.h>
-//#include <string.h>
-//#include <unistd.h>
-
-#include "esp_log.h"
-//#include "esp_err.h"
-//#include "errno.h"
-
-//#include "freertos/FreeRTOS.h"
-//#include "freertos/task.h"
-//#include "freertos/event_groups.h"
-//#include "freertos/queue.h"
-
-#include "tinyusb.h"
-#include "class/hid/hid_device.h"
-
-#include "Tools/USBDeviceTools.h"
-
-#define TUSB_DESC_TOTAL_LEN (TUD_CONFIG_DESC_LEN + CFG_TUD_HID * TUD_HID_DESC_LEN)
-
-static const char *TAG = "DEVICE TOOLS";
-
-typedef enum {
-    NONE,
-    MOUSE,
-    KEYBOARD,
-    DATASTICK
-} device_type_t;
-
-static device_type_t current_device = NONE;
-
-// -------------------------------- MOUSE --------------------------------
-
-static const uint8_t hid_mouse_descriptor[] = {
-    TUD_HID_REPORT_DESC_MOUSE(HID_REPORT_ID(HID_ITF_PROTOCOL_MOUSE))
-};
-
-static const char* hid_mouse_string_desc[] = {
-    (char[]){0x09, 0x04}, // English
-    "Group 16",
-    "Free Space Optical Link: Mouse",
-    "000001",
-    "Mouse Interface"
-};
-
-static const uint8_t hid_mouse_config_descriptor[] = {
-    TUD_CONFIG_DESCRIPTOR(1, 1, 0, TUSB_DESC_TOTAL_LEN, TUSB_DESC_CONFIG_ATT_REMOTE_WAKEUP, 100),
-    TUD_HID_DESCRIPTOR(0, 4, false, sizeof(hid_mouse_descriptor), 0x81, 16, 10),
-};
-
-void enumerate_as_mouse(void)
-{
-    tinyusb_config_t tusb_cfg = {
-        .device_descriptor = NULL,
-        .string_descriptor = hid_mouse_string_desc,
-        .string_descriptor_count = sizeof(hid_mouse_string_desc)/sizeof(hid_mouse_string_desc[0]),
-        .external_phy = false,
-        .configuration_descriptor = hid_mouse_config_descriptor
-    };
-    ESP_ERROR_CHECK(tinyusb_driver_install(&tusb_cfg)); // Starts tinyUSB, if it fails it aborts
-    current_device = MOUSE;
-}
-
-void send_mouse_report_to_computer(usb_mouse_report_t *report) {
-    tud_hid_mouse_report(
-        HID_ITF_PROTOCOL_MOUSE,
-        report->buttons,
-        report->x_displacement,
-        report->y_displacement,
-        report->wheel,
-        0); // horizontal scroll
-    //ESP_LOGI(TAG, "Mouse report sent to computer!.");
-    //ESP_LOGI(TAG, "X: %+04d\tY: %+04d\tWheel: %+03d\t|L:%c|R:%c|M:%c|\r",
-    //       report->x_displacement,
-    //       report->y_displacement,
-    //       report->wheel,
-    //       (report->buttons & 0x01) ? 'o' : ' ',   // Left button (bit 0)
-    //       (report->buttons & 0x02) ? 'o' : ' ',   // Right button (bit 1)
-    //       (report->buttons & 0x04) ? 'o' : ' ');  // Middle button (bit 2)
-}
-
-// -------------------------------- KEYBOARD --------------------------------
-
-static const uint8_t hid_keyboard_descriptor[] = {
-    TUD_HID_REPORT_DESC_KEYBOARD()
-};
-
-static const char* hid_keyboard_string_desc[] = {
-    (char[]){0x09, 0x04}, // English
-    "Group 16",
-    "Free Space Optical Link: Keyboard",
-    "000001",
-    "Keyboard Interface"
-};
-
-static const uint8_t hid_keyboard_config_descriptor[] = {
-    TUD_CONFIG_DESCRIPTOR(1, 1, 0, TUSB_DESC_TOTAL_LEN, TUSB_DESC_CONFIG_ATT_REMOTE_WAKEUP, 100),
-    TUD_HID_DESCRIPTOR(0, 1, false, sizeof(hid_keyboard_descriptor), 0x81, 16, 10),
-};
-
-void enumerate_as_keyboard(void)
-{
-    tinyusb_config_t tusb_cfg = {
-        .device_descriptor = NULL,
-        .string_descriptor = hid_keyboard_string_desc,
-        .string_descriptor_count = sizeof(hid_keyboard_string_desc)/sizeof(hid_keyboard_string_desc[0]),
-        .external_phy = false,
-        .configuration_descriptor = hid_keyboard_config_descriptor
-    };
-    ESP_ERROR_CHECK(tinyusb_driver_install(&tusb_cfg));
-    current_device = KEYBOARD;
-}
-
-
-void send_keyboard_report_to_computer(usb_keyboard_report_t *report) {
-    tud_hid_keyboard_report(
-        0,                    // report ID (0 if not used)
-        report->modifier,      // modifier keys
-        report->keycodes);       // array of 6 keycodes
-}
-
-// -------------------------------- GENERAL --------------------------------
-
-uint8_t const* tud_hid_descriptor_report_cb(uint8_t instance) {
-    (void) instance; // ignore, single interface
-
-    switch (current_device) {
-        case MOUSE:
-            return hid_mouse_descriptor;
-        case KEYBOARD:
-            return hid_keyboard_descriptor;
-        default:
-            return NULL; // should not happen
-    }
-}
-
-uint16_t tud_hid_get_report_cb(uint8_t instance, uint8_t report_id, hid_report_type_t report_type, uint8_t* buffer, uint16_t reqlen) {
-    return 0;
-}
-
-void tud_hid_set_report_cb(uint8_t instance, uint8_t report_id, hid_report_type_t report_type, uint8_t const* buffer, uint16_t bufsize) {
-}
-
-void disconnect_device(void) {
-    ESP_ERROR_CHECK(tinyusb_driver_uninstall());
-    current_device = NONE;
-}
-
-bool detect_host() {
-    return tud_ready();
-}
+//#include <stdlib.h>
+//#include <stdio.h>
+//#include <stdbool.h>
+#include <string.h>
+//#include <unistd.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+//#include "esp_err.h"
+//#include "errno.h"
+
+//#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+//#include "freertos/event_groups.h"
+//#include "freertos/queue.h"
+
+#include "tinyusb.h"
+#include "class/hid/hid_device.h"
+#include "class/msc/msc_device.h"
+
+#include "Tools/USBDeviceTools.h"
+#include "Tools/MSCBridge.h"
+#include "Tools/Telemetry.h"
+#include "Tools/OutputReports.h"
+#include "Tools/HIDPassthrough.h"
+#include "state_machines.h"
+
+#define HID_KEYBOARD_INTERFACES 2                       // Fixed interfaces of the composite device, channels are mapped onto them
+#define HID_MOUSE_INTERFACES    2
+#define HID_INTERFACES          (HID_KEYBOARD_INTERFACES + HID_MOUSE_INTERFACES)
+#if CONFIG_TINYUSB_MSC_ENABLED
+#define MSC_INTERFACES          1                       // Optional, the medium is only present while a stick is bridged
+#else
+#define MSC_INTERFACES          0
+#endif
+#define TUSB_DESC_TOTAL_LEN     (TUD_CONFIG_DESC_LEN + HID_INTERFACES * TUD_HID_DESC_LEN + MSC_INTERFACES * TUD_MSC_DESC_LEN)
+#define HID_EP_SIZE     64                              // A full speed interrupt endpoint's largest packet, RAW_REPORT_MAX
+#define HID_EP_INTERVAL 10
+#define CLONE_INTERVAL  1                               // Raw reports are not coalesced, the endpoint must keep up with the link
+#define NO_CHANNEL      0xFF
+#define REENUMERATE_MS       50                         // Detached this long so the computer notices
+#define REENUMERATE_GRACE_US 2000000                    // detect_host holds while the computer enumerates again
+
+#if CONFIG_TINYUSB_HID_COUNT < HID_INTERFACES
+#error "CONFIG_TINYUSB_HID_COUNT must cover every HID interface of the composite device"
+#endif
+#if defined(CFG_TUD_HID_EP_BUFSIZE) && CFG_TUD_HID_EP_BUFSIZE < HID_EP_SIZE
+#error "CFG_TUD_HID_EP_BUFSIZE must hold a whole raw report"
+#endif
+
+static const char *TAG = "DEVICE TOOLS";
+
+static bool installed = false;                          // tinyusb driver installed with the composite configuration
+static uint8_t interface_channel[HID_INTERFACES];       // Channel each HID interface is active for, NO_CHANNEL while idle
+static volatile bool datastick_active = false;          // Mass storage medium present
+static volatile bool medium_changed = false;            // Report UNIT ATTENTION once so the computer reads the new capacity
+static uint8_t clone_channel[HID_INTERFACES];           // Channel whose cloned descriptor each interface presents, NO_CHANNEL for the canned one
+static uint32_t presented_hash[HID_INTERFACES];         // Of the report descriptor each interface was last enumerated with
+static uint8_t raw_length[HID_INTERFACES];              // Length of the last raw report, release sends that many zeros
+static uint8_t raw_id[HID_INTERFACES];                  // Its first byte, the report ID if the descriptor uses them
+static volatile int64_t reconnect_until = 0;            // Re-enumerating, the computer is still there
+
+// -------------------------------- DESCRIPTORS --------------------------------
+
+static const uint8_t hid_keyboard_descriptor[] = {
+    TUD_HID_REPORT_DESC_KEYBOARD()
+};
+
+#if TELEMETRY_FEATURE_REPORT
+#define KEYBOARD_REPORT_ID 1
+static const uint8_t hid_telemetry_descriptor[] = {   // First keyboard interface: the keyboard plus a vendor feature report with the link counters
+    TUD_HID_REPORT_DESC_KEYBOARD(HID_REPORT_ID(KEYBOARD_REPORT_ID)),
+    HID_USAGE_PAGE_N(HID_USAGE_PAGE_VENDOR, 2),
+    HID_USAGE(0x01),
+    HID_COLLECTION(HID_COLLECTION_APPLICATION),
+        HID_REPORT_ID(TELEMETRY_REPORT_ID)
+        HID_USAGE(0x02),
+        HID_LOGICAL_MIN(0x00),
+        HID_LOGICAL_MAX_N(0xFF, 2),
+        HID_REPORT_SIZE(8),
+        HID_REPORT_COUNT(TELEMETRY_REPORT_LENGTH),
+        HID_FEATURE(HID_DATA | HID_VARIABLE | HID_ABSOLUTE),
+    HID_COLLECTION_END
+};
+#define FIRST_KEYBOARD_DESCRIPTOR hid_telemetry_descriptor
+#else
+#define KEYBOARD_REPORT_ID 0
+#define FIRST_KEYBOARD_DESCRIPTOR hid_keyboard_descriptor
+#endif
+
+static const uint8_t hid_mouse_descriptor[] = {
+    TUD_HID_REPORT_DESC_MOUSE()                 // No report ID, every device has an interface of its own
+};
+
+static const char* string_desc[] = {
+    (char[]){0x09, 0x04}, // English
+    "Group 16",
+    "Free Space Optical Link",
+    "000001",
+    "Keyboard Interface",
+    "Mouse Interface",
+    "Mass Storage Interface"
+};
+
+static uint8_t config_descriptor[] = {          // Enumerated again only when an interface's report descriptor changes (present_descriptors)
+    TUD_CONFIG_DESCRIPTOR(1, HID_INTERFACES + MSC_INTERFACES, 0, TUSB_DESC_TOTAL_LEN, TUSB_DESC_CONFIG_ATT_REMOTE_WAKEUP, 100),
+    TUD_HID_DESCRIPTOR(0, 4, false, sizeof(FIRST_KEYBOARD_DESCRIPTOR), 0x81, HID_EP_SIZE, HID_EP_INTERVAL),
+    TUD_HID_DESCRIPTOR(1, 4, false, sizeof(hid_keyboard_descriptor), 0x82, HID_EP_SIZE, HID_EP_INTERVAL),
+    TUD_HID_DESCRIPTOR(2, 5, false, sizeof(hid_mouse_descriptor), 0x83, HID_EP_SIZE, HID_EP_INTERVAL),
+    TUD_HID_DESCRIPTOR(3, 5, false, sizeof(hid_mouse_descriptor), 0x84, HID_EP_SIZE, HID_EP_INTERVAL),
+#if CONFIG_TINYUSB_MSC_ENABLED
+    TUD_MSC_DESCRIPTOR(4, 6, 0x05, 0x85, 64),
+#endif
+};
+
+static uint8_t interface_type(uint8_t instance) {
+    return instance < HID_KEYBOARD_INTERFACES ? KEYBOARD : MOUSE;
+}
+
+static uint8_t keyboard_report_id(uint8_t instance) {  // Only the first keyboard interface can carry the telemetry feature report
+    return instance == 0 ? KEYBOARD_REPORT_ID : 0;
+}
+
+static const uint8_t *canned_descriptor(uint8_t instance, uint16_t *length) {
+    if (instance == 0) {
+        *length = sizeof(FIRST_KEYBOARD_DESCRIPTOR);
+        return FIRST_KEYBOARD_DESCRIPTOR;
+    }
+    *length = interface_type(instance) == KEYBOARD ? sizeof(hid_keyboard_descriptor) : sizeof(hid_mouse_descriptor);
+    return interface_type(instance) == KEYBOARD ? hid_keyboard_descriptor : hid_mouse_descriptor;
+}
+
+static const uint8_t *presented_descriptor(uint8_t instance, uint16_t *length) {   // Canned until the channel's clone arrives
+    const uint8_t *descriptor = NULL;
+    if (clone_channel[instance] != NO_CHANNEL) {
+        descriptor = passthrough_descriptor(clone_channel[instance], length);
+    }
+    return descriptor != NULL ? descriptor : canned_descriptor(instance, length);
+}
+
+static uint32_t descriptor_hash(const uint8_t *descriptor, uint16_t length) {      // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (uint16_t i = 0; i < length; i++) {
+        hash = (hash ^ descriptor[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static bool uses_report_ids(const uint8_t *descriptor, uint16_t length) {          // Any Report ID item, its reports then start with the ID
+    for (uint16_t i = 0; i < length; ) {
+        uint8_t prefix = descriptor[i];
+        if (prefix == 0xFE) {                   // Long item: data size in the next byte
+            i += 3 + (i + 1 < length ? descriptor[i + 1] : 0);
+            continue;
+        }
+        if ((prefix & 0xFC) == 0x84) {
+            return true;
+        }
+        i += 1 + ((prefix & 0x03) == 3 ? 4 : (prefix & 0x03));
+    }
+    return false;
+}
+
+// -------------------------------- DEVICE --------------------------------
+
+void device_install(void)
+{
+    if (installed) {
+        return;
+    }
+    tinyusb_config_t tusb_cfg = {
+        .device_descriptor = NULL,
+        .string_descriptor = string_desc,
+        .string_descriptor_count = sizeof(string_desc)/sizeof(string_desc[0]),
+        .external_phy = false,
+        .configuration_descriptor = config_descriptor
+    };
+    ESP_ERROR_CHECK(tinyusb_driver_install(&tusb_cfg));
+    memset(interface_channel, NO_CHANNEL, sizeof(interface_channel));
+    memset(clone_channel, NO_CHANNEL, sizeof(clone_channel));
+    for (uint8_t instance = 0; instance < HID_INTERFACES; instance++) {
+        uint16_t length;
+        const uint8_t *descriptor = canned_descriptor(instance, &length);
+        presented_hash[instance] = descriptor_hash(descriptor, length);
+    }
+    datastick_active = false;
+    installed = true;
+}
+
+void disconnect_device(void) {
+    if (!installed) {
+        return;
+    }
+    ESP_ERROR_CHECK(tinyusb_driver_uninstall());
+    installed = false;
+}
+
+bool detect_host() {
+    return installed && (tud_ready() || esp_timer_get_time() < reconnect_until);
+}
+
+// Invoked by tinyusb whenever tud_ready() may have changed, the USB state machine checks detect_host again
+void tud_mount_cb(void) {
+    reconnect_until = 0;
+    usb_event(USB_EVENT_COMPUTER);
+}
+
+void tud_umount_cb(void) {
+    usb_event(USB_EVENT_COMPUTER);
+}
+
+void tud_suspend_cb(bool remote_wakeup_en) {
+    usb_event(USB_EVENT_COMPUTER);
+}
+
+void tud_resume_cb(void) {
+    usb_event(USB_EVENT_COMPUTER);
+}
+
+// -------------------------------- HID --------------------------------
+
+static void release(uint8_t instance) {         // Idle report so nothing stays held when an interface loses its device
+    if (clone_channel[instance] != NO_CHANNEL && raw_length[instance] > 0) {
+        uint16_t length;
+        const uint8_t *descriptor = presented_descriptor(instance, &length);
+        uint8_t report[RAW_REPORT_MAX] = {0};
+        uint8_t id = uses_report_ids(descriptor, length) ? raw_id[instance] : 0;
+        report[0] = id;                         // Zeros after the ID: no buttons, keys or motion in any sane layout
+        tud_hid_n_report(instance, 0, report, raw_length[instance]);
+        raw_length[instance] = 0;
+    } else if (interface_type(instance) == KEYBOARD) {
+        tud_hid_n_keyboard_report(instance, keyboard_report_id(instance), 0, NULL);
+    } else {
+        tud_hid_n_mouse_report(instance, 0, 0, 0, 0, 0, 0);
+    }
+}
+
+static void reenumerate(void) {                 // USB task, the state machine sees the computer stay throughout
+    reconnect_until = esp_timer_get_time() + REENUMERATE_GRACE_US;
+    tud_disconnect();
+    vTaskDelay(pdMS_TO_TICKS(REENUMERATE_MS));
+    tud_connect();
+}
+
+static void present_descriptors(void) {         // Each active interface presents its channel's clone, idle ones the canned descriptor
+    bool changed = false;
+    for (uint8_t instance = 0; instance < HID_INTERFACES; instance++) {
+        uint8_t channel = interface_channel[instance];
+        uint16_t length;
+        clone_channel[instance] = channel != NO_CHANNEL && passthrough_descriptor(channel, &length) != NULL ? channel : NO_CHANNEL;
+        const uint8_t *descriptor = presented_descriptor(instance, &length);
+        uint32_t hash = descriptor_hash(descriptor, length);
+        if (hash == presented_hash[instance]) {
+            continue;
+        }
+        uint8_t *hid = &config_descriptor[TUD_CONFIG_DESC_LEN + instance * TUD_HID_DESC_LEN];
+        hid[16] = length & 0xFF;                // wDescriptorLength of the HID descriptor
+        hid[17] = length >> 8;
+        hid[24] = clone_channel[instance] != NO_CHANNEL ? CLONE_INTERVAL : HID_EP_INTERVAL;    // bInterval of the IN endpoint
+        presented_hash[instance] = hash;
+        raw_length[instance] = 0;
+        changed = true;
+    }
+    if (changed && installed && tud_mounted()) {
+        ESP_LOGI(TAG, "Report descriptors changed, enumerating again.");
+        reenumerate();
+    }
+}
+
+void activate_hid(uint8_t layout)
+{
+    uint8_t active = 0;
+    for (uint8_t instance = 0; instance < HID_INTERFACES; instance++) {    // Channels that kept their device keep their interface
+        uint8_t channel = interface_channel[instance];
+        if (channel != NO_CHANNEL && CHANNEL_TYPE(layout, channel) != interface_type(instance)) {
+            release(instance);
+            interface_channel[instance] = NO_CHANNEL;
+        }
+    }
+    for (uint8_t channel = 0; channel < HID_CHANNELS; channel++) {
+        uint8_t type = CHANNEL_TYPE(layout, channel);
+        if (type != KEYBOARD && type != MOUSE) {
+            continue;
+        }
+        uint8_t free = NO_CHANNEL;
+        bool mapped = false;
+        for (uint8_t instance = 0; instance < HID_INTERFACES; instance++) {
+            mapped |= interface_channel[instance] == channel;
+            if (free == NO_CHANNEL && interface_channel[instance] == NO_CHANNEL && interface_type(instance) == type) {
+                free = instance;
+            }
+        }
+        if (!mapped && free == NO_CHANNEL) {
+            ESP_LOGW(TAG, "No %s interface left for channel %d.", type == KEYBOARD ? "keyboard" : "mouse", channel);
+            continue;
+        }
+        if (!mapped) {
+            interface_channel[free] = channel;
+        }
+        active++;
+    }
+    present_descriptors();
+    ESP_LOGI(TAG, "%d HID interface(s) active.", active);
+}
+
+static int8_t hid_instance(uint8_t channel, uint8_t type) {    // Interface a report from this channel goes to, -1 if none is active for it
+    for (uint8_t instance = 0; instance < HID_INTERFACES; instance++) {
+        if (interface_channel[instance] == channel) {
+            return interface_type(instance) == type ? instance : -1;
+        }
+    }
+    return -1;
+}
+
+void send_keyboard_report_to_computer(uint8_t channel, usb_keyboard_report_t *report) {
+    int8_t instance = hid_instance(channel, KEYBOARD);
+    if (instance < 0) {
+        return;
+    }
+    tud_hid_n_keyboard_report(
+        instance,
+        keyboard_report_id(instance),
+        report->modifier,      // modifier keys
+        report->keycodes);       // array of 6 keycodes
+}
+
+void send_mouse_report_to_computer(uint8_t channel, usb_mouse_report_t *report) {
+    int8_t instance = hid_instance(channel, MOUSE);
+    if (instance < 0) {
+        return;
+    }
+    tud_hid_n_mouse_report(
+        instance,
+        0,                    // report ID (0 if not used)
+        report->buttons,
+        report->x_displacement,
+        report->y_displacement,
+        report->wheel,
+        0); // horizontal scroll
+}
+
+void send_raw_report_to_computer(uint8_t channel, const uint8_t *report, uint8_t length) {
+    for (uint8_t instance = 0; instance < HID_INTERFACES; instance++) {
+        if (interface_channel[instance] != channel || clone_channel[instance] != channel || length == 0) {
+            continue;                           // Only an interface presenting the channel's descriptor can make sense of it
+        }
+        if (tud_hid_n_report(instance, 0, report, length)) {    // The report ID, if any, is already the first byte
+            raw_length[instance] = length;
+            raw_id[instance] = report[0];
+        }
+        return;
+    }
+}
+
+// -------------------------------- DATASTICK --------------------------------
+
+void activate_datastick(bool active)
+{
+    if (active && !datastick_active) {
+        medium_changed = true;
+    }
+    datastick_active = active;
+}
+
+void tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16], uint8_t product_rev[4]) {
+    memcpy(vendor_id, "Group 16", 8);
+    memcpy(product_id, "Optical Link MSC", 16);
+    memcpy(product_rev, "1.0 ", 4);
+}
+
+bool tud_msc_test_unit_ready_cb(uint8_t lun) {
+    uint32_t block_count;
+    if (!datastick_active) {                    // An empty card reader until a stick is bridged
+        tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x3A, 0x00);  // Medium not present
+        return false;
+    }
+    if (medium_changed) {
+        medium_changed = false;
+        tud_msc_set_sense(lun, SCSI_SENSE_UNIT_ATTENTION, 0x28, 0x00);  // Medium may have changed
+        return false;
+    }
+    if (!msc_bridge_capacity(&block_count)) {   // Far side has not reported the stick's size yet
+        tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x04, 0x01);
+        return false;
+    }
+    return true;
+}
+
+void tud_msc_capacity_cb(uint8_t lun, uint32_t* block_count, uint16_t* block_size) {
+    msc_bridge_capacity(block_count);
+    *block_size = MSC_BLOCK_SIZE;
+}
+
+bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, bool load_eject) {
+    if (load_eject && !start) {                 // Ejected, make sure every write has reached the stick
+        return msc_bridge_flush(5000);
+    }
+    return true;
+}
+
+int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize) {
+    int32_t result = msc_bridge_read(lba, offset, buffer, bufsize);    // 0 makes tinyusb call again
+    if (result < 0) {
+        tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x11, 0x00);  // Unrecovered read error
+    }
+    return result;
+}
+
+int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t* buffer, uint32_t bufsize) {
+    int32_t result = msc_bridge_write(lba, offset, buffer, bufsize);   // 0 makes tinyusb call again
+    if (result < 0) {
+        tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x03, 0x00);  // Write fault
+    }
+    return result;
+}
+
+int32_t tud_msc_scsi_cb(uint8_t lun, uint8_t const scsi_cmd[16], void* buffer, uint16_t bufsize) {
+    switch (scsi_cmd[0]) {
+        case 0x35:                              // SYNCHRONIZE CACHE (10), writes are acknowledged before they reach the stick
+            if (!msc_bridge_flush(5000)) {
+                tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, 0x03, 0x00);  // Write fault
+                return -1;
+            }
+            return 0;
+        default:
+            tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x20, 0x00);  // Invalid command operation code
+            return -1;
+    }
+}
+
+// -------------------------------- GENERAL --------------------------------
+
+uint8_t const* tud_hid_descriptor_report_cb(uint8_t instance) {
+    uint16_t length;
+    return presented_descriptor(instance, &length);
+}
+
+uint16_t tud_hid_get_report_cb(uint8_t instance, uint8_t report_id, hid_report_type_t report_type, uint8_t* buffer, uint16_t reqlen) {
+#if TELEMETRY_FEATURE_REPORT
+    if (instance == 0 && clone_channel[0] == NO_CHANNEL && report_id == TELEMETRY_REPORT_ID && report_type == HID_REPORT_TYPE_FEATURE) {
+        return telemetry_report(buffer, reqlen);
+    }
+#endif
+    return 0;
+}
+
+void tud_hid_set_report_cb(uint8_t instance, uint8_t report_id, hid_report_type_t report_type, uint8_t const* buffer, uint16_t bufsize) {
+    if (instance >= HID_INTERFACES || interface_channel[instance] == NO_CHANNEL || report_type == HID_REPORT_TYPE_INPUT) {
+        return;                                 // Nothing bridged behind the interface (the computer sets the LEDs of every keyboard)
+    }
+#if TELEMETRY_FEATURE_REPORT
+    if (instance == 0 && clone_channel[0] == NO_CHANNEL && report_id == TELEMETRY_REPORT_ID) {
+        return;                                 // Read only, and ours rather than the device's
+    }
+#endif
+    if (clone_channel[instance] == NO_CHANNEL && interface_type(instance) == KEYBOARD && report_id == keyboard_report_id(instance)) {
+        report_id = 0;                          // The hosted keyboard runs the boot protocol, without report IDs
+    }
+    output_queue(interface_channel[instance], report_type, report_id, buffer, bufsize);  // tinyusb has already taken the ID byte off the data, a clone's IDs are the device's own
+}
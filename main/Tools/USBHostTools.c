@@ -1,189 +1,370 @@
-#include "usb/usb_host.h"
-#include "usb/hid_host.h"
-#include "usb/hid_usage_keyboard.h"
-#include "usb/hid_usage_mouse.h"
-
-#include "esp_log.h"
-
-#include "Tools/USBHostTools.h"
-#include "state_machines.h"
-
-static const char *TAG = "HOST TOOLS";
-
-static uint8_t current_device = NONE;
-
-QueueHandle_t app_event_queue = NULL;
-
-typedef struct {
-    hid_host_device_handle_t handle;
-    hid_host_driver_event_t event;
-    void *arg;
-} app_event_queue_t;
-
-app_event_queue_t evt_queue; 
-
-uint8_t detect_device(void) {
-    return current_device;
-}
-
-void keyboard_callback(hid_host_device_handle_t hid_device_handle,
-                                 const hid_host_interface_event_t event,
-                                 void *arg)
-{
-    uint8_t data[65] = { 0 };
-    size_t data_length = 0;
-    hid_host_dev_params_t dev_params;
-    ESP_ERROR_CHECK(hid_host_device_get_params(hid_device_handle, &dev_params));
-
-    switch (event) {
-    case HID_HOST_INTERFACE_EVENT_INPUT_REPORT:
-        ESP_ERROR_CHECK(hid_host_device_get_raw_input_report_data(hid_device_handle,
-                                                                  &data[1],
-                                                                  64,
-                                                                  &data_length));
-        data[0] = REPORT_KEYBOARD;
-        xQueueSend(usb_to_com_queue, data, 0);
-        break;
-    case HID_HOST_INTERFACE_EVENT_DISCONNECTED:
-        ESP_ERROR_CHECK(hid_host_device_close(hid_device_handle));
-        current_device = NONE;
-        break;
-    default:
-        break;
-    }
-    
-}
-
-void mouse_callback(hid_host_device_handle_t hid_device_handle,
-                                 const hid_host_interface_event_t event,
-                                 void *arg)
-{
-    uint8_t data[65] = { 0 };
-    size_t data_length = 0;
-    hid_host_dev_params_t dev_params;
-    ESP_ERROR_CHECK(hid_host_device_get_params(hid_device_handle, &dev_params));
-
-    switch (event) {
-    case HID_HOST_INTERFACE_EVENT_INPUT_REPORT:
-        ESP_ERROR_CHECK(hid_host_device_get_raw_input_report_data(hid_device_handle,
-                                                                  &data[1],
-                                                                  64,
-                                                                  &data_length));
-        data[0] = REPORT_MOUSE;
-        xQueueSend(usb_to_com_queue, data, 0);
-        //ESP_LOGI(TAG, "Sending HID mouse report to COM SM.");
-        break;
-    case HID_HOST_INTERFACE_EVENT_DISCONNECTED:
-        ESP_ERROR_CHECK(hid_host_device_close(hid_device_handle));
-        current_device = NONE;
-        break;
-    default:
-        break;
-    }
-}
-
-void hid_host_device_event(hid_host_device_handle_t hid_device_handle,
-                              const hid_host_driver_event_t event,
-                              void *arg)
-{
-    hid_host_dev_params_t dev_params;
-    ESP_ERROR_CHECK(hid_host_device_get_params(hid_device_handle, &dev_params));
-
-    switch (event) {
-    case HID_HOST_DRIVER_EVENT_CONNECTED: {
-        hid_host_device_config_t dev_config = { 0 };
-        if (dev_params.proto == HID_PROTOCOL_KEYBOARD) {
-            dev_config.callback     = keyboard_callback;
-            dev_config.callback_arg = NULL;
-            current_device = KEYBOARD;
-        } else if (dev_params.proto == HID_PROTOCOL_MOUSE) {
-            dev_config.callback     = mouse_callback;
-            dev_config.callback_arg = NULL;
-            current_device = MOUSE;
-        } else {
-            return;
-        }
-    
-        if (dev_params.proto != HID_PROTOCOL_NONE) {
-            ESP_ERROR_CHECK(hid_host_device_open(hid_device_handle, &dev_config));   // Initialises the device.
-            if (HID_SUBCLASS_BOOT_INTERFACE == dev_params.sub_class) {               // Special initialisation 
-                ESP_ERROR_CHECK(hid_class_request_set_protocol(hid_device_handle, HID_REPORT_PROTOCOL_BOOT)); 
-                if (HID_PROTOCOL_KEYBOARD == dev_params.proto) {
-                    ESP_ERROR_CHECK(hid_class_request_set_idle(hid_device_handle, 0, 0));
-                }
-            }
-            ESP_ERROR_CHECK(hid_host_device_start(hid_device_handle));    // Begins communication with the device and starts polling
-        }
-        break;
-    }
-    default:
-        break;
-    }
-}
-
-static void usb_lib_task(void *arg)
-{
-    const usb_host_config_t host_config = {
-        .skip_phy_setup = false,
-        .intr_flags = ESP_INTR_FLAG_LEVEL1,
-    };
-    ESP_ERROR_CHECK(usb_host_install(&host_config));    // Install the host driver
-    xTaskNotifyGive(arg);                               // Notifies main that the host driver is installed
-
-    while (true) {
-        uint32_t event_flags;
-        usb_host_lib_handle_events(portMAX_DELAY, &event_flags);   // Handles the USB protocol
-    }
-}
-
-// Handles the incomming USB data by placing the struct in the queue
-void hid_host_device_callback(hid_host_device_handle_t hid_device_handle,
-                              const hid_host_driver_event_t event,
-                              void *arg)
-{
-    const app_event_queue_t evt_queue = {
-        .handle = hid_device_handle,
-        .event = event,
-        .arg = arg
-    };
-    xQueueSend(app_event_queue, &evt_queue, 0);
-}
-
-void host_install(void) {
-    BaseType_t task_created; 
-    app_event_queue = xQueueCreate(10, sizeof(app_event_queue_t));  // Create queue. wouldnt it make more sense to have this before the other tasks are created?
-
-    // Creates a task for USB initialisation and host event handling?
-    task_created = xTaskCreatePinnedToCore(usb_lib_task,                    // Task function
-                                           "usb_events",                    // Task name (for debugging)
-                                           4096,                            // Stack size in bytes (4 KB)
-                                           xTaskGetCurrentTaskHandle(),     // Task parameter (argument passed in)
-                                           2,                               // Priority
-                                           NULL,                            // Task handle (not saved here)
-                                           0);                              // Core to pin the task to (core 0)
-    assert(task_created == pdTRUE);             // if task creation fails aborts the program
-    ulTaskNotifyTake(false, 1000);              // Wait for notification from usb_lib_task to proceed
-  
-    const hid_host_driver_config_t hid_host_driver_config = {   // Configure and install the HID host driver.
-        .create_background_task = true,
-        .task_priority = 5,
-        .stack_size = 4096,
-        .core_id = 0,
-        .callback = hid_host_device_callback,       // gets called whenever HID devices connect, disconnect.
-        .callback_arg = NULL
-    };
-    ESP_ERROR_CHECK(hid_host_install(&hid_host_driver_config));
-}
-
-void host_uninstall(void) {
-    hid_host_uninstall();
-    usb_host_uninstall();
-}
-
-void handle_hosting(void) {
-    if (xQueueReceive(app_event_queue, &evt_queue, pdMS_TO_TICKS(10))) {  // Wait until an item is placed in the queue
-            hid_host_device_event(evt_queue.handle,
-                                  evt_queue.event,
-                                  evt_queue.arg);
-    }
+#include <string.h>
+
+#include "usb/usb_host.h"
+#include "usb/hid_host.h"
+#include "usb/hid_usage_keyboard.h"
+#include "usb/hid_usage_mouse.h"
+#include "usb/msc_host.h"
+
+#include "esp_log.h"
+
+#include "Tools/USBHostTools.h"
+#include "Tools/LatencyTools.h"
+#include "Tools/ReportPool.h"
+#include "Tools/MouseCoalescer.h"
+#include "Tools/HIDPassthrough.h"
+#include "Tools/OutputReports.h"
+#include "Tools/StaticMemory.h"
+#include "state_machines.h"
+
+static const char *TAG = "HOST TOOLS";
+
+typedef struct {                                        // A HID device (interface) being hosted, its index is its channel on the link
+    hid_host_device_handle_t handle;
+    volatile uint8_t type;                                  // enum device, NONE while the channel is free
+} hid_channel_t;
+
+static hid_channel_t channels[HID_CHANNELS];            // Opened and closed by the HID driver task, read by the USB task
+static volatile bool stick_connected = false;
+
+QueueHandle_t app_event_queue = NULL;
+static QueueHandle_t msc_event_queue = NULL;           // MSC driver events, handled in handle_hosting like the HID ones
+static msc_host_device_handle_t datastick = NULL;
+
+typedef struct {
+    hid_host_device_handle_t handle;
+    hid_host_driver_event_t event;
+    void *arg;
+} app_event_queue_t;
+
+app_event_queue_t evt_queue; 
+
+MEMORY_QUEUE(app_event_memory, "hid host events", 10, sizeof(app_event_queue_t));
+MEMORY_QUEUE(msc_event_memory, "msc host events", 4, sizeof(msc_host_event_t));
+MEMORY_TASK(usb_lib_memory, "usb_events", STACK_USB_LIB);   // Created by the first host_install, kept for the next hosting session
+static TaskHandle_t installer = NULL;                   // Task calling host_install and host_uninstall, usb_lib_task answers it
+static volatile bool hosting = false;                   // usb_lib_task handles host library events while set
+
+uint8_t detect_device(void) {
+    return stick_connected ? DATASTICK : NONE;
+}
+
+uint8_t hid_layout(void) {
+    uint8_t layout = 0;
+    for (uint8_t channel = 0; channel < HID_CHANNELS; channel++) {
+        layout |= channels[channel].type << (2*channel);
+    }
+    return layout;
+}
+
+static void close_channel(hid_host_device_handle_t hid_device_handle, uint8_t channel) {
+    ESP_ERROR_CHECK(hid_host_device_close(hid_device_handle));
+    channels[channel].type = NONE;                      // Free for the next device plugged in
+    passthrough_set(channel, NULL, 0);
+    usb_event(USB_EVENT_PERIPHERAL);                    // The layout changed
+}
+
+static void publish_raw_report(hid_host_device_handle_t hid_device_handle, uint8_t channel, bool mouse, int64_t capture_time) {
+    size_t data_length = 0;
+    uint8_t *slot = report_pool_claim();                // Not coalesced, a report protocol layout is only known to the computer
+    if (slot == NULL) {
+        return;
+    }
+    esp_err_t err = hid_host_device_get_raw_input_report_data(hid_device_handle, &slot[3], RAW_REPORT_MAX, &data_length);
+    if (err != ESP_OK) {                                // Too long for a slot or the device went away, drop this report only
+        ESP_LOGW(TAG, "Channel %d report not read: %s", channel, esp_err_to_name(err));
+        report_pool_unclaim(slot);
+        return;
+    }
+    slot[0] = mouse ? REPORT_RAW_MOUSE : REPORT_RAW;
+    slot[1] = channel;
+    slot[2] = data_length;
+    latency_report_captured(capture_time, mouse);
+    report_pool_publish(slot, mouse);
+}
+
+void keyboard_callback(hid_host_device_handle_t hid_device_handle,
+                                 const hid_host_interface_event_t event,
+                                 void *arg)
+{
+    size_t data_length = 0;
+    hid_host_dev_params_t dev_params;
+    ESP_ERROR_CHECK(hid_host_device_get_params(hid_device_handle, &dev_params));
+
+    uint8_t channel = (uintptr_t)arg;                   // Given to hid_host_device_open when the keyboard connected
+
+    switch (event) {
+    case HID_HOST_INTERFACE_EVENT_INPUT_REPORT:
+        int64_t capture_time = esp_timer_get_time();    // Start of the report's latency trace
+        if (passthrough_raw(channel)) {
+            publish_raw_report(hid_device_handle, channel, false, capture_time);
+            break;
+        }
+        uint8_t *slot = report_pool_claim();            // Read the report straight into a slot the COM task will encode from
+        if (slot == NULL) {                             // Every slot in flight, drop the report
+            break;
+        }
+        ESP_ERROR_CHECK(hid_host_device_get_raw_input_report_data(hid_device_handle,
+                                                                  &slot[2],
+                                                                  REPORT_SLOT_SIZE - 2,
+                                                                  &data_length));
+        if (data_length < 8) {                          // Slots are reused, clear what a short report did not overwrite
+            memset(&slot[2 + data_length], 0, 8 - data_length);
+        }
+        slot[0] = REPORT_KEYBOARD;
+        slot[1] = channel;
+        latency_report_captured(capture_time, false);
+        report_pool_publish(slot, false);
+        break;
+    case HID_HOST_INTERFACE_EVENT_DISCONNECTED:
+        close_channel(hid_device_handle, channel);
+        break;
+    default:
+        break;
+    }
+    
+}
+
+void mouse_callback(hid_host_device_handle_t hid_device_handle,
+                                 const hid_host_interface_event_t event,
+                                 void *arg)
+{
+    uint8_t data[64] = { 0 };
+    size_t data_length = 0;
+    hid_host_dev_params_t dev_params;
+    ESP_ERROR_CHECK(hid_host_device_get_params(hid_device_handle, &dev_params));
+
+    uint8_t channel = (uintptr_t)arg;
+
+    switch (event) {
+    case HID_HOST_INTERFACE_EVENT_INPUT_REPORT:
+        int64_t capture_time = esp_timer_get_time();    // Start of the report's latency trace
+        if (passthrough_raw(channel)) {
+            publish_raw_report(hid_device_handle, channel, true, capture_time);
+            break;
+        }
+        ESP_ERROR_CHECK(hid_host_device_get_raw_input_report_data(hid_device_handle,
+                                                                  data,
+                                                                  64,
+                                                                  &data_length));
+        coalesce_mouse_report(channel, (usb_mouse_report_t *)data, capture_time);  // Motion is summed until the COM task can send it
+        //ESP_LOGI(TAG, "Sending HID mouse report to COM SM.");
+        break;
+    case HID_HOST_INTERFACE_EVENT_DISCONNECTED:
+        close_channel(hid_device_handle, channel);
+        break;
+    default:
+        break;
+    }
+}
+
+void hid_host_device_event(hid_host_device_handle_t hid_device_handle,
+                              const hid_host_driver_event_t event,
+                              void *arg)
+{
+    hid_host_dev_params_t dev_params;
+    ESP_ERROR_CHECK(hid_host_device_get_params(hid_device_handle, &dev_params));
+
+    switch (event) {
+    case HID_HOST_DRIVER_EVENT_CONNECTED: {
+        hid_host_device_config_t dev_config = { 0 };
+        uint8_t channel = 0;
+        while (channel < HID_CHANNELS && channels[channel].type != NONE) {     // Lowest free channel, the others keep theirs
+            channel++;
+        }
+        if (channel == HID_CHANNELS) {
+            ESP_LOGW(TAG, "Every HID channel is in use, ignoring the new device.");
+            return;
+        }
+        if (dev_params.proto == HID_PROTOCOL_KEYBOARD) {
+            dev_config.callback     = keyboard_callback;
+        } else if (dev_params.proto == HID_PROTOCOL_MOUSE) {
+            dev_config.callback     = mouse_callback;
+        } else {
+            return;
+        }
+        dev_config.callback_arg = (void *)(uintptr_t)channel;
+        channels[channel].handle = hid_device_handle;
+    
+        if (dev_params.proto != HID_PROTOCOL_NONE) {
+            ESP_ERROR_CHECK(hid_host_device_open(hid_device_handle, &dev_config));   // Initialises the device.
+            size_t descriptor_length = 0;
+            const uint8_t *descriptor = hid_host_get_report_descriptor(hid_device_handle, &descriptor_length);
+            bool raw = HID_PASSTHROUGH && descriptor != NULL && descriptor_length > 0 && descriptor_length <= DESCRIPTOR_MAX;
+            passthrough_set(channel, raw ? descriptor : NULL, descriptor_length);   // Sent to the far side with the next HID_CONNECTED
+            if (HID_SUBCLASS_BOOT_INTERFACE == dev_params.sub_class) {               // Special initialisation 
+                ESP_ERROR_CHECK(hid_class_request_set_protocol(hid_device_handle, raw ? HID_REPORT_PROTOCOL_REPORT : HID_REPORT_PROTOCOL_BOOT)); 
+                if (HID_PROTOCOL_KEYBOARD == dev_params.proto) {
+                    ESP_ERROR_CHECK(hid_class_request_set_idle(hid_device_handle, 0, 0));
+                }
+            }
+            ESP_ERROR_CHECK(hid_host_device_start(hid_device_handle));    // Begins communication with the device and starts polling
+            channels[channel].type = dev_params.proto == HID_PROTOCOL_KEYBOARD ? KEYBOARD : MOUSE;  // Listed once it is reporting
+            ESP_LOGI(TAG, "%s connected on channel %d, %s protocol.", dev_params.proto == HID_PROTOCOL_KEYBOARD ? "Keyboard" : "Mouse", channel, raw ? "report" : "boot");
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+bool send_output_report_to_device(uint8_t channel, uint8_t type, uint8_t id, const uint8_t *data, uint8_t length) {
+    if (channel >= HID_CHANNELS || channels[channel].type == NONE) {
+        return false;
+    }
+    uint8_t report[OUTPUT_MAX_DATA + 1] = {id};
+    if (id != 0) {                                      // A device using report IDs expects the ID as the first data byte
+        memcpy(&report[1], data, length);
+        data = report;
+        length++;
+    }
+    return hid_class_request_set_report(channels[channel].handle, type, id, (uint8_t *)data, length) == ESP_OK;   // Waits for the device, never called from its callbacks
+}
+
+static void usb_lib_task(void *arg)                     // One hosting session at a time, the task itself is never deleted
+{
+    const usb_host_config_t host_config = {
+        .skip_phy_setup = false,
+        .intr_flags = ESP_INTR_FLAG_LEVEL1,
+    };
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);        // Woken by host_install
+        ESP_ERROR_CHECK(usb_host_install(&host_config));    // Install the host driver
+        xTaskNotifyGive(installer);                     // Notifies host_install that the host driver is installed
+        while (hosting) {
+            uint32_t event_flags;
+            usb_host_lib_handle_events(portMAX_DELAY, &event_flags);   // Handles the USB protocol, usb_host_lib_unblock ends the wait
+        }
+        xTaskNotifyGive(installer);                     // Notifies host_uninstall that the library is no longer in use
+    }
+}
+
+// Handles the incomming USB data by placing the struct in the queue
+void hid_host_device_callback(hid_host_device_handle_t hid_device_handle,
+                              const hid_host_driver_event_t event,
+                              void *arg)
+{
+    const app_event_queue_t evt_queue = {
+        .handle = hid_device_handle,
+        .event = event,
+        .arg = arg
+    };
+    xQueueSend(app_event_queue, &evt_queue, 0);
+    usb_event(USB_EVENT_PERIPHERAL);                    // The USB task opens it in handle_hosting
+}
+
+// -------------------------------- DATASTICK --------------------------------
+
+static void msc_event_callback(const msc_host_event_t *event, void *arg) {
+    xQueueSend(msc_event_queue, event, 0);      // Installing the device blocks on the USB library, do it from handle_hosting
+    usb_event(USB_EVENT_PERIPHERAL);
+}
+
+static void msc_host_event(const msc_host_event_t *event) {
+    if (event->event == MSC_DEVICE_CONNECTED) {
+        if (msc_host_install_device(event->device.address, &datastick) == ESP_OK) {
+            ESP_LOGI(TAG, "Datastick connected.");
+            stick_connected = true;
+        }
+    } else if (event->event == MSC_DEVICE_DISCONNECTED && datastick != NULL) {
+        ESP_LOGI(TAG, "Datastick disconnected.");
+        msc_host_uninstall_device(datastick);
+        datastick = NULL;
+        stick_connected = false;
+    }
+}
+
+bool datastick_info(uint32_t *block_count, uint32_t *block_size) {
+    msc_host_device_info_t info;
+    if (datastick == NULL || msc_host_get_device_info(datastick, &info) != ESP_OK) {
+        return false;
+    }
+    *block_count = info.sector_count;
+    *block_size = info.sector_size;
+    return true;
+}
+
+bool datastick_read(uint32_t lba, uint8_t blocks, uint8_t *data) {
+    msc_host_device_info_t info;
+    if (datastick == NULL || msc_host_get_device_info(datastick, &info) != ESP_OK) {
+        return false;
+    }
+    return msc_host_read_sector(datastick, lba, data, blocks * info.sector_size) == ESP_OK;
+}
+
+bool datastick_write(uint32_t lba, uint8_t blocks, const uint8_t *data) {
+    msc_host_device_info_t info;
+    if (datastick == NULL || msc_host_get_device_info(datastick, &info) != ESP_OK) {
+        return false;
+    }
+    return msc_host_write_sector(datastick, lba, data, blocks * info.sector_size) == ESP_OK;
+}
+
+// -------------------------------- SETUP --------------------------------
+
+void host_install(void) {
+    app_event_queue = memory_queue_create(&app_event_memory);   // Created once, kept across host_uninstall
+    msc_event_queue = memory_queue_create(&msc_event_memory);
+    installer = xTaskGetCurrentTaskHandle();
+    hosting = true;
+
+    // Wakes (and the first time creates) the task for USB initialisation and host event handling
+    xTaskNotifyGive(memory_task_start(&usb_lib_memory,     // Task and its stack
+                                      usb_lib_task,        // Task function
+                                      NULL,                // Task parameter
+                                      2,                   // Priority
+                                      0));                 // Core to pin the task to (core 0)
+    ulTaskNotifyTake(false, 1000);              // Wait for notification from usb_lib_task to proceed
+  
+    const hid_host_driver_config_t hid_host_driver_config = {   // Configure and install the HID host driver.
+        .create_background_task = true,
+        .task_priority = 5,
+        .stack_size = 4096,
+        .core_id = 0,
+        .callback = hid_host_device_callback,       // gets called whenever HID devices connect, disconnect.
+        .callback_arg = NULL
+    };
+    ESP_ERROR_CHECK(hid_host_install(&hid_host_driver_config));
+
+    const msc_host_driver_config_t msc_host_driver_config = {   // Configure and install the MSC host driver alongside the HID one.
+        .create_backround_task = true,
+        .task_priority = 5,
+        .stack_size = 4096,
+        .core_id = 0,
+        .callback = msc_event_callback,             // gets called whenever mass storage devices connect, disconnect.
+        .callback_arg = NULL
+    };
+    ESP_ERROR_CHECK(msc_host_install(&msc_host_driver_config));
+}
+
+void host_uninstall(void) {
+    if (datastick != NULL) {
+        msc_host_uninstall_device(datastick);
+        datastick = NULL;
+        stick_connected = false;
+    }
+    for (uint8_t channel = 0; channel < HID_CHANNELS; channel++) {
+        if (channels[channel].type != NONE) {
+            close_channel(channels[channel].handle, channel);
+        }
+    }
+    msc_host_uninstall();
+    hid_host_uninstall();
+    hosting = false;
+    usb_host_lib_unblock();                     // usb_lib_task stops handling events and answers
+    ulTaskNotifyTake(false, 1000);
+    usb_host_uninstall();
+}
+
+void handle_hosting(void) {
+    msc_host_event_t msc_event;
+    while (xQueueReceive(msc_event_queue, &msc_event, 0)) {
+        msc_host_event(&msc_event);
+    }
+    while (xQueueReceive(app_event_queue, &evt_queue, 0)) {    // Everything the driver queued since the last USB_EVENT_PERIPHERAL
+            hid_host_device_event(evt_queue.handle,
+                                  evt_queue.event,
+                                  evt_queue.arg);
+    }
 }
\ No newline at end of file
@@ -1,7 +1,24 @@
-void host_install(void);
-
-void host_uninstall(void);
-
-uint8_t detect_device(void);
-
-void handle_hosting(void);
\ No newline at end of file
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+void host_install(void);
+
+void host_uninstall(void);
+
+uint8_t detect_device(void);                    // DATASTICK while a datastick is connected, otherwise NONE (HID devices are listed by hid_layout)
+
+uint8_t hid_layout(void);                       // enum device on each HID channel, 2 bits per channel (CHANNEL_TYPE), 0 if none is connected
+
+void handle_hosting(void);                      // USB task, after a USB_EVENT_PERIPHERAL: opens or closes what the drivers reported, never waits
+
+bool send_output_report_to_device(uint8_t channel, uint8_t type, uint8_t id, const uint8_t *data, uint8_t length);  // USB task, SET_REPORT control transfer, false if no device is on the channel
+
+// -------------------------------- DATASTICK --------------------------------
+
+bool datastick_info(uint32_t *block_count, uint32_t *block_size);
+
+bool datastick_read(uint32_t lba, uint8_t blocks, uint8_t *data);          // Blocking, false on a USB or SCSI error
+
+bool datastick_write(uint32_t lba, uint8_t blocks, const uint8_t *data);   // Blocking, false on a USB or SCSI error
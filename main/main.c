@@ -1,12 +1,34 @@
-#include "freertos/FreeRTOS.h"  // Header file for the FreeRTOS operating system
-#include "state_machines.h"     // Header file for both the usb state machine and the communication state machine
-
-QueueHandle_t usb_to_com_queue; // FreeRTOS Queue that will be used to pass messages from the USB state machine to the communication state machine
-QueueHandle_t com_to_usb_queue; // FreeRTOS Queue that will be used to pass messages from the communication state machine to the USB state machine
-
-void app_main(void) {
-    usb_to_com_queue = xQueueCreate(10, 9); // Initialise the queue to hold (number of messages, bytes per message)
-    com_to_usb_queue = xQueueCreate(10, 9); // Initialise the queue to hold (number of messages, bytes per message)
-    xTaskCreatePinnedToCore(usb_state_machine, "USB SM", 4096, NULL, 2, NULL, 0); // (Run the usb_state_machine function (declared in state_machines.h) as a FreeRTOS task, Name the task "USB SM", Allocate 4096 bytes of memory, Dont provide a pointer for any additional parameters, Set task priority to 2, Don't request a handle, Pin the task to core 0)
-    xTaskCreatePinnedToCore(com_state_machine, "COM SM", 4096, NULL, 2, NULL, 1); // (Run the com_state_machine function (declared in state_machines.h) as a FreeRTOS task, Name the task "COM SM", Allocate 4096 bytes of memory, Dont provide a pointer for any additional parameters, Set task priority to 2, Don't request a handle, Pin the task to core 1)
+#include "freertos/FreeRTOS.h"  // Header file for the FreeRTOS operating system
+#include "state_machines.h"     // Header file for both the usb state machine and the communication state machine
+#include "Tools/ConsoleTools.h" // Header file for the diagnostic console (latency histograms)
+#include "Tools/StaticMemory.h" // Header file for the task and queue memory (static unless STATIC_MEMORY is 0)
+#include "Tools/PowerTools.h"   // Header file for the low-power idle mode (automatic light sleep)
+
+QueueHandle_t usb_to_com_queue; // FreeRTOS Queue that will be used to pass messages from the USB state machine to the communication state machine
+QueueHandle_t com_to_usb_queue; // FreeRTOS Queue that will be used to pass messages from the communication state machine to the USB state machine
+QueueHandle_t com_to_usb_mouse_queue;   // FreeRTOS Queue that will be used to pass mouse reports from the communication state machine to the USB state machine
+QueueHandle_t usb_event_queue;          // FreeRTOS Queue of local events (enum usb_events) for the USB state machine
+QueueSetHandle_t usb_event_set;         // FreeRTOS Queue set the USB state machine waits on for all three queues
+
+MEMORY_QUEUE(usb_to_com_memory, "usb to com", 10, USB_MESSAGE_SIZE);    // (number of messages, bytes per message)
+MEMORY_QUEUE(com_to_usb_memory, "com to usb", 10, USB_MESSAGE_SIZE);
+MEMORY_QUEUE(com_to_usb_mouse_memory, "com to usb mouse", 10, USB_MESSAGE_SIZE);
+MEMORY_QUEUE(usb_event_memory, "usb events", 8, sizeof(uint8_t));
+MEMORY_QUEUE(usb_event_set_memory, "usb event set", 28, sizeof(QueueSetMemberHandle_t));  // Room for every message and event the three queues can hold
+MEMORY_TASK(usb_task_memory, "USB SM", STACK_USB_SM);
+MEMORY_TASK(com_task_memory, "COM SM", STACK_COM_SM);
+
+void app_main(void) {
+    power_init();                           // Light sleep is allowed from here on, the USB task holds it off while anything is plugged in
+    usb_to_com_queue = memory_queue_create(&usb_to_com_memory);  // Initialise the queues, their storage is declared above
+    com_to_usb_queue = memory_queue_create(&com_to_usb_memory);
+    com_to_usb_mouse_queue = memory_queue_create(&com_to_usb_mouse_memory);
+    usb_event_queue = memory_queue_create(&usb_event_memory);
+    usb_event_set = memory_queue_set_create(&usb_event_set_memory);
+    xQueueAddToSet(com_to_usb_queue, usb_event_set);
+    xQueueAddToSet(com_to_usb_mouse_queue, usb_event_set);
+    xQueueAddToSet(usb_event_queue, usb_event_set);
+    console_start();                        // Start the console REPL so diagnostics can be dumped on demand
+    memory_task_start(&usb_task_memory, usb_state_machine, NULL, 2, 0); // (Run the usb_state_machine function (declared in state_machines.h) as a FreeRTOS task named "USB SM" on the stack declared above, Dont provide a pointer for any additional parameters, Set task priority to 2, Pin the task to core 0)
+    memory_task_start(&com_task_memory, com_state_machine, NULL, 2, 1); // (Run the com_state_machine function (declared in state_machines.h) as a FreeRTOS task named "COM SM" on the stack declared above, Dont provide a pointer for any additional parameters, Set task priority to 2, Pin the task to core 1)
 }
\ No newline at end of file
@@ -1,142 +1,810 @@
-#include "state_machines.h"
-#include "esp_log.h"
-#include "esp_random.h"
-#include "driver/uart.h"
-
-#include "Tools/UARTTools.h"
-
-static const char *TAG = "COM SM";    // Tag used for ESP logging
-
-#define UART_PORT UART_NUM_1          // Define which UART port to use
-#define BAUD_RATE 1000000             // Define the baud rate for UART communication
-#define HB_PERIOD 1000                // Heartbeat period in milliseconds
-#define MIN_BACKOFF_MS   100          // Minimum backoff in milliseconds
-#define MAX_BACKOFF_MS   1000         // Maximum backoff in milliseconds
-
-static uint8_t header;                // Variable to hold the received header
-static uint8_t message[9];            // Buffer to hold messages (max size set by keyboard report)
-
-enum COM_STATE {                      // Define all the states of the communication state machine
-    BACKOFF,                             // Backoff state attempts to estabblish half-duplex communication
-    READ,                                // Read state waits for incoming messages
-    WRITE                                // Write state sends outgoing messages
-};
-
-void com_state_machine(void *arg) {   // Communication state machine function
-    uint8_t com_state = BACKOFF;      // Initialise the communication state to BACKOFF
-    uart_init(BAUD_RATE);             // Initialise UART drivers with defined baud rate
-    while(1) {
-        switch (com_state) {          // Switch statement defining behaviour for the different communication states
-            // -------------------------------- BACKOFF STATE --------------------------------
-            case BACKOFF:
-                vTaskDelay(pdMS_TO_TICKS(10));       // delay and flush to avoid reading reflected signal
-                uart_flush(UART_PORT);
-                uint32_t backoff = MIN_BACKOFF_MS + (esp_random() % (MAX_BACKOFF_MS - MIN_BACKOFF_MS)); // Generate backoff time
-                ESP_LOGW(TAG, "Reading for %d ms.", backoff);
-                header = read_header(backoff);        // Attempt to read a header with timeout defined by the backoff time
-                if (header == HELLO) {                // HELLO header received
-                    ESP_LOGW(TAG, "Received HELLO, transmitting HEARD and updating state to READ.");
-                    vTaskDelay(pdMS_TO_TICKS(15));    // delay to wait for other side to flush
-                    send_header((uint8_t)HEARD);      // Transmit HEARD header
-                    com_state = READ;                 // Update communication state to READ
-                } else if (header == HEARD) {         // HEARD header received
-                    ESP_LOGW(TAG, "Received HEARD, transmitting STATE and updating state to READ.");
-                    message[0] = (uint8_t)STATE;      // Prepare STATE message
-                    message[1] = usb_state;
-                    vTaskDelay(pdMS_TO_TICKS(15));    // delay to wait for other side to flush
-                    send_data(message, 2);            // Transmit STATE message
-                    com_state = READ;                 // Update communication state to READ
-                } else if (header == NO_HEADER) {     // No header received
-                    ESP_LOGW(TAG, "No header received, transmitting HELLO.");
-                    vTaskDelay(pdMS_TO_TICKS(15));    // delay to wait for other side to flush
-                    send_header((uint8_t)HELLO);      // Transmit HELLO header
-                } else if (header == ERROR) {         // ERROR header received
-                    ESP_LOGW(TAG, "Error header received, transmitting HELLO.");
-                    vTaskDelay(pdMS_TO_TICKS(15));    // delay to wait for other side to flush
-                    send_header((uint8_t)HELLO);      // Transmit HELLO header
-                }
-                break;
-            // -------------------------------- WRITE STATE --------------------------------
-            case WRITE:
-                BaseType_t QueueFlag = pdFAIL; // Flag to check if a message was received from the usb state machine
-                switch (usb_state) {
-                    case UNKNOWN:              // In unknown or host states, wait for up to the
-                    case HOST_UNKNOWN:         // heartbeat period to receive a message from 
-                    case HOST_DATASTICK:       // the usb state machine
-                    case HOST_KEYBOARD:
-                    case HOST_MOUSE:           
-                        QueueFlag = xQueueReceive(usb_to_com_queue, &message, pdMS_TO_TICKS(HB_PERIOD));
-                        break;
-                    case DEVICE_UNKNOWN:       // In device states, check but do not 
-                    case DEVICE_DATASTICK:     // wait to receive a message from 
-                    case DEVICE_KEYBOARD:      // the usb state machine
-                    case DEVICE_MOUSE:
-                        QueueFlag = xQueueReceive(usb_to_com_queue, &message, 0);
-                        break;
-                }
-                if (QueueFlag == pdPASS) {     // If a message was received from the usb state machine
-                    if (message[0] == UPDATE) {                  // If the message is an update
-                        ESP_LOGW(TAG, "Received an update from the usb state machine, transmitting it");
-                        send_data(message, 2); // Transmit full update (1 header + 1 data byte)
-                    } else if (message[0] == REPORT_MOUSE) {     // If the message is a mouse report
-                        send_data(message, 5); // Transmit full mouse report (1 header + 4 data bytes)
-                    } else if (message[0] == REPORT_KEYBOARD) {  // If the message is a keyboard report
-                        send_data(message, 9); // Transmit full keyboard report (1 header + 8 data bytes)
-                    }
-                } else {                       // If no message was received from the usb state machine
-                    send_header((uint8_t)ACK); // Transmit ACK header as a heartbeat
-                }
-                com_state = READ;              // Update communication state to READ
-                break;
-            // -------------------------------- READ STATE --------------------------------
-            case READ:
-                uart_flush(UART_PORT);                      // Flush UART to avoid reading reflected signal
-                message[0] = read_header(2*HB_PERIOD);      // Attempt to read a header with timeout defined by twice the heartbeat period
-                if (message[0] == ACK) {                    // If an ACK header is received
-                    com_state = WRITE;                      // Update communication state to WRITE  
-                } else if (message[0] == UPDATE) {          // If an UPDATE header is received
-                    ESP_LOGW(TAG, "Received UPDATE, sending to USB state machine and updating comm state to WRITE.");
-                    read_data(&message[1], 1, 10);          // Read the rest of the update message (1 data byte)
-                    xQueueSend(com_to_usb_queue, message, portMAX_DELAY); // Send the full update message to the usb state machine
-                    com_state = WRITE;                      // Update communication state to WRITE
-                }  else if (message[0] == REPORT_MOUSE) {   // If a REPORT_MOUSE header is received
-                    read_data(&message[1], 4, 10);          // Read the rest of the mouse report message (4 data bytes)
-                    xQueueSend(com_to_usb_queue, message, portMAX_DELAY); // Send the full mouse report message to the usb state machine
-                    com_state = WRITE;                      // Update communication state to WRITE
-                }  else if (message[0] == REPORT_KEYBOARD) {// If a REPORT_KEYBOARD header is received
-                    read_data(&message[1], 8, 10);          // Read the rest of the keyboard report message (8 data bytes)
-                    xQueueSend(com_to_usb_queue, message, portMAX_DELAY); // Send the full keyboard report message to the usb state machine
-                    com_state = WRITE;                      // Update communication state to WRITE
-                }  else if (message[0] == STATE) {          // If a STATE header is received
-                    ESP_LOGW(TAG, "Received STATE, comparing with own state and deciding what to do.");
-                    read_data(&message[1], 1, 10);          // Read the rest of the state message (1 data byte)
-                    uint8_t desired_state = UNKNOWN;
-                    switch (usb_state) {                    // Map own usb state to desired state of other device
-                        case UNKNOWN:           desired_state = UNKNOWN;            break;
-                        case DEVICE_UNKNOWN:    desired_state = HOST_UNKNOWN;       break;
-                        case DEVICE_DATASTICK:  desired_state = HOST_DATASTICK;     break;
-                        case DEVICE_KEYBOARD:   desired_state = HOST_KEYBOARD;      break;
-                        case DEVICE_MOUSE:      desired_state = HOST_MOUSE;         break;
-                        case HOST_UNKNOWN:      desired_state = DEVICE_UNKNOWN;     break;
-                        case HOST_DATASTICK:    desired_state = DEVICE_DATASTICK;   break;
-                        case HOST_KEYBOARD:     desired_state = DEVICE_KEYBOARD;    break;
-                        case HOST_MOUSE:        desired_state = DEVICE_MOUSE;       break;
-                    }
-                    if (message[1] == desired_state) {      // Compare received state with what own usb state desires
-                        ESP_LOGW(TAG, "States match, moving on.");
-                        com_state = WRITE;                  // If they match, update communication state to WRITE
-                    } else {                                // If states do not match, return a state message and abort to UNKNOWN
-                        ESP_LOGW(TAG, "States do not match, aborting to UNKNOWN.");
-                        message[0] = (uint8_t)STATE;        // Prepare STATE message
-                        message[1] = usb_state;
-                        send_data(message, 2);              // Transmit STATE message
-                        xQueueSend(com_to_usb_queue, message, portMAX_DELAY); // Send message to usb state machine to return to UNKNOWN        
-                    }
-                } else {                                    // If an unexpected or no header is received, return to BACKOFF
-                    ESP_LOGW(TAG, "Timeout or received an unexpected header, returning state to BACKOFF.");
-                    com_state = BACKOFF;
-                }
-                break;
-        }
-    }
-}
\ No newline at end of file
+#include <stdatomic.h>
+
+#include "state_machines.h"
+#include "esp_log.h"
+#include "esp_random.h"
+
+#include "Tools/UARTTools.h"
+#include "Tools/Transport.h"
+#include "Tools/LatencyTools.h"
+#include "Tools/ReportPool.h"
+#include "Tools/MouseCoalescer.h"
+#include "Tools/MSCBridge.h"
+#include "Tools/LinkARQ.h"
+#include "Tools/Telemetry.h"
+#include "Tools/LinkRate.h"
+#include "Tools/LinkScheduler.h"
+#include "Tools/LinkTrace.h"
+#include "Tools/ReportCodec.h"
+#include "Tools/StaticMemory.h"
+#include "Tools/PowerTools.h"
+#include "Tools/OutputReports.h"
+#include "Tools/HIDPassthrough.h"
+
+static const char *TAG = "COM SM";    // Tag used for ESP logging
+
+#define HB_PERIOD 1000                // Heartbeat period in milliseconds
+#define HB_IDLE_PERIOD   4000         // Heartbeat period once the link is idle (Tools/PowerTools.h)
+#define HB_UNIT_MS       100          // Unit of the heartbeat period an ACK announces
+#define MIN_BACKOFF_MS   100          // Minimum backoff in milliseconds
+#define MAX_BACKOFF_MS   1000         // Maximum backoff in milliseconds
+#define IDLE_BACKOFF_MS  4000         // Maximum backoff once HELLOs have gone unanswered for IDLE_AFTER_MS
+#define RESUME_PING_MS   10           // A reconnecting initiator sends RESUME this often (one tick, a reply ends the wait at once)
+#define RESUME_TIMEOUT_MS (2*HB_PERIOD)// Give up resuming the last session after this long and start over with BACKOFF
+#define DUPLEX_SUPPORTED 1            // Set to 0 to force the half-duplex READ/WRITE link mode on this board
+#define SEQ_ROLE_BIT     0x80         // Top bit of the full-duplex sequence byte identifies the sender (filters out our own reflected frames)
+#define SEQ_MASK         0x7F         // Lower 7 bits of the full-duplex sequence byte hold the sequence number
+#define MAX_MESSAGE_LENGTH MAX_FRAME_PAYLOAD // Longest message a frame can carry
+#define PROBE_MARGIN_MS  50           // Added to the air time of the peer's training frames: its reaction to RATE and task wake-ups
+#define NO_RUNG          0xFF         // rate_request when no rate change is pending
+
+static uint8_t header;                // Variable to hold the received header
+static uint8_t message[MAX_MESSAGE_LENGTH]; // Buffer to hold messages (max size set by the frame payload)
+static uint8_t resend[MAX_MESSAGE_LENGTH];  // Unacknowledged reliable message being sent again
+
+enum COM_STATE {                      // Define all the states of the communication state machine
+    BACKOFF,                             // Backoff state attempts to estabblish half-duplex communication
+    READ,                                // Read state waits for incoming messages
+    WRITE,                               // Write state sends outgoing messages
+    DUPLEX,                              // Duplex state streams outgoing messages while the RX task receives
+    RECONNECT,                           // Reconnect state resumes the last session with the roles it had, no contention
+    PROBE                                // Probe state tries a baud rate rung with the peer, then returns to the link mode
+};
+
+enum link_modes {                     // Link modes negotiated in the HELLO/HEARD handshake
+    HALF_DUPLEX,                         // READ/WRITE turn-taking, always supported
+    FULL_DUPLEX                          // Separate TX and RX tasks with sequence-numbered frames
+};
+
+static uint8_t link_mode = HALF_DUPLEX;       // Link mode agreed in the last handshake
+static uint8_t link_role = 0;                 // SEQ_ROLE_BIT if this board answered the HELLO, 0 if it sent it
+static uint8_t tx_seq = 0;                    // Sequence number of the next full-duplex frame sent
+static volatile bool duplex_link_up = false;  // Cleared by the RX task when the full-duplex link times out
+MEMORY_TASK(duplex_rx_memory, "COM RX", STACK_COM_RX); // Full-duplex RX task, created on first use
+static TickType_t last_heartbeat = 0;         // Tick count when the last ACK heartbeat was sent
+static volatile uint16_t peer_period = HB_PERIOD; // Heartbeat period the peer announced in its last ACK
+static uint16_t announced_period = HB_PERIOD; // Heartbeat period this board announced in its last ACK
+static bool session = false;                  // Set by a handshake, a lost link is then resumed (RECONNECT) instead of renegotiated (BACKOFF)
+static volatile bool duplex_rx_parked = true; // The RX task is waiting for duplex_start and leaves the receiver to this task
+static uint8_t rate_ceiling = RATE_BASE;      // Fastest baud rate rung both boards offer, agreed in the handshake
+static volatile uint8_t rate_request = NO_RUNG; // Rung a RATE message (received, or this board's own decision) asks for
+static TaskHandle_t com_task = NULL;          // Woken by the RX task when it hands the receiver over or has a reply to send
+static atomic_uchar duplex_reply = NO_HEADER;  // STATE or RESUME the RX task wants answered, sent by this task like every other frame
+
+static uint8_t next_seq(void) {                    // Sequence byte of the next frame sent: role bit + 7-bit sequence number
+    return link_role | (tx_seq++ & SEQ_MASK);
+}
+
+static uint8_t message_length(const uint8_t *msg) { // Full length (header + data bytes) of a message, compact reports say theirs in their meta byte
+    switch (msg[0]) {
+        case HELLO:
+        case HEARD:           return 4;
+        case STATE:
+        case RESUME:
+        case RATE:            return 2;
+        case UPDATE:          return 3;
+        case ACK:             return 2 + LATENCY_HEARTBEAT_LEN;   // Header, power byte, timestamps
+        case REPORT_MOUSE:    return 6 + LATENCY_TRAILER_LEN;   // Header, channel, report
+        case REPORT_KEYBOARD: return 10 + LATENCY_TRAILER_LEN;
+        case REPORT_KEYS:
+        case REPORT_MOTION:   return report_compact_length(msg) + LATENCY_TRAILER_LEN;
+        case MSC_REQUEST:     return MSC_REQUEST_LENGTH;
+        case MSC_DATA:        return MSC_DATA_LENGTH;
+        case MSC_STATUS:      return MSC_STATUS_LENGTH;
+        case TRAIN:           return TRAIN_LENGTH;
+        case OUTPUT_REPORT:   return msg[4] <= OUTPUT_MAX_DATA ? OUTPUT_REPORT_LENGTH(msg[4]) : 1;   // A bad length fails the frame length check
+        case REPORT_RAW_MOUSE:
+        case REPORT_RAW:      return msg[2] <= RAW_REPORT_MAX ? REPORT_RAW_LENGTH(msg[2]) + LATENCY_TRAILER_LEN : 1;
+        case DESCRIPTOR:      return msg[4] <= DESCRIPTOR_CHUNK ? DESCRIPTOR_LENGTH(msg[4]) : 1;
+        default:              return 1;
+    }
+}
+
+static uint8_t frame_length(const uint8_t *msg) { // Message plus ARQ trailer, what a frame of the message carries
+    return message_length(msg) + arq_trailer_length(msg[0]);
+}
+
+static bool carries_traffic(const uint8_t *msg) {   // A message from or for the USB side, the link is idle without them (Tools/PowerTools.h)
+    return (msg[0] >= STATE && msg[0] <= MSC_STATUS) || msg[0] >= REPORT_KEYS;
+}
+
+static uint16_t idle_period(void) {                 // Heartbeat period for the link as it is now, longer while it is idle
+    return power_idle() ? HB_IDLE_PERIOD : HB_PERIOD;
+}
+
+static uint16_t hb_period(void) {                   // Heartbeat period in milliseconds: never longer than the last ACK announced, shorter at once when traffic resumes
+    uint16_t period = idle_period();
+    return period < announced_period ? period : announced_period;
+}
+
+static int link_timeout_ms(void) {                  // No frame from the peer for two of its heartbeat periods and the link is lost
+    uint16_t period = peer_period > idle_period() ? peer_period : idle_period();    // Both sides see the same traffic, in case the ACK announcing idle was lost
+    return 2 * (period > HB_PERIOD ? period : HB_PERIOD);
+}
+
+static void stamp_outgoing(uint8_t *msg) {          // Add latency timestamps to an outgoing (compacted) report or heartbeat
+    if (msg[0] == REPORT_MOTION || msg[0] == REPORT_KEYS || msg[0] == REPORT_RAW || msg[0] == REPORT_RAW_MOUSE) {
+        latency_report_transmit(&msg[message_length(msg) - LATENCY_TRAILER_LEN]);
+    } else if (msg[0] == ACK) {
+        announced_period = idle_period();       // The next heartbeat keeps to it, the ones before kept to the last announced
+        msg[1] = (power_sleeps() ? POWER_SLEEPS : 0) | announced_period / HB_UNIT_MS;
+        latency_fill_heartbeat(&msg[2]);
+        last_heartbeat = xTaskGetTickCount();
+    }
+}
+
+static bool heartbeat_due(void) {                   // True once a heartbeat period has passed without sending an ACK (keeps the clock offset fresh under traffic)
+    return xTaskGetTickCount() - last_heartbeat >= pdMS_TO_TICKS(hb_period());
+}
+
+static uint8_t *next_outgoing(TickType_t ticks_to_wait) { // Next message for the link: an update, report or datastick message (copied into message) or a report slot, NULL on timeout
+    TickType_t start = xTaskGetTickCount();
+    bool batched = false;               // The coalescer already waited for the transmitter once
+    while (1) {
+        uint8_t answer = atomic_exchange(&duplex_reply, NO_HEADER);
+        if (answer != NO_HEADER) {         // The peer's STATE or RESUME, answered before anything else
+            message[0] = answer;
+            message[1] = usb_state;
+            return message;
+        }
+        if (arq_retransmit(resend)) {   // Lost updates and keyboard reports before anything new
+            return resend;
+        }
+        bool window = !arq_window_full();   // Updates and keyboard reports wait while the window is full
+        UBaseType_t waiting = uxQueueMessagesWaiting(usb_to_com_queue);
+        scheduler_ready(CLASS_CONTROL, window && (waiting > 0 || passthrough_pending()));
+        scheduler_ready(CLASS_KEYBOARD, window && report_pool_pending(false));
+        scheduler_ready(CLASS_MOUSE, coalesce_pending() || report_pool_pending(true));
+        scheduler_ready(CLASS_OUTPUT, window && output_pending());
+        scheduler_ready(CLASS_BULK, msc_bridge_pending());
+        uint8_t class = scheduler_pick();
+        if (class == CLASS_CONTROL && passthrough_next(message)) {     // Announced before the HID_CONNECTED queued behind them
+            scheduler_served(class);
+            return message;
+        }
+        if (class == CLASS_CONTROL && xQueueReceive(usb_to_com_queue, &message, 0) == pdPASS) {
+            telemetry_high_water(TELEMETRY_USB_TO_COM, waiting);
+            scheduler_served(class);
+            return message;
+        }
+        if (class == CLASS_KEYBOARD) {
+            uint8_t *slot = report_pool_take(false);
+            latency_report_dequeued(false);
+            scheduler_served(class);
+            return slot;
+        }
+        if (class == CLASS_MOUSE && report_pool_pending(true)) {   // A report protocol mouse, its reports cannot be merged
+            uint8_t *slot = report_pool_take(true);
+            latency_report_dequeued(true);
+            scheduler_served(class);
+            return slot;
+        }
+        if (class == CLASS_MOUSE) {     // Mouse motion merged since the last report
+            if (coalesce_batching() && !batched) {  // Link slower than the mouse, let the previous report leave first so more motion merges into this one
+                transport_wait_tx_done(HB_PERIOD);
+                batched = true;
+                continue;               // A keystroke may have arrived meanwhile
+            }
+            if (coalesce_take(message)) {
+                scheduler_served(class);
+                return message;
+            }
+        }
+        if (class == CLASS_OUTPUT && output_next(message)) {
+            scheduler_served(class);
+            return message;
+        }
+        if ((class == CLASS_BULK || class == CLASS_NONE) && msc_bridge_next(message)) { // Also checks datastick transfers for timeouts
+            scheduler_served(CLASS_BULK);
+            return message;
+        }
+        if (arq_ack_due()) {            // Nothing to carry the acknowledgement of a reliable message, send it on a heartbeat
+            message[0] = (uint8_t)ACK;
+            return message;
+        }
+        if (xTaskGetTickCount() - start >= ticks_to_wait || (link_mode == FULL_DUPLEX && !duplex_link_up)) {
+            return NULL;                // Also leave DUPLEX at once when the RX task times out
+        }
+        ulTaskNotifyTake(pdTRUE, 1);    // Woken at once by report_pool_publish, the MSC bridge and the ARQ receiver, updates and retransmit timers are polled every tick
+    }
+}
+
+static void release_outgoing(uint8_t *outgoing) {  // Hand a transmitted report slot back to the HID host callbacks
+    if (outgoing != message && outgoing != resend) {
+        report_pool_release(outgoing);
+    }
+}
+
+static void mouse_sent(int64_t start, uint8_t coded_length) {  // Tell the coalescer how long one mouse report occupied the link
+    int64_t wire_us = (int64_t)coded_length * 10 * 1000000 / rate_baud(rate_current());   // 10 bits per UART byte
+    int64_t blocked_us = esp_timer_get_time() - start;                      // Longer if the UART FIFO was still full
+    coalesce_link_time(blocked_us > wire_us ? blocked_us : wire_us);
+}
+
+static uint8_t prepare_frame(uint8_t *msg) {        // Compact and stamp a new message and hand it to the ARQ window, then append the trailer, returns the frame length
+    if (msg != resend) {                            // A retransmission goes out exactly as it did the first time
+        if (carries_traffic(msg)) {
+            power_traffic();
+        }
+        if (msg[0] == REPORT_MOUSE || msg[0] == REPORT_KEYBOARD || msg[0] == REPORT_RAW || msg[0] == REPORT_RAW_MOUSE) {
+            telemetry_count(TELEMETRY_REPORTS_SENT, 1);
+            report_compact(msg);                    // Keyboard deltas in the order the ARQ delivers them, raw reports go as they are
+        }
+        stamp_outgoing(msg);
+        arq_track(msg, message_length(msg));
+    }
+    return arq_fill_trailer(msg, message_length(msg));
+}
+
+static void stamp_incoming(const uint8_t *msg, bool wake) {    // Read latency timestamps from a received report or heartbeat, wake if it ended an idle period
+    if (msg[0] == REPORT_MOUSE || msg[0] == REPORT_KEYBOARD || msg[0] == REPORT_RAW || msg[0] == REPORT_RAW_MOUSE) {
+        latency_report_decoded(&msg[message_length(msg) - LATENCY_TRAILER_LEN], msg[0] == REPORT_MOUSE || msg[0] == REPORT_RAW_MOUSE, wake);
+    } else if (msg[0] == ACK) {
+        peer_period = (msg[1] & ~POWER_SLEEPS) * HB_UNIT_MS;
+        power_peer_sleeps(msg[1] & POWER_SLEEPS);
+        latency_read_heartbeat(&msg[2]);
+    }
+}
+
+static void deliver_message(uint8_t *msg) {         // Pass a received message on to the usb state machine or the MSC bridge
+    report_expand(msg);                             // Reliable keyboard deltas arrive here in order
+    stamp_incoming(msg, carries_traffic(msg) && power_traffic());
+    switch (msg[0]) {
+        case UPDATE:
+            ESP_LOGW(TAG, "Received UPDATE, sending to USB state machine.");
+            // fall through
+        case REPORT_MOUSE:
+        case REPORT_KEYBOARD:
+        case REPORT_RAW:
+        case REPORT_RAW_MOUSE:
+            xQueueSend(msg[0] == REPORT_MOUSE || msg[0] == REPORT_RAW_MOUSE ? com_to_usb_mouse_queue : com_to_usb_queue, msg, portMAX_DELAY); // Send the full message to the usb state machine
+            telemetry_high_water(TELEMETRY_COM_TO_USB, uxQueueMessagesWaiting(com_to_usb_queue) + uxQueueMessagesWaiting(com_to_usb_mouse_queue));
+            if (msg[0] != UPDATE) {
+                telemetry_count(TELEMETRY_REPORTS_RECEIVED, 1);
+            }
+            break;
+        case MSC_REQUEST:
+        case MSC_DATA:
+        case MSC_STATUS:
+            msc_bridge_receive(msg);                // Copied out at once, the bridge never blocks the receiver
+            break;
+        case OUTPUT_REPORT:
+            output_receive(msg);                    // Copied out too, the USB task makes the control transfer
+            break;
+        case DESCRIPTOR:
+            passthrough_receive(msg);               // Ahead of the HID_CONNECTED that maps it
+            break;
+        default:                                    // ACK heartbeats only carry timestamps and acknowledgements
+            break;
+    }
+}
+
+static void deliver_held(uint8_t *msg) {            // Deliver reliable messages in order while the usb state machine has room for them
+    while (uxQueueSpacesAvailable(com_to_usb_queue) > 0 && arq_deliver(msg)) {
+        deliver_message(msg);                       // Held in the ARQ while the USB task is busy, their acknowledgement waits too
+    }
+}
+
+static void receive_message(uint8_t *msg) {         // Run a received message through the ARQ, delivering whatever is now in order
+    bool room = uxQueueSpacesAvailable(com_to_usb_mouse_queue) > 0;
+    if (arq_receive(msg, message_length(msg)) && (room || (msg[0] != REPORT_MOTION && msg[0] != REPORT_RAW_MOUSE))) {
+        deliver_message(msg);                       // USB task busy (e.g. enumerating) drops a mouse report rather than stop reading and overrun the UART
+    }
+    deliver_held(msg);
+}
+
+static bool states_match(uint8_t peer_state) {      // Compare the other device's usb state with own, on a mismatch tell the usb state machine to return to UNKNOWN
+    uint8_t desired_state = UNKNOWN;
+    switch (usb_state) {                    // Map own usb state to desired state of other device
+        case UNKNOWN:           desired_state = UNKNOWN;            break;
+        case DEVICE_UNKNOWN:    desired_state = HOST_UNKNOWN;       break;
+        case DEVICE_DATASTICK:  desired_state = HOST_DATASTICK;     break;
+        case DEVICE_HID:        desired_state = HOST_HID;           break;
+        case HOST_UNKNOWN:      desired_state = DEVICE_UNKNOWN;     break;
+        case HOST_DATASTICK:    desired_state = DEVICE_DATASTICK;   break;
+        case HOST_HID:          desired_state = DEVICE_HID;         break;
+    }
+    if (peer_state == desired_state) {      // Compare received state with what own usb state desires
+        ESP_LOGW(TAG, "States match, moving on.");
+        return true;
+    }
+    ESP_LOGW(TAG, "States do not match, aborting to UNKNOWN.");
+    uint8_t abort[MAX_MESSAGE_LENGTH] = {(uint8_t)STATE, usb_state};
+    xQueueSend(com_to_usb_queue, abort, portMAX_DELAY); // Send message to usb state machine to return to UNKNOWN
+    return false;
+}
+
+static uint8_t transmit(uint8_t *msg) {             // Frame and send a message, the same in both link modes, returns the frame length
+    power_before_transmit();                        // A peer in light sleep would lose the frame's first bytes, woken before the timestamps
+    uint8_t length = prepare_frame(msg);
+    send_frame(msg, next_seq(), length);
+    return length;
+}
+
+static void reply(uint8_t header) {                // Answer with own usb state, only this task sends: the full-duplex RX task hands the reply over
+    if (xTaskGetCurrentTaskHandle() != com_task) {
+        atomic_store(&duplex_reply, header);
+        xTaskNotifyGive(com_task);          // Sent by next_outgoing
+        return;
+    }
+    uint8_t answer[MAX_MESSAGE_LENGTH] = {header, usb_state};
+    transmit(answer);
+}
+
+static bool handle_state(uint8_t *state_message) { // Compare a received STATE message with own usb state, true if they match
+    arq_receive(state_message, message_length(state_message)); // Only its acknowledgements
+    if (states_match(state_message[1])) {
+        return true;
+    }
+    if (link_role == SEQ_ROLE_BIT) {        // Only answer the initiator's STATE, answering an answer would ping-pong forever
+        reply(STATE);                       // Transmit STATE message
+    }
+    return false;
+}
+
+static void handle_resume(uint8_t *resume_message) { // The answerer replies to every RESUME (its reply may have been lost), both compare usb states
+    arq_receive(resume_message, message_length(resume_message));
+    if (link_role == SEQ_ROLE_BIT) {
+        reply(RESUME);
+    }
+    states_match(resume_message[1]);        // The link is back either way, a mismatch only resets the usb state machines
+}
+
+// -------------------------------- FULL-DUPLEX --------------------------------
+
+static void duplex_rx_task(void *arg) {         // Receives full-duplex frames while com_state_machine transmits
+    uint8_t rx_message[MAX_MESSAGE_LENGTH];
+    uint8_t seq = 0;
+    uint8_t expected_seq = 0;
+    bool first_frame = true;
+    while (1) {
+        duplex_rx_parked = true;
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);    // Park until com_state_machine starts a full-duplex session
+        duplex_rx_parked = false;
+        first_frame = true;
+        TickType_t last_frame = xTaskGetTickCount();
+        while (duplex_link_up) {
+            int length = read_frame(rx_message, &seq, arq_holding() ? 10 : link_timeout_ms()); // Attempt to read a frame, polling every 10 ms while reliable messages wait for the USB task
+            if (xTaskGetTickCount() - last_frame >= pdMS_TO_TICKS(link_timeout_ms())) {
+                ESP_LOGW(TAG, "Full-duplex timeout, returning state to %s.", session ? "RECONNECT" : "BACKOFF");  // No valid frame for two heartbeats (reflections or a peer handshaking again do not count)
+                duplex_link_up = false;
+                break;
+            }
+            if (length == 0) {
+                deliver_held(rx_message);
+                continue;
+            }
+            if (length == FRAME_CORRUPT || length != frame_length(rx_message)) {
+                continue;                               // Skip a frame the CRC rejected (counted as lost by the sequence check) or a message of the wrong size
+            }
+            if (rx_message[0] == HELLO || rx_message[0] == HEARD || rx_message[0] == TRAIN) {
+                continue;                               // Handshake reflected or the peer starting over (the heartbeat timeout catches that), or a late training frame
+            }
+            if ((seq & SEQ_ROLE_BIT) == link_role) {    // Our own frame reflected back, ignore it
+                continue;
+            }
+            last_frame = xTaskGetTickCount();
+            follow_fec_request();
+            if (!first_frame && (seq & SEQ_MASK) != expected_seq) {
+                ESP_LOGW(TAG, "Lost %d full-duplex frame(s).", ((seq & SEQ_MASK) - expected_seq) & SEQ_MASK);
+            }
+            first_frame = false;
+            expected_seq = (seq + 1) & SEQ_MASK;
+            if (rx_message[0] == STATE) {
+                ESP_LOGW(TAG, "Received STATE, comparing with own state and deciding what to do.");
+                handle_state(rx_message);
+            } else if (rx_message[0] == RESUME) {
+                handle_resume(rx_message);
+            } else if (rx_message[0] == RATE) {         // The peer starts a probe or asks for one, hand the receiver to com_state_machine
+                arq_receive(rx_message, message_length(rx_message));
+                rate_request = rx_message[1];
+                duplex_link_up = false;
+                xTaskNotifyGive(com_task);
+                break;
+            } else {
+                receive_message(rx_message);
+            }
+        }
+    }
+}
+
+static void duplex_wait_parked(void) {          // The RX task has left the receiver, this task may read frames
+    while (!duplex_rx_parked) {
+        vTaskDelay(1);
+    }
+}
+
+static void duplex_start(void) {                // Enter full-duplex mode, starting (or waking) the RX task
+    tx_seq = 0;
+    atomic_store(&duplex_reply, NO_HEADER);
+    duplex_link_up = true;
+    xTaskNotifyGive(memory_task_start(&duplex_rx_memory, duplex_rx_task, NULL, 2, 1));
+}
+
+// -------------------------------- RATE --------------------------------
+
+static int probe_wait_ms(void) {                // Air time of the peer's training frames at the current rung, plus its reaction time
+    return TRAIN_FRAMES * frame_coded_length(TRAIN_LENGTH + arq_trailer_length(TRAIN)) * 10 * 1000 / rate_baud(rate_current()) + PROBE_MARGIN_MS;
+}
+
+static void send_training(uint8_t verdict) {
+    uint8_t training[MAX_MESSAGE_LENGTH];
+    for (uint8_t i = 0; i < TRAIN_FRAMES; i++) {
+        rate_fill_training(training, i, verdict);
+        transmit(training);
+    }
+}
+
+static uint8_t receive_training(uint8_t *verdict) { // Read the peer's training frames until its last one or the wait runs out, returns how many arrived intact
+    uint8_t training[MAX_MESSAGE_LENGTH];
+    uint8_t seq = 0;
+    uint8_t good = 0;
+    int wait_ms = probe_wait_ms();
+    TickType_t start = xTaskGetTickCount();
+    while (1) {
+        int remaining_ms = wait_ms - (int)pdTICKS_TO_MS(xTaskGetTickCount() - start);
+        if (remaining_ms <= 0) {
+            return good;
+        }
+        int length = read_frame(training, &seq, remaining_ms);
+        if (length != frame_length(training) || training[0] != TRAIN || (seq & SEQ_ROLE_BIT) == link_role || !rate_training_valid(training)) {
+            continue;                           // Nothing yet, a reflection, or a frame from before the switch
+        }
+        arq_receive(training, message_length(training));  // Only its acknowledgements
+        good++;
+        *verdict = training[2];
+        if (training[1] == TRAIN_FRAMES - 1) {
+            return good;
+        }
+    }
+}
+
+static bool probe_rate(uint8_t rung) {          // Initiator: move both sides to rung and exchange training frames, back to the previous rung unless both passed
+    uint8_t previous = rate_current();
+    uint8_t verdict = 0;
+    uint8_t probe[MAX_MESSAGE_LENGTH] = {(uint8_t)RATE, rung};
+    transmit(probe);
+    rate_set(rung);                             // Once RATE has left at the old rate
+    rate_probe_start();
+    bool passed = rate_probe_passed(receive_training(&verdict));
+    send_training(passed);
+    bool confirmed = receive_training(&verdict) > 0 && verdict;  // Wait for the answerer's verdict even after a failure, it only switches back once it has sent it
+    if (passed && confirmed) {
+        ESP_LOGW(TAG, "Link rate %d baud.", rate_baud(rung));
+        return true;
+    }
+    ESP_LOGW(TAG, "%d baud failed its probe, staying at %d baud.", rate_baud(rung), rate_baud(previous));
+    rate_set(previous);
+    return false;
+}
+
+static void answer_probe(uint8_t rung) {        // Answerer: follow the initiator to rung, keep it only if both sides passed
+    uint8_t previous = rate_current();
+    uint8_t verdict = 0;
+    rate_set(rung);
+    send_training(1);                           // The verdict only counts in the second round
+    rate_probe_start();
+    bool passed = rate_probe_passed(receive_training(&verdict)) && verdict;
+    send_training(passed);
+    if (passed) {
+        ESP_LOGW(TAG, "Link rate %d baud.", rate_baud(rung));
+        return;
+    }
+    rate_set(previous);
+    if (rung > previous) {
+        rate_step_up_failed();
+    }
+}
+
+static void settle_rate(void) {                 // Initiator after the handshake: the fastest rung both offer that passes its probe
+    for (uint8_t rung = rate_ceiling; rung > RATE_BASE; rung--) {
+        if (probe_rate(rung)) {
+            return;
+        }
+    }
+}
+
+static bool follow_rate(void) {                 // Answerer after HEARD: answer the initiator's probes until its STATE arrives in message, false if it did not
+    uint8_t seq = 0;
+    while (1) {
+        int length = read_frame(message, &seq, 2*HB_PERIOD);
+        if (length <= 0 || length != frame_length(message) || (seq & SEQ_ROLE_BIT) == link_role || message[0] == TRAIN) {
+            if (length == 0) {
+                return false;                   // Timed out, the link carries on as if STATE was lost
+            }
+            continue;                           // A corrupt frame, a reflection or a late training frame
+        }
+        if (message[0] != RATE) {
+            return message[0] == STATE;
+        }
+        arq_receive(message, message_length(message));
+        if (message[1] <= rate_ceiling) {
+            answer_probe(message[1]);
+        }
+    }
+}
+
+static void request_rate(uint8_t rung) {        // The initiator takes the receiver over to probe rung, the answerer asks it to
+    if (link_role == 0) {
+        rate_request = rung;
+        if (link_mode == FULL_DUPLEX) {
+            duplex_link_up = false;
+            transport_cancel_receive();
+        }
+        return;
+    }
+    uint8_t request[MAX_MESSAGE_LENGTH] = {(uint8_t)RATE, rung};
+    transmit(request);
+}
+
+static uint8_t change_rate(void) {              // Probe the requested rung (initiator) or answer the probe (answerer), then carry on in the session's link mode
+    uint8_t rung = rate_request > rate_ceiling ? rate_ceiling : rate_request;
+    rate_request = NO_RUNG;
+    if (link_role == SEQ_ROLE_BIT) {
+        answer_probe(rung);
+    } else if (rung > rate_current()) {         // One rung up at a time
+        if (!probe_rate(rung)) {
+            rate_step_up_failed();
+        }
+    } else {
+        for (int slower = rung; slower >= RATE_BASE && !probe_rate(slower); slower--) {
+        }
+    }
+    if (link_mode == FULL_DUPLEX) {
+        duplex_start();
+        return DUPLEX;
+    }
+    return link_role == 0 ? WRITE : READ;       // As after RESUME, the initiator writes next
+}
+
+// -------------------------------- HANDSHAKE --------------------------------
+
+static uint8_t handshake(void) {                // Answer a HELLO or HEARD in message, returns the next communication state
+    link_mode = (DUPLEX_SUPPORTED && message[1] == FULL_DUPLEX) ? FULL_DUPLEX : HALF_DUPLEX;
+    session = true;                             // The roles and everything agreed here are kept for RECONNECT
+    power_traffic();                            // A new session is activity, something was plugged in or powered up
+    peer_period = HB_PERIOD;                    // Until the peer's first ACK
+    power_peer_sleeps(true);
+    arq_reset();                                // New session, unacknowledged messages are sent again first
+    report_codec_reset();                       // then every keyboard's whole report, the far side may have restarted
+    if (message[0] == HELLO) {                  // message[1] holds the link modes and message[2] the FEC codes the other side supports
+        link_role = SEQ_ROLE_BIT;
+        ESP_LOGW(TAG, "Received HELLO, transmitting HEARD and updating state to %s.", link_mode == FULL_DUPLEX ? "DUPLEX" : "READ");
+        rate_ceiling = message[3] < RATE_TOP ? message[3] : RATE_TOP;
+        message[0] = (uint8_t)HEARD;            // Prepare HEARD message carrying the agreed link mode
+        message[1] = link_mode;
+        message[2] = negotiate_fec(message[2]); // the FEC codes both sides support
+        message[3] = rate_ceiling;              // and the fastest baud rate rung both offer
+        transmit(message);                      // Transmit HEARD message
+        bool state = follow_rate();             // Nothing else is sent until the rate is settled, it would be lost in a switch
+        if (link_mode == FULL_DUPLEX) {
+            duplex_start();
+            if (state) {
+                handle_state(message);
+            }
+            return DUPLEX;
+        }
+        return state && handle_state(message) ? WRITE : READ;
+    }
+    link_role = 0;                              // HEARD: message[1] holds the agreed link mode, message[2] the agreed FEC codes and message[3] the rate ceiling
+    negotiate_fec(message[2]);
+    follow_fec_request();                       // HEARD already asks for a code
+    rate_ceiling = message[3] < RATE_TOP ? message[3] : RATE_TOP;
+    ESP_LOGW(TAG, "Received HEARD, probing the link rate, transmitting STATE and updating state to %s.", link_mode == FULL_DUPLEX ? "DUPLEX" : "READ");
+    settle_rate();                              // Before the RX task starts, this task has the receiver to itself
+    message[0] = (uint8_t)STATE;                // Prepare STATE message
+    message[1] = usb_state;
+    if (link_mode == FULL_DUPLEX) {
+        duplex_start();
+    }
+    transmit(message);                          // Transmit STATE message
+    return link_mode == FULL_DUPLEX ? DUPLEX : READ;
+}
+
+static uint8_t link_lost(void) {                // Next communication state once the link stops answering
+    telemetry_count(TELEMETRY_LINK_TIMEOUTS, 1);
+    return session ? RECONNECT : BACKOFF;
+}
+
+static uint8_t reconnect(void) {                // Resume the last session: the initiator sends RESUME every RESUME_PING_MS, the answerer replies the moment one lands
+    ESP_LOGW(TAG, "Link lost, resuming the session as the %s.", link_role == SEQ_ROLE_BIT ? "answerer" : "initiator");
+    power_peer_sleeps(true);                    // It may have been unplugged meanwhile, its heartbeat period is kept until its next ACK
+    uint8_t seq = 0;
+    TickType_t start = xTaskGetTickCount();
+    while (xTaskGetTickCount() - start < pdMS_TO_TICKS(RESUME_TIMEOUT_MS)) {
+        if (link_role == 0) {                   // Roles come from the last handshake, so the two sides never contend
+            message[0] = (uint8_t)RESUME;
+            message[1] = usb_state;
+            transmit(message);
+        }
+        int length = read_frame(message, &seq, link_role == 0 ? RESUME_PING_MS : RESUME_TIMEOUT_MS);
+        if (length <= 0 || length != frame_length(message)) {
+            continue;                           // Nothing yet or a corrupt frame
+        }
+        if (message[0] == HELLO) {              // The other side restarted and lost the session (its role bit is no longer set)
+            return handshake();
+        }
+        if ((seq & SEQ_ROLE_BIT) == link_role) {
+            continue;                           // Our own RESUME reflected back
+        }
+        if (message[0] == RESUME) {
+            ESP_LOGW(TAG, "Session resumed, updating state to %s.", link_mode == FULL_DUPLEX ? "DUPLEX" : (link_role == 0 ? "WRITE" : "READ"));
+            follow_fec_request();
+            handle_resume(message);             // ARQ, FEC and link mode carry on from where the link was lost
+            if (link_mode == FULL_DUPLEX) {
+                duplex_start();
+                return DUPLEX;
+            }
+            return link_role == 0 ? WRITE : READ;   // The answerer has just replied, the initiator writes next
+        }
+    }
+    ESP_LOGW(TAG, "No answer, returning state to BACKOFF.");
+    session = false;
+    return BACKOFF;
+}
+
+// -------------------------------- STATE MACHINE --------------------------------
+
+void com_state_machine(void *arg) {   // Communication state machine function
+    uint8_t com_state = BACKOFF;      // Initialise the communication state to BACKOFF
+    uint8_t previous_state = BACKOFF; // State of the last loop, to count the returns to BACKOFF
+    uint8_t *outgoing = NULL;         // Message being transmitted, points into message or a report slot
+    int length = 0;                   // Length of the last frame read, 0 on timeout, FRAME_CORRUPT if it was rejected
+    uint8_t seq = 0;                  // Sequence byte of the last frame read (only the full-duplex RX task checks it)
+    uint32_t backoff = 0;             // Time BACKOFF listens before sending HELLO
+    bool heartbeat_sent = false;      // The last WRITE turn went to a heartbeat
+    uint8_t advice = RATE_BASE;       // Rung the error rate asks for (Tools/LinkRate.h)
+    report_pool_init(xTaskGetCurrentTaskHandle()); // Make the report slots available to the HID host callbacks
+    coalesce_init(xTaskGetCurrentTaskHandle());    // Wake this task whenever mouse motion is added
+    msc_bridge_init(xTaskGetCurrentTaskHandle());  // Wake this task whenever a datastick message is ready
+    output_init(xTaskGetCurrentTaskHandle());      // Wake this task whenever the computer sets a report
+    passthrough_init(xTaskGetCurrentTaskHandle()); // Wake this task whenever report descriptors are announced
+    arq_init(xTaskGetCurrentTaskHandle());         // Wake this task whenever a reliable message needs acknowledging
+    com_task = xTaskGetCurrentTaskHandle();        // Woken by the RX task when a RATE message arrives
+    uart_init(rate_baud(RATE_BASE));  // Initialise UART drivers at the handshake baud rate
+    memory_account("link trace", TRACE_BYTES);
+    while(1) {
+        telemetry_sample();           // Closes a telemetry period once a second (READ may wait two heartbeat periods)
+        if (com_state != previous_state) {
+            uint8_t transition[2] = {previous_state, com_state};
+            trace_record(TRACE_COM_STATE, transition, sizeof(transition));
+        }
+        if (com_state == BACKOFF && previous_state != BACKOFF) {
+            telemetry_count(TELEMETRY_BACKOFF_ENTRIES, 1);
+        }
+        previous_state = com_state;
+        switch (com_state) {          // Switch statement defining behaviour for the different communication states
+            // -------------------------------- BACKOFF STATE --------------------------------
+            case BACKOFF:
+                backoff = MIN_BACKOFF_MS + (esp_random() % ((power_idle() ? IDLE_BACKOFF_MS : MAX_BACKOFF_MS) - MIN_BACKOFF_MS)); // Generate backoff time, longer once nobody has answered for a while
+                ESP_LOGW(TAG, "Reading for %d ms.", backoff);
+                length = read_frame(message, &seq, backoff);  // Attempt to read a frame with timeout defined by the backoff time
+                header = length > 0 ? message[0] : (length == FRAME_CORRUPT ? ERROR : NO_HEADER);
+                if (header == HELLO || header == HEARD) {
+                    com_state = handshake();
+                } else if (header == NO_HEADER || header == ERROR || header == RESUME) { // No header, ERROR header or a peer trying to resume a session this side gave up
+                    ESP_LOGW(TAG, "%s, transmitting HELLO.", header == NO_HEADER ? "No header received" : (header == ERROR ? "Error header received" : "Received RESUME"));
+                    message[0] = (uint8_t)HELLO;      // Prepare HELLO message advertising the link modes this board supports
+                    message[1] = DUPLEX_SUPPORTED ? FULL_DUPLEX : HALF_DUPLEX;
+                    message[2] = FEC_SUPPORTED;       // FEC codes
+                    message[3] = RATE_TOP;            // and baud rate rungs
+                    session = false;
+                    reset_fec();                      // The peer may not be in a session any more, talk Hamming(7,4) until it answers
+                    rate_set(RATE_BASE);              // at the base rate
+                    transmit(message);                // Transmit HELLO message
+                }
+                break;
+            // -------------------------------- DUPLEX STATE --------------------------------
+            case DUPLEX:
+                outgoing = next_outgoing(pdMS_TO_TICKS(hb_period()));
+                if (outgoing != NULL) {
+                    if (outgoing[0] == UPDATE) {
+                        ESP_LOGW(TAG, "Received an update from the usb state machine, transmitting it");
+                    }
+                    int64_t start = esp_timer_get_time();
+                    uint8_t sent = transmit(outgoing);  // Transmit the message as soon as it arrives
+                    if (outgoing[0] == REPORT_MOTION) {
+                        mouse_sent(start, frame_coded_length(sent));
+                    }
+                    release_outgoing(outgoing);
+                }
+                if (heartbeat_due()) {
+                    message[0] = (uint8_t)ACK; // Transmit ACK header as a heartbeat
+                    transmit(message);
+                }
+                advice = rate_advice(rate_ceiling);
+                if (advice != rate_current() && duplex_link_up) {
+                    request_rate(advice);
+                }
+                if (!duplex_link_up) {         // RX task timed out or handed the receiver over for a rate probe
+                    duplex_wait_parked();
+                    com_state = rate_request != NO_RUNG ? PROBE : link_lost();
+                }
+                break;
+            // -------------------------------- RECONNECT STATE --------------------------------
+            case RECONNECT:
+                com_state = reconnect();
+                break;
+            // -------------------------------- PROBE STATE --------------------------------
+            case PROBE:
+                com_state = change_rate();
+                break;
+            // -------------------------------- WRITE STATE --------------------------------
+            case WRITE:
+                advice = rate_advice(rate_ceiling);
+                if (advice != rate_current()) { // Between turns the link is quiet, the initiator probes now
+                    request_rate(advice);
+                    com_state = link_role == 0 ? PROBE : READ;   // The answerer's request was its turn
+                    break;
+                }
+                outgoing = NULL;               // Set if a message was received from the usb state machine
+                bool heartbeat_turn = heartbeat_due() && !heartbeat_sent; // Never two turns in a row, an idle peer's turns are a heartbeat period apart and updates would starve
+                switch (usb_state) {
+                    case UNKNOWN:              // In unknown or host states, wait for up to the
+                    case HOST_UNKNOWN:         // heartbeat period to receive a message from
+                    case HOST_DATASTICK:       // the usb state machine
+                    case HOST_HID:
+                        if (!heartbeat_turn) {
+                            outgoing = next_outgoing(pdMS_TO_TICKS(hb_period()));
+                        }
+                        break;
+                    case DEVICE_UNKNOWN:       // In device states, check but do not
+                    case DEVICE_DATASTICK:     // wait to receive a message from
+                    case DEVICE_HID:           // the usb state machine
+                        if (!heartbeat_turn) {
+                            outgoing = next_outgoing(0);
+                        }
+                        break;
+                }
+                if (outgoing != NULL) {        // If a message was received from the usb state machine
+                    if (outgoing[0] == UPDATE) {                  // If the message is an update
+                        ESP_LOGW(TAG, "Received an update from the usb state machine, transmitting it");
+                    }
+                    transmit(outgoing);        // Reports get their timestamps, updates and keyboard reports a place in the ARQ window
+                    release_outgoing(outgoing);
+                } else {                       // If no message was received from the usb state machine
+                    message[0] = (uint8_t)ACK; // Transmit ACK as a heartbeat (carries clock offset timestamps)
+                    transmit(message);
+                }
+                heartbeat_sent = outgoing == NULL;
+                com_state = READ;              // Update communication state to READ
+                break;
+            // -------------------------------- READ STATE --------------------------------
+            case READ:
+                do {                                        // Reflections of the frame just written are dropped by read_frame, nothing to flush
+                    length = read_frame(message, &seq, link_timeout_ms()); // Attempt to read a frame with timeout defined by twice the peer's heartbeat period
+                } while (length > 0 && ((seq & SEQ_ROLE_BIT) == link_role || message[0] == TRAIN)); // Skip a late copy of our own frame, its acknowledgements are not for us, or of a training frame
+                if (length > 0) {
+                    follow_fec_request();
+                }
+                if (length <= 0 || length != frame_length(message)) {  // Rejected by the CRC, timeout or a message of the wrong size
+                    message[0] = length == FRAME_CORRUPT ? ERROR : NO_HEADER;
+                }
+                if (message[0] == ERROR) {                  // If a corrupt frame was rejected, the other side has had its turn
+                    ESP_LOGW(TAG, "Rejected a corrupt frame, updating comm state to WRITE.");
+                    com_state = WRITE;                      // Update communication state to WRITE
+                } else if (message[0] == ACK || message[0] == UPDATE || message[0] == REPORT_MOTION || message[0] == REPORT_KEYS
+                           || message[0] == MSC_REQUEST || message[0] == MSC_DATA || message[0] == MSC_STATUS || message[0] == OUTPUT_REPORT
+                           || message[0] == REPORT_RAW || message[0] == REPORT_RAW_MOUSE || message[0] == DESCRIPTOR) {
+                    receive_message(message);               // Heartbeat, update, report, datastick message, output report or descriptor, the reliable ones are delivered in order
+                    com_state = WRITE;                      // Update communication state to WRITE
+                }  else if (message[0] == STATE) {          // If a STATE header is received
+                    ESP_LOGW(TAG, "Received STATE, comparing with own state and deciding what to do.");
+                    if (handle_state(message) || link_role == 0) {
+                        com_state = WRITE;                  // If they match, or the answerer will not reply, update communication state to WRITE
+                    }
+                } else if (message[0] == RESUME) {          // The initiator missed the answer to its RESUME (or this is a late copy of ours)
+                    handle_resume(message);
+                    com_state = link_role == 0 ? WRITE : READ;
+                } else if (message[0] == RATE) {            // The initiator starts a probe, or the answerer asks for one
+                    arq_receive(message, message_length(message));
+                    rate_request = message[1];
+                    com_state = PROBE;
+                } else {                                    // If an unexpected or no header is received, resume or re-establish the link
+                    ESP_LOGW(TAG, "Timeout or received an unexpected header, returning state to %s.", session ? "RECONNECT" : "BACKOFF");
+                    com_state = link_lost();
+                }
+                break;
+        }
+    }
+}
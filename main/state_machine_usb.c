@@ -1,239 +1,268 @@
-#include "state_machines.h"
-#include "esp_log.h"
-
-#include "Tools/USBDeviceTools.h"
-#include "Tools/USBHostTools.h"
-
-static const char *TAG = "USB SM";                  // Tag used for ESP logging
-
-extern volatile uint8_t usb_state = UNKNOWN;        // Variable shared with communication state machine to hold current usb state
-
-void usb_state_machine(void *arg) {                 // USB state machine function
-    ESP_LOGI(TAG, "Initialising usb state machine");
-    uint8_t header = NO_HEADER;                     // Variable to hold received header
-    uint8_t received_data[10] = {0};                // Buffer to hold received messages (1 header + 9 data bytes)
-    uint8_t transmit_data[10] = {0};                // Buffer to hold messages to be transmitted (1 header + 9 data bytes)
-    uint8_t wait_time = 0;                          // Variable wait time to prevent watchdog timer triggering
-    enumerate_as_keyboard();                        // Temporary method to detect host, want to use phy but cant get it working
-    while (1) {
-        if (xQueueReceive(com_to_usb_queue, &received_data, wait_time) == pdPASS) {
-            header = received_data[0];              // Extract header from received message
-        } else {
-            header = NO_HEADER;                     // If no message received set header to NO_HEADER
-        }
-        switch (usb_state) {
-            case UNKNOWN:
-                // -------------------------------- CHECK EXIT CONDITIONS --------------------------------
-                if (header == UPDATE) {         // Receive an update that the other device has detected a host, thus this device is hosting a device.
-                    if (received_data[1] == HOST_CONNECTED) {
-                        disconnect_device();    // Uninstall device drivers
-                        usb_state = HOST_UNKNOWN;
-                        ESP_LOGI(TAG, "Beginning host behaviour.");
-                        host_install();         // Install host drivers
-                    }
-                }
-                if (detect_host()) {            // Detect a host
-                    ESP_LOGI(TAG, "Detected a host, informing the com state machine.");
-                    transmit_data[0] = UPDATE;
-                    transmit_data[1] = HOST_CONNECTED;
-                    xQueueSend(usb_to_com_queue, transmit_data, portMAX_DELAY);
-                    usb_state = DEVICE_UNKNOWN;
-                    wait_time = 10;
-                }
-                // -------------------------------- STATE BEHAVIOUR --------------------------------
-                vTaskDelay(pdMS_TO_TICKS(10));  // Small delay to prevent watchdog timer triggering
-                break;
-
-            case DEVICE_UNKNOWN:
-                // -------------------------------- CHECK EXIT CONDITIONS --------------------------------
-                if (header == UPDATE) {         // Receive an update that the other device has detected a device connection
-                    disconnect_device();
-                    if (received_data[1] == MOUSE_CONNECTED) {
-                        usb_state = DEVICE_MOUSE;
-                        ESP_LOGI(TAG, "Beginning mouse behaviour.");
-                        enumerate_as_mouse();
-                        vTaskDelay(pdMS_TO_TICKS(1000));
-                    } else if (received_data[1] == KEYBOARD_CONNECTED) {
-                        usb_state = DEVICE_KEYBOARD;
-                        ESP_LOGI(TAG, "Beginning keyboard behaviour.");
-                        enumerate_as_keyboard();
-                        vTaskDelay(pdMS_TO_TICKS(1000));
-                    } else if (received_data[1] == DATASTICK_CONNECTED) {
-                        usb_state = DEVICE_DATASTICK;
-                        ESP_LOGI(TAG, "Beginning datastick behaviour.");
-                        // enumerate as data stick
-                    }
-                } else if (!(detect_host())) { // Host disconnected
-                    usb_state = UNKNOWN;
-                    ESP_LOGI(TAG, "Host disconnected.");
-                    transmit_data[0] = UPDATE;
-                    transmit_data[1] = HOST_DISCONNECTED;
-                    xQueueSend(usb_to_com_queue, transmit_data, portMAX_DELAY);
-                }
-                // -------------------------------- STATE BEHAVIOUR --------------------------------
-                break;
-
-            case DEVICE_DATASTICK:
-                // -------------------------------- CHECK EXIT CONDITIONS --------------------------------
-                if (header == UPDATE) {             // Receive an update that the other device has detected a device disconnection
-                    if (received_data[1] == DEVICE_DISCONNECTED) {
-                        disconnect_device();        // Uninstall device drivers
-                        vTaskDelay(pdMS_TO_TICKS(1000));
-                        usb_state = DEVICE_UNKNOWN;
-                        enumerate_as_keyboard();    // Temporary method to detect host, want to use phy but cant get it working
-                        vTaskDelay(pdMS_TO_TICKS(1000));
-                    }
-                } else if (!(detect_host())) { // Host disconnected
-                    disconnect_device();
-                    usb_state = UNKNOWN;
-                    ESP_LOGI(TAG, "Host disconnected.");
-                    transmit_data[0] = UPDATE;
-                    transmit_data[1] = HOST_DISCONNECTED;
-                    xQueueSend(usb_to_com_queue, transmit_data, portMAX_DELAY);
-                    enumerate_as_keyboard(); // Temporary method to detect host, want to use phy but cant get it working
-                }
-                // -------------------------------- STATE BEHAVIOUR --------------------------------
-                break;
-            case DEVICE_KEYBOARD:
-                // -------------------------------- STATE BEHAVIOUR --------------------------------
-                if (header == REPORT_KEYBOARD) {
-                    send_keyboard_report_to_computer((usb_keyboard_report_t *) &received_data[1]);
-                }
-                // -------------------------------- CHECK EXIT CONDITIONS --------------------------------
-                if (header == UPDATE) {
-                    if (received_data[1] == DEVICE_DISCONNECTED) {
-                        disconnect_device();
-                        vTaskDelay(pdMS_TO_TICKS(1000));
-                        usb_state = DEVICE_UNKNOWN;
-                        enumerate_as_keyboard(); // Temporary method to detect host, want to use phy but cant get it working
-                        vTaskDelay(pdMS_TO_TICKS(1000));
-                    }
-                } else if (!(detect_host())) { // Host disconnected
-                    disconnect_device();
-                    usb_state = UNKNOWN;
-                    ESP_LOGI(TAG, "Host disconnected.");
-                    transmit_data[0] = UPDATE;
-                    transmit_data[1] = HOST_DISCONNECTED;
-                    xQueueSend(usb_to_com_queue, transmit_data, portMAX_DELAY);
-                    enumerate_as_keyboard(); // Temporary method to detect host, want to use phy but cant get it working
-                }
-                break;
-            case DEVICE_MOUSE:
-                // -------------------------------- STATE BEHAVIOUR --------------------------------
-                if (header == REPORT_MOUSE) {
-                    //ESP_LOGI(TAG, "Received a mouse report.");
-                    send_mouse_report_to_computer((usb_mouse_report_t *) &received_data[1]);
-                }
-                // -------------------------------- CHECK EXIT CONDITIONS --------------------------------
-                if (header == UPDATE) {
-                    if (received_data[1] == DEVICE_DISCONNECTED) {
-                        ESP_LOGI(TAG, "Received an update, uninstalling mouse drivers.");
-                        disconnect_device();
-                        vTaskDelay(pdMS_TO_TICKS(1000));
-                        usb_state = DEVICE_UNKNOWN;
-                        enumerate_as_keyboard(); // Temporary method to detect host, want to use phy but cant get it working
-                        vTaskDelay(pdMS_TO_TICKS(1000));
-                    }
-                } else if (!(detect_host())) { // Host disconnected
-                    disconnect_device();
-                    vTaskDelay(pdMS_TO_TICKS(1000));
-                    usb_state = UNKNOWN;
-                    ESP_LOGI(TAG, "Host disconnected.");
-                    transmit_data[0] = UPDATE;
-                    transmit_data[1] = HOST_DISCONNECTED;
-                    xQueueSend(usb_to_com_queue, transmit_data, portMAX_DELAY);
-                    enumerate_as_keyboard(); // Temporary method to detect host, want to use phy but cant get it working
-                    vTaskDelay(pdMS_TO_TICKS(1000));
-                }
-                
-                break;
-            case HOST_UNKNOWN:
-                // -------------------------------- CHECK EXIT CONDITIONS --------------------------------
-                if (detect_device() == NONE) {
-                    // Stay in HOST_UNKNOWN
-                } else if (detect_device() == MOUSE) {
-                    ESP_LOGI(TAG, "Mouse detected.");
-                    usb_state = HOST_MOUSE;
-                    transmit_data[0] = UPDATE;
-                    transmit_data[1] = MOUSE_CONNECTED;
-                    xQueueSend(usb_to_com_queue, transmit_data, portMAX_DELAY);
-                } else if (detect_device() == KEYBOARD) {
-                    ESP_LOGI(TAG, "Keyboard detected.");
-                    usb_state = HOST_KEYBOARD;
-                    transmit_data[0] = UPDATE;
-                    transmit_data[1] = KEYBOARD_CONNECTED;
-                    xQueueSend(usb_to_com_queue, transmit_data, portMAX_DELAY);
-                } else if (detect_device() == DATASTICK) {
-                    ESP_LOGI(TAG, "Datastick detected.");
-                    usb_state = HOST_DATASTICK;
-                    transmit_data[0] = UPDATE;
-                    transmit_data[1] = DATASTICK_CONNECTED;
-                    xQueueSend(usb_to_com_queue, transmit_data, portMAX_DELAY);
-                }
-                if (header == UPDATE) { // Receive an update that the other device has detected a host disconnection, thus this device no longer needs to host a device
-                    if (received_data[1] == HOST_DISCONNECTED) {
-                        host_uninstall();
-                        usb_state = UNKNOWN;
-                        enumerate_as_keyboard(); // Temporary method to detect host, want to use phy but cant get it working
-                    }
-                }
-                // -------------------------------- STATE BEHAVIOUR --------------------------------
-                handle_hosting();
-                break;
-            case HOST_DATASTICK:
-                // -------------------------------- CHECK EXIT CONDITIONS --------------------------------
-                if (detect_device() == NONE) {
-                    usb_state = HOST_UNKNOWN;
-                }
-                if (header == UPDATE) { // Receive an update that the other device has detected a host disconnection, thus this device no longer needs to host a device
-                    if (received_data[1] == HOST_DISCONNECTED) {
-                        host_uninstall();
-                        usb_state = UNKNOWN;
-                        enumerate_as_keyboard(); // Temporary method to detect host, want to use phy but cant get it working
-                    }
-                }
-                // -------------------------------- STATE BEHAVIOUR --------------------------------
-                handle_hosting();
-                break;
-            case HOST_KEYBOARD:
-                // -------------------------------- CHECK EXIT CONDITIONS --------------------------------
-                if (detect_device() == NONE) {
-                    usb_state = HOST_UNKNOWN;
-                    ESP_LOGI(TAG, "Keyboard disconnected.");
-                    transmit_data[0] = UPDATE;
-                    transmit_data[1] = DEVICE_DISCONNECTED;
-                    xQueueSend(usb_to_com_queue, transmit_data, portMAX_DELAY);
-                }
-                if (header == UPDATE) { // Receive an update that the other device has detected a host disconnection, thus this device no longer needs to host a device
-                    if (received_data[1] == HOST_DISCONNECTED) {
-                        host_uninstall();
-                        usb_state = UNKNOWN;
-                        enumerate_as_keyboard(); // Temporary method to detect host, want to use phy but cant get it working
-                    }
-                }
-                // -------------------------------- STATE BEHAVIOUR --------------------------------
-                handle_hosting();
-                break;
-            case HOST_MOUSE:
-                // -------------------------------- CHECK EXIT CONDITIONS --------------------------------
-                if (detect_device() == NONE) {
-                    usb_state = HOST_UNKNOWN;
-                    ESP_LOGI(TAG, "Mouse disconnected.");
-                    transmit_data[0] = UPDATE;
-                    transmit_data[1] = DEVICE_DISCONNECTED;
-                    xQueueSend(usb_to_com_queue, transmit_data, portMAX_DELAY);
-                }
-                if (header == UPDATE) { // Receive an update that the other device has detected a host disconnection, thus this device no longer needs to host a device
-                    if (received_data[1] == HOST_DISCONNECTED) {
-                        ESP_LOGI(TAG, "Received host disconnected update, uninstalling host drivers.");
-                        host_uninstall();
-                        usb_state = UNKNOWN;
-                        enumerate_as_keyboard(); // Temporary method to detect host, want to use phy but cant get it working
-                    }
-                }
-                // -------------------------------- STATE BEHAVIOUR --------------------------------
-                handle_hosting();
-                break;
-        }
-    }
-}
\ No newline at end of file
+#include "state_machines.h"
+#include "esp_log.h"
+
+#include "Tools/USBDeviceTools.h"
+#include "Tools/USBHostTools.h"
+#include "Tools/LatencyTools.h"
+#include "Tools/MSCBridge.h"
+#include "Tools/LinkTrace.h"
+#include "Tools/PowerTools.h"
+#include "Tools/OutputReports.h"
+#include "Tools/HIDPassthrough.h"
+
+#define USB_POLL_MS 1000                            // Guards are checked again this often without an event, in case a callback never came
+
+static const char *TAG = "USB SM";                  // Tag used for ESP logging
+
+volatile uint8_t usb_state = UNKNOWN;               // Variable shared with communication state machine to hold current usb state
+
+enum triggers {             // What a transition reacts to, after the update types of enum updates
+    ON_REPORT = DEVICE_DISCONNECTED + 1,    // A keyboard or mouse report from the com state machine
+    ON_CHANGE               // A local event, the poll timer or entering the state: the row's guard decides
+};
+
+typedef struct {            // One row of the transition table
+    uint8_t state;              // enum USBstate the row applies in
+    uint8_t trigger;            // enum updates for an update from the com state machine, otherwise enum triggers
+    bool (*guard)(void);        // NULL if the trigger alone decides
+    void (*action)(const uint8_t *message);    // The update or report that triggered it, NULL for ON_CHANGE
+    uint8_t next;               // enum USBstate, set before the action runs
+} transition_t;
+
+static uint8_t layout = 0;                          // HID devices being hosted (HOST_HID) or bridged to the computer (DEVICE_HID), see CHANNEL_TYPE
+
+static void send_update(uint8_t update, uint8_t detail) {
+    uint8_t transmit_data[USB_MESSAGE_SIZE] = {UPDATE, update, detail};
+    xQueueSend(usb_to_com_queue, transmit_data, portMAX_DELAY);
+}
+
+// -------------------------------- GUARDS --------------------------------
+
+static bool host_present(void) {
+    return detect_host();
+}
+
+static bool host_absent(void) {
+    return !detect_host();
+}
+
+static bool hid_present(void) {
+    return hid_layout() != 0;
+}
+
+static bool hid_absent(void) {
+    return hid_layout() == 0;
+}
+
+static bool hid_changed(void) {                     // A device joined or left the hub
+    return hid_layout() != layout;
+}
+
+static bool stick_present(void) {
+    return detect_device() == DATASTICK;
+}
+
+static bool stick_absent(void) {
+    return detect_device() == NONE;
+}
+
+// -------------------------------- ACTIONS --------------------------------
+
+static void start_hosting(const uint8_t *message) { // The other device has detected a host, thus this device is hosting a device
+    disconnect_device();                            // Uninstall device drivers, the port is needed for hosting
+    ESP_LOGI(TAG, "Beginning host behaviour.");
+    host_install();
+}
+
+static void stop_hosting(const uint8_t *message) {  // The other device lost its host, thus this device no longer needs to host a device
+    ESP_LOGI(TAG, "Received host disconnected update, uninstalling host drivers.");
+    host_uninstall();
+    device_install();                               // Back to waiting for a computer
+}
+
+static void announce_host(const uint8_t *message) {
+    ESP_LOGI(TAG, "Detected a host, informing the com state machine.");
+    send_update(HOST_CONNECTED, 0);
+}
+
+static void announce_host_lost(const uint8_t *message) {
+    ESP_LOGI(TAG, "Host disconnected.");
+    send_update(HOST_DISCONNECTED, 0);
+}
+
+static void bridge_hid(const uint8_t *message) {    // Also remaps the interfaces when a device joined or left the far side's hub
+    layout = message[2];
+    ESP_LOGI(TAG, "Beginning HID behaviour, layout 0x%02X.", layout);
+    activate_hid(layout);
+}
+
+static void idle_hid(const uint8_t *message) {
+    ESP_LOGI(TAG, "Idling HID interfaces.");
+    activate_hid(0);
+    if (message == NULL) {                          // Lost the computer rather than the far side's device
+        announce_host_lost(message);
+    }
+}
+
+static void forward_report(const uint8_t *message) {
+    if (message[0] == REPORT_KEYBOARD) {
+        send_keyboard_report_to_computer(message[1], (usb_keyboard_report_t *) &message[2]);
+    } else if (message[0] == REPORT_RAW || message[0] == REPORT_RAW_MOUSE) {
+        send_raw_report_to_computer(message[1], &message[3], message[2]);
+    } else {
+        send_mouse_report_to_computer(message[1], (usb_mouse_report_t *) &message[2]);
+    }
+    latency_report_delivered();
+}
+
+static void bridge_datastick(const uint8_t *message) {
+    ESP_LOGI(TAG, "Beginning datastick behaviour.");
+    msc_bridge_start(false);                        // Ask the far side for the stick's size before the computer does
+    activate_datastick(true);
+}
+
+static void idle_datastick(const uint8_t *message) {
+    activate_datastick(false);                      // The computer sees the medium removed
+    msc_bridge_stop();
+    if (message == NULL) {
+        announce_host_lost(message);
+    }
+}
+
+static void announce_hid(const uint8_t *message) {
+    layout = hid_layout();
+    ESP_LOGI(TAG, "HID device(s) connected, layout 0x%02X.", layout);
+    passthrough_announce();                         // The descriptors go ahead of the update, the far side clones them before mapping
+    send_update(HID_CONNECTED, layout);
+}
+
+static void announce_hid_lost(const uint8_t *message) {
+    ESP_LOGI(TAG, "HID device(s) disconnected.");
+    send_update(DEVICE_DISCONNECTED, 0);
+}
+
+static void announce_datastick(const uint8_t *message) {
+    ESP_LOGI(TAG, "Datastick detected.");
+    msc_bridge_start(true);                         // Serve block requests from the far side
+    send_update(DATASTICK_CONNECTED, 0);
+}
+
+static void announce_datastick_lost(const uint8_t *message) {
+    ESP_LOGI(TAG, "Datastick disconnected.");
+    msc_bridge_stop();
+    send_update(DEVICE_DISCONNECTED, 0);
+}
+
+static void stop_hosting_datastick(const uint8_t *message) {
+    msc_bridge_stop();
+    stop_hosting(message);
+}
+
+// -------------------------------- TABLE --------------------------------
+
+static const transition_t transitions[] = {         // First matching row wins, a message or event no row matches is dropped
+    // state            trigger              guard          action                   next
+    {UNKNOWN,          HOST_CONNECTED,      NULL,          start_hosting,           HOST_UNKNOWN},
+    {UNKNOWN,          ON_CHANGE,           host_present,  announce_host,           DEVICE_UNKNOWN},
+
+    {DEVICE_UNKNOWN,   HID_CONNECTED,       NULL,          bridge_hid,              DEVICE_HID},
+    {DEVICE_UNKNOWN,   DATASTICK_CONNECTED, NULL,          bridge_datastick,        DEVICE_DATASTICK},
+    {DEVICE_UNKNOWN,   ON_CHANGE,           host_absent,   announce_host_lost,      UNKNOWN},
+
+    {DEVICE_DATASTICK, DEVICE_DISCONNECTED, NULL,          idle_datastick,          DEVICE_UNKNOWN},
+    {DEVICE_DATASTICK, ON_CHANGE,           host_absent,   idle_datastick,          UNKNOWN},
+
+    {DEVICE_HID,       ON_REPORT,           NULL,          forward_report,          DEVICE_HID},
+    {DEVICE_HID,       HID_CONNECTED,       NULL,          bridge_hid,              DEVICE_HID},
+    {DEVICE_HID,       DEVICE_DISCONNECTED, NULL,          idle_hid,                DEVICE_UNKNOWN},
+    {DEVICE_HID,       ON_CHANGE,           host_absent,   idle_hid,                UNKNOWN},
+
+    {HOST_UNKNOWN,     ON_CHANGE,           hid_present,   announce_hid,            HOST_HID},
+    {HOST_UNKNOWN,     ON_CHANGE,           stick_present, announce_datastick,      HOST_DATASTICK},
+    {HOST_UNKNOWN,     HOST_DISCONNECTED,   NULL,          stop_hosting,            UNKNOWN},
+
+    {HOST_DATASTICK,   ON_CHANGE,           stick_absent,  announce_datastick_lost, HOST_UNKNOWN},
+    {HOST_DATASTICK,   HOST_DISCONNECTED,   NULL,          stop_hosting_datastick,  UNKNOWN},
+
+    {HOST_HID,         ON_CHANGE,           hid_absent,    announce_hid_lost,       HOST_UNKNOWN},
+    {HOST_HID,         ON_CHANGE,           hid_changed,   announce_hid,            HOST_HID},
+    {HOST_HID,         HOST_DISCONNECTED,   NULL,          stop_hosting,            UNKNOWN},
+};
+
+static bool dispatch(uint8_t trigger, const uint8_t *message) {    // True if the state changed
+    for (uint8_t i = 0; i < sizeof(transitions) / sizeof(transitions[0]); i++) {
+        const transition_t *row = &transitions[i];
+        if (row->state != usb_state || row->trigger != trigger || (row->guard != NULL && !row->guard())) {
+            continue;
+        }
+        bool changed = row->next != usb_state;
+        if (changed) {
+            uint8_t transition[2] = {usb_state, row->next};
+            trace_record(TRACE_USB_STATE, transition, sizeof(transition));
+        }
+        usb_state = row->next;                      // Before the action, the device tools check it when an interface comes up
+        power_usb_active(usb_state != UNKNOWN);     // Light sleep would stop the USB peripheral under a computer or a device
+        row->action(message);
+        return changed;
+    }
+    return false;
+}
+
+static void settle(uint8_t trigger, const uint8_t *message) {
+    if (dispatch(trigger, message)) {
+        while (dispatch(ON_CHANGE, NULL)) {         // The new state's guards may already hold, a device plugged in before hosting started
+        }
+    }
+}
+
+// -------------------------------- TASK --------------------------------
+
+void usb_event(uint8_t event) {
+    xQueueSend(usb_event_queue, &event, 0);         // Full only if the task already has events to wake for, each one checks every guard
+}
+
+void usb_state_machine(void *arg) {                 // USB state machine function
+    ESP_LOGI(TAG, "Initialising usb state machine");
+    uint8_t received_data[USB_MESSAGE_SIZE] = {0};  // Buffer to hold received messages (1 header + channel + up to a raw report)
+    device_install();                               // Composite device, enumerated once, its interfaces idle until something is bridged
+    settle(ON_CHANGE, NULL);
+    while (1) {                                     // Sleeps until a message or event arrives, nothing here waits on anything else
+        QueueSetMemberHandle_t woken = xQueueSelectFromSet(usb_event_set, pdMS_TO_TICKS(USB_POLL_MS));
+        if (woken == NULL) {
+            output_deliver();                       // In case its event was dropped on a full queue
+            settle(ON_CHANGE, NULL);
+            continue;
+        }
+        if (woken == usb_event_queue) {
+            uint8_t event;
+            xQueueReceive(usb_event_queue, &event, 0);
+            if (event == USB_EVENT_OUTPUT) {
+                output_deliver();                   // Nothing else changed, no guard to check
+                continue;
+            }
+            if (event == USB_EVENT_PERIPHERAL && (usb_state == HOST_UNKNOWN || usb_state == HOST_DATASTICK || usb_state == HOST_HID)) {
+                handle_hosting();
+            }
+            settle(ON_CHANGE, NULL);
+            continue;
+        }
+        if (xQueueReceive(com_to_usb_queue, received_data, 0) != pdPASS        // Updates and keyboard reports before mouse reports, whichever queue woke the set
+            && xQueueReceive(com_to_usb_mouse_queue, received_data, 0) != pdPASS) {
+            continue;                               // One message per set entry of the two, so one is there
+        }
+        switch (received_data[0]) {
+            case REPORT_KEYBOARD:
+            case REPORT_MOUSE:
+            case REPORT_RAW:
+            case REPORT_RAW_MOUSE:
+                latency_report_received(received_data[0] == REPORT_MOUSE || received_data[0] == REPORT_RAW_MOUSE);
+                settle(ON_REPORT, received_data);
+                break;
+            case UPDATE:
+                settle(received_data[1], received_data);
+                break;
+            default:                                // STATE from the com state machine after a mismatch, nothing here acts on it
+                break;
+        }
+    }
+}
@@ -1,56 +1,76 @@
-#include <stdint.h>             // Header file to declare integer types (needed for uint8_t)
-#include "freertos/FreeRTOS.h"  // Header file for the FreeRTOS operating system (needed for QueueHandle_t)
-#include "esp_timer.h"
-
-
-enum headers {          // Define all the headers for messages between state machines and between modules 
-    NO_HEADER,          // Used as a placeholder header when no header has been received
-    ERROR,              // Used when a header has been received but the error correction detects a random bit error and the header cant be identified. (Needed?)
-    HELLO,
-    HEARD,
-    ACK,
-    STATE,              // Used to check for pre-existing state, useful if there was a communication disconnect
-    UPDATE,
-    REPORT_MOUSE,
-    REPORT_KEYBOARD
-};
-
-enum updates {          // Define all the message types following an update header 
-    HOST_CONNECTED,
-    HOST_DISCONNECTED,
-    MOUSE_CONNECTED,
-    KEYBOARD_CONNECTED,
-    DATASTICK_CONNECTED,
-    DEVICE_DISCONNECTED
-};
-
-enum device { // perhaps use just USBState, or maybe use host and device as separate
-    NONE,
-    MOUSE,
-    KEYBOARD,
-    DATASTICK
-};
-
-enum USBstate {             // Define all the states of the USB state machine
-    UNKNOWN,
-    DEVICE_UNKNOWN,
-    DEVICE_DATASTICK,
-    DEVICE_KEYBOARD,
-    DEVICE_MOUSE,
-    HOST_UNKNOWN,
-    HOST_DATASTICK,
-    HOST_KEYBOARD,
-    HOST_MOUSE
-};
-
-extern volatile uint8_t usb_state;      // Defined in state_machine_usb.c
-
-extern QueueHandle_t usb_to_com_queue;  // Defined in main.c
-extern QueueHandle_t com_to_usb_queue;  // Defined in main.c
-
-extern int64_t start_time;
-extern int64_t end_time;
-extern int64_t duration;
-
-void usb_state_machine(void *arg);      // Defined in state_machine_usb.c
+#include <stdint.h>             // Header file to declare integer types (needed for uint8_t)
+#include "freertos/FreeRTOS.h"  // Header file for the FreeRTOS operating system (needed for QueueHandle_t)
+#include "freertos/queue.h"     // Header file for FreeRTOS queues (needed for QueueSetHandle_t)
+#include "esp_timer.h"
+
+#define USB_MESSAGE_SIZE 67     // Bytes per message on the queues between the state machines: header + channel + length + 64 byte raw report (Tools/HIDPassthrough.h)
+#define HID_CHANNELS     4      // HID devices bridged at once (a keyboard and a mouse behind a hub, and more), each on its own channel
+#define CHANNEL_TYPE(layout, channel) (((layout) >> (2*(channel))) & 0x03)   // enum device on a channel of a HID_CONNECTED layout byte
+
+enum headers {          // Define all the headers for messages between state machines and between modules 
+    NO_HEADER,          // Used as a placeholder header when no header has been received
+    ERROR,              // Used when a header has been received but the error correction detects a random bit error and the header cant be identified. (Needed?)
+    HELLO,
+    HEARD,
+    ACK,
+    STATE,              // Used to check for pre-existing state, useful if there was a communication disconnect
+    UPDATE,
+    REPORT_MOUSE,       // Followed by the channel the mouse is on, then its report
+    REPORT_KEYBOARD,    // Followed by the channel the keyboard is on, then its report
+    MSC_REQUEST,        // Datastick block request, computer side to stick side (Tools/MSCBridge.h)
+    MSC_DATA,           // Chunk of a block transfer, either direction
+    MSC_STATUS,         // Datastick request result, stick side to computer side
+    RESUME,             // Reconnect to the last session without a new handshake, carries the sender's usb state
+    RATE,               // Followed by a baud rate rung: from the initiator it starts a probe of that rung, from the answerer it asks for one
+    TRAIN,              // Training frame of a rate probe (Tools/LinkRate.h)
+    REPORT_KEYS,        // REPORT_KEYBOARD on the link: the keys pressed and released since the channel's last report (Tools/ReportCodec.h)
+    REPORT_MOTION,      // REPORT_MOUSE on the link: only its nonzero fields
+    OUTPUT_REPORT,      // Output or feature report from the computer, computer side to device side (Tools/OutputReports.h)
+    REPORT_RAW,         // Followed by the channel, the length and an input report exactly as a report protocol device sent it
+    DESCRIPTOR,         // A chunk of the report descriptor of a channel's device, device side to computer side (Tools/HIDPassthrough.h)
+    REPORT_RAW_MOUSE    // REPORT_RAW from a mouse channel: sent unreliable in the mouse class and queued with the mouse reports, like REPORT_MOTION
+};
+
+enum updates {          // Define all the message types following an update header 
+    HOST_CONNECTED,
+    HOST_DISCONNECTED,
+    HID_CONNECTED,      // HID devices connected or changed, the next byte is the layout: the enum device on each channel, 2 bits per channel
+    DATASTICK_CONNECTED,
+    DEVICE_DISCONNECTED
+};
+
+enum device { // perhaps use just USBState, or maybe use host and device as separate
+    NONE,
+    MOUSE,
+    KEYBOARD,
+    DATASTICK
+};
+
+enum USBstate {             // Define all the states of the USB state machine
+    UNKNOWN,
+    DEVICE_UNKNOWN,
+    DEVICE_DATASTICK,
+    DEVICE_HID,             // Composite HID device with an interface per channel of the far side's layout
+    HOST_UNKNOWN,
+    HOST_DATASTICK,
+    HOST_HID                // Hosting keyboards and mice (directly or behind a hub)
+};
+
+extern volatile uint8_t usb_state;      // Defined in state_machine_usb.c
+
+extern QueueHandle_t usb_to_com_queue;  // Defined in main.c
+extern QueueHandle_t com_to_usb_queue;  // Defined in main.c
+extern QueueHandle_t com_to_usb_mouse_queue;    // Defined in main.c, mouse reports kept apart so keystrokes and updates never wait behind them
+extern QueueHandle_t usb_event_queue;   // Defined in main.c, local events for the usb state machine (enum usb_events)
+extern QueueSetHandle_t usb_event_set;  // Defined in main.c, everything the usb state machine waits on: both queues from the com state machine and usb_event_queue
+
+enum usb_events {           // Local events that wake the usb state machine, which then checks its guards again
+    USB_EVENT_COMPUTER,     // The computer mounted, unmounted, suspended or resumed the device (tinyusb callbacks)
+    USB_EVENT_PERIPHERAL,   // A host driver reported a device connecting or disconnecting, handle_hosting opens or closes it
+    USB_EVENT_OUTPUT        // An output or feature report for a hosted device arrived over the link
+};
+
+void usb_event(uint8_t event);          // Defined in state_machine_usb.c, any task, never blocks
+
+void usb_state_machine(void *arg);      // Defined in state_machine_usb.c
 void com_state_machine(void *arg);      // Defined in state_machine_com.c
\ No newline at end of file